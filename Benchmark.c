@@ -0,0 +1,236 @@
+// Throughput benchmarks for the hot paths of simple_shell.h.
+//
+// Build and run:
+//   make benchmark
+//   ./shell_benchmark [-n iterations] [-s stages] [-m megabytes]
+//
+// Every benchmark drives the shell in-process through its public API and
+// prints operations per second, so two versions of the header can be
+// compared by building this file against each of them.
+#include "simple_shell.h"
+
+// Command without output, for measuring dispatch alone
+ShellError noop_command(ShellContext *ctx, int argc, char **argv) {
+    (void)ctx;
+    (void)argc;
+    (void)argv;
+    return SHELL_OK;
+}
+
+typedef struct {
+    long iterations;
+    int stages;
+    long megabytes;
+} BenchmarkOptions;
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double ops, const char *unit, double started) {
+    double elapsed = seconds_now() - started;
+    printf("%-34s %12.0f %-8s %8.3f s %14.1f %s/s\n", name, ops, unit, elapsed, ops / elapsed, unit);
+}
+
+// Run the same command line repeatedly and report commands per second;
+// each run of the line executes commands_per_line commands
+static void bench_commands(ExtendedShellContext *ctx, const char *name, const char *command, long iterations, int commands_per_line) {
+    double started = seconds_now();
+    for (long i = 0; i < iterations; i++) {
+        if (shell_execute_command(ctx, command) != SHELL_OK) {
+            fprintf(stderr, "%s: '%s' failed\n", name, command);
+            return;
+        }
+    }
+    report(name, (double)iterations * commands_per_line, "cmds", started);
+}
+
+static void bench_command(ExtendedShellContext *ctx, const char *name, const char *command, long iterations) {
+    bench_commands(ctx, name, command, iterations, 1);
+}
+
+// Spawn the external true binary, bypassing the true built-in
+static void bench_spawn(ExtendedShellContext *ctx, ShellSpawnBackend backend, const char *name, long iterations) {
+    const char *path = shell_resolve_command(ctx, "true");
+    if (!path || shell_set_spawn_backend(ctx, backend) != SHELL_OK) {
+        printf("%-34s skipped\n", name);
+        return;
+    }
+
+    char command[PATH_MAX + 1];
+    snprintf(command, sizeof(command), "%s", path);
+    bench_command(ctx, name, command, iterations);
+    shell_set_spawn_backend(ctx, SHELL_SPAWN_POSIX);
+}
+
+// Push data through a pipeline of cat stages and report bytes per second
+static void bench_pipeline(ExtendedShellContext *ctx, int stages, long megabytes) {
+    char command[256];
+    int length = snprintf(command, sizeof(command), "head -c %ldM /dev/zero", megabytes);
+    for (int i = 1; i < stages && length < (int)sizeof(command) - 16; i++) {
+        length += snprintf(command + length, sizeof(command) - length, " | cat");
+    }
+    snprintf(command + length, sizeof(command) - length, " > /dev/null");
+
+    char name[64];
+    snprintf(name, sizeof(name), "%d-stage pipeline", stages);
+    double started = seconds_now();
+    if (shell_execute_command(ctx, command) != SHELL_OK || ctx->base.exit_status != 0) {
+        fprintf(stderr, "%s: '%s' failed\n", name, command);
+        return;
+    }
+    report(name, (double)megabytes, "MB", started);
+}
+
+static void bench_history(ExtendedShellContext *ctx, long iterations) {
+    char line[64];
+    shell_set_history_capacity(&ctx->base, (size_t)iterations);
+
+    double started = seconds_now();
+    for (long i = 0; i < iterations; i++) {
+        snprintf(line, sizeof(line), "echo history line %ld", i);
+        shell_add_history(&ctx->base, line);
+    }
+    report("history add", (double)iterations, "ops", started);
+}
+
+static void bench_aliases(ExtendedShellContext *ctx, long iterations) {
+    char name[32];
+    long count = iterations < 10000 ? iterations : 10000;
+
+    double started = seconds_now();
+    for (long i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "alias%ld", i);
+        shell_set_alias(ctx, name, "noop");
+    }
+    report("alias set", (double)count, "ops", started);
+
+    started = seconds_now();
+    for (long i = 0; i < iterations; i++) {
+        snprintf(name, sizeof(name), "alias%ld", i % count);
+        if (!shell_get_alias(ctx, name)) fprintf(stderr, "alias get: %s missing\n", name);
+    }
+    report("alias get", (double)iterations, "ops", started);
+
+    bench_command(ctx, "alias dispatch", "alias0", iterations);
+
+    started = seconds_now();
+    for (long i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "alias%ld", i);
+        shell_remove_alias(ctx, name);
+    }
+    report("alias remove", (double)count, "ops", started);
+}
+
+static void bench_environment(ExtendedShellContext *ctx, long iterations) {
+    char name[32];
+    char value[32];
+
+    double started = seconds_now();
+    for (long i = 0; i < iterations; i++) {
+        snprintf(name, sizeof(name), "BENCH_%ld", i);
+        snprintf(value, sizeof(value), "%ld", i);
+        shell_set_env(ctx, name, value);
+    }
+    report("env set", (double)iterations, "ops", started);
+
+    started = seconds_now();
+    for (long i = 0; i < iterations; i++) {
+        snprintf(name, sizeof(name), "BENCH_%ld", i);
+        if (!shell_get_env(ctx, name)) fprintf(stderr, "env get: %s missing\n", name);
+    }
+    report("env get", (double)iterations, "ops", started);
+
+    bench_command(ctx, "variable expansion", "noop $BENCH_0 ${BENCH_1} $HOME", iterations);
+
+    started = seconds_now();
+    for (long i = 0; i < iterations; i++) {
+        snprintf(name, sizeof(name), "BENCH_%ld", i);
+        shell_unset_env(ctx, name);
+    }
+    report("env unset", (double)iterations, "ops", started);
+}
+
+// Start contexts from a snapshot of one holding a thousand aliases and
+// variables, and report contexts per second
+static void bench_snapshot(ExtendedShellContext *ctx, long iterations) {
+    char name[32];
+    char value[64];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "SNAPSHOT_%d", i);
+        snprintf(value, sizeof(value), "noop snapshot %d", i);
+        shell_set_alias(ctx, name, value);
+        shell_set_env(ctx, name, value);
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/shell_benchmark.%ld.snapshot", (long)getpid());
+    if (shell_save_snapshot(ctx, path) != SHELL_OK) {
+        printf("%-34s skipped\n", "snapshot load");
+        return;
+    }
+
+    double started = seconds_now();
+    for (long i = 0; i < iterations; i++) {
+        ExtendedShellContext loaded;
+        shell_init(&loaded, NULL, false);
+        shell_register_command(&loaded, "noop", noop_command);
+        if (shell_load_snapshot(&loaded, path) != SHELL_OK) fprintf(stderr, "snapshot load failed\n");
+        shell_cleanup(&loaded);
+    }
+    report("snapshot load", (double)iterations, "ctxs", started);
+    unlink(path);
+}
+
+static bool parse_options(int argc, char **argv, BenchmarkOptions *options) {
+    for (int i = 1; i < argc; i++) {
+        long value = i + 1 < argc ? strtol(argv[i + 1], NULL, 10) : 0;
+        if (value <= 0) return false;
+
+        if (strcmp(argv[i], "-n") == 0) {
+            options->iterations = value;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            options->stages = value > 32 ? 32 : (int)value;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            options->megabytes = value;
+        } else {
+            return false;
+        }
+        i++;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options = { 100000, 4, 1024 };
+    if (!parse_options(argc, argv, &options)) {
+        fprintf(stderr, "usage: %s [-n iterations] [-s stages] [-m megabytes]\n", argv[0]);
+        return 2;
+    }
+
+    ExtendedShellContext ctx;
+    if (shell_init(&ctx, NULL, false) != SHELL_OK) return 1;
+    shell_register_command(&ctx, "noop", noop_command);
+
+    long spawns = options.iterations / 50 > 0 ? options.iterations / 50 : 1;
+    bench_command(&ctx, "custom dispatch", "noop a b c", options.iterations);
+    bench_command(&ctx, "builtin dispatch", "true", options.iterations);
+    bench_command(&ctx, "builtin with redirection", "echo x > /dev/null", options.iterations / 10 > 0 ? options.iterations / 10 : 1);
+    bench_commands(&ctx, "builtins in a for loop",
+                   "for i in 1 2 3 4 5 6 7 8 9 10; do : $i; : $i; : $i; : $i; : $i; : $i; : $i; : $i; : $i; : $i; done",
+                   options.iterations / 100 > 0 ? options.iterations / 100 : 1, 100);
+    bench_spawn(&ctx, SHELL_SPAWN_POSIX, "external spawn (posix_spawn)", spawns);
+    bench_spawn(&ctx, SHELL_SPAWN_CLONE, "external spawn (clone)", spawns);
+    bench_spawn(&ctx, SHELL_SPAWN_ZYGOTE, "external spawn (zygote)", spawns);
+    bench_pipeline(&ctx, 1, options.megabytes);
+    bench_pipeline(&ctx, options.stages, options.megabytes);
+    bench_history(&ctx, options.iterations);
+    bench_aliases(&ctx, options.iterations);
+    bench_environment(&ctx, options.iterations);
+    bench_snapshot(&ctx, options.iterations / 1000 > 0 ? options.iterations / 1000 : 1);
+
+    shell_cleanup(&ctx);
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Regression checks for simple_shell.h.
+//
+// Build and run:
+//   make check
+//
+// Every check runs a command line through the public API and compares what
+// it writes to standard output and standard error, and the exit status it
+// leaves, with the expected ones. Failed checks are listed with what they
+// got, and the program exits with status 1 if any of them failed.
+#include "simple_shell.h"
+
+typedef struct {
+    const char *name;
+    const char *command;
+    const char *output;
+    const char *error;
+    int status;
+} ShellCheck;
+
+static const ShellCheck checks[] = {
+    // Pipelines
+    { "pipeline", "printf 'b\\na\\n' | sort | tr a-z A-Z", "A\nB\n", "", 0 },
+    { "pipeline status", "true | false", "", "", 1 },
+    { "builtin stages", "echo one two | wc -w", "2\n", "", 0 },
+    { "long pipeline", "seq 1000 | cat | cat | cat | tail -1", "1000\n", "", 0 },
+
+    // And-or lists
+    { "and", "true && echo yes", "yes\n", "", 0 },
+    { "or", "false || echo yes", "yes\n", "", 0 },
+    { "and-or chain", "false && echo no || echo fallback", "fallback\n", "", 0 },
+    { "and-or status", "true && false", "", "", 1 },
+    { "and-or newline", "true &&\necho next", "next\n", "", 0 },
+
+    // Loops and conditionals
+    { "for", "for i in 1 2 3; do echo $i; done", "1\n2\n3\n", "", 0 },
+    { "while", "n=; while test \"$n\" != xxx; do n=x$n; done; echo $n", "xxx\n", "", 0 },
+    { "break", "for i in a b c; do if test $i = b; then break; fi; echo $i; done", "a\n", "", 0 },
+    { "continue", "for i in a b c; do test $i = b && continue; echo $i; done", "a\nc\n", "", 0 },
+    { "if else", "if false; then echo then; else echo else; fi", "else\n", "", 0 },
+
+    // Command substitution
+    { "substitution", "x=$(echo hi | tr a-z A-Z); echo \"[$x]\"", "[HI]\n", "", 0 },
+    { "nested substitution", "echo $(echo $(echo deep))", "deep\n", "", 0 },
+    { "substitution status", "x=$(false)", "", "", 1 },
+    { "substitution newlines", "echo \"<$(printf 'a\\n\\n')>\"", "<a>\n", "", 0 },
+
+    // Here-documents
+    { "here-document", "v=world\ncat <<EOF\nhello $v\nEOF", "hello world\n", "", 0 },
+    { "quoted here-document", "cat <<'EOF'\n$HOME\nEOF", "$HOME\n", "", 0 },
+    { "here-document tabs", "cat <<-EOF\n\tindented\n\tEOF", "indented\n", "", 0 },
+    { "here-string", "tr a-z A-Z <<< shout", "SHOUT\n", "", 0 },
+
+    // Redirections
+    { "2>&1", "sh -c 'echo out; echo err >&2' 2>&1 | sort", "err\nout\n", "", 0 },
+    { "builtin 2>&1", "echo err >&2 2>&1", "", "err\n", 0 },
+    { ">&2", "echo moved >&2", "", "moved\n", 0 },
+
+    // Syntax errors
+    { "unexpected token", "echo a; )", "", "syntax error near ')'\n", 2 },
+    { "missing done", "for i in 1; do echo $i; fi", "", "syntax error near 'fi'\n", 2 },
+    { "error stops line", "echo before; if then", "", "syntax error near 'then'\n", 2 },
+};
+
+// Run one check in a fresh context; returns whether it passed
+static bool run_check(const ShellCheck *check) {
+    ExtendedShellContext ctx;
+    if (shell_init(&ctx, NULL, false) != SHELL_OK) {
+        printf("FAIL %s: shell_init failed\n", check->name);
+        return false;
+    }
+
+    shell_capture_command(&ctx, check->command, SHELL_CAPTURE_OUTPUT | SHELL_CAPTURE_ERROR, -1);
+    const char *output = ctx.base.output ? ctx.base.output : "";
+    const char *error = ctx.base.error ? ctx.base.error : "";
+    bool passed = strcmp(output, check->output) == 0 && strcmp(error, check->error) == 0 &&
+                  ctx.base.exit_status == check->status;
+    if (!passed) {
+        printf("FAIL %s\n  output: \"%s\" (expected \"%s\")\n  error: \"%s\" (expected \"%s\")\n"
+               "  status: %d (expected %d)\n",
+               check->name, output, check->output, error, check->error, ctx.base.exit_status, check->status);
+    }
+    shell_cleanup(&ctx);
+    return passed;
+}
+
+// Report a check that is not in the table
+static bool report(const char *name, bool passed) {
+    if (!passed) printf("FAIL %s\n", name);
+    return passed;
+}
+
+// Run a script through shell_run_file from a pipe, which cannot be mapped
+// and is read to its end first. error is the expected standard error.
+static bool check_piped_script(const char *name, const char *script, const char *output, const char *error,
+                               ShellError result, int status) {
+    int fds[2];
+    if (pipe(fds) == -1) return report(name, false);
+    size_t length = strlen(script);
+    bool written = write(fds[1], script, length) == (ssize_t)length;
+    close(fds[1]);
+
+    ExtendedShellContext ctx;
+    if (!written || shell_init(&ctx, NULL, false) != SHELL_OK) {
+        close(fds[0]);
+        return report(name, false);
+    }
+
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+    // The script's output goes to pipes put in place of the context's
+    // descriptors; it is small enough not to fill them
+    int out[2], err[2];
+    if (pipe(out) == -1 || pipe(err) == -1) {
+        close(fds[0]);
+        shell_cleanup(&ctx);
+        return report(name, false);
+    }
+    int saved[2] = { ctx.base.fds[STDOUT_FILENO], ctx.base.fds[STDERR_FILENO] };
+    ctx.base.fds[STDOUT_FILENO] = out[1];
+    ctx.base.fds[STDERR_FILENO] = err[1];
+    ShellError got = shell_run_file(&ctx, path);
+    int got_status = ctx.base.exit_status;
+    ctx.base.fds[STDOUT_FILENO] = saved[0];
+    ctx.base.fds[STDERR_FILENO] = saved[1];
+    close(out[1]);
+    close(err[1]);
+    close(fds[0]);
+
+    char got_output[256] = "", got_error[256] = "";
+    ssize_t n = read(out[0], got_output, sizeof(got_output) - 1);
+    if (n > 0) got_output[n] = '\0';
+    n = read(err[0], got_error, sizeof(got_error) - 1);
+    if (n > 0) got_error[n] = '\0';
+    close(out[0]);
+    close(err[0]);
+    shell_cleanup(&ctx);
+
+    bool passed = got == result && got_status == status && strcmp(got_output, output) == 0 && strcmp(got_error, error) == 0;
+    if (!passed) {
+        printf("FAIL %s\n  output: \"%s\" (expected \"%s\")\n  error: \"%s\" (expected \"%s\")\n"
+               "  result: %d (expected %d), status: %d (expected %d)\n",
+               name, got_output, output, got_error, error, got, result, got_status, status);
+    }
+    return passed;
+}
+
+#define CHECK_THREADS 4
+#define CHECK_ROUNDS 50
+
+typedef struct {
+    int id;
+    bool passed;
+} CaptureWorker;
+
+static const char *const worker_dirs[CHECK_THREADS] = { "/", "/dev", "/proc", "/etc" };
+
+// Capture pipelines and substitutions over and over in a context of the
+// worker's own, each in a directory of its own
+static void *capture_worker(void *data) {
+    CaptureWorker *worker = data;
+    ExtendedShellContext ctx;
+    if (shell_init(&ctx, NULL, false) != SHELL_OK) return NULL;
+
+    const char *dir = worker_dirs[worker->id];
+    char command[256], expected[64];
+    snprintf(command, sizeof(command), "id=%d; cd %s; echo $id$id | tr 0-9 a-j; echo $(pwd)", worker->id, dir);
+    snprintf(expected, sizeof(expected), "%c%c\n%s\n", 'a' + worker->id, 'a' + worker->id, dir);
+
+    worker->passed = true;
+    for (int round = 0; round < CHECK_ROUNDS && worker->passed; round++) {
+        if (shell_capture_command(&ctx, command, SHELL_CAPTURE_OUTPUT, -1) != SHELL_OK ||
+            strcmp(ctx.base.output, expected) != 0) {
+            worker->passed = false;
+        }
+    }
+    shell_cleanup(&ctx);
+    return NULL;
+}
+
+// Capture from several contexts at once, one thread each. cd in a context
+// must not move the others or the process.
+static bool check_contexts(void) {
+    char cwd[PATH_MAX], after[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) return report("threaded contexts", false);
+
+    pthread_t threads[CHECK_THREADS];
+    CaptureWorker workers[CHECK_THREADS];
+    int started = 0;
+    for (int i = 0; i < CHECK_THREADS; i++) {
+        workers[i] = (CaptureWorker){ i, false };
+        if (pthread_create(&threads[i], NULL, capture_worker, &workers[i]) != 0) break;
+        started++;
+    }
+
+    bool passed = started == CHECK_THREADS;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        passed = passed && workers[i].passed;
+    }
+    passed = passed && getcwd(after, sizeof(after)) && strcmp(cwd, after) == 0;
+    return report("threaded contexts", passed);
+}
+
+int main(void) {
+    // Finished background jobs are noticed through SIGCHLD, which must stay
+    // blocked in every thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int total = 0, failed = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++, total++) {
+        if (!run_check(&checks[i])) failed++;
+    }
+
+    failed += !check_piped_script("piped script", "echo one\nfor i in 2 3; do\n  echo $i\ndone\nexit 4\n", "one\n2\n3\n", "",
+                                  SHELL_OK, 4);
+    failed += !check_piped_script("piped script error", "echo a\nif true; then\n  echo b\n", "a\n",
+                                  "line 4: syntax error: unexpected end of file\n", SHELL_ERROR_SYNTAX, 2);
+    failed += !check_contexts();
+    total += 3;
+
+    printf("%d of %d checks passed\n", total - failed, total);
+    return failed ? 1 : 0;
+}
@@ -1,11 +1,12 @@
 #include "simple_shell.h"
 
-// Custom command callback
+// Custom command callback. Output goes through the context, so it can be
+// redirected and captured like that of a built-in.
 ShellError custom_hello(ShellContext *ctx, int argc, char **argv) {
     if (argc > 1) {
-        printf("Hello, %s!\n", argv[1]);
+        shell_printf(ctx, STDOUT_FILENO, "Hello, %s!\n", argv[1]);
     } else {
-        printf("Hello, world!\n");
+        shell_printf(ctx, STDOUT_FILENO, "Hello, world!\n");
     }
     return SHELL_OK;
 }
@@ -17,10 +18,10 @@ int main() {
     // Register a custom command
     shell_register_command(&ctx, "hello", custom_hello);
 
-    // Run the shell
+    // Run the shell until exit or end of input
     shell_run(&ctx);
 
     // Clean up
     shell_cleanup(&ctx);
-    return 0;
+    return ctx.base.exit_status;
 } 
@@ -1,30 +1,127 @@
 #ifndef SIMPLE_SHELL_H
 #define SIMPLE_SHELL_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <spawn.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <termios.h>
 #include <time.h>
 
 #define MAX_INPUT_SIZE 1024
 #define MAX_HISTORY_SIZE 100
-#define MAX_ENV_VARS 100
-#define MAX_CUSTOM_COMMANDS 50
 #define MAX_JOBS 100
-#define MAX_ALIASES 50
 #define MAX_TAB_COMPLETIONS 100
+#define SHELL_MAP_INITIAL_CAPACITY 64
+#define SHELL_ARENA_CHUNK_SIZE 16384
+#define SHELL_ARENA_ALIGNMENT 16
+#define SHELL_DEFAULT_PATH "/bin:/usr/bin"
+#define SHELL_JOB_INDEX_INITIAL_CAPACITY 64
+
+// Whether posix_spawn can start a child in another directory, as glibc
+// 2.29 and later can; without it, children of a context that ran cd are
+// started with the clone backend
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define SHELL_SPAWN_FCHDIR 1
+#else
+#define SHELL_SPAWN_FCHDIR 0
+#endif
+
+// Descriptors 0-9 each context keeps its own copy of, and the size of the
+// buffer built-ins gather their output in
+#define SHELL_CONTEXT_FDS 10
+#define SHELL_OUTPUT_BUFFER 4096
+
+// Deepest chain of aliases expanded within one another
+#define SHELL_ALIAS_DEPTH 32
+
+// Parsed lines kept for reuse, and the longest line worth keeping
+#define SHELL_PARSE_CACHE_SIZE 256
+#define SHELL_PARSE_CACHE_MAX_LINE 4096
+
+// Deepest chain of shell function calls
+#define SHELL_FUNCTION_DEPTH 256
+
+// Least room left for each read of the event loop's watched input
+#define SHELL_INPUT_READ_SIZE 64
+
+// Bytes the read built-in takes at a time from a seekable input
+#define SHELL_READ_BLOCK_SIZE 4096
+
+// Returned by shell_read_line for a line discarded with Ctrl-C
+#define SHELL_LINE_CANCELLED (-2)
+
+// Events taken from epoll at a time, and bytes read from a ready descriptor
+#define SHELL_EVENT_BATCH 64
+#define SHELL_EVENT_READ_SIZE 65536
+
+// Size requested for the pipes that capture command output, the first
+// allocation of a capture buffer, and the least room kept free for a read
+#define SHELL_CAPTURE_PIPE_SIZE (1 << 20)
+#define SHELL_CAPTURE_INITIAL_SIZE 4096
+#define SHELL_CAPTURE_MIN_READ 1024
+
+// What shell_capture_command collects
+#define SHELL_CAPTURE_OUTPUT 0x01  // standard output, into output
+#define SHELL_CAPTURE_ERROR 0x02   // standard error, into error
+
+// Stack of a child started by the clone spawn backend until it calls execve
+#define SHELL_CLONE_STACK_SIZE 65536
+
+// Idle workers the zygote spawn helper keeps ready, the largest request it
+// takes and the most descriptors a request passes; requests beyond either
+// limit are spawned with clone instead
+#define SHELL_ZYGOTE_WORKERS 4
+#define SHELL_ZYGOTE_MESSAGE_MAX 65536
+#define SHELL_ZYGOTE_MAX_FDS 32
+
+// CPUs and NUMA nodes the masks of ShellSpawnResources cover, and the
+// most resource limits it carries
+#define SHELL_CPU_SETSIZE 1024
+#define SHELL_NUMA_NODES 64
+#define SHELL_MAX_RESOURCE_LIMITS 16
+#define SHELL_MASK_WORDS(bits) ((bits) / (8 * sizeof(unsigned long)))
+
+// Identification of a startup snapshot file written by shell_save_snapshot
+#define SHELL_SNAPSHOT_MAGIC "SHSNAP\0\0"
+#define SHELL_SNAPSHOT_VERSION 1
+
+// Log2 buckets of a profiling histogram, from under 1 µs to over half an hour
+#define SHELL_HISTOGRAM_BUCKETS 32
 
 // Error codes
 typedef enum {
@@ -43,332 +140,9816 @@ typedef enum {
     SHELL_ERROR_REDIRECTION_FAILED,
     SHELL_ERROR_PIPELINE_FAILED,
     SHELL_ERROR_ALIAS_FULL,
-    SHELL_ERROR_TAB_COMPLETION_FAILED
+    SHELL_ERROR_TAB_COMPLETION_FAILED,
+    SHELL_ERROR_SYNTAX
 } ShellError;
 
+// Entry of an open-addressing hash map. The map owns the key, so a key is
+// interned once and can be referenced by the value for the entry's lifetime.
+// Empty slots have key == NULL and hash == 0, deleted slots key == NULL and hash == 1.
+typedef struct {
+    uint32_t hash;
+    char *key;
+    void *value;
+} ShellMapEntry;
+
+// Growable open-addressing hash map keyed by strings with precomputed hashes
+typedef struct {
+    ShellMapEntry *entries;
+    size_t capacity;
+    size_t count;
+    size_t used;
+} ShellMap;
+
+// FNV-1a hash of a string
+static uint32_t shell_hash_string(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Find the entry for a key, or NULL if it is not in the map
+static ShellMapEntry *shell_map_find(const ShellMap *map, const char *key, uint32_t hash) {
+    if (!map->entries) return NULL;
+
+    size_t mask = map->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        ShellMapEntry *entry = &map->entries[i];
+        if (!entry->key) {
+            if (entry->hash == 0) return NULL;
+        } else if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+}
+
+// Rehash every live entry into a table of the given capacity, dropping deleted slots
+static ShellError shell_map_resize(ShellMap *map, size_t capacity) {
+    ShellMapEntry *entries = calloc(capacity, sizeof(ShellMapEntry));
+    if (!entries) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < map->capacity; i++) {
+        ShellMapEntry *entry = &map->entries[i];
+        if (!entry->key) continue;
+
+        size_t j = entry->hash & mask;
+        while (entries[j].key) j = (j + 1) & mask;
+        entries[j] = *entry;
+    }
+
+    free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+    map->used = map->count;
+    return SHELL_OK;
+}
+
+// Find the entry for a key, inserting it with a NULL value if it is missing.
+// Returns NULL if memory could not be allocated.
+static ShellMapEntry *shell_map_insert(ShellMap *map, const char *key, uint32_t hash) {
+    ShellMapEntry *entry = shell_map_find(map, key, hash);
+    if (entry) return entry;
+
+    // Keep the load factor (including deleted slots) below 3/4
+    if ((map->used + 1) * 4 > map->capacity * 3) {
+        size_t capacity = map->capacity ? map->capacity : SHELL_MAP_INITIAL_CAPACITY;
+        if ((map->count + 1) * 2 > capacity) capacity *= 2;
+        if (shell_map_resize(map, capacity) != SHELL_OK) return NULL;
+    }
+
+    char *copy = strdup(key);
+    if (!copy) return NULL;
+
+    size_t mask = map->capacity - 1;
+    size_t i = hash & mask;
+    while (map->entries[i].key) i = (i + 1) & mask;
+
+    entry = &map->entries[i];
+    if (entry->hash == 0) map->used++;
+    entry->key = copy;
+    entry->hash = hash;
+    entry->value = NULL;
+    map->count++;
+    return entry;
+}
+
+// Grow a map so that count more keys can be inserted without rehashing
+static ShellError shell_map_reserve(ShellMap *map, size_t count) {
+    size_t capacity = map->capacity ? map->capacity : SHELL_MAP_INITIAL_CAPACITY;
+    while ((map->used + count + 1) * 4 > capacity * 3) capacity *= 2;
+    return capacity == map->capacity ? SHELL_OK : shell_map_resize(map, capacity);
+}
+
+// Remove a key from the map and return its value
+static void *shell_map_remove(ShellMap *map, const char *key, uint32_t hash) {
+    ShellMapEntry *entry = shell_map_find(map, key, hash);
+    if (!entry) return NULL;
+
+    void *value = entry->value;
+    free(entry->key);
+    entry->key = NULL;
+    entry->hash = 1;
+    entry->value = NULL;
+    map->count--;
+    return value;
+}
+
+// Free the map's keys and slots; values belong to the caller
+static void shell_map_free(ShellMap *map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->entries[i].key) free(map->entries[i].key);
+    }
+    free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+    map->used = 0;
+}
+
+// Entry of the history ring. Lines loaded from the history file point into
+// its mapping and are not NUL-terminated; lines added during the session are
+// owned by the ring.
+typedef struct {
+    char *line;
+    size_t length;
+    bool mapped;
+} ShellHistoryEntry;
+
+// Command history: a circular buffer with O(1) append and eviction, backed by
+// an optional append-only history file whose tail is indexed on first use
+typedef struct {
+    ShellHistoryEntry *entries;
+    size_t capacity;
+    size_t start;
+    size_t count;
+    int fd;
+    char *map;
+    size_t map_length;
+    bool loaded;
+} ShellHistory;
+
+// Shell variable, stored as a single "NAME=value" string so the exported
+// environment can point straight at it
+typedef struct {
+    char *entry;
+    size_t name_length;
+    bool exported;
+} ShellVariable;
+
 // Shell context structure
 typedef struct {
     char *input;
-    char *output;
+    char *output;          // collected by shell_capture_command, NUL-terminated
     char *error;
-    char *history[MAX_HISTORY_SIZE];
-    int history_count;
-    char *env_vars[MAX_ENV_VARS];
-    int env_vars_count;
+    size_t output_length;
+    size_t error_length;
+    ShellHistory history;
+    ShellMap variables;
+    char **envp;
+    bool envp_dirty;
+    bool variables_loaded;
     pid_t child_pid;
     sigset_t signal_mask;
     ShellError last_error;
+    int exit_status;
     char *prompt;
     bool interactive;
+    int fds[SHELL_CONTEXT_FDS];  // what 0-9 stand for in this context, -1 when closed
 } ShellContext;
 
-// Job structure for job control
-typedef struct {
-    pid_t pid;
-    char *command;
-    bool running;
-} Job;
+// Drop one history entry
+static void shell_history_release(ShellHistoryEntry *entry) {
+    if (!entry->mapped) free(entry->line);
+    entry->line = NULL;
+    entry->length = 0;
+}
 
-// Custom command callback type
-typedef ShellError (*CommandCallback)(ShellContext *ctx, int argc, char **argv);
+// Index the tail of the history file into the free slots ahead of the
+// oldest entry. Only as many lines as fit are scanned, newest first.
+static void shell_history_load(ShellHistory *history) {
+    if (history->loaded) return;
+    history->loaded = true;
+    if (!history->map || history->count == history->capacity) return;
 
-// Custom command structure
-typedef struct {
-    char *name;
-    CommandCallback callback;
-} CustomCommand;
+    if (!history->entries) {
+        history->entries = calloc(history->capacity, sizeof(ShellHistoryEntry));
+        if (!history->entries) return;
+    }
 
-// Alias structure
-typedef struct {
-    char *name;
-    char *value;
-} Alias;
+    const char *end = history->map + history->map_length;
+    while (end > history->map && history->count < history->capacity) {
+        const char *line_end = end[-1] == '\n' ? end - 1 : end;
+        const char *newline = memrchr(history->map, '\n', (size_t)(line_end - history->map));
+        const char *line = newline ? newline + 1 : history->map;
 
-// Shell context extension for custom commands, job control, aliases, etc.
-typedef struct {
-    ShellContext base;
-    CustomCommand custom_commands[MAX_CUSTOM_COMMANDS];
-    int custom_command_count;
-    Job jobs[MAX_JOBS];
-    int job_count;
-    Alias aliases[MAX_ALIASES];
-    int alias_count;
-} ExtendedShellContext;
+        if (line_end > line) {
+            history->start = (history->start + history->capacity - 1) % history->capacity;
+            history->entries[history->start] = (ShellHistoryEntry){ (char *)line, (size_t)(line_end - line), true };
+            history->count++;
+        }
+        end = line;
+    }
+}
 
-// Initialize the shell context
-ShellError shell_init(ExtendedShellContext *ctx, const char *prompt, bool interactive) {
-    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+// Free the history ring and close the history file
+static void shell_history_free(ShellHistory *history) {
+    for (size_t i = 0; i < history->count; i++) {
+        shell_history_release(&history->entries[(history->start + i) % history->capacity]);
+    }
+    free(history->entries);
+    if (history->map) munmap(history->map, history->map_length);
+    if (history->fd != -1) close(history->fd);
 
-    ctx->base.input = NULL;
-    ctx->base.output = NULL;
-    ctx->base.error = NULL;
-    ctx->base.history_count = 0;
-    ctx->base.env_vars_count = 0;
-    ctx->base.child_pid = -1;
-    ctx->base.last_error = SHELL_OK;
-    ctx->base.prompt = prompt ? strdup(prompt) : strdup("> ");
-    ctx->base.interactive = interactive;
-    ctx->custom_command_count = 0;
-    ctx->job_count = 0;
-    ctx->alias_count = 0;
+    history->entries = NULL;
+    history->start = 0;
+    history->count = 0;
+    history->fd = -1;
+    history->map = NULL;
+    history->map_length = 0;
+}
 
-    // Initialize signal mask
-    sigemptyset(&ctx->base.signal_mask);
-    sigaddset(&ctx->base.signal_mask, SIGINT);
-    sigaddset(&ctx->base.signal_mask, SIGTERM);
+// Add a line to the history, evicting the oldest entry when the ring is full
+ShellError shell_add_history(ShellContext *ctx, const char *line) {
+    if (!ctx || !line) return SHELL_ERROR_NULL_POINTER;
 
-    // Block signals during critical sections
-    if (sigprocmask(SIG_BLOCK, &ctx->base.signal_mask, NULL) == -1) {
-        ctx->base.last_error = SHELL_ERROR_SIGNAL_HANDLING_FAILED;
-        return SHELL_ERROR_SIGNAL_HANDLING_FAILED;
+    ShellHistory *history = &ctx->history;
+    size_t length = strlen(line);
+    if (length == 0) return SHELL_OK;
+
+    // Append to the history file with a single write
+    if (history->fd != -1) {
+        struct iovec iov[2] = { { (void *)line, length }, { "\n", 1 } };
+        if (writev(history->fd, iov, 2) == -1) {
+            ctx->last_error = SHELL_ERROR_HISTORY_FULL;
+        }
+    }
+
+    if (history->capacity == 0) return SHELL_OK;
+
+    if (!history->entries) {
+        history->entries = calloc(history->capacity, sizeof(ShellHistoryEntry));
+        if (!history->entries) {
+            ctx->last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+            return SHELL_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+
+    char *copy = malloc(length + 1);
+    if (!copy) {
+        ctx->last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    memcpy(copy, line, length + 1);
+
+    if (history->count == history->capacity) {
+        shell_history_release(&history->entries[history->start]);
+        history->start = (history->start + 1) % history->capacity;
+        history->count--;
     }
 
+    history->entries[(history->start + history->count) % history->capacity] = (ShellHistoryEntry){ copy, length, false };
+    history->count++;
     return SHELL_OK;
 }
 
-// Clean up the shell context
-ShellError shell_cleanup(ExtendedShellContext *ctx) {
+// Change the number of lines kept in memory, keeping the newest ones
+ShellError shell_set_history_capacity(ShellContext *ctx, size_t capacity) {
     if (!ctx) return SHELL_ERROR_NULL_POINTER;
 
-    if (ctx->base.input) free(ctx->base.input);
-    if (ctx->base.output) free(ctx->base.output);
-    if (ctx->base.error) free(ctx->base.error);
-    if (ctx->base.prompt) free(ctx->base.prompt);
-
-    for (int i = 0; i < ctx->base.history_count; i++) {
-        if (ctx->base.history[i]) free(ctx->base.history[i]);
+    ShellHistory *history = &ctx->history;
+    ShellHistoryEntry *entries = NULL;
+    if (capacity > 0) {
+        entries = calloc(capacity, sizeof(ShellHistoryEntry));
+        if (!entries) {
+            ctx->last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+            return SHELL_ERROR_MEMORY_ALLOCATION;
+        }
     }
 
-    for (int i = 0; i < ctx->base.env_vars_count; i++) {
-        if (ctx->base.env_vars[i]) free(ctx->base.env_vars[i]);
+    size_t keep = history->count < capacity ? history->count : capacity;
+    size_t dropped = history->count - keep;
+    for (size_t i = 0; i < history->count; i++) {
+        ShellHistoryEntry *entry = &history->entries[(history->start + i) % history->capacity];
+        if (i < dropped) {
+            shell_history_release(entry);
+        } else {
+            entries[i - dropped] = *entry;
+        }
     }
 
-    for (int i = 0; i < ctx->custom_command_count; i++) {
-        if (ctx->custom_commands[i].name) free(ctx->custom_commands[i].name);
-    }
+    free(history->entries);
+    history->entries = entries;
+    history->capacity = capacity;
+    history->start = 0;
+    history->count = keep;
+    return SHELL_OK;
+}
 
-    for (int i = 0; i < ctx->job_count; i++) {
-        if (ctx->jobs[i].command) free(ctx->jobs[i].command);
+// Use an append-only history file. Existing lines are mapped but not parsed
+// until the history is first read.
+ShellError shell_open_history_file(ShellContext *ctx, const char *path) {
+    if (!ctx || !path) return SHELL_ERROR_NULL_POINTER;
+
+    ShellHistory *history = &ctx->history;
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        ctx->last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
     }
 
-    for (int i = 0; i < ctx->alias_count; i++) {
-        if (ctx->aliases[i].name) free(ctx->aliases[i].name);
-        if (ctx->aliases[i].value) free(ctx->aliases[i].value);
+    struct stat st;
+    char *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) map = NULL;
     }
 
+    if (history->map) munmap(history->map, history->map_length);
+    if (history->fd != -1) close(history->fd);
+
+    history->fd = fd;
+    history->map = map;
+    history->map_length = map ? (size_t)st.st_size : 0;
+    history->loaded = false;
     return SHELL_OK;
 }
 
-// Register a custom command
-ShellError shell_register_command(ExtendedShellContext *ctx, const char *name, CommandCallback callback) {
-    if (!ctx || !name || !callback) return SHELL_ERROR_NULL_POINTER;
+// Number of lines in the history
+size_t shell_history_count(ShellContext *ctx) {
+    if (!ctx) return 0;
+
+    shell_history_load(&ctx->history);
+    return ctx->history.count;
+}
+
+// Get a history line, 0 being the oldest. The line is not NUL-terminated
+// when it comes from the history file, so its length is returned too.
+const char *shell_get_history(ShellContext *ctx, size_t index, size_t *length) {
+    if (!ctx) return NULL;
+
+    ShellHistory *history = &ctx->history;
+    shell_history_load(history);
+    if (index >= history->count) return NULL;
+
+    ShellHistoryEntry *entry = &history->entries[(history->start + index) % history->capacity];
+    if (length) *length = entry->length;
+    return entry->line;
+}
+
+// Job structure for job control. A job is a process group with one or
+// more live processes; pid is the first process and marks the slot in use.
+typedef struct {
+    pid_t pid;
+    char *command;
+    bool running;
+    pid_t pgid;
+    int processes;
+} Job;
+
+// Chunk of a bump arena
+typedef struct ShellArenaChunk {
+    struct ShellArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ShellArenaChunk;
+
+// Bump allocator for state that lives no longer than one command line.
+// Chunks are kept after a release and reused, so steady-state parsing
+// does not touch malloc.
+typedef struct {
+    ShellArenaChunk *head;
+    ShellArenaChunk *current;
+} ShellArena;
+
+// Position in an arena that a later release rolls back to
+typedef struct {
+    ShellArenaChunk *chunk;
+    size_t used;
+} ShellArenaMark;
+
+// Allocate aligned, uninitialized memory from the arena
+static void *shell_arena_alloc(ShellArena *arena, size_t size) {
+    ShellArenaChunk *chunk = arena->current;
 
-    if (ctx->custom_command_count >= MAX_CUSTOM_COMMANDS) {
-        ctx->base.last_error = SHELL_ERROR_CUSTOM_COMMAND_FULL;
-        return SHELL_ERROR_CUSTOM_COMMAND_FULL;
+    if (chunk) {
+        size_t offset = (chunk->used + SHELL_ARENA_ALIGNMENT - 1) & ~(size_t)(SHELL_ARENA_ALIGNMENT - 1);
+        if (offset + size <= chunk->size) {
+            chunk->used = offset + size;
+            return chunk->data + offset;
+        }
+
+        // Move on to a chunk kept from an earlier line if it is large enough
+        if (chunk->next && chunk->next->size >= size) {
+            arena->current = chunk->next;
+            arena->current->used = size;
+            return arena->current->data;
+        }
     }
 
-    ctx->custom_commands[ctx->custom_command_count].name = strdup(name);
-    if (!ctx->custom_commands[ctx->custom_command_count].name) {
-        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
-        return SHELL_ERROR_MEMORY_ALLOCATION;
+    size_t chunk_size = size > SHELL_ARENA_CHUNK_SIZE ? size : SHELL_ARENA_CHUNK_SIZE;
+    ShellArenaChunk *fresh = malloc(sizeof(ShellArenaChunk) + chunk_size);
+    if (!fresh) return NULL;
+
+    fresh->size = chunk_size;
+    fresh->used = size;
+    if (chunk) {
+        fresh->next = chunk->next;
+        chunk->next = fresh;
+    } else {
+        fresh->next = arena->head;
+        arena->head = fresh;
     }
+    arena->current = fresh;
+    return fresh->data;
+}
 
-    ctx->custom_commands[ctx->custom_command_count].callback = callback;
-    ctx->custom_command_count++;
+// Copy length bytes of a string into the arena and terminate it
+static char *shell_arena_strndup(ShellArena *arena, const char *text, size_t length) {
+    char *copy = shell_arena_alloc(arena, length + 1);
+    if (!copy) return NULL;
 
-    return SHELL_OK;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
 }
 
-// Add a job to the job list
-ShellError shell_add_job(ExtendedShellContext *ctx, pid_t pid, const char *command) {
-    if (!ctx || !command) return SHELL_ERROR_NULL_POINTER;
+// Remember the current arena position
+static ShellArenaMark shell_arena_mark(const ShellArena *arena) {
+    ShellArenaMark mark = { arena->current, arena->current ? arena->current->used : 0 };
+    return mark;
+}
 
-    if (ctx->job_count >= MAX_JOBS) {
-        ctx->base.last_error = SHELL_ERROR_JOB_CONTROL_FULL;
-        return SHELL_ERROR_JOB_CONTROL_FULL;
+// Roll the arena back to a mark in O(1); later chunks are kept for reuse
+static void shell_arena_release(ShellArena *arena, ShellArenaMark mark) {
+    if (mark.chunk) {
+        arena->current = mark.chunk;
+        arena->current->used = mark.used;
+    } else {
+        arena->current = arena->head;
+        if (arena->current) arena->current->used = 0;
     }
+}
 
-    ctx->jobs[ctx->job_count].pid = pid;
-    ctx->jobs[ctx->job_count].command = strdup(command);
-    ctx->jobs[ctx->job_count].running = true;
-    ctx->job_count++;
+// Free every chunk of the arena
+static void shell_arena_free(ShellArena *arena) {
+    ShellArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ShellArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->current = NULL;
+}
 
-    return SHELL_OK;
+// Token types produced by the lexer
+typedef enum {
+    SHELL_TOKEN_WORD,
+    SHELL_TOKEN_PIPE,
+    SHELL_TOKEN_OR_IF,
+    SHELL_TOKEN_AMP,
+    SHELL_TOKEN_AND_IF,
+    SHELL_TOKEN_SEMI,
+    SHELL_TOKEN_LESS,
+    SHELL_TOKEN_GREAT,
+    SHELL_TOKEN_DGREAT,
+    SHELL_TOKEN_DLESS,       // <<
+    SHELL_TOKEN_DLESSDASH,   // <<-
+    SHELL_TOKEN_TLESS,       // <<<
+    SHELL_TOKEN_LESSAND,     // <&
+    SHELL_TOKEN_GREATAND,    // >&
+    SHELL_TOKEN_AND_GREAT,   // &>
+    SHELL_TOKEN_AND_DGREAT,  // &>>
+    SHELL_TOKEN_NEWLINE,
+    SHELL_TOKEN_LPAREN,
+    SHELL_TOKEN_RPAREN
+} ShellTokenType;
+
+// Word flags set by the lexer
+#define SHELL_WORD_QUOTED 0x01
+#define SHELL_WORD_EXPAND 0x02
+#define SHELL_WORD_ALIASED 0x04  // produced by alias expansion
+#define SHELL_WORD_GLOB 0x08     // has an unquoted *, ? or [
+#define SHELL_WORD_PROCESS 0x10  // a <(...) or >(...) process substitution
+
+// Lexer token. Words carry their text after quote removal as well as the
+// raw source slice they were scanned from. A redirection operator carries
+// the descriptor number written before it, and a here-document operator
+// its body as text, flagged SHELL_WORD_EXPAND unless the delimiter was
+// quoted.
+typedef struct {
+    ShellTokenType type;
+    unsigned flags;
+    char *text;
+    const char *raw;
+    size_t raw_length;
+    int fd;  // -1 for the operator's default descriptor
+} ShellToken;
+
+// Whether a token is a redirection operator
+static bool shell_is_redirection(ShellTokenType type) {
+    return type >= SHELL_TOKEN_LESS && type <= SHELL_TOKEN_AND_DGREAT;
 }
 
-// Check and update job status
-ShellError shell_update_jobs(ExtendedShellContext *ctx) {
-    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+// Token stream of one command line. incomplete is set when the input
+// ends inside a quote.
+typedef struct {
+    ShellToken *tokens;
+    size_t count;
+    size_t capacity;
+    bool incomplete;
+} ShellTokenList;
 
-    for (int i = 0; i < ctx->job_count; i++) {
-        if (ctx->jobs[i].running) {
-            int status;
-            pid_t result = waitpid(ctx->jobs[i].pid, &status, WNOHANG);
-            if (result > 0) {
-                ctx->jobs[i].running = false;
-                printf("[%d] Done: %s\n", i + 1, ctx->jobs[i].command);
-            }
-        }
+// Characters that end an unquoted run of word characters
+#define SHELL_WORD_DELIMITERS " \t\n|&;<>()'\"\\"
+
+// Append a token to the list, growing it inside the arena
+static ShellToken *shell_push_token(ShellArena *arena, ShellTokenList *list, ShellTokenType type) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        ShellToken *tokens = shell_arena_alloc(arena, capacity * sizeof(ShellToken));
+        if (!tokens) return NULL;
+        if (list->count) memcpy(tokens, list->tokens, list->count * sizeof(ShellToken));
+        list->tokens = tokens;
+        list->capacity = capacity;
     }
 
-    return SHELL_OK;
+    ShellToken *token = &list->tokens[list->count++];
+    token->type = type;
+    token->flags = 0;
+    token->text = NULL;
+    token->raw = NULL;
+    token->raw_length = 0;
+    token->fd = -1;
+    return token;
 }
 
-// Execute a custom command
-ShellError shell_execute_custom(ExtendedShellContext *ctx, int argc, char **argv) {
-    if (!ctx || !argv) return SHELL_ERROR_NULL_POINTER;
+static ShellError shell_scan_substitution(const char *input, size_t length, size_t start, size_t *end);
 
-    for (int i = 0; i < ctx->custom_command_count; i++) {
-        if (strcmp(argv[0], ctx->custom_commands[i].name) == 0) {
-            return ctx->custom_commands[i].callback(&ctx->base, argc, argv);
+// Find the end of the double-quoted string starting at input[start],
+// within the first length bytes of input or up to its terminator
+static ShellError shell_scan_double_quoted(const char *input, size_t length, size_t start, size_t *end) {
+    size_t i = start + 1;
+    while (i < length && input[i] && input[i] != '"') {
+        if (input[i] == '$' && i + 1 < length && input[i + 1] == '(') {
+            if (shell_scan_substitution(input, length, i, &i) != SHELL_OK) return SHELL_ERROR_SYNTAX;
+        } else {
+            i += (input[i] == '\\' && i + 1 < length && input[i + 1]) ? 2 : 1;
         }
     }
-
-    ctx->base.last_error = SHELL_ERROR_COMMAND_NOT_FOUND;
-    return SHELL_ERROR_COMMAND_NOT_FOUND;
+    if (i >= length || !input[i]) return SHELL_ERROR_SYNTAX;
+    *end = i + 1;
+    return SHELL_OK;
 }
 
-// Execute a built-in command
-ShellError shell_execute_builtin(ExtendedShellContext *ctx, const char *command) {
-    if (!ctx || !command) return SHELL_ERROR_NULL_POINTER;
+// Find the end of the $(...) command substitution whose $ is at
+// input[start], skipping quoted text and nested parentheses
+static ShellError shell_scan_substitution(const char *input, size_t length, size_t start, size_t *end) {
+    size_t i = start + 2;
+    int depth = 1;
 
-    if (strcmp(command, "exit") == 0) {
-        exit(0);
-    } else if (strcmp(command, "history") == 0) {
-        for (int i = 0; i < ctx->base.history_count; i++) {
-            printf("%d: %s\n", i + 1, ctx->base.history[i]);
+    while (i < length && input[i]) {
+        char c = input[i];
+        if (c == '\\') {
+            i += i + 1 < length && input[i + 1] ? 2 : 1;
+        } else if (c == '\'') {
+            size_t close = i + 1;
+            while (close < length && input[close] && input[close] != '\'') close++;
+            if (close >= length || !input[close]) return SHELL_ERROR_SYNTAX;
+            i = close + 1;
+        } else if (c == '"') {
+            if (shell_scan_double_quoted(input, length, i, &i) != SHELL_OK) return SHELL_ERROR_SYNTAX;
+        } else if (c == ')' && --depth == 0) {
+            *end = i + 1;
+            return SHELL_OK;
+        } else {
+            if (c == '(') depth++;
+            i++;
         }
-    } else if (strcmp(command, "jobs") == 0) {
-        shell_update_jobs(ctx);
-        for (int i = 0; i < ctx->job_count; i++) {
-            printf("[%d] %s: %s\n", i + 1, ctx->jobs[i].running ? "Running" : "Done", ctx->jobs[i].command);
-        }
-    } else {
-        ctx->base.last_error = SHELL_ERROR_COMMAND_NOT_FOUND;
-        return SHELL_ERROR_COMMAND_NOT_FOUND;
     }
-
-    return SHELL_OK;
+    return SHELL_ERROR_SYNTAX;
 }
 
-// Execute an external command using posix_spawnp
-ShellError shell_execute_external(ExtendedShellContext *ctx, char *const argv[], const char *input_file, const char *output_file, bool append_output) {
-    if (!ctx || !argv) return SHELL_ERROR_NULL_POINTER;
+// Find the end of the word starting at input[start], honouring quotes,
+// escapes and command substitutions
+static ShellError shell_scan_word(const char *input, size_t start, size_t *end) {
+    size_t i = start;
 
-    pid_t pid;
-    posix_spawnattr_t attr;
-    posix_spawn_file_actions_t file_actions;
+    while (true) {
+        // Skip the run of ordinary characters in one strcspn call
+        i += strcspn(input + i, SHELL_WORD_DELIMITERS "$");
 
-    // Initialize spawn attributes and file actions
-    posix_spawnattr_init(&attr);
-    posix_spawn_file_actions_init(&file_actions);
+        char c = input[i];
+        if (c == '\\') {
+            i += input[i + 1] ? 2 : 1;
+        } else if (c == '\'') {
+            const char *close = strchr(input + i + 1, '\'');
+            if (!close) return SHELL_ERROR_SYNTAX;
+            i = (size_t)(close - input) + 1;
+        } else if (c == '"') {
+            if (shell_scan_double_quoted(input, SIZE_MAX, i, &i) != SHELL_OK) return SHELL_ERROR_SYNTAX;
+        } else if (c == '$') {
+            if (input[i + 1] != '(') {
+                i++;
+            } else if (shell_scan_substitution(input, SIZE_MAX, i, &i) != SHELL_OK) {
+                return SHELL_ERROR_SYNTAX;
+            }
+        } else {
+            *end = i;
+            return SHELL_OK;
+        }
+    }
+}
 
-    // Set flags for posix_spawn
-    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
-    posix_spawnattr_setsigmask(&attr, &ctx->base.signal_mask);
+// Output of word cooking, grown inside the arena. In pattern mode quoted
+// characters that are special to fnmatch are written with a backslash.
+typedef struct {
+    ShellArena *arena;
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+    bool pattern;
+} ShellWordBuffer;
+
+// Append bytes to a word buffer, keeping room for the terminator
+static void shell_word_append(ShellWordBuffer *buffer, const char *text, size_t length) {
+    if (buffer->failed) return;
 
-    // Handle input redirection
-    if (input_file) {
-        posix_spawn_file_actions_addopen(&file_actions, STDIN_FILENO, input_file, O_RDONLY, 0);
+    if (buffer->length + length + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 64;
+        while (capacity < buffer->length + length + 1) capacity *= 2;
+
+        char *data = shell_arena_alloc(buffer->arena, capacity);
+        if (!data) {
+            buffer->failed = true;
+            return;
+        }
+        if (buffer->length) memcpy(data, buffer->data, buffer->length);
+        buffer->data = data;
+        buffer->capacity = capacity;
     }
 
-    // Handle output redirection
-    if (output_file) {
-        int flags = O_WRONLY | O_CREAT | (append_output ? O_APPEND : O_TRUNC);
-        posix_spawn_file_actions_addopen(&file_actions, STDOUT_FILENO, output_file, flags, 0644);
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
+// Append quoted text, escaping it when the buffer holds a pattern
+static void shell_word_append_quoted(ShellWordBuffer *buffer, const char *text, size_t length) {
+    if (!buffer->pattern) {
+        shell_word_append(buffer, text, length);
+        return;
     }
 
-    // Execute the command
-    int status = posix_spawnp(&pid, argv[0], &file_actions, &attr, argv, environ);
-    if (status != 0) {
-        ctx->base.last_error = SHELL_ERROR_EXECUTION_FAILED;
-        return SHELL_ERROR_EXECUTION_FAILED;
+    for (size_t i = 0; i < length; i++) {
+        if (strchr("*?[\\", text[i])) shell_word_append(buffer, "\\", 1);
+        shell_word_append(buffer, &text[i], 1);
     }
+}
 
-    // Add the job to the job list
-    shell_add_job(ctx, pid, argv[0]);
+// Expands the $ reference at the start of raw into the buffer and returns
+// the number of bytes it consumed (at least 1)
+typedef size_t (*ShellExpander)(void *data, const char *raw, size_t length, ShellWordBuffer *out);
 
-    // Clean up
-    posix_spawnattr_destroy(&attr);
-    posix_spawn_file_actions_destroy(&file_actions);
+// Remove quotes and escapes from a raw word. $ references outside single
+// quotes are handed to the expander, or copied literally without one.
+static unsigned shell_cook_word(const char *raw, size_t length, ShellWordBuffer *out, ShellExpander expander, void *data) {
+    unsigned flags = 0;
+    bool in_double = false;
+    size_t i = 0;
 
-    return SHELL_OK;
+    shell_word_append(out, "", 0);
+    while (i < length) {
+        char c = raw[i];
+        if (c == '\\') {
+            flags |= SHELL_WORD_QUOTED;
+            char next = i + 1 < length ? raw[i + 1] : '\0';
+            if (next == '\n') {
+                // Backslash-newline is a line continuation
+                i += 2;
+            } else if (!next || (in_double && !strchr("$`\"\\", next))) {
+                shell_word_append_quoted(out, "\\", 1);
+                i++;
+            } else {
+                shell_word_append_quoted(out, &raw[i + 1], 1);
+                i += 2;
+            }
+        } else if (c == '\'' && !in_double) {
+            flags |= SHELL_WORD_QUOTED;
+            const char *close = memchr(raw + i + 1, '\'', length - i - 1);
+            size_t span = (size_t)(close - (raw + i + 1));
+            shell_word_append_quoted(out, raw + i + 1, span);
+            i += span + 2;
+        } else if (c == '"') {
+            flags |= SHELL_WORD_QUOTED;
+            in_double = !in_double;
+            i++;
+        } else if (c == '$') {
+            flags |= SHELL_WORD_EXPAND;
+            size_t end;
+            if (expander) {
+                i += expander(data, raw + i, length - i, out);
+            } else if (i + 1 < length && raw[i + 1] == '(' && shell_scan_substitution(raw, length, i, &end) == SHELL_OK) {
+                // A command substitution stays as written until expansion
+                shell_word_append(out, raw + i, end - i);
+                i = end;
+            } else {
+                shell_word_append(out, "$", 1);
+                i++;
+            }
+        } else {
+            size_t end = i + 1;
+            while (end < length && raw[end] != '\\' && raw[end] != '\'' && raw[end] != '"' && raw[end] != '$') end++;
+            if (in_double) {
+                shell_word_append_quoted(out, raw + i, end - i);
+            } else {
+                shell_word_append(out, raw + i, end - i);
+                for (size_t j = i; j < end; j++) {
+                    if (raw[j] == '*' || raw[j] == '?' || raw[j] == '[') flags |= SHELL_WORD_GLOB;
+                }
+            }
+            i = end;
+        }
+    }
+
+    return flags;
 }
 
-// Parse and execute a command with redirection and piping
-ShellError shell_execute_command(ExtendedShellContext *ctx, const char *command) {
-    if (!ctx || !command) return SHELL_ERROR_NULL_POINTER;
+// Read the bodies of the here-documents opened by tokens[first..] from
+// the lines starting at input[*position], just after a newline. Each body
+// runs up to a line holding only its delimiter; <<- strips leading tabs
+// from the body and the delimiter line.
+static ShellError shell_lex_heredocs(ShellArena *arena, const char *input, size_t *position, ShellTokenList *list, size_t first) {
+    size_t i = *position;
 
-    // Tokenize the command
-    char *tokens[MAX_INPUT_SIZE];
-    int token_count = 0;
-    char *token = strtok((char *)command, " ");
-    while (token) {
-        tokens[token_count++] = token;
-        token = strtok(NULL, " ");
-    }
-    tokens[token_count] = NULL;
-
-    // Handle redirection and piping
-    const char *input_file = NULL;
-    const char *output_file = NULL;
-    bool append_output = false;
-
-    for (int i = 0; i < token_count; i++) {
-        if (strcmp(tokens[i], "<") == 0) {
-            input_file = tokens[i + 1];
-            tokens[i] = NULL;
-        } else if (strcmp(tokens[i], ">") == 0) {
-            output_file = tokens[i + 1];
-            tokens[i] = NULL;
-        } else if (strcmp(tokens[i], ">>") == 0) {
-            output_file = tokens[i + 1];
-            append_output = true;
-            tokens[i] = NULL;
-        }
-    }
-
-    // Execute custom commands
-    if (shell_execute_custom(ctx, token_count, tokens) == SHELL_OK) {
-        return SHELL_OK;
-    }
+    for (size_t n = first; n + 1 < list->count; n++) {
+        ShellToken *op = &list->tokens[n];
+        const ShellToken *delimiter = &list->tokens[n + 1];
+        if ((op->type != SHELL_TOKEN_DLESS && op->type != SHELL_TOKEN_DLESSDASH) || delimiter->type != SHELL_TOKEN_WORD) continue;
 
-    // Execute built-in commands
-    if (shell_execute_builtin(ctx, tokens[0]) == SHELL_OK) {
-        return SHELL_OK;
+        bool strip = op->type == SHELL_TOKEN_DLESSDASH;
+        size_t delimiter_length = strlen(delimiter->text);
+        ShellWordBuffer body = { arena, NULL, 0, 0, false, false };
+        shell_word_append(&body, "", 0);
+
+        while (true) {
+            if (!input[i]) {
+                list->incomplete = true;
+                return SHELL_ERROR_SYNTAX;
+            }
+            if (strip) i += strspn(input + i, "\t");
+
+            size_t length = strcspn(input + i, "\n");
+            if (length == delimiter_length && memcmp(input + i, delimiter->text, length) == 0) {
+                i += length + (input[i + length] == '\n');
+                break;
+            }
+            if (!input[i + length]) {
+                list->incomplete = true;
+                return SHELL_ERROR_SYNTAX;
+            }
+            shell_word_append(&body, input + i, length + 1);
+            i += length + 1;
+        }
+        if (body.failed) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+        op->text = body.data;
+        if (!(delimiter->flags & SHELL_WORD_QUOTED) && strpbrk(body.data, "$\\")) op->flags |= SHELL_WORD_EXPAND;
     }
 
-    // Execute external commands
-    return shell_execute_external(ctx, tokens, input_file, output_file, append_output);
+    *position = i;
+    return SHELL_OK;
 }
 
-// Main shell loop
-ShellError shell_run(ExtendedShellContext *ctx) {
-    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+// Split a command line into words and operators in a single pass.
+// The lexer is reentrant, does not modify its input and has no length limit;
+// tokens and word text are allocated from the arena. Here-document bodies
+// are taken from the lines after the one that opens them.
+static ShellError shell_lex(ShellArena *arena, const char *input, ShellTokenList *list) {
+    *list = (ShellTokenList){ NULL, 0, 0, false };
+    size_t i = 0;
+    size_t line_start = 0;  // first token of the current line
 
-    char input[MAX_INPUT_SIZE];
     while (true) {
-        if (ctx->base.interactive) {
-            printf("%s", ctx->base.prompt);
+        // Skip blanks and line continuations
+        while (true) {
+            i += strspn(input + i, " \t");
+            if (input[i] != '\\' || input[i + 1] != '\n') break;
+            i += 2;
         }
 
-        if (!fgets(input, MAX_INPUT_SIZE, stdin)) {
-            ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
-            return SHELL_ERROR_INVALID_INPUT;
+        char c = input[i];
+        if (!c) {
+            // A here-document still needs its body
+            for (size_t n = line_start; n < list->count; n++) {
+                if (list->tokens[n].type == SHELL_TOKEN_DLESS || list->tokens[n].type == SHELL_TOKEN_DLESSDASH) {
+                    list->incomplete = true;
+                    return SHELL_ERROR_SYNTAX;
+                }
+            }
+            return SHELL_OK;
         }
 
-        // Remove newline character
-        input[strcspn(input, "\n")] = 0;
+        // Comments run to the end of the line
+        if (c == '#') {
+            i += strcspn(input + i, "\n");
+            continue;
+        }
 
-        // Add to history
-        shell_add_history(&ctx->base, input);
+        // A single digit directly before < or > names the descriptor to
+        // redirect, unless it is itself the target of a redirection
+        int fd = -1;
+        bool after_redirection = list->count > 0 && shell_is_redirection(list->tokens[list->count - 1].type);
+        if (isdigit((unsigned char)c) && (input[i + 1] == '<' || input[i + 1] == '>') && !after_redirection) {
+            fd = c - '0';
+            c = input[++i];
+        }
 
-        // Execute the command
-        shell_execute_command(ctx, input);
-    }
+        ShellTokenType type = SHELL_TOKEN_WORD;
+        size_t width = 1;
+        char next = input[i + 1];
+        switch (c) {
+            case '\n': type = SHELL_TOKEN_NEWLINE; break;
+            case ';': type = SHELL_TOKEN_SEMI; break;
+            case '(': type = SHELL_TOKEN_LPAREN; break;
+            case ')': type = SHELL_TOKEN_RPAREN; break;
+            case '|':
+                type = next == '|' ? SHELL_TOKEN_OR_IF : SHELL_TOKEN_PIPE;
+                width = next == '|' ? 2 : 1;
+                break;
+            case '&':
+                if (next == '>') {
+                    type = input[i + 2] == '>' ? SHELL_TOKEN_AND_DGREAT : SHELL_TOKEN_AND_GREAT;
+                    width = input[i + 2] == '>' ? 3 : 2;
+                } else {
+                    type = next == '&' ? SHELL_TOKEN_AND_IF : SHELL_TOKEN_AMP;
+                    width = next == '&' ? 2 : 1;
+                }
+                break;
+            case '<':
+                if (next == '(' && fd == -1) break;
+                if (next == '<') {
+                    char third = input[i + 2];
+                    type = third == '<' ? SHELL_TOKEN_TLESS : third == '-' ? SHELL_TOKEN_DLESSDASH : SHELL_TOKEN_DLESS;
+                    width = third == '<' || third == '-' ? 3 : 2;
+                } else {
+                    type = next == '&' ? SHELL_TOKEN_LESSAND : SHELL_TOKEN_LESS;
+                    width = next == '&' ? 2 : 1;
+                }
+                break;
+            case '>':
+                if (next == '(' && fd == -1) break;
+                type = next == '>' ? SHELL_TOKEN_DGREAT : next == '&' ? SHELL_TOKEN_GREATAND : SHELL_TOKEN_GREAT;
+                width = next == '>' || next == '&' ? 2 : 1;
+                break;
+            default: break;
+        }
 
-    return SHELL_OK;
+        if (type != SHELL_TOKEN_WORD) {
+            ShellToken *token = shell_push_token(arena, list, type);
+            if (!token) return SHELL_ERROR_MEMORY_ALLOCATION;
+            token->raw = input + i;
+            token->raw_length = width;
+            token->fd = fd;
+            i += width;
+
+            if (type == SHELL_TOKEN_NEWLINE) {
+                ShellError result = shell_lex_heredocs(arena, input, &i, list, line_start);
+                if (result != SHELL_OK) return result;
+                line_start = list->count;
+            }
+            continue;
+        }
+
+        // <(command) and >(command) are words of their own, kept as written
+        if (c == '<' || c == '>') {
+            size_t end;
+            if (shell_scan_substitution(input, SIZE_MAX, i, &end) != SHELL_OK) {
+                list->incomplete = true;
+                return SHELL_ERROR_SYNTAX;
+            }
+            ShellToken *token = shell_push_token(arena, list, SHELL_TOKEN_WORD);
+            if (!token) return SHELL_ERROR_MEMORY_ALLOCATION;
+            token->raw = input + i;
+            token->raw_length = end - i;
+            token->text = shell_arena_strndup(arena, input + i, end - i);
+            token->flags = SHELL_WORD_PROCESS | SHELL_WORD_EXPAND;
+            if (!token->text) return SHELL_ERROR_MEMORY_ALLOCATION;
+            i = end;
+            continue;
+        }
+
+        size_t end;
+        if (shell_scan_word(input, i, &end) != SHELL_OK) {
+            list->incomplete = true;
+            return SHELL_ERROR_SYNTAX;
+        }
+
+        // Quote removal never makes a word longer, so the text fits in one allocation
+        ShellToken *token = shell_push_token(arena, list, SHELL_TOKEN_WORD);
+        ShellWordBuffer text = { arena, shell_arena_alloc(arena, end - i + 1), 0, end - i + 1, false, false };
+        if (!token || !text.data) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+        token->raw = input + i;
+        token->raw_length = end - i;
+        token->flags = shell_cook_word(token->raw, token->raw_length, &text, NULL, NULL);
+        token->text = text.data;
+        i = end;
+    }
+}
+
+typedef struct ExtendedShellContext ExtendedShellContext;
+
+// Custom command callback type
+typedef ShellError (*CommandCallback)(ShellContext *ctx, int argc, char **argv);
+
+// Standard streams of a stream command. They are the command's
+// redirection targets or pipe ends, or the shell's own descriptors, and
+// belong to the shell: the command must not close them.
+typedef struct {
+    int input;
+    int output;
+    int error;
+} ShellIO;
+
+// Write all of a buffer, returning false on error
+static bool shell_write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+// Descriptor that stands for fd in the commands a context runs. Capture
+// and redirections of in-process commands replace the context's copy of
+// 0-9, never the process's own descriptors, so contexts on other threads
+// are not affected; the table is mapped onto 0-9 of every child.
+// A built-in running as a stage of a pipeline sees its stage's streams
+// as 0-2 of its context instead, on its own thread only.
+typedef struct {
+    const ShellContext *ctx;
+    int fds[3];
+} ShellStageView;
+
+static _Thread_local ShellStageView shell_stage_view;
+
+static int shell_context_fd(const ShellContext *ctx, int fd) {
+    if (ctx == shell_stage_view.ctx && fd >= 0 && fd <= STDERR_FILENO) return shell_stage_view.fds[fd];
+    return fd >= 0 && fd < SHELL_CONTEXT_FDS ? ctx->fds[fd] : fd;
+}
+
+// Write data to one of the context's descriptors
+ShellError shell_write(ShellContext *ctx, int fd, const void *data, size_t length) {
+    if (!ctx || (!data && length > 0)) return SHELL_ERROR_NULL_POINTER;
+    if (!shell_write_all(shell_context_fd(ctx, fd), data, length)) {
+        ctx->last_error = SHELL_ERROR_EXECUTION_FAILED;
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+    return SHELL_OK;
+}
+
+// printf to one of the context's descriptors. Custom commands write their
+// output this way: stdout is the process's, not the context's.
+int shell_printf(ShellContext *ctx, int fd, const char *format, ...) {
+    if (!ctx || !format) return -1;
+    va_list args;
+    va_start(args, format);
+    int written = vdprintf(shell_context_fd(ctx, fd), format, args);
+    va_end(args);
+    return written;
+}
+
+// Output of a built-in, gathered so it goes out in few writes
+typedef struct {
+    ShellContext *ctx;
+    int fd;
+    size_t length;
+    char data[SHELL_OUTPUT_BUFFER];
+} ShellOutput;
+
+static void shell_output_open(ShellOutput *out, ShellContext *ctx, int fd) {
+    out->ctx = ctx;
+    out->fd = fd;
+    out->length = 0;
+}
+
+static void shell_output_flush(ShellOutput *out) {
+    if (out->length > 0) shell_write_all(shell_context_fd(out->ctx, out->fd), out->data, out->length);
+    out->length = 0;
+}
+
+static void shell_output_put(ShellOutput *out, const char *data, size_t length) {
+    if (out->length + length > sizeof(out->data)) {
+        shell_output_flush(out);
+        if (length > sizeof(out->data)) {
+            shell_write_all(shell_context_fd(out->ctx, out->fd), data, length);
+            return;
+        }
+    }
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+}
+
+static void shell_output_char(ShellOutput *out, char c) {
+    shell_output_put(out, &c, 1);
+}
+
+static void shell_output_vprintf(ShellOutput *out, const char *format, va_list args) {
+    va_list again;
+    va_copy(again, args);
+    size_t room = sizeof(out->data) - out->length;
+    int needed = vsnprintf(out->data + out->length, room, format, args);
+    if (needed >= 0 && (size_t)needed < room) {
+        out->length += (size_t)needed;
+    } else if (needed >= 0) {
+        // Did not fit in what was left: format it again, on its own
+        char *text = malloc((size_t)needed + 1);
+        if (text) {
+            vsnprintf(text, (size_t)needed + 1, format, again);
+            shell_output_put(out, text, (size_t)needed);
+            free(text);
+        }
+    }
+    va_end(again);
+}
+
+static void shell_output_printf(ShellOutput *out, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    shell_output_vprintf(out, format, args);
+    va_end(args);
+}
+
+// Custom command callback type for commands that read and write through
+// the given streams, so they can be redirected and used in pipelines
+typedef ShellError (*StreamCommandCallback)(ShellContext *ctx, const ShellIO *io, int argc, char **argv);
+
+// Built-in command callback type, returns the command's exit status
+typedef int (*BuiltinCallback)(ExtendedShellContext *ctx, int argc, char **argv);
+
+// Kinds of entries in the command dispatch table
+typedef enum {
+    SHELL_COMMAND_CUSTOM,
+    SHELL_COMMAND_BUILTIN,
+    SHELL_COMMAND_ALIAS,
+    SHELL_COMMAND_FUNCTION,
+    SHELL_COMMAND_STREAM
+} ShellCommandKind;
+
+// Entry of the command dispatch table. Any entry may also carry an alias;
+// SHELL_COMMAND_ALIAS marks a name that is only an alias. The alias text is
+// lexed once when it is defined: value holds the text followed by the
+// tokens' cooked words, and the tokens point into it. A shell function
+// holds a reference to the parse its body node belongs to.
+struct ShellParse;
+struct ShellNode;
+typedef struct {
+    const char *name;
+    ShellCommandKind kind;
+    CommandCallback callback;
+    BuiltinCallback builtin;
+    bool shareable;  // built-in that changes nothing in the context
+    StreamCommandCallback stream;
+    char *value;
+    size_t value_size;
+    ShellToken *alias_tokens;
+    size_t alias_token_count;
+    bool alias_blank;
+    struct ShellParse *function;
+    const struct ShellNode *body;
+} ShellCommand;
+
+// Redirection of one descriptor, such as 2>file, 2>&1 or 3<&-
+typedef struct {
+    int fd;
+    const char *path;  // file opened onto fd with flags, or NULL
+    int flags;
+    int source;        // without a path: descriptor copied onto fd, or -1 to close it
+} ShellRedirection;
+
+// Limit set with setrlimit in a spawned process
+typedef struct {
+    int resource;  // RLIMIT_*
+    struct rlimit limit;
+} ShellResourceLimit;
+
+// Placement and limits of a spawned process, applied in the child before
+// execve. A zeroed structure changes nothing; the masks hold one bit per
+// CPU or node, as sched_setaffinity and set_mempolicy take them.
+typedef struct {
+    unsigned long cpus[SHELL_MASK_WORDS(SHELL_CPU_SETSIZE)];        // affinity; all clear to inherit
+    unsigned long numa_nodes[SHELL_MASK_WORDS(SHELL_NUMA_NODES)];  // memory bound to these nodes; all clear to inherit
+    bool set_nice;
+    int nice;
+    int io_class;  // ionice class: 1 realtime, 2 best effort, 3 idle; 0 to inherit
+    int io_level;  // 0 (highest) to 7 within the realtime and best-effort classes
+    ShellResourceLimit limits[SHELL_MAX_RESOURCE_LIMITS];
+    size_t limit_count;
+    const char *cgroup;  // cgroup v2 directory the process joins, or NULL
+} ShellSpawnResources;
+
+// One stage of a pipeline. The redirections are applied in order after
+// the input and output files. A stage with resources always runs as a
+// process of its own.
+typedef struct {
+    char **argv;
+    const char *input_file;
+    const char *output_file;
+    bool append_output;
+    char *const *envp;  // NULL to use the shell's environment
+    const ShellRedirection *redirections;
+    size_t redirection_count;
+    const ShellSpawnResources *resources;  // NULL for the shell's defaults
+} ShellPipelineStage;
+
+// How external commands are started
+typedef enum {
+    SHELL_SPAWN_POSIX,  // posix_spawn with cached attribute templates
+    SHELL_SPAWN_CLONE,  // clone(CLONE_VM | CLONE_VFORK) and execve; Linux only
+    SHELL_SPAWN_ZYGOTE  // pre-forked workers of a helper process; Linux only
+} ShellSpawnBackend;
+
+// One process to start. The descriptors are dup2'd onto stdin and stdout
+// first, then the rest of the context's 0-9 copied into place, then the
+// redirection files opened over them and the remaining redirections
+// applied in order, so explicit redirections take precedence over pipes.
+typedef struct {
+    char *const *argv;
+    char *const *envp;       // NULL to use the shell's environment
+    int input_fd;            // -1 to inherit
+    int output_fd;           // -1 to inherit
+    const char *input_file;
+    const char *output_file;
+    bool append_output;
+    const ShellRedirection *redirections;
+    size_t redirection_count;
+    pid_t pgid;              // < 0 keeps the shell's group, 0 starts a new one, > 0 joins it
+    const ShellSpawnResources *resources;  // NULL for the shell's defaults
+    const int *fds;          // the context's 0-9, NULL when they are the process's own
+} ShellSpawnRequest;
+
+// Resolved executable remembered by the PATH lookup cache
+typedef struct {
+    char *path;
+    unsigned long hits;
+} ShellPathEntry;
+
+// Path a command was dispatched through
+typedef enum {
+    SHELL_DISPATCH_CUSTOM,
+    SHELL_DISPATCH_BUILTIN,
+    SHELL_DISPATCH_FUNCTION,
+    SHELL_DISPATCH_STREAM,
+    SHELL_DISPATCH_EXTERNAL,
+    SHELL_DISPATCH_COUNT
+} ShellDispatch;
+
+// Distribution of durations. Bucket 0 counts those under 1 µs, bucket i
+// those in [2^(i-1), 2^i) µs, and the last bucket everything longer.
+typedef struct {
+    unsigned long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned long buckets[SHELL_HISTOGRAM_BUCKETS];
+} ShellHistogram;
+
+// Counters exposed through shell_get_stats. The dispatch counts,
+// histograms and resource totals are only collected while profiling.
+typedef struct {
+    unsigned long path_cache_hits;
+    unsigned long path_cache_misses;
+    unsigned long dir_cache_hits;
+    unsigned long dir_cache_misses;
+    unsigned long glob_expansions;
+    unsigned long glob_result_hits;
+    unsigned long parse_cache_hits;
+    unsigned long parse_cache_misses;
+    unsigned long dispatches[SHELL_DISPATCH_COUNT];
+    ShellHistogram parse_time;
+    ShellHistogram spawn_time;
+    ShellHistogram wall_time;
+    uint64_t user_cpu_ns;
+    uint64_t system_cpu_ns;
+    long max_rss_kb;
+} ShellStats;
+
+// Profile of every run of one command name while profiling was enabled
+typedef struct {
+    ShellDispatch dispatch;  // path of the most recent run
+    unsigned long calls;
+    uint64_t wall_ns;
+    uint64_t spawn_ns;
+    uint64_t user_cpu_ns;
+    uint64_t system_cpu_ns;
+    long max_rss_kb;
+} ShellCommandProfile;
+
+// Called once an asynchronous command has finished, with its exit status
+typedef void (*ShellCompletionCallback)(ExtendedShellContext *ctx, int exit_status, void *user_data);
+
+// Called with each chunk of output of an asynchronous command
+typedef void (*ShellOutputCallback)(ExtendedShellContext *ctx, const char *data, size_t length, void *user_data);
+
+// Called with each line of a watched input, without its newline, and with
+// NULL at end of input
+typedef void (*ShellLineCallback)(ExtendedShellContext *ctx, const char *line, void *user_data);
+
+struct ShellAsyncCommand;
+
+// What an epoll registration refers to
+typedef enum {
+    SHELL_SOURCE_SIGCHLD,
+    SHELL_SOURCE_INPUT,
+    SHELL_SOURCE_OUTPUT,
+    SHELL_SOURCE_PROCESS
+} ShellSourceType;
+
+typedef struct {
+    ShellSourceType type;
+    struct ShellAsyncCommand *command;
+    int index;  // process slot of a SHELL_SOURCE_PROCESS
+} ShellEventSource;
+
+// State of the event loop behind shell_poll_events
+typedef struct {
+    int epoll_fd;
+    struct ShellAsyncCommand **commands;
+    size_t count;
+    size_t capacity;
+    ShellOutputCallback on_output;
+    ShellEventSource sigchld_source;
+    ShellEventSource input_source;
+    int input_fd;
+    ShellLineCallback on_line;
+    void *line_data;
+    char *line;
+    size_t line_length;
+    size_t line_capacity;
+} ShellEventLoop;
+
+// Slot of the pid -> job index; pid 0 marks an empty slot
+typedef struct {
+    pid_t pid;
+    int job;
+    int pidfd;  // readable once the process exits, or -1
+} ShellJobIndexEntry;
+
+// Index of the processes of every job by pid, with linear probing. It
+// doubles before it is half full, so a job may have any number of stages.
+typedef struct {
+    ShellJobIndexEntry *entries;
+    size_t capacity;  // a power of two, or 0 before the first process
+    size_t count;
+    size_t unwatched;  // processes without a pidfd
+} ShellJobIndex;
+
+// Cached listing of one directory, sorted by name. The listing is reused
+// until the directory's device, inode or modification time changes.
+typedef struct {
+    char *name;
+    bool directory;
+} ShellDirEntry;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    ShellDirEntry *entries;
+    size_t count;
+    char *names;
+    char *glob_pattern;
+    size_t *glob_matches;
+    size_t glob_match_count;
+} ShellDirCache;
+
+// Prefix trie node; siblings are kept in byte order so a walk yields sorted names
+typedef struct ShellTrieNode {
+    struct ShellTrieNode *child;
+    struct ShellTrieNode *sibling;
+    unsigned char byte;
+    bool terminal;
+} ShellTrieNode;
+
+// Completion state: a trie of command names rebuilt only when the command
+// table, PATH or one of its directories changes
+typedef struct {
+    ShellTrieNode *trie;
+    ShellArena trie_arena;
+    ShellArena results;
+    char *trie_path;
+    unsigned long trie_generation;
+    unsigned long trie_scans;
+} ShellCompleter;
+
+// Result of shell_complete. Matches replace line[start, cursor) and stay
+// valid until the next completion.
+typedef struct {
+    size_t start;
+    int count;
+    size_t common_length;
+    const char *matches[MAX_TAB_COMPLETIONS];
+} ShellCompletion;
+
+// Descriptor or process kept alive for the command being expanded: the
+// memfd of a here-document, or the pipe end and process of a process
+// substitution. pid is -1 when there is no process.
+typedef struct {
+    int fd;
+    pid_t pid;
+} ShellTemporary;
+
+// Helper process of the zygote spawn backend. Its workers are children of
+// the shell, so idle ones are tracked here to be reaped when it stops.
+typedef struct {
+    pid_t pid;        // helper process, or 0 when not running
+    int socket;       // requests, taken by whichever worker is idle
+    int workers_fd;   // pids of new workers, written by the helper
+    int workers;      // idle workers the helper keeps ready
+    pid_t *idle;
+    size_t idle_count;
+    size_t idle_capacity;
+} ShellZygote;
+
+// Loaded startup snapshot. Strings of the loaded entries point into the
+// file's private mapping and their structs into block; both are released
+// as a whole by shell_cleanup.
+typedef struct {
+    char *map;
+    size_t map_length;
+    char *block;
+    size_t block_size;
+} ShellSnapshot;
+
+// Shell context extension for custom commands, job control, aliases, etc.
+struct ExtendedShellContext {
+    ShellContext base;
+    ShellMap commands;
+    unsigned long commands_generation;
+    unsigned long alias_generation;
+    size_t alias_count;
+    ShellMap path_cache;
+    ShellStats stats;
+    bool profiling;
+    ShellMap profiles;
+    ShellMap dir_cache;
+    unsigned long dir_scans;
+    ShellMap parse_cache;
+    size_t parse_cache_hand;  // clock hand: slot of parse_cache to look at next
+    ShellArena arena;
+    Job jobs[MAX_JOBS];
+    int job_count;
+    ShellJobIndex job_index;
+    int job_epoll;  // epoll instance watching the pidfds in job_index, or -1
+    int sigchld_fd;
+    bool job_control;
+    pid_t shell_pgid;
+    ShellSpawnBackend spawn_backend;
+    ShellZygote zygote;
+    ShellSpawnResources *spawn_resources;  // defaults of every spawned process, or NULL
+    posix_spawnattr_t spawn_attrs[2];
+    bool spawn_attrs_ready;
+    ShellCompleter completer;
+    int cwd_fd;  // directory chosen with cd, or -1 while it is the process's
+    char **positional;
+    int positional_count;
+    size_t script_line;  // line of the script command being run, or 0
+    int function_depth;
+    int loop_depth;
+    int break_levels;
+    int continue_levels;
+    bool returning;
+    bool exit_requested;
+    bool substituted;  // a command substitution ran while building the current stage
+    int execute_depth;
+    size_t capture_capacity[2];  // allocated size of output and error
+    ShellTemporary *temporaries;
+    size_t temporary_count;
+    size_t temporary_capacity;
+    unsigned long child_events;
+    sigset_t saved_signal_mask;
+    ShellEventLoop events;
+    ShellSnapshot snapshot;
+};
+
+static ShellError shell_register_builtins(ExtendedShellContext *ctx);
+
+// Directory the relative paths of a context start from. cd moves only the
+// context that runs it: its directory is kept open, and paths are opened
+// relative to it and children start in it.
+static int shell_dir_fd(const ExtendedShellContext *ctx) {
+    return ctx->cwd_fd != -1 ? ctx->cwd_fd : AT_FDCWD;
+}
+static void shell_parse_cache_clear(ExtendedShellContext *ctx);
+static void shell_parse_release(struct ShellParse *parse);
+static void shell_event_loop_free(ExtendedShellContext *ctx);
+static void shell_release_temporaries(ExtendedShellContext *ctx, size_t mark);
+static void shell_zygote_stop(ExtendedShellContext *ctx);
+
+// Free an object unless it belongs to the loaded snapshot
+static void shell_snapshot_free(ExtendedShellContext *ctx, void *pointer) {
+    const char *p = pointer;
+    const ShellSnapshot *snapshot = &ctx->snapshot;
+    if (snapshot->map && p >= snapshot->map && p < snapshot->map + snapshot->map_length) return;
+    if (snapshot->block && p >= snapshot->block && p < snapshot->block + snapshot->block_size) return;
+    free(pointer);
+}
+
+// Forget every cached PATH lookup
+void shell_clear_path_cache(ExtendedShellContext *ctx) {
+    if (!ctx) return;
+
+    for (size_t i = 0; i < ctx->path_cache.capacity; i++) {
+        ShellMapEntry *entry = &ctx->path_cache.entries[i];
+        if (!entry->key) continue;
+        ShellPathEntry *cached = entry->value;
+        shell_snapshot_free(ctx, cached->path);
+        shell_snapshot_free(ctx, cached);
+        free(entry->key);
+        entry->key = NULL;
+        entry->hash = 0;
+        entry->value = NULL;
+    }
+    ctx->path_cache.count = 0;
+    ctx->path_cache.used = 0;
+}
+
+// Forget the cached PATH lookup of a single command
+static void shell_forget_command_path(ExtendedShellContext *ctx, const char *name) {
+    ShellPathEntry *cached = shell_map_remove(&ctx->path_cache, name, shell_hash_string(name));
+    if (cached) {
+        shell_snapshot_free(ctx, cached->path);
+        shell_snapshot_free(ctx, cached);
+    }
+}
+
+// Check that a string is a valid variable name
+static bool shell_valid_name(const char *name, size_t length) {
+    if (length == 0 || (!isalpha((unsigned char)name[0]) && name[0] != '_')) return false;
+    for (size_t i = 1; i < length; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_') return false;
+    }
+    return true;
+}
+
+// Store a variable; exported < 0 keeps the current export flag
+static ShellError shell_store_variable(ExtendedShellContext *ctx, const char *key, size_t key_length, const char *value, int exported) {
+    size_t value_length = strlen(value);
+    char *entry = malloc(key_length + value_length + 2);
+    if (!entry) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    memcpy(entry, key, key_length);
+    entry[key_length] = '=';
+    memcpy(entry + key_length + 1, value, value_length + 1);
+
+    ShellMap *variables = &ctx->base.variables;
+    entry[key_length] = '\0';
+    uint32_t hash = shell_hash_string(entry);
+    ShellMapEntry *slot = shell_map_insert(variables, entry, hash);
+    entry[key_length] = '=';
+    if (!slot) {
+        free(entry);
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    ShellVariable *variable = slot->value;
+    if (!variable) {
+        variable = malloc(sizeof(ShellVariable));
+        if (!variable) {
+            free(shell_map_remove(variables, slot->key, hash));
+            free(entry);
+            return SHELL_ERROR_MEMORY_ALLOCATION;
+        }
+        variable->exported = false;
+        slot->value = variable;
+    } else {
+        shell_snapshot_free(ctx, variable->entry);
+    }
+
+    variable->entry = entry;
+    variable->name_length = key_length;
+    if (exported >= 0) variable->exported = exported != 0;
+
+    // Only changes to exported variables invalidate the cached environment
+    if (variable->exported) ctx->base.envp_dirty = true;
+    return SHELL_OK;
+}
+
+// Import the process environment the first time the variable store is used
+static void shell_load_variables(ExtendedShellContext *ctx) {
+    if (ctx->base.variables_loaded) return;
+    ctx->base.variables_loaded = true;
+
+    for (char **env = environ; env && *env; env++) {
+        const char *equals = strchr(*env, '=');
+        if (!equals || equals == *env) continue;
+        shell_store_variable(ctx, *env, (size_t)(equals - *env), equals + 1, 1);
+    }
+
+    // Nothing has changed yet, so the process environment is still accurate
+    ctx->base.envp_dirty = false;
+}
+
+// Look up a variable
+static ShellVariable *shell_find_variable(ExtendedShellContext *ctx, const char *key) {
+    shell_load_variables(ctx);
+    ShellMapEntry *entry = shell_map_find(&ctx->base.variables, key, shell_hash_string(key));
+    return entry ? entry->value : NULL;
+}
+
+// Set a variable, keeping its export flag (new variables are not exported)
+ShellError shell_set_var(ExtendedShellContext *ctx, const char *key, const char *value) {
+    if (!ctx || !key || !value) return SHELL_ERROR_NULL_POINTER;
+
+    size_t key_length = strlen(key);
+    if (!shell_valid_name(key, key_length)) {
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    shell_load_variables(ctx);
+    ShellError result = shell_store_variable(ctx, key, key_length, value, -1);
+    if (result != SHELL_OK) {
+        ctx->base.last_error = result;
+        return result;
+    }
+
+    if (strcmp(key, "PATH") == 0) shell_clear_path_cache(ctx);
+    return SHELL_OK;
+}
+
+// Mark a variable for export to spawned commands
+ShellError shell_export_env(ExtendedShellContext *ctx, const char *key) {
+    if (!ctx || !key) return SHELL_ERROR_NULL_POINTER;
+
+    ShellVariable *variable = shell_find_variable(ctx, key);
+    if (!variable) {
+        ctx->base.last_error = SHELL_ERROR_ENV_VAR_NOT_FOUND;
+        return SHELL_ERROR_ENV_VAR_NOT_FOUND;
+    }
+
+    if (!variable->exported) {
+        variable->exported = true;
+        ctx->base.envp_dirty = true;
+    }
+    return SHELL_OK;
+}
+
+// Set and export an environment variable
+ShellError shell_set_env(ExtendedShellContext *ctx, const char *key, const char *value) {
+    ShellError result = shell_set_var(ctx, key, value);
+    if (result == SHELL_OK) result = shell_export_env(ctx, key);
+    return result;
+}
+
+// Remove a variable
+ShellError shell_unset_env(ExtendedShellContext *ctx, const char *key) {
+    if (!ctx || !key) return SHELL_ERROR_NULL_POINTER;
+
+    shell_load_variables(ctx);
+    ShellVariable *variable = shell_map_remove(&ctx->base.variables, key, shell_hash_string(key));
+    if (!variable) {
+        ctx->base.last_error = SHELL_ERROR_ENV_VAR_NOT_FOUND;
+        return SHELL_ERROR_ENV_VAR_NOT_FOUND;
+    }
+
+    if (variable->exported) ctx->base.envp_dirty = true;
+    shell_snapshot_free(ctx, variable->entry);
+    shell_snapshot_free(ctx, variable);
+
+    if (strcmp(key, "PATH") == 0) shell_clear_path_cache(ctx);
+    return SHELL_OK;
+}
+
+// Get the value of a variable, or NULL if it is not set
+const char *shell_get_env(ExtendedShellContext *ctx, const char *key) {
+    if (!ctx || !key) return NULL;
+
+    ShellVariable *variable = shell_find_variable(ctx, key);
+    return variable ? variable->entry + variable->name_length + 1 : NULL;
+}
+
+// Environment for spawned commands. The process environment is used until an
+// exported variable changes; after that the envp array is rebuilt once per
+// change, pointing at the variables' own "NAME=value" strings.
+static char *const *shell_environment(ExtendedShellContext *ctx) {
+    if (!ctx->base.envp_dirty) return ctx->base.envp ? ctx->base.envp : environ;
+
+    size_t count = 0;
+    for (size_t i = 0; i < ctx->base.variables.capacity; i++) {
+        ShellVariable *variable = ctx->base.variables.entries[i].value;
+        if (ctx->base.variables.entries[i].key && variable && variable->exported) count++;
+    }
+
+    char **envp = realloc(ctx->base.envp, (count + 1) * sizeof(char *));
+    if (!envp) return environ;
+
+    size_t n = 0;
+    for (size_t i = 0; i < ctx->base.variables.capacity; i++) {
+        ShellVariable *variable = ctx->base.variables.entries[i].value;
+        if (ctx->base.variables.entries[i].key && variable && variable->exported) envp[n++] = variable->entry;
+    }
+    envp[n] = NULL;
+
+    ctx->base.envp = envp;
+    ctx->base.envp_dirty = false;
+    return envp;
+}
+
+// Value of the positional parameter named by a run of digits, or NULL
+static const char *shell_positional(ExtendedShellContext *ctx, const char *digits, size_t length) {
+    size_t n = 0;
+    for (size_t i = 0; i < length && n <= (size_t)ctx->positional_count; i++) n = n * 10 + (size_t)(digits[i] - '0');
+    return n >= 1 && n <= (size_t)ctx->positional_count ? ctx->positional[n - 1] : NULL;
+}
+
+static size_t shell_expand_substitution(ExtendedShellContext *ctx, const char *raw, size_t length, ShellWordBuffer *out);
+
+// Expand $?, $$, $#, $@, $*, $N, ${N}, $NAME, ${NAME} and $(command)
+static size_t shell_expand_parameter(void *data, const char *raw, size_t length, ShellWordBuffer *out) {
+    ExtendedShellContext *ctx = data;
+    char number[32];
+
+    if (length >= 2 && raw[1] == '(') return shell_expand_substitution(ctx, raw, length, out);
+
+    if (length >= 2 && (raw[1] == '?' || raw[1] == '$' || raw[1] == '#')) {
+        int value = raw[1] == '?' ? ctx->base.exit_status : raw[1] == '#' ? ctx->positional_count : (int)getpid();
+        int digits = snprintf(number, sizeof(number), "%d", value);
+        shell_word_append_quoted(out, number, (size_t)digits);
+        return 2;
+    }
+
+    // Inside a word the positional parameters are joined by spaces
+    if (length >= 2 && (raw[1] == '@' || raw[1] == '*')) {
+        for (int i = 0; i < ctx->positional_count; i++) {
+            if (i > 0) shell_word_append(out, " ", 1);
+            shell_word_append_quoted(out, ctx->positional[i], strlen(ctx->positional[i]));
+        }
+        return 2;
+    }
+
+    if (length >= 2 && isdigit((unsigned char)raw[1])) {
+        const char *value = shell_positional(ctx, raw + 1, 1);
+        if (value) shell_word_append_quoted(out, value, strlen(value));
+        return 2;
+    }
+
+    const char *name = raw + 1;
+    size_t name_length = 0;
+    size_t consumed;
+    if (length >= 2 && raw[1] == '{') {
+        const char *close = memchr(raw + 2, '}', length - 2);
+        if (!close) {
+            shell_word_append(out, "$", 1);
+            return 1;
+        }
+        name = raw + 2;
+        name_length = (size_t)(close - name);
+        consumed = name_length + 3;
+
+        if (name_length > 0 && strspn(name, "0123456789") >= name_length) {
+            const char *value = shell_positional(ctx, name, name_length);
+            if (value) shell_word_append_quoted(out, value, strlen(value));
+            return consumed;
+        }
+    } else {
+        while (1 + name_length < length && (isalnum((unsigned char)name[name_length]) || name[name_length] == '_')) name_length++;
+        consumed = name_length + 1;
+    }
+
+    if (!shell_valid_name(name, name_length)) {
+        shell_word_append(out, raw, consumed);
+        return consumed;
+    }
+
+    // Map keys are NUL-terminated, so look the name up through a copy
+    char *key = shell_arena_strndup(out->arena, name, name_length);
+    const char *value = key ? shell_get_env(ctx, key) : NULL;
+    if (value) shell_word_append_quoted(out, value, strlen(value));
+    return consumed;
+}
+
+static char *shell_expand_process(ExtendedShellContext *ctx, const ShellToken *token);
+
+// Final text of a word: words without $ references are used as lexed
+static char *shell_expand_word(ExtendedShellContext *ctx, const ShellToken *token) {
+    if (!(token->flags & SHELL_WORD_EXPAND)) return token->text;
+    if (token->flags & SHELL_WORD_PROCESS) return shell_expand_process(ctx, token);
+
+    ShellWordBuffer text = { &ctx->arena, NULL, 0, 0, false, false };
+    shell_cook_word(token->raw, token->raw_length, &text, shell_expand_parameter, ctx);
+    return text.failed ? NULL : text.data;
+}
+
+// Body of a here-document with an unquoted delimiter: $ references are
+// expanded, and a backslash only escapes $, `, another backslash or a newline
+static char *shell_expand_heredoc(ExtendedShellContext *ctx, const char *body, size_t *length) {
+    ShellWordBuffer text = { &ctx->arena, NULL, 0, 0, false, false };
+    size_t size = strlen(body);
+    size_t i = 0;
+
+    shell_word_append(&text, "", 0);
+    while (i < size) {
+        if (body[i] == '\\' && i + 1 < size && strchr("$`\\\n", body[i + 1])) {
+            if (body[i + 1] != '\n') shell_word_append(&text, &body[i + 1], 1);
+            i += 2;
+        } else if (body[i] == '$') {
+            i += shell_expand_parameter(ctx, body + i, size - i, &text);
+        } else {
+            size_t run = strcspn(body + i + 1, "$\\") + 1;
+            shell_word_append(&text, body + i, run);
+            i += run;
+        }
+    }
+    *length = text.length;
+    return text.failed ? NULL : text.data;
+}
+
+// Search PATH for an executable regular file; relative elements start
+// from the directory at
+static char *shell_search_path(int at, const char *path, const char *name) {
+    char candidate[PATH_MAX];
+    size_t name_length = strlen(name);
+
+    while (true) {
+        const char *end = strchr(path, ':');
+        size_t dir_length = end ? (size_t)(end - path) : strlen(path);
+
+        // An empty PATH element means the current directory
+        const char *dir = dir_length ? path : ".";
+        if (!dir_length) dir_length = 1;
+
+        if (dir_length + name_length + 2 <= sizeof(candidate)) {
+            memcpy(candidate, dir, dir_length);
+            candidate[dir_length] = '/';
+            memcpy(candidate + dir_length + 1, name, name_length + 1);
+
+            struct stat st;
+            if (fstatat(at, candidate, &st, 0) == 0 && S_ISREG(st.st_mode) && faccessat(at, candidate, X_OK, 0) == 0) {
+                return strdup(candidate);
+            }
+        }
+
+        if (!end) return NULL;
+        path = end + 1;
+    }
+}
+
+// Resolve a command name to the executable posix_spawn should run.
+// Names containing a slash are used as is; everything else goes through the
+// PATH lookup cache, which shell_set_var drops whenever PATH changes.
+const char *shell_resolve_command(ExtendedShellContext *ctx, const char *name) {
+    if (!ctx || !name) return NULL;
+    if (strchr(name, '/')) return name;
+
+    const char *path = shell_get_env(ctx, "PATH");
+    if (!path) path = SHELL_DEFAULT_PATH;
+
+    uint32_t hash = shell_hash_string(name);
+    ShellMapEntry *entry = shell_map_find(&ctx->path_cache, name, hash);
+    if (entry) {
+        ShellPathEntry *cached = entry->value;
+        cached->hits++;
+        ctx->stats.path_cache_hits++;
+        return cached->path;
+    }
+
+    ctx->stats.path_cache_misses++;
+    char *resolved = shell_search_path(shell_dir_fd(ctx), path, name);
+    if (!resolved) return NULL;
+
+    ShellPathEntry *cached = malloc(sizeof(ShellPathEntry));
+    entry = cached ? shell_map_insert(&ctx->path_cache, name, hash) : NULL;
+    if (!entry) {
+        free(cached);
+        free(resolved);
+        return NULL;
+    }
+
+    cached->path = resolved;
+    cached->hits = 1;
+    entry->value = cached;
+    return resolved;
+}
+
+// Copy the context's counters
+ShellError shell_get_stats(ExtendedShellContext *ctx, ShellStats *stats) {
+    if (!ctx || !stats) return SHELL_ERROR_NULL_POINTER;
+
+    *stats = ctx->stats;
+    return SHELL_OK;
+}
+
+// Drop the per-command profiles
+static void shell_clear_profiles(ExtendedShellContext *ctx) {
+    for (size_t i = 0; i < ctx->profiles.capacity; i++) {
+        if (ctx->profiles.entries[i].key) free(ctx->profiles.entries[i].value);
+    }
+    shell_map_free(&ctx->profiles);
+}
+
+// Zero every counter and forget the per-command profiles
+void shell_reset_stats(ExtendedShellContext *ctx) {
+    if (!ctx) return;
+
+    ctx->stats = (ShellStats){ 0 };
+    shell_clear_profiles(ctx);
+}
+
+// Turn timing and resource accounting of commands on or off
+ShellError shell_set_profiling(ExtendedShellContext *ctx, bool enabled) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+    ctx->profiling = enabled;
+    return SHELL_OK;
+}
+
+// Copy the profile collected for a command name
+ShellError shell_get_command_profile(ExtendedShellContext *ctx, const char *name, ShellCommandProfile *profile) {
+    if (!ctx || !name || !profile) return SHELL_ERROR_NULL_POINTER;
+
+    ShellMapEntry *entry = shell_map_find(&ctx->profiles, name, shell_hash_string(name));
+    if (!entry || !entry->value) return SHELL_ERROR_COMMAND_NOT_FOUND;
+
+    *profile = *(ShellCommandProfile *)entry->value;
+    return SHELL_OK;
+}
+
+// Monotonic clock reading in nanoseconds
+static uint64_t shell_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t shell_timeval_ns(const struct timeval *time) {
+    return (uint64_t)time->tv_sec * 1000000000u + (uint64_t)time->tv_usec * 1000u;
+}
+
+// Count a duration in a histogram
+static void shell_histogram_add(ShellHistogram *histogram, uint64_t ns) {
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us > 0 && bucket < SHELL_HISTOGRAM_BUCKETS - 1; us >>= 1) bucket++;
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_ns += ns;
+    if (ns > histogram->max_ns) histogram->max_ns = ns;
+}
+
+// Resource use of the calling thread, for commands run in the shell process
+static void shell_thread_usage(struct rusage *usage) {
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, usage);
+#else
+    getrusage(RUSAGE_SELF, usage);
+#endif
+}
+
+// Turn a later reading of shell_thread_usage into the CPU time used since
+// before; the peak RSS stays that of the whole process
+static void shell_usage_since(const struct rusage *before, struct rusage *usage) {
+    shell_thread_usage(usage);
+    timersub(&usage->ru_utime, &before->ru_utime, &usage->ru_utime);
+    timersub(&usage->ru_stime, &before->ru_stime, &usage->ru_stime);
+}
+
+// Record one profiled run of a command. usage holds its CPU time and peak RSS.
+static void shell_profile_command(ExtendedShellContext *ctx, const char *name, ShellDispatch dispatch,
+                                  uint64_t wall_ns, uint64_t spawn_ns, const struct rusage *usage) {
+    ShellStats *stats = &ctx->stats;
+    uint64_t user_ns = shell_timeval_ns(&usage->ru_utime);
+    uint64_t system_ns = shell_timeval_ns(&usage->ru_stime);
+
+    stats->dispatches[dispatch]++;
+    shell_histogram_add(&stats->wall_time, wall_ns);
+    if (dispatch == SHELL_DISPATCH_EXTERNAL) shell_histogram_add(&stats->spawn_time, spawn_ns);
+    stats->user_cpu_ns += user_ns;
+    stats->system_cpu_ns += system_ns;
+    if (usage->ru_maxrss > stats->max_rss_kb) stats->max_rss_kb = usage->ru_maxrss;
+
+    ShellMapEntry *entry = shell_map_insert(&ctx->profiles, name, shell_hash_string(name));
+    if (entry && !entry->value) entry->value = calloc(1, sizeof(ShellCommandProfile));
+    ShellCommandProfile *profile = entry ? entry->value : NULL;
+    if (!profile) return;
+
+    profile->dispatch = dispatch;
+    profile->calls++;
+    profile->wall_ns += wall_ns;
+    profile->spawn_ns += spawn_ns;
+    profile->user_cpu_ns += user_ns;
+    profile->system_cpu_ns += system_ns;
+    if (usage->ru_maxrss > profile->max_rss_kb) profile->max_rss_kb = usage->ru_maxrss;
+}
+
+// Drop the glob result remembered for a directory
+static void shell_dir_forget_glob(ShellDirCache *dir) {
+    free(dir->glob_pattern);
+    free(dir->glob_matches);
+    dir->glob_pattern = NULL;
+    dir->glob_matches = NULL;
+    dir->glob_match_count = 0;
+}
+
+// Release every cached directory listing
+static void shell_dir_cache_free(ExtendedShellContext *ctx) {
+    for (size_t i = 0; i < ctx->dir_cache.capacity; i++) {
+        ShellDirCache *dir = ctx->dir_cache.entries[i].value;
+        if (!ctx->dir_cache.entries[i].key || !dir) continue;
+        shell_dir_forget_glob(dir);
+        free(dir->entries);
+        free(dir->names);
+        free(dir);
+    }
+    shell_map_free(&ctx->dir_cache);
+}
+
+// Order directory entries by name
+static int shell_compare_dir_entries(const void *a, const void *b) {
+    return strcmp(((const ShellDirEntry *)a)->name, ((const ShellDirEntry *)b)->name);
+}
+
+// Read a directory, relative to at, into a sorted listing. Names are packed
+// into one block, so a directory of 100k files costs two allocations
+// rather than 100k.
+static bool shell_scan_dir(ShellDirCache *dir, int at, const char *path) {
+    int fd = openat(at, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *handle = fd != -1 ? fdopendir(fd) : NULL;
+    if (!handle) {
+        if (fd != -1) close(fd);
+        return false;
+    }
+
+    size_t capacity = dir->count ? dir->count : 64;
+    size_t names_capacity = capacity * 16;
+    ShellDirEntry *entries = malloc(capacity * sizeof(ShellDirEntry));
+    char *names = malloc(names_capacity);
+    size_t count = 0;
+    size_t names_length = 0;
+    bool ok = entries && names;
+    struct dirent *ent;
+
+    while (ok && (ent = readdir(handle))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+        // Only entries of unknown type or symlinks need a stat to tell directories apart
+        bool directory = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+            struct stat st;
+            directory = fstatat(dirfd(handle), ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        if (count == capacity) {
+            ShellDirEntry *grown = realloc(entries, capacity * 2 * sizeof(ShellDirEntry));
+            ok = grown != NULL;
+            if (!ok) break;
+            entries = grown;
+            capacity *= 2;
+        }
+
+        // Entries record offsets until the block stops moving
+        size_t length = strlen(ent->d_name) + 1;
+        if (names_length + length > names_capacity) {
+            while (names_length + length > names_capacity) names_capacity *= 2;
+            char *grown = realloc(names, names_capacity);
+            ok = grown != NULL;
+            if (!ok) break;
+            names = grown;
+        }
+        memcpy(names + names_length, ent->d_name, length);
+        entries[count++] = (ShellDirEntry){ (char *)(uintptr_t)names_length, directory };
+        names_length += length;
+    }
+    closedir(handle);
+
+    if (!ok) {
+        free(entries);
+        free(names);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) entries[i].name = names + (uintptr_t)entries[i].name;
+    qsort(entries, count, sizeof(ShellDirEntry), shell_compare_dir_entries);
+
+    shell_dir_forget_glob(dir);
+    free(dir->entries);
+    free(dir->names);
+    dir->entries = entries;
+    dir->names = names;
+    dir->count = count;
+    return true;
+}
+
+// Get the sorted listing of a directory. A cached listing costs one stat
+// and is read again only if the directory's device, inode or mtime changed.
+static ShellDirCache *shell_cached_dir(ExtendedShellContext *ctx, const char *path) {
+    struct stat st;
+    if (fstatat(shell_dir_fd(ctx), path, &st, 0) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+
+    ShellMapEntry *entry = shell_map_insert(&ctx->dir_cache, path, shell_hash_string(path));
+    if (!entry) return NULL;
+
+    ShellDirCache *dir = entry->value;
+    if (!dir) {
+        dir = calloc(1, sizeof(ShellDirCache));
+        if (!dir) {
+            shell_map_remove(&ctx->dir_cache, path, entry->hash);
+            return NULL;
+        }
+        entry->value = dir;
+    } else if (dir->dev == st.st_dev && dir->ino == st.st_ino &&
+               dir->mtime.tv_sec == st.st_mtim.tv_sec && dir->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        ctx->stats.dir_cache_hits++;
+        return dir;
+    }
+
+    ctx->stats.dir_cache_misses++;
+    if (!shell_scan_dir(dir, shell_dir_fd(ctx), path)) return NULL;
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+    ctx->dir_scans++;
+    return dir;
+}
+
+// Matches of one glob pattern, collected in the line arena
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+    char path[PATH_MAX];
+} ShellGlob;
+
+// Check a pattern component for an unescaped wildcard
+static bool shell_has_wildcard(const char *pattern, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (pattern[i] == '\\') i++;
+        else if (pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '[') return true;
+    }
+    return false;
+}
+
+// Record the path built so far as a match
+static bool shell_glob_push(ExtendedShellContext *ctx, ShellGlob *glob, size_t length) {
+    if (glob->count == glob->capacity) {
+        size_t capacity = glob->capacity ? glob->capacity * 2 : 16;
+        char **paths = shell_arena_alloc(&ctx->arena, capacity * sizeof(char *));
+        if (!paths) return false;
+        if (glob->count) memcpy(paths, glob->paths, glob->count * sizeof(char *));
+        glob->paths = paths;
+        glob->capacity = capacity;
+    }
+
+    char *path = shell_arena_strndup(&ctx->arena, glob->path, length);
+    if (!path) return false;
+    glob->paths[glob->count++] = path;
+    return true;
+}
+
+// Match the pattern one component at a time below the path built so far.
+// Wildcard components are matched against cached sorted listings, so the
+// matches come out sorted; the matching entries of a listing are kept and
+// reused while the directory is unchanged.
+static ShellError shell_glob_expand(ExtendedShellContext *ctx, ShellGlob *glob, size_t length, const char *pattern) {
+    const char *slash = strchr(pattern, '/');
+    size_t component_length = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    const char *rest = slash ? slash + strspn(slash, "/") : NULL;
+
+    if (!shell_has_wildcard(pattern, component_length)) {
+        for (size_t i = 0; i < component_length; i++) {
+            if (pattern[i] == '\\' && i + 1 < component_length) i++;
+            if (length + 2 >= sizeof(glob->path)) return SHELL_OK;
+            glob->path[length++] = pattern[i];
+        }
+        if (slash) glob->path[length++] = '/';
+        glob->path[length] = '\0';
+
+        if (rest && *rest) return shell_glob_expand(ctx, glob, length, rest);
+
+        struct stat st;
+        if (fstatat(shell_dir_fd(ctx), glob->path, &st, AT_SYMLINK_NOFOLLOW) != 0 || (slash && !S_ISDIR(st.st_mode))) return SHELL_OK;
+        return shell_glob_push(ctx, glob, length) ? SHELL_OK : SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    char *component = shell_arena_strndup(&ctx->arena, pattern, component_length);
+    if (!component) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    ShellDirCache *dir = shell_cached_dir(ctx, length ? glob->path : ".");
+    if (!dir) return SHELL_OK;
+
+    if (dir->glob_pattern && strcmp(dir->glob_pattern, component) == 0) {
+        ctx->stats.glob_result_hits++;
+    } else {
+        shell_dir_forget_glob(dir);
+        dir->glob_pattern = strdup(component);
+        dir->glob_matches = malloc((dir->count + 1) * sizeof(size_t));
+        if (!dir->glob_pattern || !dir->glob_matches) {
+            shell_dir_forget_glob(dir);
+            return SHELL_ERROR_MEMORY_ALLOCATION;
+        }
+
+        // A leading dot must be matched explicitly
+        for (size_t i = 0; i < dir->count; i++) {
+            if (fnmatch(component, dir->entries[i].name, FNM_PERIOD) == 0) dir->glob_matches[dir->glob_match_count++] = i;
+        }
+    }
+
+    // Matching below a subdirectory may rescan other directories, but never
+    // this one, so its listing stays valid for the whole walk
+    for (size_t i = 0; i < dir->glob_match_count; i++) {
+        const ShellDirEntry *entry = &dir->entries[dir->glob_matches[i]];
+        if (rest && !entry->directory) continue;
+
+        size_t name_length = strlen(entry->name);
+        if (length + name_length + 2 >= sizeof(glob->path)) continue;
+        memcpy(glob->path + length, entry->name, name_length);
+        size_t end = length + name_length;
+        if (slash) glob->path[end++] = '/';
+        glob->path[end] = '\0';
+
+        ShellError result = rest && *rest ? shell_glob_expand(ctx, glob, end, rest)
+                                          : (shell_glob_push(ctx, glob, end) ? SHELL_OK : SHELL_ERROR_MEMORY_ALLOCATION);
+        if (result != SHELL_OK) return result;
+    }
+    return SHELL_OK;
+}
+
+// Expand a word with unquoted wildcards into the sorted paths it matches.
+// Without matches the word is kept as it is, taken from the expanded
+// pattern so that command substitutions in it do not run twice.
+static ShellError shell_glob_word(ExtendedShellContext *ctx, const ShellToken *token, char ***paths, size_t *count) {
+    ShellWordBuffer pattern = { &ctx->arena, NULL, 0, 0, false, true };
+    shell_cook_word(token->raw, token->raw_length, &pattern, shell_expand_parameter, ctx);
+    if (pattern.failed) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    ShellGlob *glob = shell_arena_alloc(&ctx->arena, sizeof(ShellGlob));
+    if (!glob) return SHELL_ERROR_MEMORY_ALLOCATION;
+    glob->paths = NULL;
+    glob->count = 0;
+    glob->capacity = 0;
+
+    ctx->stats.glob_expansions++;
+    ShellError result = shell_glob_expand(ctx, glob, 0, pattern.data);
+    if (result == SHELL_OK && glob->count == 0) {
+        // Every backslash in a pattern escapes the character after it
+        char *word = pattern.data;
+        size_t length = 0;
+        for (size_t i = 0; word[i]; i++) {
+            if (word[i] == '\\' && word[i + 1]) i++;
+            word[length++] = word[i];
+        }
+        word[length] = '\0';
+
+        glob->paths = shell_arena_alloc(&ctx->arena, sizeof(char *));
+        if (!glob->paths) return SHELL_ERROR_MEMORY_ALLOCATION;
+        glob->paths[0] = word;
+        glob->count = 1;
+    }
+    *paths = glob->paths;
+    *count = glob->count;
+    return result;
+}
+
+// Release the command trie and the last completion results
+static void shell_completer_free(ShellCompleter *completer) {
+    shell_arena_free(&completer->trie_arena);
+    shell_arena_free(&completer->results);
+    free(completer->trie_path);
+}
+
+// Add a name to the command trie
+static bool shell_trie_insert(ShellCompleter *completer, const char *name) {
+    ShellTrieNode **link = &completer->trie;
+
+    for (const unsigned char *c = (const unsigned char *)name; ; c++) {
+        if (!*link) {
+            *link = shell_arena_alloc(&completer->trie_arena, sizeof(ShellTrieNode));
+            if (!*link) return false;
+            **link = (ShellTrieNode){ NULL, NULL, 0, false };
+        }
+        if (!*c) {
+            (*link)->terminal = true;
+            return true;
+        }
+
+        // Children are kept sorted, with the root level holding the first byte
+        ShellTrieNode **slot = &(*link)->child;
+        while (*slot && (*slot)->byte < *c) slot = &(*slot)->sibling;
+        if (!*slot || (*slot)->byte != *c) {
+            ShellTrieNode *node = shell_arena_alloc(&completer->trie_arena, sizeof(ShellTrieNode));
+            if (!node) return false;
+            *node = (ShellTrieNode){ NULL, *slot, *c, false };
+            *slot = node;
+        }
+        link = slot;
+    }
+}
+
+// Copy the next PATH directory into buffer, advancing *cursor; an empty
+// entry means the current directory
+static bool shell_next_path_dir(const char **cursor, char *buffer, size_t size) {
+    while (*cursor) {
+        const char *start = *cursor;
+        const char *end = strchr(start, ':');
+        size_t length = end ? (size_t)(end - start) : strlen(start);
+        *cursor = end ? end + 1 : NULL;
+
+        if (length == 0) {
+            memcpy(buffer, ".", 2);
+            return true;
+        }
+        if (length < size) {
+            memcpy(buffer, start, length);
+            buffer[length] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// Rebuild the command trie if the command table, PATH or any PATH directory changed
+static ShellError shell_update_command_trie(ExtendedShellContext *ctx) {
+    ShellCompleter *completer = &ctx->completer;
+    const char *path = shell_get_env(ctx, "PATH");
+    if (!path) path = SHELL_DEFAULT_PATH;
+
+    // Directory listings are revalidated with one stat each
+    char dir_path[PATH_MAX];
+    const char *cursor = path;
+    while (shell_next_path_dir(&cursor, dir_path, sizeof(dir_path))) {
+        shell_cached_dir(ctx, dir_path);
+    }
+
+    if (completer->trie && completer->trie_generation == ctx->commands_generation &&
+        completer->trie_scans == ctx->dir_scans && strcmp(completer->trie_path, path) == 0) {
+        return SHELL_OK;
+    }
+
+    char *trie_path = strdup(path);
+    if (!trie_path) return SHELL_ERROR_MEMORY_ALLOCATION;
+    free(completer->trie_path);
+    completer->trie_path = trie_path;
+
+    shell_arena_free(&completer->trie_arena);
+    completer->trie_arena = (ShellArena){ NULL, NULL };
+    completer->trie = NULL;
+
+    for (size_t i = 0; i < ctx->commands.capacity; i++) {
+        if (ctx->commands.entries[i].key && !shell_trie_insert(completer, ctx->commands.entries[i].key)) {
+            completer->trie = NULL;
+            return SHELL_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+
+    cursor = path;
+    while (shell_next_path_dir(&cursor, dir_path, sizeof(dir_path))) {
+        ShellMapEntry *entry = shell_map_find(&ctx->dir_cache, dir_path, shell_hash_string(dir_path));
+        ShellDirCache *dir = entry ? entry->value : NULL;
+        for (size_t j = 0; dir && j < dir->count; j++) {
+            if (!dir->entries[j].directory && !shell_trie_insert(completer, dir->entries[j].name)) {
+                completer->trie = NULL;
+                return SHELL_ERROR_MEMORY_ALLOCATION;
+            }
+        }
+    }
+
+    completer->trie_generation = ctx->commands_generation;
+    completer->trie_scans = ctx->dir_scans;
+    return SHELL_OK;
+}
+
+// Record a completion match, copied into the results arena
+static void shell_add_completion(ExtendedShellContext *ctx, ShellCompletion *completion, const char *prefix, size_t prefix_length, const char *name, bool directory) {
+    if (completion->count >= MAX_TAB_COMPLETIONS) return;
+
+    size_t name_length = strlen(name);
+    char *match = shell_arena_alloc(&ctx->completer.results, prefix_length + name_length + 2);
+    if (!match) return;
+
+    memcpy(match, prefix, prefix_length);
+    memcpy(match + prefix_length, name, name_length);
+    if (directory) match[prefix_length + name_length++] = '/';
+    match[prefix_length + name_length] = '\0';
+
+    // Track the prefix shared by every match
+    if (completion->count == 0) {
+        completion->common_length = prefix_length + name_length;
+    } else {
+        const char *first = completion->matches[0];
+        size_t n = 0;
+        while (n < completion->common_length && first[n] == match[n]) n++;
+        completion->common_length = n;
+    }
+    completion->matches[completion->count++] = match;
+}
+
+// Walk the trie below a node, collecting names in sorted order
+static void shell_collect_commands(ExtendedShellContext *ctx, ShellCompletion *completion, const ShellTrieNode *node, char *name, size_t length, size_t size) {
+    for (; node && completion->count < MAX_TAB_COMPLETIONS; node = node->sibling) {
+        if (length + 1 >= size) return;
+        name[length] = (char)node->byte;
+        name[length + 1] = '\0';
+        if (node->terminal) shell_add_completion(ctx, completion, "", 0, name, false);
+        shell_collect_commands(ctx, completion, node->child, name, length + 1, size);
+    }
+}
+
+// Complete the word before the cursor: command names in command position,
+// otherwise file names. Matches are sorted and capped at MAX_TAB_COMPLETIONS.
+ShellError shell_complete(ExtendedShellContext *ctx, const char *line, size_t cursor, ShellCompletion *completion) {
+    if (!ctx || !line || !completion) return SHELL_ERROR_NULL_POINTER;
+
+    ShellCompleter *completer = &ctx->completer;
+    shell_arena_release(&completer->results, (ShellArenaMark){ NULL, 0 });
+    completion->count = 0;
+    completion->common_length = 0;
+
+    // Find the start of the word and whether it names a command
+    size_t start = cursor;
+    while (start > 0 && !strchr(" \t\n|&;<>", line[start - 1])) start--;
+    size_t before = start;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t')) before--;
+    bool command_position = before == 0 || strchr("|&;\n", line[before - 1]);
+
+    completion->start = start;
+    const char *word = line + start;
+    size_t word_length = cursor - start;
+    const char *slash = memrchr(word, '/', word_length);
+
+    ShellError result = SHELL_OK;
+    if (command_position && !slash) {
+        result = shell_update_command_trie(ctx);
+
+        // Descend to the node for the typed prefix
+        const ShellTrieNode *node = completer->trie;
+        for (size_t i = 0; node && i < word_length; i++) {
+            node = node->child;
+            while (node && node->byte != (unsigned char)word[i]) node = node->sibling;
+        }
+
+        char name[PATH_MAX];
+        if (node && word_length < sizeof(name)) {
+            memcpy(name, word, word_length);
+            name[word_length] = '\0';
+            if (node->terminal) shell_add_completion(ctx, completion, "", 0, name, false);
+            shell_collect_commands(ctx, completion, node->child, name, word_length, sizeof(name));
+        }
+    } else {
+        // Split the word into its directory and the prefix of the file name
+        size_t dir_length = slash ? (size_t)(slash - word) + 1 : 0;
+        const char *prefix = word + dir_length;
+        size_t prefix_length = word_length - dir_length;
+
+        char dir_path[PATH_MAX];
+        if (dir_length >= sizeof(dir_path)) return SHELL_ERROR_TAB_COMPLETION_FAILED;
+        memcpy(dir_path, dir_length ? word : ".", dir_length ? dir_length : 1);
+        dir_path[dir_length ? dir_length : 1] = '\0';
+
+        ShellDirCache *dir = shell_cached_dir(ctx, dir_path);
+        size_t low = 0;
+        size_t high = dir ? dir->count : 0;
+
+        // Binary search for the first name not below the prefix
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (strncmp(dir->entries[mid].name, prefix, prefix_length) < 0) low = mid + 1;
+            else high = mid;
+        }
+
+        for (size_t i = low; dir && i < dir->count && strncmp(dir->entries[i].name, prefix, prefix_length) == 0; i++) {
+            // Hidden files are only offered once a dot has been typed
+            if (dir->entries[i].name[0] == '.' && prefix[0] != '.') continue;
+            shell_add_completion(ctx, completion, word, dir_length, dir->entries[i].name, dir->entries[i].directory);
+        }
+    }
+
+    if (result == SHELL_OK && completion->count == 0) result = SHELL_ERROR_TAB_COMPLETION_FAILED;
+    if (result != SHELL_OK) ctx->base.last_error = result;
+    return result;
+}
+
+// Initialize the shell context
+ShellError shell_init(ExtendedShellContext *ctx, const char *prompt, bool interactive) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+    ctx->base.input = NULL;
+    ctx->base.output = NULL;
+    ctx->base.error = NULL;
+    ctx->base.output_length = 0;
+    ctx->base.error_length = 0;
+    ctx->base.history = (ShellHistory){ NULL, MAX_HISTORY_SIZE, 0, 0, -1, NULL, 0, false };
+    ctx->base.variables = (ShellMap){ NULL, 0, 0, 0 };
+    ctx->base.envp = NULL;
+    ctx->base.envp_dirty = false;
+    ctx->base.variables_loaded = false;
+    ctx->base.child_pid = -1;
+    ctx->base.last_error = SHELL_OK;
+    ctx->base.exit_status = 0;
+    ctx->base.prompt = prompt ? strdup(prompt) : strdup("> ");
+    ctx->base.interactive = interactive;
+    for (int fd = 0; fd < SHELL_CONTEXT_FDS; fd++) ctx->base.fds[fd] = fd;
+    ctx->commands = (ShellMap){ NULL, 0, 0, 0 };
+    ctx->commands_generation = 0;
+    ctx->alias_generation = 0;
+    ctx->alias_count = 0;
+    ctx->path_cache = (ShellMap){ NULL, 0, 0, 0 };
+    ctx->stats = (ShellStats){ 0 };
+    ctx->profiling = false;
+    ctx->profiles = (ShellMap){ NULL, 0, 0, 0 };
+    ctx->arena = (ShellArena){ NULL, NULL };
+    ctx->job_count = 0;
+    memset(ctx->jobs, 0, sizeof(ctx->jobs));
+    ctx->job_index = (ShellJobIndex){ NULL, 0, 0, 0 };
+    ctx->job_epoll = -1;
+    ctx->sigchld_fd = -1;
+    ctx->job_control = interactive && isatty(STDIN_FILENO);
+    ctx->shell_pgid = getpgrp();
+    ctx->spawn_backend = SHELL_SPAWN_POSIX;
+    ctx->zygote = (ShellZygote){ 0, -1, -1, 0, NULL, 0, 0 };
+    ctx->spawn_resources = NULL;
+    ctx->cwd_fd = -1;
+    ctx->spawn_attrs_ready = false;
+    ctx->dir_cache = (ShellMap){ NULL, 0, 0, 0 };
+    ctx->dir_scans = 0;
+    ctx->parse_cache = (ShellMap){ NULL, 0, 0, 0 };
+    ctx->parse_cache_hand = 0;
+    memset(&ctx->completer, 0, sizeof(ctx->completer));
+    ctx->positional = NULL;
+    ctx->positional_count = 0;
+    ctx->script_line = 0;
+    ctx->function_depth = 0;
+    ctx->loop_depth = 0;
+    ctx->break_levels = 0;
+    ctx->continue_levels = 0;
+    ctx->returning = false;
+    ctx->exit_requested = false;
+    ctx->substituted = false;
+    ctx->execute_depth = 0;
+    ctx->capture_capacity[0] = 0;
+    ctx->capture_capacity[1] = 0;
+    ctx->temporaries = NULL;
+    ctx->temporary_count = 0;
+    ctx->temporary_capacity = 0;
+    ctx->child_events = 0;
+    ctx->events = (ShellEventLoop){ 0 };
+    ctx->events.epoll_fd = -1;
+    ctx->events.input_fd = -1;
+    ctx->snapshot = (ShellSnapshot){ NULL, 0, NULL, 0 };
+
+    // Populate the dispatch table with the built-in commands
+    if (shell_register_builtins(ctx) != SHELL_OK) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    // Initialize signal mask
+    sigemptyset(&ctx->base.signal_mask);
+    sigaddset(&ctx->base.signal_mask, SIGINT);
+    sigaddset(&ctx->base.signal_mask, SIGTERM);
+    sigaddset(&ctx->base.signal_mask, SIGCHLD);
+
+    // With job control the shell hands the terminal to foreground jobs and
+    // takes it back, and must not be stopped by the job control signals itself
+    if (ctx->job_control) {
+        sigaddset(&ctx->base.signal_mask, SIGTSTP);
+        sigaddset(&ctx->base.signal_mask, SIGTTIN);
+        sigaddset(&ctx->base.signal_mask, SIGTTOU);
+    }
+
+    // Block signals during critical sections. Only the calling thread's
+    // mask changes, and shell_cleanup restores it.
+    if (pthread_sigmask(SIG_BLOCK, &ctx->base.signal_mask, &ctx->saved_signal_mask) != 0) {
+        ctx->base.last_error = SHELL_ERROR_SIGNAL_HANDLING_FAILED;
+        return SHELL_ERROR_SIGNAL_HANDLING_FAILED;
+    }
+
+    // Child exits are delivered through a signalfd so reaping only happens when needed
+    sigset_t sigchld_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    ctx->sigchld_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    return SHELL_OK;
+}
+
+// Clean up the shell context
+ShellError shell_cleanup(ExtendedShellContext *ctx) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+    if (ctx->base.input) free(ctx->base.input);
+    if (ctx->base.output) free(ctx->base.output);
+    if (ctx->base.error) free(ctx->base.error);
+    if (ctx->base.prompt) free(ctx->base.prompt);
+
+    shell_history_free(&ctx->base.history);
+
+    for (size_t i = 0; i < ctx->base.variables.capacity; i++) {
+        ShellVariable *variable = ctx->base.variables.entries[i].value;
+        if (!ctx->base.variables.entries[i].key || !variable) continue;
+        shell_snapshot_free(ctx, variable->entry);
+        shell_snapshot_free(ctx, variable);
+    }
+    shell_map_free(&ctx->base.variables);
+    free(ctx->base.envp);
+
+    for (size_t i = 0; i < ctx->commands.capacity; i++) {
+        ShellCommand *command = ctx->commands.entries[i].value;
+        if (!ctx->commands.entries[i].key || !command) continue;
+        shell_snapshot_free(ctx, command->value);
+        shell_snapshot_free(ctx, command->alias_tokens);
+        if (command->function) shell_parse_release(command->function);
+        shell_snapshot_free(ctx, command);
+    }
+    shell_map_free(&ctx->commands);
+
+    shell_clear_path_cache(ctx);
+    shell_map_free(&ctx->path_cache);
+    if (ctx->snapshot.map) munmap(ctx->snapshot.map, ctx->snapshot.map_length);
+    free(ctx->snapshot.block);
+    ctx->snapshot = (ShellSnapshot){ NULL, 0, NULL, 0 };
+    shell_clear_profiles(ctx);
+    shell_event_loop_free(ctx);
+    shell_release_temporaries(ctx, 0);
+    free(ctx->temporaries);
+    shell_zygote_stop(ctx);
+    free(ctx->spawn_resources);
+
+    shell_arena_free(&ctx->arena);
+    shell_completer_free(&ctx->completer);
+    shell_dir_cache_free(ctx);
+    shell_parse_cache_clear(ctx);
+
+    for (int i = 0; i < ctx->job_count; i++) {
+        if (ctx->jobs[i].command) free(ctx->jobs[i].command);
+    }
+    for (size_t i = 0; i < ctx->job_index.capacity; i++) {
+        if (ctx->job_index.entries[i].pid != 0 && ctx->job_index.entries[i].pidfd != -1) close(ctx->job_index.entries[i].pidfd);
+    }
+    free(ctx->job_index.entries);
+    ctx->job_index = (ShellJobIndex){ NULL, 0, 0, 0 };
+    if (ctx->job_epoll != -1) close(ctx->job_epoll);
+    ctx->job_epoll = -1;
+    if (ctx->cwd_fd != -1) close(ctx->cwd_fd);
+    ctx->cwd_fd = -1;
+
+    if (ctx->sigchld_fd != -1) close(ctx->sigchld_fd);
+    pthread_sigmask(SIG_SETMASK, &ctx->saved_signal_mask, NULL);
+    if (ctx->spawn_attrs_ready) {
+        posix_spawnattr_destroy(&ctx->spawn_attrs[0]);
+        posix_spawnattr_destroy(&ctx->spawn_attrs[1]);
+    }
+
+    return SHELL_OK;
+}
+
+// Insert or replace an entry of the dispatch table
+static ShellCommand *shell_define_command(ExtendedShellContext *ctx, const char *name, ShellCommandKind kind) {
+    ShellMapEntry *entry = shell_map_insert(&ctx->commands, name, shell_hash_string(name));
+    if (!entry) return NULL;
+
+    ShellCommand *command = entry->value;
+    if (!command) {
+        command = calloc(1, sizeof(ShellCommand));
+        if (!command) {
+            free(shell_map_remove(&ctx->commands, name, entry->hash));
+            return NULL;
+        }
+        command->name = entry->key;
+        entry->value = command;
+    }
+
+    // An alias attached to the name is kept
+    command->kind = kind;
+    command->callback = NULL;
+    command->builtin = NULL;
+    command->shareable = false;
+    command->stream = NULL;
+    if (command->function) {
+        shell_parse_release(command->function);
+        command->function = NULL;
+        command->body = NULL;
+    }
+    ctx->commands_generation++;
+    return command;
+}
+
+// Look up a name in the dispatch table
+static ShellCommand *shell_lookup_command(ExtendedShellContext *ctx, const char *name) {
+    ShellMapEntry *entry = shell_map_find(&ctx->commands, name, shell_hash_string(name));
+    return entry ? entry->value : NULL;
+}
+
+// Register a custom command
+ShellError shell_register_command(ExtendedShellContext *ctx, const char *name, CommandCallback callback) {
+    if (!ctx || !name || !callback) return SHELL_ERROR_NULL_POINTER;
+
+    ShellCommand *command = shell_define_command(ctx, name, SHELL_COMMAND_CUSTOM);
+    if (!command) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    command->callback = callback;
+    return SHELL_OK;
+}
+
+// Register a custom command that reads and writes through ShellIO streams.
+// It runs in the shell process even as a stage of a pipeline.
+ShellError shell_register_stream_command(ExtendedShellContext *ctx, const char *name, StreamCommandCallback callback) {
+    if (!ctx || !name || !callback) return SHELL_ERROR_NULL_POINTER;
+
+    ShellCommand *command = shell_define_command(ctx, name, SHELL_COMMAND_STREAM);
+    if (!command) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    command->stream = callback;
+    return SHELL_OK;
+}
+
+// Define or replace an alias. The text is lexed here, once, so expanding
+// the alias later only splices its tokens into the command line.
+ShellError shell_set_alias(ExtendedShellContext *ctx, const char *name, const char *value) {
+    if (!ctx || !name || !value) return SHELL_ERROR_NULL_POINTER;
+
+    size_t name_length = strlen(name);
+    if (name_length == 0 || strcspn(name, SHELL_WORD_DELIMITERS "=$`/") != name_length) {
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    ShellTokenList list;
+    ShellError result = shell_lex(&ctx->arena, value, &list);
+
+    // One block holds the text and every cooked word
+    size_t value_length = strlen(value);
+    size_t size = value_length + 1;
+    for (size_t i = 0; result == SHELL_OK && i < list.count; i++) {
+        if (list.tokens[i].text) size += strlen(list.tokens[i].text) + 1;
+    }
+
+    char *block = result == SHELL_OK ? malloc(size) : NULL;
+    ShellToken *tokens = block && list.count ? malloc(list.count * sizeof(ShellToken)) : NULL;
+    if (result == SHELL_OK && (!block || (list.count && !tokens))) result = SHELL_ERROR_MEMORY_ALLOCATION;
+
+    ShellCommand *command = NULL;
+    if (result == SHELL_OK) {
+        command = shell_lookup_command(ctx, name);
+        if (!command) command = shell_define_command(ctx, name, SHELL_COMMAND_ALIAS);
+        if (!command) result = SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if (result != SHELL_OK) {
+        free(block);
+        free(tokens);
+        shell_arena_release(&ctx->arena, mark);
+        ctx->base.last_error = result;
+        return result;
+    }
+
+    memcpy(block, value, value_length + 1);
+    size_t offset = value_length + 1;
+    for (size_t i = 0; i < list.count; i++) {
+        tokens[i] = list.tokens[i];
+        tokens[i].raw = block + (list.tokens[i].raw - value);
+        if (list.tokens[i].text) {
+            size_t length = strlen(list.tokens[i].text);
+            memcpy(block + offset, list.tokens[i].text, length + 1);
+            tokens[i].text = block + offset;
+            offset += length + 1;
+        }
+    }
+    shell_arena_release(&ctx->arena, mark);
+
+    if (!command->value) ctx->alias_count++;
+    shell_snapshot_free(ctx, command->value);
+    shell_snapshot_free(ctx, command->alias_tokens);
+    command->value = block;
+    command->value_size = size;
+    command->alias_tokens = tokens;
+    command->alias_token_count = list.count;
+    command->alias_blank = value_length > 0 && (value[value_length - 1] == ' ' || value[value_length - 1] == '\t');
+    ctx->commands_generation++;
+    ctx->alias_generation++;
+    return SHELL_OK;
+}
+
+// Get the text of an alias, or NULL if the name is not an alias
+const char *shell_get_alias(ExtendedShellContext *ctx, const char *name) {
+    if (!ctx || !name) return NULL;
+
+    ShellCommand *command = shell_lookup_command(ctx, name);
+    return command ? command->value : NULL;
+}
+
+// Remove an alias, leaving any command of the same name in place
+ShellError shell_remove_alias(ExtendedShellContext *ctx, const char *name) {
+    if (!ctx || !name) return SHELL_ERROR_NULL_POINTER;
+
+    ShellCommand *command = shell_lookup_command(ctx, name);
+    if (!command || !command->value) {
+        ctx->base.last_error = SHELL_ERROR_COMMAND_NOT_FOUND;
+        return SHELL_ERROR_COMMAND_NOT_FOUND;
+    }
+
+    shell_snapshot_free(ctx, command->value);
+    shell_snapshot_free(ctx, command->alias_tokens);
+    command->value = NULL;
+    command->alias_tokens = NULL;
+    command->alias_token_count = 0;
+    ctx->alias_count--;
+    ctx->commands_generation++;
+    ctx->alias_generation++;
+
+    if (command->kind == SHELL_COMMAND_ALIAS) {
+        shell_snapshot_free(ctx, shell_map_remove(&ctx->commands, name, shell_hash_string(name)));
+    }
+    return SHELL_OK;
+}
+
+// Descriptor that becomes readable when a child exits, or -1 where pidfds
+// are not available
+static int shell_open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+// Home slot of a pid in the job index
+static size_t shell_job_index_slot(const ShellJobIndex *index, pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & (index->capacity - 1);
+}
+
+// Slot holding a pid, or the capacity if it is not indexed. The table is
+// never full, but the probe stops after one pass around it regardless.
+static size_t shell_job_index_find(const ShellJobIndex *index, pid_t pid) {
+    size_t mask = index->capacity - 1;
+    size_t i = index->capacity ? shell_job_index_slot(index, pid) : 0;
+    for (size_t probes = 0; probes < index->capacity; probes++, i = (i + 1) & mask) {
+        if (index->entries[i].pid == pid) return i;
+        if (index->entries[i].pid == 0) break;
+    }
+    return index->capacity;
+}
+
+// Rehash the index into a table of the given capacity
+static bool shell_job_index_resize(ShellJobIndex *index, size_t capacity) {
+    ShellJobIndexEntry *entries = calloc(capacity, sizeof(ShellJobIndexEntry));
+    if (!entries) return false;
+
+    ShellJobIndex grown = { entries, capacity, index->count, index->unwatched };
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (index->entries[i].pid == 0) continue;
+        size_t j = shell_job_index_slot(&grown, index->entries[i].pid);
+        while (entries[j].pid != 0) j = (j + 1) & (capacity - 1);
+        entries[j] = index->entries[i];
+    }
+    free(index->entries);
+    *index = grown;
+    return true;
+}
+
+// Find the job slot of a pid, or -1
+static int shell_find_job(ExtendedShellContext *ctx, pid_t pid) {
+    size_t i = shell_job_index_find(&ctx->job_index, pid);
+    return i < ctx->job_index.capacity ? ctx->job_index.entries[i].job : -1;
+}
+
+// Remove a pid from the job index, shifting later entries of its probe
+// run back. Closing its pidfd also takes it out of the job epoll set.
+static void shell_unindex_job(ExtendedShellContext *ctx, pid_t pid) {
+    ShellJobIndex *index = &ctx->job_index;
+    size_t hole = shell_job_index_find(index, pid);
+    if (hole == index->capacity) return;
+
+    if (index->entries[hole].pidfd != -1) {
+        close(index->entries[hole].pidfd);
+    } else {
+        index->unwatched--;
+    }
+
+    size_t mask = index->capacity - 1;
+    size_t j = (hole + 1) & mask;
+    for (size_t probes = 1; probes < index->capacity && index->entries[j].pid != 0; probes++, j = (j + 1) & mask) {
+        size_t home = shell_job_index_slot(index, index->entries[j].pid);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            index->entries[hole] = index->entries[j];
+            hole = j;
+        }
+    }
+    index->entries[hole].pid = 0;
+    index->count--;
+}
+
+// Release a job slot for reuse once all of its processes are gone. Any
+// that could not be waited for are dropped from the index.
+static void shell_remove_job(ExtendedShellContext *ctx, int job) {
+    ShellJobIndex *index = &ctx->job_index;
+    for (size_t i = 0; ctx->jobs[job].processes > 0 && i < index->capacity; i++) {
+        // Unindexing moves later entries back, so the slot is checked again
+        while (index->entries[i].pid != 0 && index->entries[i].job == job && ctx->jobs[job].processes > 0) {
+            shell_unindex_job(ctx, index->entries[i].pid);
+            ctx->jobs[job].processes--;
+        }
+    }
+
+    free(ctx->jobs[job].command);
+    ctx->jobs[job] = (Job){ 0, NULL, false, 0, 0 };
+
+    while (ctx->job_count > 0 && ctx->jobs[ctx->job_count - 1].pid == 0) {
+        ctx->job_count--;
+    }
+}
+
+// Record that a child exited; children that are not jobs are ignored
+static void shell_reap_child(ExtendedShellContext *ctx, pid_t pid, int status) {
+    (void)status;
+
+    int job = shell_find_job(ctx, pid);
+    if (job < 0) return;
+
+    shell_unindex_job(ctx, pid);
+    if (--ctx->jobs[job].processes > 0) return;
+
+    shell_printf(&ctx->base, STDOUT_FILENO, "[%d] Done: %s\n", job + 1, ctx->jobs[job].command);
+    shell_remove_job(ctx, job);
+}
+
+// SIGCHLD notifications read by any context. The signal is process-wide
+// and consumed by whichever context reads it first, so each context
+// compares this count with the one it saw last.
+static atomic_ulong shell_child_events;
+
+// Check and update job status. Each context waits for the processes of its
+// own jobs by pid, never with waitpid(-1), so children of other contexts
+// and of the host are left alone. A process with a pidfd is reaped once
+// the job epoll set reports it readable, so the cost follows the number of
+// exits rather than of jobs; the others are tried after each SIGCHLD.
+ShellError shell_update_jobs(ExtendedShellContext *ctx) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+    bool signalled = true;
+    if (ctx->sigchld_fd != -1) {
+        struct signalfd_siginfo info[8];
+        while (read(ctx->sigchld_fd, info, sizeof(info)) > 0) atomic_fetch_add(&shell_child_events, 1);
+
+        unsigned long events = atomic_load(&shell_child_events);
+        signalled = events != ctx->child_events;
+        ctx->child_events = events;
+    }
+
+    ShellJobIndex *index = &ctx->job_index;
+    if (index->count == 0) return SHELL_OK;
+
+    if (ctx->job_epoll != -1) {
+        struct epoll_event ready[16];
+        int count;
+        do {
+            count = epoll_wait(ctx->job_epoll, ready, 16, 0);
+            for (int i = 0; i < count; i++) {
+                // One reaped by someone else is gone all the same
+                pid_t pid = (pid_t)ready[i].data.u64;
+                int status = 0;
+                pid_t reaped = waitpid(pid, &status, WNOHANG);
+                if (reaped == pid || (reaped == -1 && errno == ECHILD)) shell_reap_child(ctx, pid, status);
+            }
+        } while (count == 16);
+    }
+    if (!signalled || index->unwatched == 0) return SHELL_OK;
+
+    // Reaping removes entries from the index, so collect the pids first
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    pid_t *pids = shell_arena_alloc(&ctx->arena, index->unwatched * sizeof(pid_t));
+    if (!pids) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (index->entries[i].pid != 0 && index->entries[i].pidfd == -1) pids[count++] = index->entries[i].pid;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        int status;
+        if (waitpid(pids[i], &status, WNOHANG) == pids[i]) shell_reap_child(ctx, pids[i], status);
+    }
+
+    shell_arena_release(&ctx->arena, mark);
+    return SHELL_OK;
+}
+
+// Create a job without processes; returns its slot or -1
+static int shell_new_job(ExtendedShellContext *ctx, pid_t pid, pid_t pgid, const char *command) {
+    // Reuse the first free slot, reaping finished jobs if the table is full
+    int job = 0;
+    while (job < ctx->job_count && ctx->jobs[job].pid != 0) job++;
+    if (job >= MAX_JOBS) {
+        shell_update_jobs(ctx);
+        job = 0;
+        while (job < ctx->job_count && ctx->jobs[job].pid != 0) job++;
+    }
+    if (job >= MAX_JOBS) {
+        ctx->base.last_error = SHELL_ERROR_JOB_CONTROL_FULL;
+        return -1;
+    }
+
+    char *copy = strdup(command);
+    if (!copy) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return -1;
+    }
+
+    ctx->jobs[job] = (Job){ pid, copy, true, pgid, 0 };
+    if (job == ctx->job_count) ctx->job_count++;
+    return job;
+}
+
+// Attach a process to a job; returns false if the index cannot grow
+static bool shell_add_job_process(ExtendedShellContext *ctx, int job, pid_t pid) {
+    ShellJobIndex *index = &ctx->job_index;
+    if ((index->count + 1) * 2 > index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : SHELL_JOB_INDEX_INITIAL_CAPACITY;
+        if (!shell_job_index_resize(index, capacity)) {
+            ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+            return false;
+        }
+    }
+
+    // The process is watched through a pidfd where the kernel has them
+    if (ctx->job_epoll == -1) ctx->job_epoll = epoll_create1(EPOLL_CLOEXEC);
+    int pidfd = ctx->job_epoll != -1 ? shell_open_pidfd(pid) : -1;
+    struct epoll_event event = { EPOLLIN, { .u64 = (uint64_t)pid } };
+    if (pidfd != -1 && epoll_ctl(ctx->job_epoll, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+        close(pidfd);
+        pidfd = -1;
+    }
+
+    size_t i = shell_job_index_slot(index, pid);
+    while (index->entries[i].pid != 0) i = (i + 1) & (index->capacity - 1);
+    index->entries[i] = (ShellJobIndexEntry){ pid, job, pidfd };
+    index->count++;
+    if (pidfd == -1) index->unwatched++;
+    ctx->jobs[job].processes++;
+    return true;
+}
+
+// Add a job to the job list
+ShellError shell_add_job(ExtendedShellContext *ctx, pid_t pid, const char *command) {
+    if (!ctx || !command) return SHELL_ERROR_NULL_POINTER;
+
+    int job = shell_new_job(ctx, pid, 0, command);
+    if (job < 0) return ctx->base.last_error;
+
+    if (!shell_add_job_process(ctx, job, pid)) {
+        if (ctx->jobs[job].processes == 0) shell_remove_job(ctx, job);
+        return ctx->base.last_error;
+    }
+    return SHELL_OK;
+}
+
+// Execute a custom command
+ShellError shell_execute_custom(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (!ctx || !argv) return SHELL_ERROR_NULL_POINTER;
+
+    ShellCommand *command = argv[0] ? shell_lookup_command(ctx, argv[0]) : NULL;
+    if (!command || (command->kind != SHELL_COMMAND_CUSTOM && command->kind != SHELL_COMMAND_STREAM)) {
+        ctx->base.last_error = SHELL_ERROR_COMMAND_NOT_FOUND;
+        return SHELL_ERROR_COMMAND_NOT_FOUND;
+    }
+
+    // Stream commands get the context's standard streams
+    ShellIO io = { shell_context_fd(&ctx->base, STDIN_FILENO), shell_context_fd(&ctx->base, STDOUT_FILENO),
+                   shell_context_fd(&ctx->base, STDERR_FILENO) };
+    if (command->kind == SHELL_COMMAND_STREAM) fflush(stdout);
+    ShellError result = command->kind == SHELL_COMMAND_STREAM ? command->stream(&ctx->base, &io, argc, argv)
+                                                              : command->callback(&ctx->base, argc, argv);
+    ctx->base.exit_status = result == SHELL_OK ? 0 : 1;
+    return result;
+}
+
+// Built-in: exit [n]. The host process keeps running: the commands being
+// run unwind, and shell_run returns with n, or $?, as the exit status.
+static int shell_builtin_exit(ExtendedShellContext *ctx, int argc, char **argv) {
+    ctx->exit_requested = true;
+    return argc > 1 ? atoi(argv[1]) & 0xff : ctx->base.exit_status;
+}
+
+// Whether the exit built-in ran during the last command line; the request
+// is cleared when the next line starts
+bool shell_exit_requested(ExtendedShellContext *ctx) {
+    return ctx && ctx->exit_requested;
+}
+
+// Built-in: history
+static int shell_builtin_history(ExtendedShellContext *ctx, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    ShellOutput out;
+    shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+    size_t count = shell_history_count(&ctx->base);
+    for (size_t i = 0; i < count; i++) {
+        size_t length = 0;
+        const char *line = shell_get_history(&ctx->base, i, &length);
+        if (!line) continue;
+        shell_output_printf(&out, "%zu: %.*s\n", i + 1, (int)length, line);
+    }
+    shell_output_flush(&out);
+    return 0;
+}
+
+// Built-in: jobs
+static int shell_builtin_jobs(ExtendedShellContext *ctx, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    shell_update_jobs(ctx);
+    ShellOutput out;
+    shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+    for (int i = 0; i < ctx->job_count; i++) {
+        if (ctx->jobs[i].pid == 0) continue;
+        shell_output_printf(&out, "[%d] %s: %s\n", i + 1, ctx->jobs[i].running ? "Running" : "Done", ctx->jobs[i].command);
+    }
+    shell_output_flush(&out);
+    return 0;
+}
+
+// Convert a wait status to an exit status the way sh reports it
+static int shell_exit_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 1;
+}
+
+// Find the job named by a fg/bg argument ("%n" or "n"), defaulting to the newest one
+static int shell_job_argument(ExtendedShellContext *ctx, int argc, char **argv) {
+    int job = ctx->job_count - 1;
+    if (argc > 1) {
+        const char *spec = argv[1][0] == '%' ? argv[1] + 1 : argv[1];
+        job = atoi(spec) - 1;
+    }
+    if (job < 0 || job >= ctx->job_count || ctx->jobs[job].pid == 0) return -1;
+    return job;
+}
+
+// Built-in: fg [job]
+static int shell_builtin_fg(ExtendedShellContext *ctx, int argc, char **argv) {
+    shell_update_jobs(ctx);
+    int job = shell_job_argument(ctx, argc, argv);
+    if (job < 0) {
+        shell_printf(&ctx->base, STDERR_FILENO, "fg: no such job\n");
+        return 1;
+    }
+
+    Job *entry = &ctx->jobs[job];
+    pid_t target = entry->pgid > 0 ? -entry->pgid : entry->pid;
+    shell_printf(&ctx->base, STDOUT_FILENO, "%s\n", entry->command);
+
+    if (ctx->job_control && entry->pgid > 0) tcsetpgrp(STDIN_FILENO, entry->pgid);
+    kill(target, SIGCONT);
+    entry->running = true;
+
+    int status = 0;
+    bool stopped = false;
+    while (entry->processes > 0) {
+        int wait_status;
+        pid_t pid = waitpid(target, &wait_status, ctx->job_control ? WUNTRACED : 0);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        status = shell_exit_status(wait_status);
+        if (WIFSTOPPED(wait_status)) {
+            stopped = true;
+            break;
+        }
+        shell_unindex_job(ctx, pid);
+        entry->processes--;
+    }
+
+    if (ctx->job_control) tcsetpgrp(STDIN_FILENO, ctx->shell_pgid);
+
+    if (stopped) {
+        entry->running = false;
+        shell_printf(&ctx->base, STDOUT_FILENO, "\n[%d] Stopped: %s\n", job + 1, entry->command);
+    } else {
+        shell_remove_job(ctx, job);
+    }
+    return status;
+}
+
+// Built-in: bg [job]
+static int shell_builtin_bg(ExtendedShellContext *ctx, int argc, char **argv) {
+    int job = shell_job_argument(ctx, argc, argv);
+    if (job < 0) {
+        shell_printf(&ctx->base, STDERR_FILENO, "bg: no such job\n");
+        return 1;
+    }
+
+    Job *entry = &ctx->jobs[job];
+    kill(entry->pgid > 0 ? -entry->pgid : entry->pid, SIGCONT);
+    entry->running = true;
+    shell_printf(&ctx->base, STDOUT_FILENO, "[%d] %s &\n", job + 1, entry->command);
+    return 0;
+}
+
+// Built-in: hash [-r] [name ...]
+static int shell_builtin_hash(ExtendedShellContext *ctx, int argc, char **argv) {
+    int status = 0;
+
+    if (argc == 1) {
+        ShellOutput out;
+        shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+        shell_output_printf(&out, "hits\tcommand\n");
+        for (size_t i = 0; i < ctx->path_cache.capacity; i++) {
+            ShellPathEntry *cached = ctx->path_cache.entries[i].value;
+            if (ctx->path_cache.entries[i].key && cached) {
+                shell_output_printf(&out, "%4lu\t%s\n", cached->hits, cached->path);
+            }
+        }
+        shell_output_flush(&out);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            shell_clear_path_cache(ctx);
+        } else if (!shell_resolve_command(ctx, argv[i])) {
+            shell_printf(&ctx->base, STDERR_FILENO, "hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+// Print a histogram: its count, mean and maximum, then each bucket in use
+static void shell_print_histogram(ShellOutput *out, const char *title, const ShellHistogram *histogram) {
+    if (histogram->count == 0) return;
+
+    shell_output_printf(out, "%s: %lu, mean %.1f us, max %.1f us\n", title, histogram->count,
+                        histogram->total_ns / 1e3 / histogram->count, histogram->max_ns / 1e3);
+    for (int i = 0; i < SHELL_HISTOGRAM_BUCKETS; i++) {
+        if (!histogram->buckets[i]) continue;
+        if (i == SHELL_HISTOGRAM_BUCKETS - 1) {
+            shell_output_printf(out, "  >= %10llu us %8lu\n", 1ULL << (i - 1), histogram->buckets[i]);
+        } else {
+            shell_output_printf(out, "  <  %10llu us %8lu\n", 1ULL << i, histogram->buckets[i]);
+        }
+    }
+}
+
+// Order profile map entries by descending wall time
+static int shell_compare_profiles(const void *a, const void *b) {
+    const ShellCommandProfile *left = (*(ShellMapEntry *const *)a)->value;
+    const ShellCommandProfile *right = (*(ShellMapEntry *const *)b)->value;
+    return (left->wall_ns < right->wall_ns) - (left->wall_ns > right->wall_ns);
+}
+
+// stats [on | off | reset]: print the shell's counters and, once profiling
+// has been turned on, where the time of each command went
+static int shell_builtin_stats(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (argc > 2) {
+        shell_printf(&ctx->base, STDERR_FILENO, "stats: usage: stats [on | off | reset]\n");
+        return 2;
+    }
+    if (argc == 2) {
+        if (strcmp(argv[1], "on") == 0) {
+            ctx->profiling = true;
+        } else if (strcmp(argv[1], "off") == 0) {
+            ctx->profiling = false;
+        } else if (strcmp(argv[1], "reset") == 0) {
+            shell_reset_stats(ctx);
+        } else {
+            shell_printf(&ctx->base, STDERR_FILENO, "stats: %s: invalid argument\n", argv[1]);
+            return 2;
+        }
+        return 0;
+    }
+
+    const ShellStats *stats = &ctx->stats;
+    ShellOutput out;
+    shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+    shell_output_printf(&out, "path cache: %lu hits, %lu misses\n", stats->path_cache_hits, stats->path_cache_misses);
+    shell_output_printf(&out, "dir cache: %lu hits, %lu misses\n", stats->dir_cache_hits, stats->dir_cache_misses);
+    shell_output_printf(&out, "globs: %lu expansions, %lu result hits\n", stats->glob_expansions, stats->glob_result_hits);
+    shell_output_printf(&out, "parse cache: %lu hits, %lu misses\n", stats->parse_cache_hits, stats->parse_cache_misses);
+    shell_output_printf(&out, "profiling: %s\n", ctx->profiling ? "on" : "off");
+    if (ctx->profiles.count == 0) {
+        shell_output_flush(&out);
+        return 0;
+    }
+
+    static const char *const dispatch_names[SHELL_DISPATCH_COUNT] = { "custom", "builtin", "function", "stream", "external" };
+    shell_output_printf(&out, "dispatch:");
+    for (int i = 0; i < SHELL_DISPATCH_COUNT; i++) shell_output_printf(&out, " %s %lu", dispatch_names[i], stats->dispatches[i]);
+    shell_output_printf(&out, "\ncpu: user %.3f s, system %.3f s, max rss %ld KiB\n",
+                        stats->user_cpu_ns / 1e9, stats->system_cpu_ns / 1e9, stats->max_rss_kb);
+    shell_print_histogram(&out, "parse", &stats->parse_time);
+    shell_print_histogram(&out, "spawn", &stats->spawn_time);
+    shell_print_histogram(&out, "wall", &stats->wall_time);
+
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    ShellMapEntry **entries = shell_arena_alloc(&ctx->arena, ctx->profiles.count * sizeof(ShellMapEntry *));
+    if (!entries) {
+        shell_output_flush(&out);
+        shell_printf(&ctx->base, STDERR_FILENO, "stats: %s\n", strerror(ENOMEM));
+        return 1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < ctx->profiles.capacity; i++) {
+        if (ctx->profiles.entries[i].key && ctx->profiles.entries[i].value) entries[count++] = &ctx->profiles.entries[i];
+    }
+    qsort(entries, count, sizeof(ShellMapEntry *), shell_compare_profiles);
+
+    shell_output_printf(&out, "%8s %12s %10s %10s %10s %9s %-8s %s\n", "calls", "wall ms", "spawn us", "user ms", "sys ms",
+                        "rss KiB", "dispatch", "command");
+    for (size_t i = 0; i < count; i++) {
+        const ShellCommandProfile *profile = entries[i]->value;
+        double spawn_us = profile->dispatch == SHELL_DISPATCH_EXTERNAL ? profile->spawn_ns / 1e3 / profile->calls : 0;
+        shell_output_printf(&out, "%8lu %12.3f %10.1f %10.3f %10.3f %9ld %-8s %s\n", profile->calls, profile->wall_ns / 1e6,
+                            spawn_us, profile->user_cpu_ns / 1e6, profile->system_cpu_ns / 1e6, profile->max_rss_kb,
+                            dispatch_names[profile->dispatch], entries[i]->key);
+    }
+
+    shell_output_flush(&out);
+    shell_arena_release(&ctx->arena, mark);
+    return 0;
+}
+
+// Execute a built-in command
+ShellError shell_execute_builtin(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (!ctx || !argv) return SHELL_ERROR_NULL_POINTER;
+
+    ShellCommand *command = argv[0] ? shell_lookup_command(ctx, argv[0]) : NULL;
+    if (!command || command->kind != SHELL_COMMAND_BUILTIN) {
+        ctx->base.last_error = SHELL_ERROR_COMMAND_NOT_FOUND;
+        return SHELL_ERROR_COMMAND_NOT_FOUND;
+    }
+
+    ctx->base.exit_status = command->builtin(ctx, argc, argv);
+    return SHELL_OK;
+}
+
+// Whether the context's descriptor fd is put in place in the child, and
+// not left to a pipe of the request or to what the shell has open there
+static bool shell_maps_context_fd(const ShellSpawnRequest *request, int fd) {
+    return request->fds && request->fds[fd] != fd && !(fd == STDIN_FILENO && request->input_fd != -1) &&
+           !(fd == STDOUT_FILENO && request->output_fd != -1);
+}
+
+// Add the input/output redirections of a command to its file actions
+static void shell_add_redirections(posix_spawn_file_actions_t *file_actions, const ShellSpawnRequest *request) {
+    for (int fd = 0; fd < SHELL_CONTEXT_FDS; fd++) {
+        if (!shell_maps_context_fd(request, fd)) continue;
+        if (request->fds[fd] == -1) {
+            posix_spawn_file_actions_addclose(file_actions, fd);
+        } else {
+            posix_spawn_file_actions_adddup2(file_actions, request->fds[fd], fd);
+        }
+    }
+
+    if (request->input_file) {
+        posix_spawn_file_actions_addopen(file_actions, STDIN_FILENO, request->input_file, O_RDONLY, 0);
+    }
+
+    if (request->output_file) {
+        int flags = O_WRONLY | O_CREAT | (request->append_output ? O_APPEND : O_TRUNC);
+        posix_spawn_file_actions_addopen(file_actions, STDOUT_FILENO, request->output_file, flags, 0644);
+    }
+
+    for (size_t i = 0; i < request->redirection_count; i++) {
+        const ShellRedirection *redirection = &request->redirections[i];
+        if (redirection->path) {
+            posix_spawn_file_actions_addopen(file_actions, redirection->fd, redirection->path, redirection->flags, 0644);
+        } else if (redirection->source == -1) {
+            posix_spawn_file_actions_addclose(file_actions, redirection->fd);
+        } else {
+            posix_spawn_file_actions_adddup2(file_actions, redirection->source, redirection->fd);
+        }
+    }
+}
+
+// Build the attribute templates shared by every posix_spawn call. Children
+// start with an empty signal mask and default dispositions for the signals
+// the shell blocks; the second template also sets the process group.
+static void shell_init_spawn_attrs(ExtendedShellContext *ctx) {
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+
+    for (int i = 0; i < 2; i++) {
+        posix_spawnattr_t *attr = &ctx->spawn_attrs[i];
+        posix_spawnattr_init(attr);
+        posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | (i ? POSIX_SPAWN_SETPGROUP : 0));
+        posix_spawnattr_setsigmask(attr, &child_mask);
+        posix_spawnattr_setsigdefault(attr, &ctx->base.signal_mask);
+    }
+    ctx->spawn_attrs_ready = true;
+}
+
+// Start a process with posix_spawn. The attributes come from the cached
+// templates, and a command without pipes or redirections, of a context
+// still in the process's directory, needs no file actions at all.
+static int shell_posix_spawn(ExtendedShellContext *ctx, const char *path, const ShellSpawnRequest *request, char *const envp[], pid_t *pid) {
+    if (!ctx->spawn_attrs_ready) shell_init_spawn_attrs(ctx);
+    posix_spawnattr_t *attr = &ctx->spawn_attrs[request->pgid >= 0];
+    if (request->pgid > 0) posix_spawnattr_setpgroup(attr, request->pgid);
+
+    posix_spawn_file_actions_t file_actions;
+    bool redirected = request->input_fd != -1 || request->output_fd != -1 || request->input_file || request->output_file ||
+                      request->redirection_count > 0 || request->fds || ctx->cwd_fd != -1;
+    if (redirected) {
+        posix_spawn_file_actions_init(&file_actions);
+        // The redirections' relative paths start from the new directory
+#if SHELL_SPAWN_FCHDIR
+        if (ctx->cwd_fd != -1) posix_spawn_file_actions_addfchdir_np(&file_actions, ctx->cwd_fd);
+#endif
+        if (request->input_fd != -1) posix_spawn_file_actions_adddup2(&file_actions, request->input_fd, STDIN_FILENO);
+        if (request->output_fd != -1) posix_spawn_file_actions_adddup2(&file_actions, request->output_fd, STDOUT_FILENO);
+        shell_add_redirections(&file_actions, request);
+    }
+
+    int status = posix_spawn(pid, path, redirected ? &file_actions : NULL, attr, request->argv, envp);
+
+    if (redirected) posix_spawn_file_actions_destroy(&file_actions);
+    if (request->pgid > 0) posix_spawnattr_setpgroup(attr, 0);
+    return status;
+}
+
+// Whether no bit of a CPU or node mask is set
+static bool shell_mask_empty(const unsigned long *mask, size_t words) {
+    for (size_t i = 0; i < words; i++) {
+        if (mask[i]) return false;
+    }
+    return true;
+}
+
+// Whether any placement or limit is set
+static bool shell_resources_empty(const ShellSpawnResources *resources) {
+    return shell_mask_empty(resources->cpus, SHELL_MASK_WORDS(SHELL_CPU_SETSIZE)) &&
+           shell_mask_empty(resources->numa_nodes, SHELL_MASK_WORDS(SHELL_NUMA_NODES)) && !resources->set_nice &&
+           resources->io_class == 0 && resources->limit_count == 0 && !resources->cgroup;
+}
+
+#ifdef __linux__
+// set_mempolicy mode that allocates only from the given nodes
+#define SHELL_MPOL_BIND 2
+
+// Join the cgroup and apply the limits and placement of a spawned process
+// in the child, with system calls only. The cgroup comes first, so the
+// rest is set up inside it.
+static bool shell_apply_resources(const ShellSpawnResources *resources) {
+    if (resources->cgroup) {
+        int dir = open(resources->cgroup, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        int procs = dir == -1 ? -1 : openat(dir, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (dir != -1) close(dir);
+        // Writing 0 moves the process that writes it
+        bool joined = procs != -1 && write(procs, "0", 1) == 1;
+        if (procs != -1) close(procs);
+        if (!joined) return false;
+    }
+
+    for (size_t i = 0; i < resources->limit_count && i < SHELL_MAX_RESOURCE_LIMITS; i++) {
+        if (setrlimit(resources->limits[i].resource, &resources->limits[i].limit) != 0) return false;
+    }
+    if (!shell_mask_empty(resources->cpus, SHELL_MASK_WORDS(SHELL_CPU_SETSIZE)) &&
+        syscall(SYS_sched_setaffinity, 0, sizeof(resources->cpus), resources->cpus) == -1) {
+        return false;
+    }
+    if (!shell_mask_empty(resources->numa_nodes, SHELL_MASK_WORDS(SHELL_NUMA_NODES)) &&
+        syscall(SYS_set_mempolicy, SHELL_MPOL_BIND, resources->numa_nodes, SHELL_NUMA_NODES + 1) == -1) {
+        return false;
+    }
+    if (resources->set_nice && setpriority(PRIO_PROCESS, 0, resources->nice) != 0) return false;
+    // ioprio_set(IOPRIO_WHO_PROCESS, self, class << IOPRIO_CLASS_SHIFT | level)
+    if (resources->io_class != 0 && syscall(SYS_ioprio_set, 1, 0, resources->io_class << 13 | resources->io_level) == -1) {
+        return false;
+    }
+    return true;
+}
+
+// State shared with a child of the clone backend. The child runs in the
+// parent's memory, so it reports a failure before execve through error.
+typedef struct {
+    const ShellSpawnRequest *request;
+    const char *path;
+    char *const *envp;
+    const sigset_t *default_signals;
+    int cwd_fd;  // directory the child starts in, or -1
+    int error;
+} ShellCloneChild;
+
+// Open a redirection file onto a standard descriptor in the child
+static bool shell_clone_open(const char *file, int flags, int target) {
+    int fd = open(file, flags, 0644);
+    if (fd == -1) return false;
+    if (fd == target) return true;
+    bool moved = dup2(fd, target) != -1;
+    close(fd);
+    return moved;
+}
+
+// Copy the context's descriptors into place in a child of the clone backend
+static bool shell_clone_context_fds(const ShellSpawnRequest *request) {
+    for (int fd = 0; fd < SHELL_CONTEXT_FDS; fd++) {
+        if (!shell_maps_context_fd(request, fd)) continue;
+        if (request->fds[fd] == -1) {
+            close(fd);
+        } else if (dup2(request->fds[fd], fd) == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Apply the redirections of a request in a child of the clone backend
+static bool shell_clone_redirect(const ShellSpawnRequest *request) {
+    for (size_t i = 0; i < request->redirection_count; i++) {
+        const ShellRedirection *redirection = &request->redirections[i];
+        if (redirection->path) {
+            if (!shell_clone_open(redirection->path, redirection->flags, redirection->fd)) return false;
+        } else if (redirection->source == -1) {
+            close(redirection->fd);
+        } else if (redirection->source == redirection->fd) {
+            // dup2 onto itself would leave close-on-exec set
+            if (fcntl(redirection->fd, F_SETFD, 0) == -1) return false;
+        } else if (dup2(redirection->source, redirection->fd) == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Set up and exec the process of a request in a child that may share or
+// have copied the parent's memory, so it makes nothing but system calls.
+// Its placement and limits are set before any descriptor is touched.
+// Handlers are reset before signals are unblocked, so none can run on the
+// parent's data. Returns the errno of the step that failed.
+static int shell_exec_child(const ShellSpawnRequest *request, const char *path, char *const envp[], const sigset_t *default_signals) {
+    struct sigaction default_action;
+    memset(&default_action, 0, sizeof(default_action));
+    default_action.sa_handler = SIG_DFL;
+    sigemptyset(&default_action.sa_mask);
+    for (int sig = 1; sig < NSIG; sig++) {
+        struct sigaction action;
+        if (sigaction(sig, NULL, &action) != 0) continue;
+        bool handled = action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN;
+        if (handled || sigismember(default_signals, sig) == 1) sigaction(sig, &default_action, NULL);
+    }
+
+    int out_flags = O_WRONLY | O_CREAT | (request->append_output ? O_APPEND : O_TRUNC);
+    bool ready = (request->pgid < 0 || setpgid(0, request->pgid) == 0) &&
+                 (!request->resources || shell_apply_resources(request->resources)) &&
+                 (request->input_fd == -1 || dup2(request->input_fd, STDIN_FILENO) != -1) &&
+                 (request->output_fd == -1 || dup2(request->output_fd, STDOUT_FILENO) != -1) &&
+                 shell_clone_context_fds(request) &&
+                 (!request->input_file || shell_clone_open(request->input_file, O_RDONLY, STDIN_FILENO)) &&
+                 (!request->output_file || shell_clone_open(request->output_file, out_flags, STDOUT_FILENO)) &&
+                 shell_clone_redirect(request);
+
+    if (ready) {
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        execve(path, request->argv, envp);
+    }
+    return errno ? errno : ENOEXEC;
+}
+
+// Child side of the clone backend: it borrows the parent's memory until
+// execve and reports a failure through the shared state
+static int shell_clone_child(void *data) {
+    ShellCloneChild *child = data;
+    if (child->cwd_fd != -1 && fchdir(child->cwd_fd) == -1) {
+        child->error = errno;
+        _exit(127);
+    }
+    child->error = shell_exec_child(child->request, child->path, child->envp, child->default_signals);
+    _exit(127);
+}
+
+// Start a process with clone(CLONE_VM | CLONE_VFORK): the child shares the
+// parent's address space until execve, so the cost does not grow with the
+// size of the parent the way copying page tables for fork does
+static int shell_clone_spawn(ExtendedShellContext *ctx, const char *path, const ShellSpawnRequest *request, char *const envp[], pid_t *pid) {
+    char *stack = mmap(NULL, SHELL_CLONE_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) return errno;
+
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+
+    ShellCloneChild child = { request, path, envp, &ctx->base.signal_mask, ctx->cwd_fd, 0 };
+    pid_t child_pid = clone(shell_clone_child, stack + SHELL_CLONE_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+    int status = child_pid == -1 ? errno : 0;
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    munmap(stack, SHELL_CLONE_STACK_SIZE);
+
+    // By now the child has either called execve or given up
+    if (status == 0 && child.error) {
+        waitpid(child_pid, NULL, 0);
+        status = child.error;
+    }
+    if (status == 0) *pid = child_pid;
+    return status;
+}
+
+// Request sent to a zygote worker. It is followed by the argv and envp
+// arrays and the redirections, whose strings are given as offsets from
+// the start of the request, then the descriptor numbers the received
+// descriptors are installed at, then the strings.
+typedef struct {
+    uint32_t size;
+    int32_t pgid;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t redirection_count;
+    uint32_t target_count;
+    uint32_t path;
+    uint32_t input_file;   // 0 when not redirected
+    uint32_t output_file;  // 0 when not redirected
+    uint32_t append_output;
+    uint32_t has_resources;
+    uint32_t cgroup;  // 0 when no cgroup is joined
+    sigset_t default_signals;
+    ShellSpawnResources resources;
+} ShellZygoteRequest;
+
+// Close every descriptor except the sorted ones in keep
+static void shell_close_other_fds(const int *keep, int count) {
+    struct rlimit limit;
+    int max = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 65536 ? (int)limit.rlim_cur : 65536;
+    int next = 0;
+    for (int i = 0; i <= count; i++) {
+        int last = i < count ? keep[i] - 1 : max - 1;
+#ifdef SYS_close_range
+        if (last >= next && syscall(SYS_close_range, (unsigned)next, i < count ? (unsigned)last : ~0u, 0) == 0) last = -1;
+#endif
+        for (int fd = next; fd <= last; fd++) close(fd);
+        if (i < count) next = keep[i] + 1;
+    }
+}
+
+// Worker of the zygote: a child of the shell that waits for one request,
+// sets up its descriptors and becomes the command. It runs in a copy of the
+// shell forked from a possibly threaded process, so it sticks to system
+// calls. The descriptors arrive as the report pipe, the working directory
+// and then the ones to install; the pid and, if the command could not be
+// started, an errno value are written to the report pipe.
+static void shell_zygote_worker(int socket, int control, int workers_fd, char *buffer) {
+    pid_t self = (pid_t)syscall(SYS_getpid);
+    bool published = write(workers_fd, &self, sizeof(self)) == sizeof(self);
+    close(workers_fd);
+    if (!published) _exit(0);
+
+    int fds[SHELL_ZYGOTE_MAX_FDS + 2];
+    char control_buffer[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { buffer, SHELL_ZYGOTE_MESSAGE_MAX };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control_buffer;
+    message.msg_controllen = sizeof(control_buffer);
+
+    ssize_t n;
+    do {
+        n = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+
+    // The end of the socket means the shell stopped using the helper
+    if (write(control, n > 0 ? "u" : "q", 1) != 1 || n <= 0) _exit(0);
+    close(socket);
+    close(control);
+
+    size_t fd_count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (fd_count + count > SHELL_ZYGOTE_MAX_FDS + 2) _exit(127);
+        memcpy(fds + fd_count, CMSG_DATA(cmsg), count * sizeof(int));
+        fd_count += count;
+    }
+
+    ShellZygoteRequest *request = (ShellZygoteRequest *)buffer;
+    if ((size_t)n < sizeof(ShellZygoteRequest) || request->size != (size_t)n || fd_count != request->target_count + 2) _exit(127);
+
+    uintptr_t *argv = (uintptr_t *)(request + 1);
+    uintptr_t *envp = argv + request->argc + 1;
+    ShellRedirection *redirections = (ShellRedirection *)(envp + request->envc + 1);
+    int32_t *targets = (int32_t *)(redirections + request->redirection_count);
+    for (uint32_t i = 0; i < request->argc; i++) argv[i] += (uintptr_t)buffer;
+    for (uint32_t i = 0; i < request->envc; i++) envp[i] += (uintptr_t)buffer;
+    for (uint32_t i = 0; i < request->redirection_count; i++) {
+        if (redirections[i].path) redirections[i].path = buffer + (uintptr_t)redirections[i].path;
+    }
+
+    // Move what arrived above every target before installing it
+    int top = 0;
+    for (size_t i = 0; i < fd_count; i++) top = fds[i] > top ? fds[i] : top;
+    for (uint32_t i = 0; i < request->target_count; i++) top = targets[i] > top ? targets[i] : top;
+    for (size_t i = 0; i < fd_count; i++) {
+        int moved = fcntl(fds[i], F_DUPFD_CLOEXEC, top + 1);
+        close(fds[i]);
+        if (moved == -1) _exit(127);
+        fds[i] = moved;
+    }
+
+    int report = fds[0];
+    if (write(report, &self, sizeof(self)) != sizeof(self)) _exit(127);
+
+    int error = 0;
+    for (uint32_t i = 0; i < request->target_count && !error; i++) {
+        if (dup2(fds[i + 2], targets[i]) == -1) error = errno;
+        close(fds[i + 2]);
+    }
+    if (!error && fchdir(fds[1]) == -1) error = errno;
+    close(fds[1]);
+
+    // Signals that arrived while the worker was idle are not the command's
+    sigset_t pending;
+    if (sigpending(&pending) == 0) {
+        struct sigaction ignore;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        for (int sig = 1; sig < NSIG; sig++) {
+            struct sigaction old;
+            if (sigismember(&pending, sig) != 1 || sigaction(sig, &ignore, &old) != 0) continue;
+            sigaction(sig, &old, NULL);
+        }
+    }
+
+    if (!error) {
+        request->resources.cgroup = request->cgroup ? buffer + request->cgroup : NULL;
+        ShellSpawnRequest spawn = { (char *const *)argv, (char *const *)envp, -1, -1,
+                                    request->input_file ? buffer + request->input_file : NULL,
+                                    request->output_file ? buffer + request->output_file : NULL,
+                                    request->append_output != 0, redirections, request->redirection_count, request->pgid,
+                                    request->has_resources ? &request->resources : NULL, NULL };
+        error = shell_exec_child(&spawn, buffer + request->path, (char *const *)envp, &request->default_signals);
+    }
+    ssize_t written = write(report, &error, sizeof(error));
+    (void)written;
+    _exit(127);
+}
+
+// Main loop of the zygote helper: keep the pool of idle workers full. The
+// workers are started with CLONE_PARENT, so the commands they become are
+// children of the shell, which waits for them as for any other. Each worker
+// tells the helper through control when it takes a request.
+static void shell_zygote_main(int socket, int control[2], int workers_fd, int workers, char *buffer) {
+    int keep[4] = { socket, control[0], control[1], workers_fd };
+    for (int i = 1; i < 4; i++) {
+        for (int j = i; j > 0 && keep[j - 1] > keep[j]; j--) {
+            int swap = keep[j];
+            keep[j] = keep[j - 1];
+            keep[j - 1] = swap;
+        }
+    }
+    shell_close_other_fds(keep, 4);
+
+    int idle = 0;
+    while (true) {
+        while (idle < workers) {
+            pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+            if (pid == 0) {
+                close(control[0]);
+                shell_zygote_worker(socket, control[1], workers_fd, buffer);
+            }
+            if (pid != -1) {
+                idle++;
+            } else if (idle > 0) {
+                break;
+            } else {
+                // Without any worker a request would wait forever, so retry
+                struct timespec delay = { 0, 10000000 };
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        char event;
+        ssize_t n = read(control[0], &event, 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0 || event == 'q') _exit(0);
+        idle--;
+    }
+}
+
+// Take the pids of newly started workers from the helper's pipe
+static void shell_zygote_collect(ExtendedShellContext *ctx) {
+    ShellZygote *zygote = &ctx->zygote;
+    pid_t pids[64];
+    ssize_t n;
+    while ((n = read(zygote->workers_fd, pids, sizeof(pids))) > 0) {
+        size_t count = (size_t)n / sizeof(pid_t);
+        if (zygote->idle_count + count > zygote->idle_capacity) {
+            size_t capacity = zygote->idle_capacity ? zygote->idle_capacity * 2 : 16;
+            while (capacity < zygote->idle_count + count) capacity *= 2;
+            pid_t *idle = realloc(zygote->idle, capacity * sizeof(pid_t));
+            if (!idle) return;
+            zygote->idle = idle;
+            zygote->idle_capacity = capacity;
+        }
+        memcpy(zygote->idle + zygote->idle_count, pids, count * sizeof(pid_t));
+        zygote->idle_count += count;
+    }
+}
+
+// Stop the zygote helper and reap its idle workers. With the helper gone
+// no worker can start, and the pipe ends once every worker has written its
+// pid and closed it.
+static void shell_zygote_stop(ExtendedShellContext *ctx) {
+    ShellZygote *zygote = &ctx->zygote;
+    if (zygote->pid <= 0) return;
+
+    kill(zygote->pid, SIGKILL);
+    while (waitpid(zygote->pid, NULL, 0) == -1 && errno == EINTR) {}
+    fcntl(zygote->workers_fd, F_SETFL, 0);
+    shell_zygote_collect(ctx);
+    close(zygote->socket);
+
+    for (size_t i = 0; i < zygote->idle_count; i++) {
+        kill(zygote->idle[i], SIGKILL);
+        while (waitpid(zygote->idle[i], NULL, 0) == -1 && errno == EINTR) {}
+    }
+    close(zygote->workers_fd);
+    free(zygote->idle);
+    zygote->pid = 0;
+    zygote->socket = -1;
+    zygote->workers_fd = -1;
+    zygote->idle = NULL;
+    zygote->idle_count = 0;
+    zygote->idle_capacity = 0;
+}
+
+// Fork the zygote helper. It is a copy of the shell as it is now, so it
+// costs least started early, before the host process grows.
+static ShellError shell_zygote_start(ExtendedShellContext *ctx, int workers) {
+    shell_zygote_stop(ctx);
+
+    int sockets[2];
+    int control[2];
+    int pids[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) return SHELL_ERROR_EXECUTION_FAILED;
+    if (pipe2(control, O_CLOEXEC) == -1) {
+        close(sockets[0]);
+        close(sockets[1]);
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+    if (pipe2(pids, O_CLOEXEC) == -1) {
+        close(sockets[0]);
+        close(sockets[1]);
+        close(control[0]);
+        close(control[1]);
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+
+    // The buffer the workers receive into is allocated before the fork, so
+    // the helper allocates nothing; every signal stays blocked in it
+    char *buffer = mmap(NULL, SHELL_ZYGOTE_MESSAGE_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    pid_t pid = buffer != MAP_FAILED ? fork() : -1;
+    if (pid == 0) shell_zygote_main(sockets[1], control, pids[1], workers, buffer);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (buffer != MAP_FAILED) munmap(buffer, SHELL_ZYGOTE_MESSAGE_MAX);
+    close(sockets[1]);
+    close(control[0]);
+    close(control[1]);
+    close(pids[1]);
+    if (pid == -1) {
+        close(sockets[0]);
+        close(pids[0]);
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+
+    fcntl(pids[0], F_SETFL, O_NONBLOCK);
+    ctx->zygote = (ShellZygote){ pid, sockets[0], pids[0], workers, NULL, 0, 0 };
+    return SHELL_OK;
+}
+
+// Read exactly length bytes unless the other end closes first
+static size_t shell_read_full(int fd, void *data, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, (char *)data + done, length - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+// Append a string to a zygote request and return its offset
+static uint32_t shell_zygote_string(char *message, size_t *end, const char *text) {
+    size_t length = strlen(text) + 1;
+    memcpy(message + *end, text, length);
+    uint32_t offset = (uint32_t)*end;
+    *end += length;
+    return offset;
+}
+
+// Start a process through an idle zygote worker. The request carries the
+// command and its redirections, and the descriptors the child starts with
+// travel with it as SCM_RIGHTS: its standard streams, any descriptor a
+// redirection copies, and the current directory. Returns -1 when the
+// request does not fit or the helper is gone, so another backend can
+// start the process instead.
+static int shell_zygote_spawn(ExtendedShellContext *ctx, const char *path, const ShellSpawnRequest *request, char *const envp[], pid_t *pid) {
+    ShellZygote *zygote = &ctx->zygote;
+    if (zygote->pid <= 0) return -1;
+
+    int targets[SHELL_ZYGOTE_MAX_FDS];
+    int fds[SHELL_ZYGOTE_MAX_FDS + 2];
+    size_t target_count = 0;
+    // The standard streams, and whatever else of 0-9 the context has
+    // replaced, go to the worker; a descriptor not sent is closed there
+    for (int fd = 0; fd < SHELL_CONTEXT_FDS; fd++) {
+        int source = fd == STDIN_FILENO && request->input_fd != -1    ? request->input_fd
+                     : fd == STDOUT_FILENO && request->output_fd != -1 ? request->output_fd
+                     : request->fds                                   ? request->fds[fd]
+                                                                      : fd;
+        if ((fd > STDERR_FILENO && source == fd) || source < 0 || fcntl(source, F_GETFD) == -1) continue;
+        if (target_count == SHELL_ZYGOTE_MAX_FDS) return -1;
+        targets[target_count] = fd;
+        fds[2 + target_count++] = source;
+    }
+    for (size_t i = 0; i < request->redirection_count; i++) {
+        int source = request->redirections[i].source;
+        int local = request->fds && source < SHELL_CONTEXT_FDS && source >= 0 ? request->fds[source] : source;
+        if (request->redirections[i].path || local < 0 || fcntl(local, F_GETFD) == -1) continue;
+        bool known = false;
+        for (size_t j = 0; j < target_count && !known; j++) known = targets[j] == source;
+        if (known) continue;
+        if (target_count == SHELL_ZYGOTE_MAX_FDS) return -1;
+        targets[target_count] = source;
+        fds[2 + target_count++] = local;
+    }
+
+    size_t argc = 0;
+    size_t envc = 0;
+    size_t strings = strlen(path) + 1;
+    for (; request->argv[argc]; argc++) strings += strlen(request->argv[argc]) + 1;
+    for (; envp[envc]; envc++) strings += strlen(envp[envc]) + 1;
+    if (request->input_file) strings += strlen(request->input_file) + 1;
+    if (request->output_file) strings += strlen(request->output_file) + 1;
+    if (request->resources && request->resources->cgroup) strings += strlen(request->resources->cgroup) + 1;
+    for (size_t i = 0; i < request->redirection_count; i++) {
+        if (request->redirections[i].path) strings += strlen(request->redirections[i].path) + 1;
+    }
+    size_t size = sizeof(ShellZygoteRequest) + (argc + envc + 2) * sizeof(uintptr_t) +
+                  request->redirection_count * sizeof(ShellRedirection) + target_count * sizeof(int32_t) + strings;
+    if (size > SHELL_ZYGOTE_MESSAGE_MAX) return -1;
+
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    char *message = shell_arena_alloc(&ctx->arena, size);
+    if (!message) return -1;
+
+    ShellZygoteRequest *header = (ShellZygoteRequest *)message;
+    uintptr_t *argv = (uintptr_t *)(header + 1);
+    uintptr_t *envv = argv + argc + 1;
+    ShellRedirection *redirections = (ShellRedirection *)(envv + envc + 1);
+    int32_t *numbers = (int32_t *)(redirections + request->redirection_count);
+    size_t end = (size_t)((char *)(numbers + target_count) - message);
+
+    static const ShellSpawnResources no_resources;
+    *header = (ShellZygoteRequest){ (uint32_t)size, request->pgid, (uint32_t)argc, (uint32_t)envc,
+                                    (uint32_t)request->redirection_count, (uint32_t)target_count, 0, 0, 0,
+                                    request->append_output, request->resources != NULL, 0, ctx->base.signal_mask,
+                                    request->resources ? *request->resources : no_resources };
+    header->path = shell_zygote_string(message, &end, path);
+    header->resources.cgroup = NULL;
+    if (request->resources && request->resources->cgroup) {
+        header->cgroup = shell_zygote_string(message, &end, request->resources->cgroup);
+    }
+    for (size_t i = 0; i < argc; i++) argv[i] = shell_zygote_string(message, &end, request->argv[i]);
+    argv[argc] = 0;
+    for (size_t i = 0; i < envc; i++) envv[i] = shell_zygote_string(message, &end, envp[i]);
+    envv[envc] = 0;
+    if (request->input_file) header->input_file = shell_zygote_string(message, &end, request->input_file);
+    if (request->output_file) header->output_file = shell_zygote_string(message, &end, request->output_file);
+    for (size_t i = 0; i < request->redirection_count; i++) {
+        redirections[i] = request->redirections[i];
+        if (redirections[i].path) {
+            redirections[i].path = (const char *)(uintptr_t)shell_zygote_string(message, &end, request->redirections[i].path);
+        }
+    }
+    for (size_t i = 0; i < target_count; i++) numbers[i] = targets[i];
+
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) == -1) {
+        shell_arena_release(&ctx->arena, mark);
+        return -1;
+    }
+    fds[0] = report[1];
+    fds[1] = openat(shell_dir_fd(ctx), ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fds[1] == -1) {
+        close(report[0]);
+        close(report[1]);
+        shell_arena_release(&ctx->arena, mark);
+        return -1;
+    }
+
+    char control_buffer[CMSG_SPACE(sizeof(fds))];
+    memset(control_buffer, 0, sizeof(control_buffer));
+    struct iovec iov = { message, size };
+    struct msghdr packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.msg_iov = &iov;
+    packet.msg_iovlen = 1;
+    packet.msg_control = control_buffer;
+    packet.msg_controllen = CMSG_SPACE((target_count + 2) * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&packet);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN((target_count + 2) * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, (target_count + 2) * sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(zygote->socket, &packet, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    close(report[1]);
+    close(fds[1]);
+    shell_arena_release(&ctx->arena, mark);
+
+    // The worker reports its pid, then an errno value unless execve closed
+    // the pipe; a request dropped unread ends the pipe at once
+    pid_t child = 0;
+    int error = 0;
+    bool started = sent == (ssize_t)size && shell_read_full(report[0], &child, sizeof(child)) == sizeof(child);
+    bool failed = started && shell_read_full(report[0], &error, sizeof(error)) == sizeof(error);
+    close(report[0]);
+
+    shell_zygote_collect(ctx);
+    for (size_t i = 0; started && i < zygote->idle_count; i++) {
+        if (zygote->idle[i] != child) continue;
+        zygote->idle[i] = zygote->idle[--zygote->idle_count];
+        break;
+    }
+    if (!started) return -1;
+    if (failed) {
+        waitpid(child, NULL, 0);
+        return error;
+    }
+    *pid = child;
+    return 0;
+}
+#else
+static void shell_zygote_stop(ExtendedShellContext *ctx) {
+    (void)ctx;
+}
+#endif
+
+// Start a process at a resolved path with the configured backend
+static int shell_spawn_path(ExtendedShellContext *ctx, const char *path, const ShellSpawnRequest *request, char *const envp[], pid_t *pid) {
+#ifdef __linux__
+    if (ctx->spawn_backend == SHELL_SPAWN_ZYGOTE) {
+        int status = shell_zygote_spawn(ctx, path, request, envp, pid);
+        if (status != -1) return status;
+    }
+    // posix_spawn has no attributes for placement and limits
+    if (ctx->spawn_backend != SHELL_SPAWN_POSIX || request->resources || (!SHELL_SPAWN_FCHDIR && ctx->cwd_fd != -1)) {
+        return shell_clone_spawn(ctx, path, request, envp, pid);
+    }
+#else
+    if (request->resources || (!SHELL_SPAWN_FCHDIR && ctx->cwd_fd != -1)) return ENOTSUP;
+#endif
+    return shell_posix_spawn(ctx, path, request, envp, pid);
+}
+
+// Spawn a single process; returns 0 or an errno value
+static int shell_spawn_process(ExtendedShellContext *ctx, const ShellSpawnRequest *request, pid_t *pid) {
+    // Spawn the resolved path directly instead of letting posix_spawnp probe PATH
+    char *const *argv = request->argv;
+    char *const *envp = request->envp ? request->envp : shell_environment(ctx);
+
+    // A process without placement and limits of its own gets the defaults,
+    // and one of a context with replaced descriptors gets those
+    ShellSpawnRequest defaulted = *request;
+    if (!request->resources && ctx->spawn_resources) defaulted.resources = ctx->spawn_resources;
+    int fds[SHELL_CONTEXT_FDS];
+    for (int fd = 0; fd < SHELL_CONTEXT_FDS && !request->fds; fd++) {
+        fds[fd] = shell_context_fd(&ctx->base, fd);
+        if (fds[fd] != fd) defaulted.fds = fds;
+    }
+    request = &defaulted;
+    const char *path = shell_resolve_command(ctx, argv[0]);
+    int status = path ? shell_spawn_path(ctx, path, request, envp, pid) : ENOENT;
+
+    // A cached path may have gone stale, so search PATH once more
+    if (status == ENOENT && path && path != argv[0]) {
+        shell_forget_command_path(ctx, argv[0]);
+        path = shell_resolve_command(ctx, argv[0]);
+        status = path ? shell_spawn_path(ctx, path, request, envp, pid) : ENOENT;
+    }
+    return status;
+}
+
+// Choose how external commands are started. The clone and zygote backends
+// are only available on Linux; choosing the zygote starts its helper when
+// it is not running yet, and choosing another backend stops it.
+ShellError shell_set_spawn_backend(ExtendedShellContext *ctx, ShellSpawnBackend backend) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+#ifdef __linux__
+    bool supported = backend == SHELL_SPAWN_POSIX || backend == SHELL_SPAWN_CLONE || backend == SHELL_SPAWN_ZYGOTE;
+    if (supported && backend != SHELL_SPAWN_ZYGOTE) {
+        shell_zygote_stop(ctx);
+    } else if (supported && ctx->zygote.pid <= 0 && shell_zygote_start(ctx, SHELL_ZYGOTE_WORKERS) != SHELL_OK) {
+        ctx->base.last_error = SHELL_ERROR_EXECUTION_FAILED;
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+#else
+    bool supported = backend == SHELL_SPAWN_POSIX;
+#endif
+    if (!supported) {
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    ctx->spawn_backend = backend;
+    return SHELL_OK;
+}
+
+// Set the placement and limits every spawned process starts with, or clear
+// them with NULL. The structure and its cgroup path are copied. Only Linux
+// can apply them.
+ShellError shell_set_spawn_resources(ExtendedShellContext *ctx, const ShellSpawnResources *resources) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+#ifdef __linux__
+    bool supported = !resources || resources->limit_count <= SHELL_MAX_RESOURCE_LIMITS;
+#else
+    bool supported = !resources;
+#endif
+    if (!supported) {
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    ShellSpawnResources *copy = NULL;
+    if (resources) {
+        size_t cgroup_size = resources->cgroup ? strlen(resources->cgroup) + 1 : 0;
+        copy = malloc(sizeof(ShellSpawnResources) + cgroup_size);
+        if (!copy) {
+            ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+            return SHELL_ERROR_MEMORY_ALLOCATION;
+        }
+        *copy = *resources;
+        if (resources->cgroup) copy->cgroup = memcpy(copy + 1, resources->cgroup, cgroup_size);
+    }
+
+    free(ctx->spawn_resources);
+    ctx->spawn_resources = copy;
+    return SHELL_OK;
+}
+
+// Start the zygote helper with the given number of idle workers and make
+// it the spawn backend. Call it early, right after shell_init, while the
+// host is small: the helper is a copy of it and so are its workers.
+ShellError shell_start_zygote(ExtendedShellContext *ctx, int workers) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+#ifdef __linux__
+    if (workers <= 0) {
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+    if (shell_zygote_start(ctx, workers) != SHELL_OK) {
+        ctx->base.last_error = SHELL_ERROR_EXECUTION_FAILED;
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+    ctx->spawn_backend = SHELL_SPAWN_ZYGOTE;
+    return SHELL_OK;
+#else
+    (void)workers;
+    ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+    return SHELL_ERROR_INVALID_INPUT;
+#endif
+}
+
+// Keep a descriptor, and the process behind it, until the command that
+// uses it has run. Takes ownership of fd even on failure.
+static bool shell_add_temporary(ExtendedShellContext *ctx, int fd, pid_t pid) {
+    if (ctx->temporary_count == ctx->temporary_capacity) {
+        size_t capacity = ctx->temporary_capacity ? ctx->temporary_capacity * 2 : 8;
+        ShellTemporary *temporaries = realloc(ctx->temporaries, capacity * sizeof(ShellTemporary));
+        if (!temporaries) {
+            close(fd);
+            return false;
+        }
+        ctx->temporaries = temporaries;
+        ctx->temporary_capacity = capacity;
+    }
+    ctx->temporaries[ctx->temporary_count++] = (ShellTemporary){ fd, pid };
+    return true;
+}
+
+// Close the temporaries added since mark, then wait for their processes.
+// Every descriptor goes first: a process substitution only finishes once
+// the shell's end of its pipe is closed.
+static void shell_release_temporaries(ExtendedShellContext *ctx, size_t mark) {
+    for (size_t i = mark; i < ctx->temporary_count; i++) {
+        if (ctx->temporaries[i].fd != -1) close(ctx->temporaries[i].fd);
+    }
+    for (size_t i = mark; i < ctx->temporary_count; i++) {
+        if (ctx->temporaries[i].pid <= 0) continue;
+        while (waitpid(ctx->temporaries[i].pid, NULL, 0) == -1 && errno == EINTR) {}
+    }
+    ctx->temporary_count = mark;
+}
+
+// Move a descriptor the shell keeps for itself above 0-9, so copying a
+// context's descriptors into place in a child cannot overwrite it
+static int shell_fd_above_context(int fd) {
+    if (fd < 0 || fd >= SHELL_CONTEXT_FDS) return fd;
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_CONTEXT_FDS);
+    close(fd);
+    return moved;
+}
+
+// Descriptor reading the given text from its start, for a here-document or
+// here-string. The text goes into a memfd, so nothing touches the file
+// system; without memfd_create, text that fits is written into a pipe.
+static int shell_open_document(const char *text, size_t length) {
+    int fd = memfd_create("shell-document", MFD_CLOEXEC);
+    if (fd != -1) {
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n = write(fd, text + written, length - written);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                close(fd);
+                return -1;
+            }
+            written += (size_t)n;
+        }
+        if (lseek(fd, 0, SEEK_SET) == -1) {
+            close(fd);
+            return -1;
+        }
+        return shell_fd_above_context(fd);
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) return -1;
+    int size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+    if (size < 0 || length > (size_t)size || (length && write(pipe_fds[1], text, length) != (ssize_t)length)) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    close(pipe_fds[1]);
+    return shell_fd_above_context(pipe_fds[0]);
+}
+
+// Every redirection of a stage in the order it applies: the input and
+// output files first, then the redirection list. The list is used as it is
+// when the stage has no files; otherwise a combined copy goes in the arena.
+static bool shell_stage_redirections(ExtendedShellContext *ctx, const ShellPipelineStage *stage, const ShellRedirection **out, size_t *count) {
+    size_t files = (stage->input_file != NULL) + (stage->output_file != NULL);
+    *out = stage->redirections;
+    *count = stage->redirection_count;
+    if (files == 0) return true;
+
+    ShellRedirection *all = shell_arena_alloc(&ctx->arena, (files + stage->redirection_count) * sizeof(ShellRedirection));
+    if (!all) return false;
+
+    size_t n = 0;
+    if (stage->input_file) all[n++] = (ShellRedirection){ STDIN_FILENO, stage->input_file, O_RDONLY, -1 };
+    if (stage->output_file) {
+        int flags = O_WRONLY | O_CREAT | (stage->append_output ? O_APPEND : O_TRUNC);
+        all[n++] = (ShellRedirection){ STDOUT_FILENO, stage->output_file, flags, -1 };
+    }
+    if (stage->redirection_count) memcpy(all + n, stage->redirections, stage->redirection_count * sizeof(ShellRedirection));
+
+    *out = all;
+    *count = n + stage->redirection_count;
+    return true;
+}
+
+// Stream command or built-in running as a stage of a pipeline.
+// Descriptors in owned are closed by the shell once the stage returns.
+typedef struct {
+    ExtendedShellContext *ctx;
+    ShellCommand *command;
+    char **argv;
+    int argc;
+    ShellIO io;
+    int *owned;
+    size_t owned_count;
+    pthread_t thread;
+    bool threaded;
+    int status;           // exit status of the stage
+    struct rusage usage;  // CPU time of the stage while profiling
+} ShellStreamStage;
+
+// Run a stream stage. SIGPIPE is blocked meanwhile and any that was raised
+// is discarded, so a reader that went away shows up as EPIPE instead of
+// killing the shell. A built-in gets the stage's streams as its 0-2.
+static void *shell_run_stream_stage(void *data) {
+    ShellStreamStage *stage = data;
+    sigset_t pipe_mask;
+    sigset_t old_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, &old_mask);
+
+    struct rusage before;
+    if (stage->ctx->profiling) shell_thread_usage(&before);
+    if (stage->command->kind == SHELL_COMMAND_BUILTIN) {
+        ShellStageView view = shell_stage_view;
+        shell_stage_view = (ShellStageView){ &stage->ctx->base, { stage->io.input, stage->io.output, stage->io.error } };
+        stage->status = stage->command->builtin(stage->ctx, stage->argc, stage->argv);
+        shell_stage_view = view;
+    } else {
+        stage->status = stage->command->stream(&stage->ctx->base, &stage->io, stage->argc, stage->argv) == SHELL_OK ? 0 : 1;
+    }
+    if (stage->ctx->profiling) shell_usage_since(&before, &stage->usage);
+
+    struct timespec poll_only = { 0, 0 };
+    while (sigtimedwait(&pipe_mask, NULL, &poll_only) > 0) {
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    for (size_t i = 0; i < stage->owned_count; i++) close(stage->owned[i]);
+    return NULL;
+}
+
+// Wait until the processes of a foreground job exit or one of them stops.
+// Reaped pids are cleared from pids, and their resource use is stored in
+// usages unless it is NULL; returns true if the job stopped.
+static bool shell_wait_foreground(ExtendedShellContext *ctx, pid_t pgid, pid_t *pids, int count, struct rusage *usages) {
+    int remaining = count;
+
+    while (remaining > 0) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(pgid > 0 ? -pgid : pids[0], &status, ctx->job_control ? WUNTRACED : 0, &usage);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (WIFSTOPPED(status)) {
+            ctx->base.exit_status = shell_exit_status(status);
+            return true;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (pids[i] != pid) continue;
+            pids[i] = 0;
+            remaining--;
+            if (usages) usages[i] = usage;
+            // The exit status of a pipeline is that of its last stage
+            if (i == count - 1) ctx->base.exit_status = shell_exit_status(status);
+            break;
+        }
+    }
+
+    return false;
+}
+
+// Set up a stream command or built-in as stage of a pipeline. Descriptors
+// it does not use because of its own redirections are closed right away;
+// the others are closed when the stage finishes.
+static bool shell_setup_stream_stage(ExtendedShellContext *ctx, ShellStreamStage *stream, ShellCommand *command,
+                                     const ShellPipelineStage *stage, int input, int output) {
+    const ShellRedirection *redirections;
+    size_t count;
+    int *owned = shell_stage_redirections(ctx, stage, &redirections, &count) ? shell_arena_alloc(&ctx->arena, (count + 2) * sizeof(int)) : NULL;
+    if (!owned) {
+        if (input != -1) close(input);
+        if (output != -1) close(output);
+        return false;
+    }
+
+    size_t owned_count = 0;
+    if (input != -1) owned[owned_count++] = input;
+    if (output != -1) owned[owned_count++] = output;
+
+    // The pipe ends, then the redirections in order; a closed stream reads
+    // from or writes to /dev/null instead
+    int io[3] = { input != -1 ? input : shell_context_fd(&ctx->base, STDIN_FILENO),
+                  output != -1 ? output : shell_context_fd(&ctx->base, STDOUT_FILENO), shell_context_fd(&ctx->base, STDERR_FILENO) };
+    bool opened = true;
+    for (size_t i = 0; opened && i < count; i++) {
+        const ShellRedirection *redirection = &redirections[i];
+        if (!redirection->path && redirection->source == redirection->fd) {
+            // Keeping a descriptor open across exec means nothing in process
+        } else if (redirection->fd > STDERR_FILENO) {
+            shell_printf(&ctx->base, STDERR_FILENO, "%s: %d: cannot redirect a stream command's descriptor\n", stage->argv[0], redirection->fd);
+            opened = false;
+        } else if (redirection->path || redirection->source == -1) {
+            const char *path = redirection->path ? redirection->path : "/dev/null";
+            int fd = openat(shell_dir_fd(ctx), path, (redirection->path ? redirection->flags : O_RDWR) | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                shell_printf(&ctx->base, STDERR_FILENO, "%s: %s\n", path, strerror(errno));
+                opened = false;
+            } else {
+                owned[owned_count++] = fd;
+                io[redirection->fd] = fd;
+            }
+        } else {
+            io[redirection->fd] = redirection->source <= STDERR_FILENO ? io[redirection->source]
+                                                                      : shell_context_fd(&ctx->base, redirection->source);
+        }
+    }
+
+    // Pipe ends that were redirected away are closed right away
+    size_t kept = 0;
+    for (size_t i = 0; i < owned_count; i++) {
+        bool used = opened && (owned[i] == io[0] || owned[i] == io[1] || owned[i] == io[2]);
+        if (used) {
+            owned[kept++] = owned[i];
+        } else {
+            close(owned[i]);
+        }
+    }
+    if (!opened) return false;
+
+    stream->ctx = ctx;
+    stream->command = command;
+    stream->argv = stage->argv;
+    stream->argc = 0;
+    while (stage->argv[stream->argc]) stream->argc++;
+    stream->owned = owned;
+    stream->owned_count = kept;
+    stream->io = (ShellIO){ io[0], io[1], io[2] };
+    stream->threaded = false;
+    stream->status = 0;
+    return true;
+}
+
+// Refuse the stages of a command line that the shell cannot launch with
+// a message, returning false. Functions and custom commands run on the
+// shell's own thread and descriptors, so only alone in the foreground;
+// stream commands run on threads of the shell, so not in a background job
+// or under pin, which need a process of their own. Looking any of them up
+// in PATH instead would run some other command or none. Built-in stages
+// of a foreground pipeline run on threads of the shell too, and only one
+// of them may be a built-in that is not shareable, as nothing keeps two
+// of those from changing the context at once.
+static bool shell_check_launchable(ExtendedShellContext *ctx, const ShellPipelineStage *stages, size_t stage_count, bool background) {
+    const char *unshared = NULL;
+    for (size_t i = 0; i < stage_count; i++) {
+        ShellCommand *entry = stages[i].argv[0] ? shell_lookup_command(ctx, stages[i].argv[0]) : NULL;
+        bool stream = entry && entry->kind == SHELL_COMMAND_STREAM;
+        bool in_process = !background && !stages[i].resources;
+        if (entry && entry->kind == SHELL_COMMAND_BUILTIN && in_process && !entry->shareable) {
+            if (unshared) {
+                shell_printf(&ctx->base, STDERR_FILENO, "%s: cannot run in a pipeline with %s\n", stages[i].argv[0], unshared);
+                ctx->base.exit_status = 1;
+                return false;
+            }
+            unshared = stages[i].argv[0];
+        }
+        if (!entry || (stream && in_process) ||
+            (!stream && entry->kind != SHELL_COMMAND_FUNCTION && entry->kind != SHELL_COMMAND_CUSTOM)) {
+            continue;
+        }
+
+        const char *where = stages[i].resources ? "under pin" : background ? "in the background" : "in a pipeline";
+        shell_printf(&ctx->base, STDERR_FILENO, "%s: cannot run %s\n", stages[i].argv[0], where);
+        ctx->base.exit_status = 1;
+        return false;
+    }
+    return true;
+}
+
+// Spawn every stage of a pipeline concurrently, connected by pipes, then
+// either wait for it in the foreground or record it as a background job.
+// Stream commands and built-ins of a foreground job run in the shell
+// process instead of being spawned: once every stage is set up, each one
+// but the last starts on a thread of its own, so the shell's state is no
+// longer touched by this thread while they run. The processes of
+// temporaries from index temporaries on belong to the pipeline, and join
+// its job when it runs in the background.
+static ShellError shell_launch_pipeline(ExtendedShellContext *ctx, const ShellPipelineStage *stages, int stage_count, bool background, const char *command, size_t temporaries) {
+    for (int i = 0; i < stage_count; i++) {
+        if (!stages[i].argv || !stages[i].argv[0]) {
+            ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+            return SHELL_ERROR_INVALID_INPUT;
+        }
+    }
+
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    pid_t *pids = shell_arena_alloc(&ctx->arena, (size_t)stage_count * sizeof(pid_t));
+    ShellStreamStage *streams = shell_arena_alloc(&ctx->arena, (size_t)stage_count * sizeof(ShellStreamStage));
+    if (!pids || !streams) {
+        shell_arena_release(&ctx->arena, mark);
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    int stream_count = 0;
+    bool last_is_stream = false;
+    fflush(stdout);
+
+    // While profiling, remember which stage each process runs, how long it
+    // took to spawn and what it used
+    bool profiling = ctx->profiling && !background;
+    uint64_t started = profiling ? shell_clock_ns() : 0;
+    int *spawned_stages = NULL;
+    uint64_t *spawn_ns = NULL;
+    struct rusage *usages = NULL;
+    if (profiling) {
+        spawned_stages = shell_arena_alloc(&ctx->arena, (size_t)stage_count * sizeof(int));
+        spawn_ns = shell_arena_alloc(&ctx->arena, (size_t)stage_count * sizeof(uint64_t));
+        usages = shell_arena_alloc(&ctx->arena, (size_t)stage_count * sizeof(struct rusage));
+        profiling = spawned_stages && spawn_ns && usages;
+        if (usages) memset(usages, 0, (size_t)stage_count * sizeof(struct rusage));
+    }
+
+    // Pipelines, background jobs and anything run under job control get
+    // their own process group
+    pid_t pgid = (stage_count > 1 || background || ctx->job_control) ? 0 : -1;
+    ShellError result = SHELL_OK;
+    int spawn_error = 0;
+    int failed = 0;
+    int spawned = 0;
+    int prev_read = -1;
+
+    for (int i = 0; i < stage_count; i++) {
+        int pipe_fds[2] = {-1, -1};
+
+        // Every stage but the last writes into a fresh pipe
+        if (i < stage_count - 1 && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            spawn_error = errno;
+            failed = i;
+            result = SHELL_ERROR_PIPELINE_FAILED;
+            break;
+        }
+
+        // Stream commands and built-ins of a foreground job run in the
+        // shell process and take over the pipe ends
+        ShellCommand *entry = shell_lookup_command(ctx, stages[i].argv[0]);
+        bool in_process = entry && (entry->kind == SHELL_COMMAND_STREAM || entry->kind == SHELL_COMMAND_BUILTIN);
+        if (in_process && !background && !stages[i].resources) {
+            bool last = i == stage_count - 1;
+            if (!shell_setup_stream_stage(ctx, &streams[stream_count], entry, &stages[i], prev_read, pipe_fds[1])) {
+                if (pipe_fds[0] != -1) close(pipe_fds[0]);
+                prev_read = -1;
+                spawn_error = 0;
+                result = stage_count > 1 ? SHELL_ERROR_PIPELINE_FAILED : SHELL_ERROR_EXECUTION_FAILED;
+                break;
+            }
+            if (profiling) memset(&streams[stream_count].usage, 0, sizeof(struct rusage));
+            stream_count++;
+            last_is_stream = last;
+            prev_read = pipe_fds[0];
+            continue;
+        }
+
+        // Wire the pipe ends onto stdin/stdout
+        ShellSpawnRequest request = { stages[i].argv, stages[i].envp, prev_read, pipe_fds[1],
+                                      stages[i].input_file, stages[i].output_file, stages[i].append_output,
+                                      stages[i].redirections, stages[i].redirection_count, pgid, stages[i].resources, NULL };
+        pid_t pid;
+        uint64_t spawn_started = profiling ? shell_clock_ns() : 0;
+        int status = shell_spawn_process(ctx, &request, &pid);
+        if (profiling && status == 0) {
+            spawned_stages[spawned] = i;
+            spawn_ns[spawned] = shell_clock_ns() - spawn_started;
+        }
+
+        // The children hold their own copies of the pipe ends now
+        if (prev_read != -1) close(prev_read);
+        if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        prev_read = pipe_fds[0];
+
+        if (status != 0) {
+            spawn_error = status;
+            failed = i;
+            result = stage_count > 1 ? SHELL_ERROR_PIPELINE_FAILED : SHELL_ERROR_EXECUTION_FAILED;
+            break;
+        }
+
+        if (pgid == 0) pgid = pid;
+        pids[spawned++] = pid;
+    }
+
+    if (prev_read != -1) close(prev_read);
+
+    // A stage that is not started yet gives up its descriptors, so the
+    // stages around it see end of file or EPIPE
+    for (int i = 0; i < stream_count - last_is_stream; i++) {
+        streams[i].threaded = result == SHELL_OK && pthread_create(&streams[i].thread, NULL, shell_run_stream_stage, &streams[i]) == 0;
+        if (streams[i].threaded) continue;
+        for (size_t j = 0; j < streams[i].owned_count; j++) close(streams[i].owned[j]);
+        if (result == SHELL_OK) result = stage_count > 1 ? SHELL_ERROR_PIPELINE_FAILED : SHELL_ERROR_EXECUTION_FAILED;
+    }
+    if (last_is_stream && result != SHELL_OK) {
+        ShellStreamStage *last = &streams[stream_count - 1];
+        for (size_t j = 0; j < last->owned_count; j++) close(last->owned[j]);
+        last_is_stream = false;
+    }
+
+    // The last stage runs on this thread while the others stream into it
+    if (last_is_stream) shell_run_stream_stage(&streams[stream_count - 1]);
+
+    if (background && spawned > 0) {
+        // Background jobs are tracked by the job table and reaped on SIGCHLD
+        int job = shell_new_job(ctx, pids[0], pgid, command);
+        for (int i = 0; job >= 0 && i < spawned; i++) {
+            shell_add_job_process(ctx, job, pids[i]);
+        }
+        for (size_t i = temporaries; job >= 0 && i < ctx->temporary_count; i++) {
+            if (ctx->temporaries[i].pid <= 0) continue;
+            shell_add_job_process(ctx, job, ctx->temporaries[i].pid);
+            ctx->temporaries[i].pid = -1;
+        }
+        if (job >= 0 && ctx->base.interactive) {
+            shell_printf(&ctx->base, STDOUT_FILENO, "[%d] %d\n", job + 1, (int)pids[spawned - 1]);
+        }
+        ctx->base.exit_status = 0;
+    } else if (spawned > 0) {
+        // Hand the terminal to the job while it runs in the foreground
+        if (ctx->job_control) tcsetpgrp(STDIN_FILENO, pgid);
+        bool stopped = shell_wait_foreground(ctx, pgid, pids, spawned, usages);
+        if (ctx->job_control) tcsetpgrp(STDIN_FILENO, ctx->shell_pgid);
+        profiling = profiling && !stopped;
+
+        // A stopped job moves to the job table with the processes still alive
+        if (stopped) {
+            int job = shell_new_job(ctx, pids[0], pgid, command);
+            for (int i = 0; job >= 0 && i < spawned; i++) {
+                if (pids[i]) shell_add_job_process(ctx, job, pids[i]);
+            }
+            if (job >= 0) {
+                ctx->jobs[job].running = false;
+                shell_printf(&ctx->base, STDOUT_FILENO, "\n[%d] Stopped: %s\n", job + 1, command);
+            }
+        }
+    }
+
+    for (int i = 0; i < stream_count; i++) {
+        if (streams[i].threaded) pthread_join(streams[i].thread, NULL);
+    }
+    if (last_is_stream) ctx->base.exit_status = streams[stream_count - 1].status;
+
+    // Every stage of a pipeline is charged the wall time of the whole pipeline
+    if (profiling) {
+        uint64_t wall_ns = shell_clock_ns() - started;
+        for (int i = 0; i < spawned; i++) {
+            const char *name = stages[spawned_stages[i]].argv[0];
+            shell_profile_command(ctx, name, SHELL_DISPATCH_EXTERNAL, wall_ns, spawn_ns[i], &usages[i]);
+        }
+        for (int i = 0; i < stream_count; i++) {
+            ShellDispatch dispatch = streams[i].command->kind == SHELL_COMMAND_BUILTIN ? SHELL_DISPATCH_BUILTIN : SHELL_DISPATCH_STREAM;
+            shell_profile_command(ctx, streams[i].argv[0], dispatch, wall_ns, 0, &streams[i].usage);
+        }
+    }
+
+    // A stage that could not be spawned reports 127 like sh does for
+    // unknown commands, or 126 when the file could not be executed; a
+    // stream stage that could not be set up or started reports 1
+    if (result != SHELL_OK) {
+        if (spawn_error) shell_printf(&ctx->base, STDERR_FILENO, "%s: %s\n", stages[failed].argv[0], strerror(spawn_error));
+        ctx->base.exit_status = spawn_error == ENOENT ? 127 : spawn_error ? 126 : 1;
+        ctx->base.last_error = result;
+    }
+
+    shell_arena_release(&ctx->arena, mark);
+    return result;
+}
+
+// Execute an external command using posix_spawn and wait for it to finish
+ShellError shell_execute_external(ExtendedShellContext *ctx, char *const argv[], const char *input_file, const char *output_file, bool append_output) {
+    if (!ctx || !argv) return SHELL_ERROR_NULL_POINTER;
+
+    ShellPipelineStage stage = { (char **)argv, input_file, output_file, append_output, NULL, NULL, 0, NULL };
+    return shell_launch_pipeline(ctx, &stage, 1, false, argv[0] ? argv[0] : "", ctx->temporary_count);
+}
+
+// Execute a pipeline: all stages run concurrently in one process group,
+// connected by pipes, and the shell waits for the whole group to finish
+ShellError shell_execute_pipeline(ExtendedShellContext *ctx, const ShellPipelineStage *stages, int stage_count) {
+    if (!ctx || !stages) return SHELL_ERROR_NULL_POINTER;
+    if (stage_count <= 0) return SHELL_ERROR_INVALID_INPUT;
+
+    return shell_launch_pipeline(ctx, stages, stage_count, false, stages[0].argv ? stages[0].argv[0] : "", ctx->temporary_count);
+}
+
+// Read a line from fd into a malloc'd buffer, without its newline. A
+// seekable input is read a block at a time and the offset moved back to
+// just after the line; anything else is read a byte at a time, so no
+// input past the newline is consumed. Returns the length, or -1 at end of
+// input with nothing read; newline tells whether the line was ended.
+static ssize_t shell_read_input_line(int fd, char **line, size_t *capacity, size_t length, bool *newline) {
+    bool seekable = lseek(fd, 0, SEEK_CUR) != -1;
+    size_t start = length;
+    *newline = false;
+
+    while (true) {
+        if (length + SHELL_READ_BLOCK_SIZE + 1 > *capacity) {
+            size_t grown = *capacity * 2 > length + SHELL_READ_BLOCK_SIZE + 1 ? *capacity * 2 : length + SHELL_READ_BLOCK_SIZE + 1;
+            char *buffer = realloc(*line, grown);
+            if (!buffer) break;
+            *line = buffer;
+            *capacity = grown;
+        }
+
+        ssize_t count = read(fd, *line + length, seekable ? SHELL_READ_BLOCK_SIZE : 1);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+
+        char *end = memchr(*line + length, '\n', (size_t)count);
+        if (end) {
+            size_t used = (size_t)(end - (*line + length)) + 1;
+            if (seekable && used < (size_t)count) lseek(fd, -(off_t)((size_t)count - used), SEEK_CUR);
+            length += used - 1;
+            *newline = true;
+            break;
+        }
+        length += (size_t)count;
+    }
+
+    if (!*line) return -1;
+    (*line)[length] = '\0';
+    return length > start || *newline ? (ssize_t)length : -1;
+}
+
+// Source of input lines for the parallel scheduler: an array, or a
+// descriptor read one line at a time (-1 for none)
+typedef struct {
+    char *const *items;
+    int count;
+    int next;
+    int fd;
+    char *line;
+    size_t line_size;
+} ShellParallelInput;
+
+// Fetch the next input, or NULL when the source is exhausted
+static const char *shell_parallel_next(ShellParallelInput *input) {
+    if (input->fd == -1) {
+        return input->next < input->count ? input->items[input->next++] : NULL;
+    }
+
+    bool newline;
+    return shell_read_input_line(input->fd, &input->line, &input->line_size, 0, &newline) == -1 ? NULL : input->line;
+}
+
+// Replace every {} in a template word with the input
+static char *shell_parallel_substitute(ShellArena *arena, const char *word, const char *value) {
+    size_t value_length = strlen(value);
+    size_t length = 0;
+    for (const char *p = word; *p; p++) {
+        if (p[0] == '{' && p[1] == '}') {
+            length += value_length;
+            p++;
+        } else {
+            length++;
+        }
+    }
+
+    char *result = shell_arena_alloc(arena, length + 1);
+    if (!result) return NULL;
+
+    char *out = result;
+    for (const char *p = word; *p; p++) {
+        if (p[0] == '{' && p[1] == '}') {
+            memcpy(out, value, value_length);
+            out += value_length;
+            p++;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+// Wait until one of the running children exits and return its slot, or -1.
+// Only these children are waited for, so children of other contexts and of
+// the host are left alone. Children are polled through their pidfds; one
+// without a pidfd is waited for directly.
+static int shell_parallel_wait(const pid_t *running, struct pollfd *pidfds, int slots, int *status) {
+    while (true) {
+        int direct = -1;
+        for (int i = 0; i < slots && direct < 0; i++) {
+            if (running[i] && pidfds[i].fd == -1) direct = i;
+        }
+
+        if (direct >= 0) {
+            if (waitpid(running[direct], status, 0) == running[direct]) return direct;
+            if (errno != EINTR) return -1;
+            continue;
+        }
+
+        if (poll(pidfds, (nfds_t)slots, -1) == -1) {
+            if (errno != EINTR) return -1;
+            continue;
+        }
+        for (int i = 0; i < slots; i++) {
+            if (running[i] && pidfds[i].revents && waitpid(running[i], status, WNOHANG) == running[i]) return i;
+        }
+    }
+}
+
+// Give each job slot one of the CPUs the shell's processes may run on, in
+// turn, on top of the shell's defaults. A job started in a freed slot runs
+// where the one before it did, so its caches and local memory stay warm.
+static ShellSpawnResources *shell_parallel_pin(ExtendedShellContext *ctx, int slots) {
+    unsigned long allowed[SHELL_MASK_WORDS(SHELL_CPU_SETSIZE)];
+    const size_t bits = 8 * sizeof(unsigned long);
+    memset(allowed, 0, sizeof(allowed));
+    if (ctx->spawn_resources && !shell_mask_empty(ctx->spawn_resources->cpus, SHELL_MASK_WORDS(SHELL_CPU_SETSIZE))) {
+        memcpy(allowed, ctx->spawn_resources->cpus, sizeof(allowed));
+    } else {
+#ifdef __linux__
+        if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) == -1) memset(allowed, 0, sizeof(allowed));
+#endif
+        if (shell_mask_empty(allowed, SHELL_MASK_WORDS(SHELL_CPU_SETSIZE))) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            for (long cpu = 0; cpu < (cpus > 0 ? cpus : 1) && cpu < SHELL_CPU_SETSIZE; cpu++) allowed[cpu / bits] |= 1UL << (cpu % bits);
+        }
+    }
+
+    ShellSpawnResources *resources = malloc((size_t)slots * sizeof(ShellSpawnResources));
+    if (!resources) return NULL;
+
+    size_t cpu = 0;
+    for (int i = 0; i < slots; i++) {
+        // Wrap around to the first allowed CPU
+        while (!(allowed[cpu / bits] & (1UL << (cpu % bits)))) cpu = (cpu + 1) % SHELL_CPU_SETSIZE;
+        if (ctx->spawn_resources) {
+            resources[i] = *ctx->spawn_resources;
+        } else {
+            memset(&resources[i], 0, sizeof(ShellSpawnResources));
+        }
+        memset(resources[i].cpus, 0, sizeof(resources[i].cpus));
+        resources[i].cpus[cpu / bits] = 1UL << (cpu % bits);
+        cpu = (cpu + 1) % SHELL_CPU_SETSIZE;
+    }
+    return resources;
+}
+
+// Run the template once per input with at most max_jobs processes in flight.
+// A new job starts as soon as one is reaped, and with pin each job slot
+// keeps a CPU of its own. The exit status is the number of failed jobs,
+// capped at 101 as GNU parallel does.
+static ShellError shell_parallel(ExtendedShellContext *ctx, char *const *template_words, int template_count, ShellParallelInput *input, int max_jobs, bool pin) {
+    if (max_jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_jobs = cpus > 0 ? (int)cpus : 1;
+    }
+
+    bool has_placeholder = false;
+    for (int i = 0; i < template_count; i++) {
+        if (strstr(template_words[i], "{}")) has_placeholder = true;
+    }
+
+    pid_t *running = calloc((size_t)max_jobs, sizeof(pid_t));
+    struct pollfd *pidfds = malloc((size_t)max_jobs * sizeof(struct pollfd));
+    ShellSpawnResources *slot_resources = pin ? shell_parallel_pin(ctx, max_jobs) : NULL;
+    if (!running || !pidfds || (pin && !slot_resources)) {
+        free(running);
+        free(pidfds);
+        free(slot_resources);
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    for (int i = 0; i < max_jobs; i++) pidfds[i] = (struct pollfd){ -1, POLLIN, 0 };
+
+    ShellError result = SHELL_OK;
+    int in_flight = 0;
+    int failed = 0;
+    bool exhausted = false;
+
+    while (!exhausted || in_flight > 0) {
+        // Fill every free slot
+        while (!exhausted && in_flight < max_jobs) {
+            const char *value = shell_parallel_next(input);
+            if (!value) {
+                exhausted = true;
+                break;
+            }
+
+            // argv only has to live until posix_spawn returns
+            ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+            char **argv = shell_arena_alloc(&ctx->arena, (size_t)(template_count + 2) * sizeof(char *));
+            int argc = 0;
+            for (int i = 0; argv && i < template_count; i++) {
+                argv[argc] = shell_parallel_substitute(&ctx->arena, template_words[i], value);
+                if (!argv[argc++]) argv = NULL;
+            }
+            if (!argv) {
+                shell_arena_release(&ctx->arena, mark);
+                result = SHELL_ERROR_MEMORY_ALLOCATION;
+                exhausted = true;
+                break;
+            }
+            if (!has_placeholder) argv[argc++] = (char *)value;
+            argv[argc] = NULL;
+
+            int slot = 0;
+            while (running[slot]) slot++;
+
+            pid_t pid;
+            ShellSpawnRequest request = { argv, NULL, -1, -1, NULL, NULL, false, NULL, 0, -1, pin ? &slot_resources[slot] : NULL, NULL };
+            int status = shell_spawn_process(ctx, &request, &pid);
+            shell_arena_release(&ctx->arena, mark);
+            if (status != 0) {
+                failed++;
+                continue;
+            }
+
+            running[slot] = pid;
+            pidfds[slot].fd = shell_open_pidfd(pid);
+            in_flight++;
+        }
+
+        if (in_flight == 0) break;
+
+        int status;
+        int slot = shell_parallel_wait(running, pidfds, max_jobs, &status);
+        if (slot < 0) break;
+
+        running[slot] = 0;
+        if (pidfds[slot].fd != -1) close(pidfds[slot].fd);
+        pidfds[slot].fd = -1;
+        in_flight--;
+        if (shell_exit_status(status) != 0) failed++;
+    }
+
+    for (int i = 0; i < max_jobs; i++) {
+        if (pidfds[i].fd != -1) close(pidfds[i].fd);
+    }
+    free(pidfds);
+    free(running);
+    free(slot_resources);
+    free(input->line);
+    input->line = NULL;
+
+    ctx->base.exit_status = failed > 100 ? 101 : failed;
+    if (result != SHELL_OK) ctx->base.last_error = result;
+    return result;
+}
+
+// Run a command template once per input with bounded concurrency, like
+// xargs -P or GNU parallel. Each {} in the template is replaced with the
+// input; without {} the input is appended as the last argument.
+ShellError shell_run_parallel(ExtendedShellContext *ctx, const char *command_template, char *const inputs[], int input_count, int max_jobs) {
+    if (!ctx || !command_template || (!inputs && input_count > 0)) return SHELL_ERROR_NULL_POINTER;
+
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+
+    // Lex the template once; it must be a simple command
+    ShellTokenList list;
+    ShellError result = shell_lex(&ctx->arena, command_template, &list);
+    char **words = result == SHELL_OK ? shell_arena_alloc(&ctx->arena, (list.count + 1) * sizeof(char *)) : NULL;
+    if (result == SHELL_OK && !words) result = SHELL_ERROR_MEMORY_ALLOCATION;
+
+    for (size_t i = 0; result == SHELL_OK && i < list.count; i++) {
+        if (list.tokens[i].type != SHELL_TOKEN_WORD) result = SHELL_ERROR_SYNTAX;
+        words[i] = shell_expand_word(ctx, &list.tokens[i]);
+        if (result == SHELL_OK && !words[i]) result = SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    if (result == SHELL_OK && list.count == 0) result = SHELL_ERROR_INVALID_INPUT;
+
+    if (result == SHELL_OK) {
+        ShellParallelInput input = { inputs, input_count, 0, -1, NULL, 0 };
+        result = shell_parallel(ctx, words, (int)list.count, &input, max_jobs, false);
+    } else {
+        ctx->base.last_error = result;
+    }
+
+    shell_arena_release(&ctx->arena, mark);
+    return result;
+}
+
+// Built-in: parallel [-j N] [--pin] command [args] [::: input ...]
+// Without ::: the inputs are read from the context's standard input, one
+// per line. --pin keeps
+// each job slot on a CPU of its own.
+static int shell_builtin_parallel(ExtendedShellContext *ctx, int argc, char **argv) {
+    int max_jobs = 0;
+    bool pin = false;
+    int first = 1;
+
+    while (first < argc) {
+        if (strncmp(argv[first], "-j", 2) == 0) {
+            const char *value = argv[first][2] ? argv[first] + 2 : (first + 1 < argc ? argv[++first] : "0");
+            max_jobs = atoi(value);
+        } else if (strcmp(argv[first], "--pin") == 0) {
+            pin = true;
+        } else {
+            break;
+        }
+        first++;
+    }
+
+    int separator = first;
+    while (separator < argc && strcmp(argv[separator], ":::") != 0) separator++;
+
+    if (separator == first) {
+        shell_printf(&ctx->base, STDERR_FILENO, "parallel: usage: parallel [-j N] [--pin] command [args] [::: input ...]\n");
+        return 1;
+    }
+
+    ShellParallelInput input = { NULL, 0, 0, shell_context_fd(&ctx->base, STDIN_FILENO), NULL, 0 };
+    if (separator < argc) {
+        input.items = &argv[separator + 1];
+        input.count = argc - separator - 1;
+        input.fd = -1;
+    }
+
+    shell_parallel(ctx, &argv[first], separator - first, &input, max_jobs, pin);
+    return ctx->base.exit_status;
+}
+
+// Limits pin -l takes, by the names prlimit gives them
+static const struct {
+    const char *name;
+    int resource;
+} shell_resource_names[] = {
+    { "as", RLIMIT_AS },           { "core", RLIMIT_CORE },     { "cpu", RLIMIT_CPU },     { "data", RLIMIT_DATA },
+    { "fsize", RLIMIT_FSIZE },     { "memlock", RLIMIT_MEMLOCK }, { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC },
+    { "rss", RLIMIT_RSS },         { "stack", RLIMIT_STACK },
+};
+
+// Names of the ionice classes, indexed by class
+static const char *const shell_io_classes[] = { "none", "realtime", "best-effort", "idle" };
+
+// Set the bits of a list such as 0-3,8,10-11 in a mask of the given size;
+// false if the list is malformed or names a bit past it
+static bool shell_parse_mask(const char *text, unsigned long *mask, size_t size) {
+    const size_t bits = 8 * sizeof(unsigned long);
+    memset(mask, 0, size / 8);
+    while (true) {
+        if (!isdigit((unsigned char)*text)) return false;
+        char *end;
+        unsigned long first = strtoul(text, &end, 10);
+        unsigned long last = first;
+        if (*end == '-') {
+            if (!isdigit((unsigned char)end[1])) return false;
+            last = strtoul(end + 1, &end, 10);
+        }
+        if (last < first || last >= size) return false;
+        for (unsigned long bit = first; bit <= last; bit++) mask[bit / bits] |= 1UL << (bit % bits);
+        if (*end == '\0') return true;
+        if (*end != ',') return false;
+        text = end + 1;
+    }
+}
+
+// Print a mask as the shortest list shell_parse_mask reads back
+static void shell_print_mask(ShellOutput *out, const unsigned long *mask, size_t size) {
+    const size_t bits = 8 * sizeof(unsigned long);
+    const char *separator = "";
+    for (size_t bit = 0; bit < size; bit++) {
+        if (!(mask[bit / bits] & (1UL << (bit % bits)))) continue;
+        size_t last = bit;
+        while (last + 1 < size && (mask[(last + 1) / bits] & (1UL << ((last + 1) % bits)))) last++;
+        shell_output_printf(out, last > bit ? "%s%zu-%zu" : "%s%zu", separator, bit, last);
+        separator = ",";
+        bit = last;
+    }
+}
+
+// Parse one limit value of pin -l
+static bool shell_parse_limit_value(const char *text, const char *end, rlim_t *value) {
+    if ((size_t)(end - text) == 9 && strncmp(text, "unlimited", 9) == 0) {
+        *value = RLIM_INFINITY;
+        return true;
+    }
+    if (text == end || !isdigit((unsigned char)*text)) return false;
+    char *stop;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &stop, 10);
+    *value = (rlim_t)parsed;
+    return errno == 0 && stop == end;
+}
+
+// Parse name=soft[:hard] of pin -l; one value sets both limits
+static bool shell_parse_limit(const char *text, ShellResourceLimit *limit) {
+    const char *equals = strchr(text, '=');
+    if (!equals) return false;
+
+    limit->resource = -1;
+    for (size_t i = 0; i < sizeof(shell_resource_names) / sizeof(shell_resource_names[0]); i++) {
+        const char *name = shell_resource_names[i].name;
+        if (strlen(name) == (size_t)(equals - text) && strncmp(text, name, strlen(name)) == 0) {
+            limit->resource = shell_resource_names[i].resource;
+        }
+    }
+    if (limit->resource == -1) return false;
+
+    const char *soft = equals + 1;
+    const char *colon = strchr(soft, ':');
+    const char *end = soft + strlen(soft);
+    if (!shell_parse_limit_value(soft, colon ? colon : end, &limit->limit.rlim_cur)) return false;
+    if (!colon) {
+        limit->limit.rlim_max = limit->limit.rlim_cur;
+        return true;
+    }
+    return shell_parse_limit_value(colon + 1, end, &limit->limit.rlim_max);
+}
+
+// Parse class[:level] of pin -i
+static bool shell_parse_io_class(const char *text, int *io_class, int *io_level) {
+    const char *colon = strchr(text, ':');
+    size_t length = colon ? (size_t)(colon - text) : strlen(text);
+    *io_class = 0;
+    for (int i = 1; i < 4; i++) {
+        bool named = strlen(shell_io_classes[i]) == length && strncmp(text, shell_io_classes[i], length) == 0;
+        if (named || (length == 1 && *text == '0' + i)) *io_class = i;
+    }
+    *io_level = 4;
+    if (colon) {
+        if (!isdigit((unsigned char)colon[1]) || colon[2] != '\0' || colon[1] > '7') return false;
+        *io_level = colon[1] - '0';
+    }
+    return *io_class != 0;
+}
+
+// Parse the options and CPU list of pin into resources, starting from the
+// shell's defaults, and set first to the index of the command, or argc
+// when there is none. A non-absolute cgroup is taken under /sys/fs/cgroup.
+// Errors are printed when report is set.
+static bool shell_parse_pin(ExtendedShellContext *ctx, int argc, char **argv, ShellSpawnResources *resources, int *first, bool report) {
+    if (ctx->spawn_resources) {
+        *resources = *ctx->spawn_resources;
+    } else {
+        memset(resources, 0, sizeof(ShellSpawnResources));
+    }
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        const char *option = argv[i];
+        if (strcmp(option, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(option, "-r") == 0) {
+            memset(resources, 0, sizeof(ShellSpawnResources));
+            continue;
+        }
+
+        const char *value = option[2] ? option + 2 : (i + 1 < argc ? argv[++i] : NULL);
+        bool valid = value && option[1] && strchr("mnilg", option[1]);
+        if (valid && option[1] == 'm') {
+            valid = shell_parse_mask(value, resources->numa_nodes, SHELL_NUMA_NODES);
+        } else if (valid && option[1] == 'n') {
+            char *end;
+            long nice = strtol(value, &end, 10);
+            valid = *value && *end == '\0' && nice >= -20 && nice <= 19;
+            resources->set_nice = true;
+            resources->nice = (int)nice;
+        } else if (valid && option[1] == 'i') {
+            valid = shell_parse_io_class(value, &resources->io_class, &resources->io_level);
+        } else if (valid && option[1] == 'l') {
+            ShellResourceLimit limit;
+            valid = shell_parse_limit(value, &limit);
+            size_t slot = 0;
+            while (valid && slot < resources->limit_count && resources->limits[slot].resource != limit.resource) slot++;
+            valid = valid && slot < SHELL_MAX_RESOURCE_LIMITS;
+            if (valid) {
+                resources->limits[slot] = limit;
+                if (slot == resources->limit_count) resources->limit_count++;
+            }
+        } else if (valid) {
+            char *cgroup = *value == '/' ? (char *)value : shell_arena_alloc(&ctx->arena, strlen(value) + 16);
+            if (cgroup && cgroup != value) sprintf(cgroup, "/sys/fs/cgroup/%s", value);
+            valid = cgroup != NULL;
+            resources->cgroup = cgroup;
+        }
+
+        if (!valid) {
+            if (report && value) shell_printf(&ctx->base, STDERR_FILENO, "pin: %s: invalid argument to %.2s\n", value, option);
+            if (report && !value) {
+                shell_printf(&ctx->base, STDERR_FILENO, "pin: usage: pin [-r] [-m nodes] [-n nice] [-i class[:level]] [-l limit=soft[:hard]] [-g cgroup] [cpus] [command [args]]\n");
+            }
+            return false;
+        }
+    }
+
+    if (i < argc && shell_parse_mask(argv[i], resources->cpus, SHELL_CPU_SETSIZE)) {
+        i++;
+    } else if (i < argc && isdigit((unsigned char)argv[i][0])) {
+        if (report) shell_printf(&ctx->base, STDERR_FILENO, "pin: %s: invalid CPU list\n", argv[i]);
+        return false;
+    }
+    *first = i;
+    return true;
+}
+
+// Print the shell's defaults as the pin command that sets them
+static void shell_print_pin(ShellOutput *out, const ShellSpawnResources *resources) {
+    shell_output_printf(out, "pin -r");
+    if (resources && !shell_mask_empty(resources->numa_nodes, SHELL_MASK_WORDS(SHELL_NUMA_NODES))) {
+        shell_output_printf(out, " -m ");
+        shell_print_mask(out, resources->numa_nodes, SHELL_NUMA_NODES);
+    }
+    if (resources && resources->set_nice) shell_output_printf(out, " -n %d", resources->nice);
+    if (resources && resources->io_class > 0 && resources->io_class < 4) {
+        shell_output_printf(out, " -i %s:%d", shell_io_classes[resources->io_class], resources->io_level);
+    }
+    for (size_t i = 0; resources && i < resources->limit_count; i++) {
+        const char *name = "?";
+        for (size_t j = 0; j < sizeof(shell_resource_names) / sizeof(shell_resource_names[0]); j++) {
+            if (shell_resource_names[j].resource == resources->limits[i].resource) name = shell_resource_names[j].name;
+        }
+        shell_output_printf(out, " -l %s=", name);
+        for (int j = 0; j < 2; j++) {
+            rlim_t value = j ? resources->limits[i].limit.rlim_max : resources->limits[i].limit.rlim_cur;
+            if (value == RLIM_INFINITY) shell_output_printf(out, "%sunlimited", j ? ":" : "");
+            else shell_output_printf(out, "%s%llu", j ? ":" : "", (unsigned long long)value);
+        }
+    }
+    if (resources && resources->cgroup) shell_output_printf(out, " -g %s", resources->cgroup);
+    if (resources && !shell_mask_empty(resources->cpus, SHELL_MASK_WORDS(SHELL_CPU_SETSIZE))) {
+        shell_output_printf(out, " ");
+        shell_print_mask(out, resources->cpus, SHELL_CPU_SETSIZE);
+    }
+    shell_output_printf(out, "\n");
+}
+
+// Built-in: pin [-r] [-m nodes] [-n nice] [-i class[:level]] [-l limit=soft[:hard]] [-g cgroup] [cpus] [command [args]]
+// Before a command the settings apply to the process started for it
+// only; alone they become the defaults of every later process, and
+// without arguments the defaults are printed. -r starts from nothing
+// instead of the defaults.
+static int shell_builtin_pin(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (argc < 2) {
+        ShellOutput out;
+        shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+        shell_print_pin(&out, ctx->spawn_resources);
+        shell_output_flush(&out);
+        return 0;
+    }
+
+    ShellSpawnResources resources;
+    int first;
+    if (!shell_parse_pin(ctx, argc, argv, &resources, &first, true)) return 2;
+    if (first == argc) {
+        ShellError result = shell_set_spawn_resources(ctx, shell_resources_empty(&resources) ? NULL : &resources);
+        if (result != SHELL_OK) shell_printf(&ctx->base, STDERR_FILENO, "pin: not supported on this platform\n");
+        return result == SHELL_OK ? 0 : 1;
+    }
+
+    // Commands in a line get their settings when the stage is built, so
+    // this is only reached through shell_execute_builtin
+    ShellPipelineStage stage = { &argv[first], NULL, NULL, false, NULL, NULL, 0, &resources };
+    if (shell_check_launchable(ctx, &stage, 1, false)) shell_launch_pipeline(ctx, &stage, 1, false, argv[first], ctx->temporary_count);
+    return ctx->base.exit_status;
+}
+
+// Built-in: export [NAME[=value] ...]
+// Without arguments the exported variables are listed.
+static int shell_builtin_export(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (argc < 2) {
+        ShellOutput out;
+        shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+        for (char *const *env = shell_environment(ctx); *env; env++) {
+            shell_output_printf(&out, "export %s\n", *env);
+        }
+        shell_output_flush(&out);
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        char *equals = strchr(argv[i], '=');
+        ShellError result;
+        if (equals) {
+            *equals = '\0';
+            result = shell_set_env(ctx, argv[i], equals + 1);
+            *equals = '=';
+        } else {
+            // Exporting an unset name creates it empty, as sh does
+            result = shell_get_env(ctx, argv[i]) ? shell_export_env(ctx, argv[i]) : shell_set_env(ctx, argv[i], "");
+        }
+        if (result != SHELL_OK) {
+            shell_printf(&ctx->base, STDERR_FILENO, "export: %s: not a valid identifier\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Built-in: unset NAME ...
+static int shell_builtin_unset(ExtendedShellContext *ctx, int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        shell_unset_env(ctx, argv[i]);
+    }
+    return 0;
+}
+
+// Print an alias in a form that can be read back
+static void shell_print_alias(ShellOutput *out, const ShellCommand *command) {
+    shell_output_printf(out, "alias %s='", command->name);
+    for (const char *c = command->value; *c; c++) {
+        if (*c == '\'') shell_output_put(out, "'\\''", 4);
+        else shell_output_char(out, *c);
+    }
+    shell_output_put(out, "'\n", 2);
+}
+
+// Order dispatch table entries by name
+static int shell_compare_commands(const void *a, const void *b) {
+    return strcmp((*(ShellCommand *const *)a)->name, (*(ShellCommand *const *)b)->name);
+}
+
+// Built-in: alias [name[=value] ...]
+// Without arguments every alias is listed, sorted by name.
+static int shell_builtin_alias(ExtendedShellContext *ctx, int argc, char **argv) {
+    ShellOutput out;
+    shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+    if (argc < 2) {
+        ShellCommand **aliases = shell_arena_alloc(&ctx->arena, (ctx->alias_count + 1) * sizeof(ShellCommand *));
+        if (!aliases) return 1;
+
+        size_t count = 0;
+        for (size_t i = 0; i < ctx->commands.capacity; i++) {
+            ShellCommand *command = ctx->commands.entries[i].value;
+            if (ctx->commands.entries[i].key && command && command->value) aliases[count++] = command;
+        }
+        qsort(aliases, count, sizeof(ShellCommand *), shell_compare_commands);
+        for (size_t i = 0; i < count; i++) shell_print_alias(&out, aliases[i]);
+        shell_output_flush(&out);
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        char *equals = strchr(argv[i], '=');
+        if (!equals) {
+            ShellCommand *command = shell_lookup_command(ctx, argv[i]);
+            if (command && command->value) {
+                shell_print_alias(&out, command);
+            } else {
+                shell_printf(&ctx->base, STDERR_FILENO, "alias: %s: not found\n", argv[i]);
+                status = 1;
+            }
+            continue;
+        }
+
+        *equals = '\0';
+        ShellError result = shell_set_alias(ctx, argv[i], equals + 1);
+        if (result != SHELL_OK) {
+            shell_printf(&ctx->base, STDERR_FILENO, "alias: %s: %s\n", argv[i], result == SHELL_ERROR_SYNTAX ? "syntax error" : "invalid alias name");
+            status = 1;
+        }
+        *equals = '=';
+    }
+    shell_output_flush(&out);
+    return status;
+}
+
+// Built-in: unalias [-a] name ...
+static int shell_builtin_unalias(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "-a") == 0) {
+        for (size_t i = 0; i < ctx->commands.capacity && ctx->alias_count > 0; i++) {
+            ShellCommand *command = ctx->commands.entries[i].value;
+            if (ctx->commands.entries[i].key && command && command->value) shell_remove_alias(ctx, command->name);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        if (shell_remove_alias(ctx, argv[i]) != SHELL_OK) {
+            shell_printf(&ctx->base, STDERR_FILENO, "unalias: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Parse the loop count of break or continue
+static int shell_loop_levels(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (ctx->loop_depth == 0) {
+        shell_printf(&ctx->base, STDERR_FILENO, "%s: only meaningful in a loop\n", argv[0]);
+        return 0;
+    }
+
+    int levels = argc > 1 ? atoi(argv[1]) : 1;
+    if (levels < 1) {
+        shell_printf(&ctx->base, STDERR_FILENO, "%s: %s: loop count out of range\n", argv[0], argv[1]);
+        return 0;
+    }
+    return levels < ctx->loop_depth ? levels : ctx->loop_depth;
+}
+
+// Built-in: break [n]
+static int shell_builtin_break(ExtendedShellContext *ctx, int argc, char **argv) {
+    ctx->break_levels = shell_loop_levels(ctx, argc, argv);
+    return ctx->break_levels > 0 ? 0 : 1;
+}
+
+// Built-in: continue [n]
+static int shell_builtin_continue(ExtendedShellContext *ctx, int argc, char **argv) {
+    ctx->continue_levels = shell_loop_levels(ctx, argc, argv);
+    return ctx->continue_levels > 0 ? 0 : 1;
+}
+
+// Built-in: return [n]
+static int shell_builtin_return(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (ctx->function_depth == 0) {
+        shell_printf(&ctx->base, STDERR_FILENO, "return: can only return from a function\n");
+        return 1;
+    }
+
+    ctx->returning = true;
+    return argc > 1 ? atoi(argv[1]) & 0xff : ctx->base.exit_status;
+}
+
+// Built-in: shift [n]
+static int shell_builtin_shift(ExtendedShellContext *ctx, int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1;
+    if (count < 0 || count > ctx->positional_count) {
+        shell_printf(&ctx->base, STDERR_FILENO, "shift: %s: shift count out of range\n", argc > 1 ? argv[1] : "1");
+        return 1;
+    }
+
+    if (count > 0) {
+        ctx->positional += count;
+        ctx->positional_count -= count;
+    }
+    return 0;
+}
+
+// Built-ins: true and :
+static int shell_builtin_true(ExtendedShellContext *ctx, int argc, char **argv) {
+    (void)ctx;
+    (void)argc;
+    (void)argv;
+    return 0;
+}
+
+// Built-in: false
+static int shell_builtin_false(ExtendedShellContext *ctx, int argc, char **argv) {
+    (void)ctx;
+    (void)argc;
+    (void)argv;
+    return 1;
+}
+
+// Decode the escape after a backslash for printf and echo -e. Octal
+// escapes are \ddd in a printf format and \0ddd elsewhere. Returns the
+// number of characters used, 0 if the escape is not recognized, or -1 for
+// \c, which ends the output.
+static int shell_decode_escape(const char *text, bool format, char *c) {
+    static const char from[] = "\\abefnrtv";
+    static const char to[] = "\\\a\b\x1b\f\n\r\t\v";
+
+    const char *known = *text ? strchr(from, *text) : NULL;
+    if (known) {
+        *c = to[known - from];
+        return 1;
+    }
+    if (*text == 'c' && !format) return -1;
+
+    int used = 0;
+    int value = 0;
+    if (*text == 'x' && isxdigit((unsigned char)text[1])) {
+        for (used = 1; used <= 2 && isxdigit((unsigned char)text[used]); used++) {
+            value = value * 16 + (isdigit((unsigned char)text[used]) ? text[used] - '0' : (tolower((unsigned char)text[used]) - 'a' + 10));
+        }
+    } else if (format ? (*text >= '0' && *text <= '7') : *text == '0') {
+        int first = format ? 0 : 1;
+        for (used = first; used < first + 3 && text[used] >= '0' && text[used] <= '7'; used++) {
+            value = value * 8 + (text[used] - '0');
+        }
+    } else {
+        return 0;
+    }
+
+    *c = (char)value;
+    return used;
+}
+
+// Write text, decoding backslash escapes; returns false after \c
+static bool shell_put_escaped(ShellOutput *out, const char *text, bool format) {
+    for (const char *p = text; *p; p++) {
+        if (*p != '\\') {
+            shell_output_char(out, *p);
+            continue;
+        }
+
+        char c;
+        int used = shell_decode_escape(p + 1, format, &c);
+        if (used < 0) return false;
+        if (used == 0) {
+            shell_output_char(out, '\\');
+        } else {
+            shell_output_char(out, c);
+            p += used;
+        }
+    }
+    return true;
+}
+
+// Built-in: echo [-neE] [arg ...]
+static int shell_builtin_echo(ExtendedShellContext *ctx, int argc, char **argv) {
+    bool newline = true;
+    bool escapes = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] && strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1); i++) {
+        for (const char *option = argv[i] + 1; *option; option++) {
+            if (*option == 'n') newline = false;
+            else escapes = *option == 'e';
+        }
+    }
+
+    // The whole line goes out in one write
+    ShellOutput out;
+    shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+    for (int first = i; i < argc; i++) {
+        if (i > first) shell_output_char(&out, ' ');
+        if (!escapes) {
+            shell_output_put(&out, argv[i], strlen(argv[i]));
+        } else if (!shell_put_escaped(&out, argv[i], false)) {
+            newline = false;
+            break;
+        }
+    }
+    if (newline) shell_output_char(&out, '\n');
+    shell_output_flush(&out);
+    return 0;
+}
+
+// Convert a numeric printf argument. A leading quote gives the value of
+// the character after it, as in sh.
+static long long shell_printf_number(ShellOutput *out, const char *text, int *status) {
+    if (!text) return 0;
+    if (*text == '\'' || *text == '"') return (unsigned char)text[1];
+
+    char *end;
+    errno = 0;
+    long long value = strtoll(text, &end, 0);
+    if (end == text || *end || errno) {
+        shell_printf(out->ctx, STDERR_FILENO, "printf: %s: invalid number\n", text);
+        *status = 1;
+    }
+    return value;
+}
+
+// Format the arguments of printf; returns the exit status
+static int shell_printf_arguments(ShellOutput *out, int argc, char **argv) {
+    int status = 0;
+    int arg = 2;
+    int pass_start;
+    do {
+        pass_start = arg;
+        for (const char *p = argv[1]; *p; p++) {
+            if (*p == '\\') {
+                char c;
+                int used = shell_decode_escape(p + 1, true, &c);
+                shell_output_char(out, used > 0 ? c : '\\');
+                if (used > 0) p += used;
+                continue;
+            }
+            if (*p != '%') {
+                shell_output_char(out, *p);
+                continue;
+            }
+            if (p[1] == '%') {
+                shell_output_char(out, '%');
+                p++;
+                continue;
+            }
+
+            // Keep flags, width and precision for the C printf
+            char spec[64] = "%";
+            size_t n = 1;
+            p++;
+            while (*p && strchr("-+ #0", *p) && n < 16) spec[n++] = *p++;
+            while (isdigit((unsigned char)*p) && n < 32) spec[n++] = *p++;
+            if (*p == '.') {
+                spec[n++] = *p++;
+                while (isdigit((unsigned char)*p) && n < 48) spec[n++] = *p++;
+            }
+
+            const char *value = *p && arg < argc ? argv[arg++] : NULL;
+            switch (*p) {
+                case 's':
+                    spec[n++] = 's';
+                    shell_output_printf(out, spec, value ? value : "");
+                    break;
+                case 'b':
+                    if (value && !shell_put_escaped(out, value, false)) return status;
+                    break;
+                case 'c':
+                    spec[n++] = 'c';
+                    if (value && *value) shell_output_printf(out, spec, *value);
+                    break;
+                case 'd':
+                case 'i':
+                    memcpy(spec + n, "lld", 3);
+                    shell_output_printf(out, spec, shell_printf_number(out, value, &status));
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    memcpy(spec + n, "ll", 2);
+                    spec[n + 2] = *p;
+                    shell_output_printf(out, spec, (unsigned long long)shell_printf_number(out, value, &status));
+                    break;
+                case 'e':
+                case 'E':
+                case 'f':
+                case 'F':
+                case 'g':
+                case 'G': {
+                    char *end = NULL;
+                    double number = value ? strtod(value, &end) : 0.0;
+                    if (value && (end == value || *end)) {
+                        shell_printf(out->ctx, STDERR_FILENO, "printf: %s: invalid number\n", value);
+                        status = 1;
+                    }
+                    spec[n++] = *p;
+                    shell_output_printf(out, spec, number);
+                    break;
+                }
+                default:
+                    shell_printf(out->ctx, STDERR_FILENO, "printf: %%%c: invalid format character\n", *p ? *p : ' ');
+                    return 1;
+            }
+        }
+    } while (arg < argc && arg > pass_start);
+
+    return status;
+}
+
+// Built-in: printf format [argument ...]
+// The format is reused until every argument has been consumed.
+static int shell_builtin_printf(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (argc < 2) {
+        shell_printf(&ctx->base, STDERR_FILENO, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    ShellOutput out;
+    shell_output_open(&out, &ctx->base, STDOUT_FILENO);
+    int status = shell_printf_arguments(&out, argc, argv);
+    shell_output_flush(&out);
+    return status;
+}
+
+// State of a test expression being evaluated
+typedef struct {
+    char **argv;
+    int argc;
+    int position;
+    bool error;
+    ShellContext *ctx;  // where errors are reported
+    int dir;            // where relative paths start
+} ShellTest;
+
+// Binary operators of test, in the order shell_test_binary handles them
+static const char *const shell_test_operators[] = {
+    "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"
+};
+
+// Index of a binary test operator, or -1
+static int shell_test_operator(const char *word) {
+    for (size_t i = 0; i < sizeof(shell_test_operators) / sizeof(shell_test_operators[0]); i++) {
+        if (strcmp(word, shell_test_operators[i]) == 0) return (int)i;
+    }
+    return -1;
+}
+
+// Whether a word is a unary test operator
+static bool shell_test_is_unary(const char *word) {
+    return word[0] == '-' && word[1] && !word[2] && strchr("bcdefghknprstuwxzLS", word[1]);
+}
+
+// Integer operand of test
+static long long shell_test_integer(ShellTest *test, const char *text) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    if (end == text || *end || errno) {
+        shell_printf(test->ctx, STDERR_FILENO, "test: %s: integer expression expected\n", text);
+        test->error = true;
+    }
+    return value;
+}
+
+// Evaluate a unary string or file test
+static bool shell_test_unary(const ShellTest *test, const char *op, const char *operand) {
+    struct stat st;
+    switch (op[1]) {
+        case 'n': return *operand != '\0';
+        case 'z': return *operand == '\0';
+        case 't': return isatty(atoi(operand));
+        case 'r': return faccessat(test->dir, operand, R_OK, 0) == 0;
+        case 'w': return faccessat(test->dir, operand, W_OK, 0) == 0;
+        case 'x': return faccessat(test->dir, operand, X_OK, 0) == 0;
+        case 'h':
+        case 'L': return fstatat(test->dir, operand, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+        default: break;
+    }
+
+    if (fstatat(test->dir, operand, &st, 0) != 0) return false;
+    switch (op[1]) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'f': return S_ISREG(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        default: return true;
+    }
+}
+
+// Evaluate a binary test
+static bool shell_test_binary(ShellTest *test, const char *left, int op, const char *right) {
+    struct stat a, b;
+    switch (op) {
+        case 0:
+        case 1: return strcmp(left, right) == 0;
+        case 2: return strcmp(left, right) != 0;
+        case 3: return strcmp(left, right) < 0;
+        case 4: return strcmp(left, right) > 0;
+        case 11:
+        case 12: {
+            bool has_left = fstatat(test->dir, left, &a, 0) == 0;
+            bool has_right = fstatat(test->dir, right, &b, 0) == 0;
+            if (op == 12) return has_right && (!has_left || a.st_mtim.tv_sec < b.st_mtim.tv_sec ||
+                                               (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec < b.st_mtim.tv_nsec));
+            return has_left && (!has_right || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                                (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+        }
+        case 13: return fstatat(test->dir, left, &a, 0) == 0 && fstatat(test->dir, right, &b, 0) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        default: break;
+    }
+
+    long long x = shell_test_integer(test, left);
+    long long y = shell_test_integer(test, right);
+    switch (op) {
+        case 5: return x == y;
+        case 6: return x != y;
+        case 7: return x < y;
+        case 8: return x <= y;
+        case 9: return x > y;
+        default: return x >= y;
+    }
+}
+
+static bool shell_test_or(ShellTest *test);
+
+// primary: '!' primary | '(' expression ')' | WORD operator WORD | unary WORD | WORD
+// A binary operator in second place wins, so [ "$x" = ! ] compares strings.
+static bool shell_test_primary(ShellTest *test) {
+    int remaining = test->argc - test->position;
+    char **words = test->argv + test->position;
+    if (remaining <= 0) {
+        shell_printf(test->ctx, STDERR_FILENO, "test: argument expected\n");
+        test->error = true;
+        return false;
+    }
+
+    int op = remaining >= 3 ? shell_test_operator(words[1]) : -1;
+    if (op >= 0) {
+        test->position += 3;
+        return shell_test_binary(test, words[0], op, words[2]);
+    }
+    if (remaining >= 2 && strcmp(words[0], "!") == 0) {
+        test->position++;
+        return !shell_test_primary(test);
+    }
+    if (remaining >= 2 && strcmp(words[0], "(") == 0) {
+        test->position++;
+        bool value = shell_test_or(test);
+        if (test->position >= test->argc || strcmp(test->argv[test->position], ")") != 0) {
+            shell_printf(test->ctx, STDERR_FILENO, "test: missing ')'\n");
+            test->error = true;
+        } else {
+            test->position++;
+        }
+        return value;
+    }
+    if (remaining >= 2 && shell_test_is_unary(words[0])) {
+        test->position += 2;
+        return shell_test_unary(test, words[0], words[1]);
+    }
+
+    test->position++;
+    return words[0][0] != '\0';
+}
+
+// and: primary ('-a' primary)*
+static bool shell_test_and(ShellTest *test) {
+    bool value = shell_test_primary(test);
+    while (!test->error && test->position < test->argc && strcmp(test->argv[test->position], "-a") == 0) {
+        test->position++;
+        bool right = shell_test_primary(test);
+        value = value && right;
+    }
+    return value;
+}
+
+// expression: and ('-o' and)*
+static bool shell_test_or(ShellTest *test) {
+    bool value = shell_test_and(test);
+    while (!test->error && test->position < test->argc && strcmp(test->argv[test->position], "-o") == 0) {
+        test->position++;
+        bool right = shell_test_and(test);
+        value = value || right;
+    }
+    return value;
+}
+
+// Built-ins: test expression and [ expression ]
+static int shell_builtin_test(ExtendedShellContext *ctx, int argc, char **argv) {
+    if (strcmp(argv[0], "[") == 0) {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+            shell_printf(&ctx->base, STDERR_FILENO, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    ShellTest test = { argv + 1, argc - 1, 0, false, &ctx->base, shell_dir_fd(ctx) };
+    if (test.argc == 0) return 1;
+
+    bool value = shell_test_or(&test);
+    if (!test.error && test.position < test.argc) {
+        shell_printf(&ctx->base, STDERR_FILENO, "test: %s: unexpected argument\n", test.argv[test.position]);
+        test.error = true;
+    }
+    return test.error ? 2 : value ? 0 : 1;
+}
+
+// Path of the context's current directory, read back from its descriptor
+// once cd has run, or NULL
+static char *shell_context_cwd(ExtendedShellContext *ctx, char *buffer, size_t size) {
+    if (ctx->cwd_fd == -1) return getcwd(buffer, size);
+
+    char link[32];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", ctx->cwd_fd);
+    ssize_t length = readlink(link, buffer, size - 1);
+    if (length < 0) return NULL;
+    buffer[length] = '\0';
+    return buffer;
+}
+
+// Built-in: cd [dir | -]
+static int shell_builtin_cd(ExtendedShellContext *ctx, int argc, char **argv) {
+    const char *target = argc > 1 ? argv[1] : shell_get_env(ctx, "HOME");
+    bool print = target && strcmp(target, "-") == 0;
+    if (print) target = shell_get_env(ctx, "OLDPWD");
+    if (!target) {
+        shell_printf(&ctx->base, STDERR_FILENO, "cd: %s not set\n", print ? "OLDPWD" : "HOME");
+        return 1;
+    }
+
+    // The directory must be searchable, as chdir would require
+    char previous[PATH_MAX];
+    bool known = shell_context_cwd(ctx, previous, sizeof(previous)) != NULL;
+    int fd = shell_fd_above_context(openat(shell_dir_fd(ctx), target, O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1 || faccessat(fd, ".", X_OK, 0) != 0) {
+        shell_printf(&ctx->base, STDERR_FILENO, "cd: %s: %s\n", target, strerror(errno));
+        if (fd != -1) close(fd);
+        return 1;
+    }
+    if (ctx->cwd_fd != -1) close(ctx->cwd_fd);
+    ctx->cwd_fd = fd;
+
+    char cwd[PATH_MAX];
+    if (known) shell_set_env(ctx, "OLDPWD", previous);
+    if (shell_context_cwd(ctx, cwd, sizeof(cwd))) {
+        shell_set_env(ctx, "PWD", cwd);
+        if (print) shell_printf(&ctx->base, STDOUT_FILENO, "%s\n", cwd);
+    }
+    return 0;
+}
+
+// Built-in: pwd
+static int shell_builtin_pwd(ExtendedShellContext *ctx, int argc, char **argv) {
+    (void)argc;
+    char cwd[PATH_MAX];
+    if (!shell_context_cwd(ctx, cwd, sizeof(cwd))) {
+        shell_printf(&ctx->base, STDERR_FILENO, "%s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+    shell_printf(&ctx->base, STDOUT_FILENO, "%s\n", cwd);
+    return 0;
+}
+
+// Whether a character separates fields of a read line; blank limits the
+// check to IFS whitespace
+static bool shell_field_separator(const char *ifs, char c, bool blank) {
+    return c && strchr(ifs, c) && (!blank || c == ' ' || c == '\t' || c == '\n');
+}
+
+// Built-in: read [-r] [-p prompt] [name ...]
+// The line is split into fields at IFS characters; the last name takes the
+// rest of the line. Without names the whole line is stored in REPLY.
+static int shell_builtin_read(ExtendedShellContext *ctx, int argc, char **argv) {
+    bool raw = false;
+    const char *prompt = NULL;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            raw = true;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            prompt = argv[++i];
+        } else {
+            shell_printf(&ctx->base, STDERR_FILENO, "read: %s: invalid option\n", argv[i]);
+            return 2;
+        }
+    }
+
+    char *reply[] = { "REPLY" };
+    char **names = i < argc ? argv + i : reply;
+    int name_count = i < argc ? argc - i : 1;
+    for (int j = 0; j < name_count; j++) {
+        if (!shell_valid_name(names[j], strlen(names[j]))) {
+            shell_printf(&ctx->base, STDERR_FILENO, "read: %s: not a valid identifier\n", names[j]);
+            return 2;
+        }
+    }
+
+    if (prompt) {
+        shell_write(&ctx->base, STDERR_FILENO, prompt, strlen(prompt));
+    }
+
+    // Without -r a backslash at the end of the line continues it
+    char *line = NULL;
+    size_t capacity = 0;
+    bool newline;
+    ssize_t length = shell_read_input_line(shell_context_fd(&ctx->base, STDIN_FILENO), &line, &capacity, 0, &newline);
+    while (!raw && newline && length > 0) {
+        size_t backslashes = 0;
+        while (backslashes < (size_t)length && line[length - 1 - (ssize_t)backslashes] == '\\') backslashes++;
+        if (backslashes % 2 == 0) break;
+        length = shell_read_input_line(shell_context_fd(&ctx->base, STDIN_FILENO), &line, &capacity, (size_t)length - 1, &newline);
+        if (length < 0) length = (ssize_t)strlen(line);
+    }
+    if (length < 0) {
+        free(line);
+        for (int j = 0; j < name_count; j++) shell_set_var(ctx, names[j], "");
+        return 1;
+    }
+
+    // Remove backslashes, remembering which characters they escaped
+    bool *escaped = shell_arena_alloc(&ctx->arena, (size_t)length + 1);
+    if (!escaped) {
+        free(line);
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t j = 0; j < (size_t)length; j++) {
+        escaped[n] = !raw && line[j] == '\\' && j + 1 < (size_t)length;
+        if (escaped[n]) j++;
+        line[n++] = line[j];
+    }
+    line[n] = '\0';
+
+    const char *ifs = shell_get_env(ctx, "IFS");
+    if (!ifs) ifs = " \t\n";
+    bool split = names != reply;
+
+    int status = newline ? 0 : 1;
+    size_t position = 0;
+    for (int j = 0; j < name_count; j++) {
+        while (split && position < n && !escaped[position] && shell_field_separator(ifs, line[position], true)) position++;
+        size_t start = position;
+        size_t end;
+
+        if (j == name_count - 1) {
+            end = n;
+            while (split && end > start && !escaped[end - 1] && shell_field_separator(ifs, line[end - 1], true)) end--;
+        } else {
+            while (position < n && (escaped[position] || !shell_field_separator(ifs, line[position], false))) position++;
+            end = position;
+            while (position < n && !escaped[position] && shell_field_separator(ifs, line[position], true)) position++;
+            if (position < n && !escaped[position] && shell_field_separator(ifs, line[position], false)) position++;
+        }
+
+        char *value = shell_arena_strndup(&ctx->arena, line + start, end - start);
+        if (!value || shell_set_var(ctx, names[j], value) != SHELL_OK) status = 1;
+    }
+
+    free(line);
+    return status;
+}
+
+// Add the built-in commands to the dispatch table. Shareable ones only
+// read their arguments and streams, and the history.
+static ShellError shell_register_builtins(ExtendedShellContext *ctx) {
+    static const struct {
+        const char *name;
+        BuiltinCallback builtin;
+        bool shareable;
+    } builtins[] = {
+        { ":", shell_builtin_true, true },
+        { "[", shell_builtin_test, true },
+        { "alias", shell_builtin_alias, false },
+        { "bg", shell_builtin_bg, false },
+        { "break", shell_builtin_break, false },
+        { "cd", shell_builtin_cd, false },
+        { "continue", shell_builtin_continue, false },
+        { "echo", shell_builtin_echo, true },
+        { "exit", shell_builtin_exit, false },
+        { "export", shell_builtin_export, false },
+        { "false", shell_builtin_false, true },
+        { "fg", shell_builtin_fg, false },
+        { "hash", shell_builtin_hash, false },
+        { "history", shell_builtin_history, true },
+        { "jobs", shell_builtin_jobs, false },
+        { "parallel", shell_builtin_parallel, false },
+        { "pin", shell_builtin_pin, false },
+        { "printf", shell_builtin_printf, true },
+        { "pwd", shell_builtin_pwd, true },
+        { "read", shell_builtin_read, false },
+        { "return", shell_builtin_return, false },
+        { "shift", shell_builtin_shift, false },
+        { "stats", shell_builtin_stats, false },
+        { "test", shell_builtin_test, true },
+        { "true", shell_builtin_true, true },
+        { "unalias", shell_builtin_unalias, false },
+        { "unset", shell_builtin_unset, false },
+    };
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        ShellCommand *command = shell_define_command(ctx, builtins[i].name, SHELL_COMMAND_BUILTIN);
+        if (!command) return SHELL_ERROR_MEMORY_ALLOCATION;
+        command->builtin = builtins[i].builtin;
+        command->shareable = builtins[i].shareable;
+    }
+
+    return SHELL_OK;
+}
+
+// Check whether a word is a NAME=value assignment
+static bool shell_is_assignment(const ShellToken *token) {
+    const char *equals = memchr(token->raw, '=', token->raw_length);
+    return equals && shell_valid_name(token->raw, (size_t)(equals - token->raw));
+}
+
+// Set a shell variable from an expanded NAME=value word
+static ShellError shell_assign(ExtendedShellContext *ctx, char *assignment) {
+    char *equals = strchr(assignment, '=');
+    *equals = '\0';
+    ShellError result = shell_set_var(ctx, assignment, equals + 1);
+    *equals = '=';
+    return result;
+}
+
+// Build the environment of a command prefixed by assignments in the line
+// arena, overriding any exported variable of the same name
+static char *const *shell_assignment_environment(ExtendedShellContext *ctx, char **assignments, int count) {
+    char *const *base = shell_environment(ctx);
+    size_t base_count = 0;
+    while (base[base_count]) base_count++;
+
+    char **envp = shell_arena_alloc(&ctx->arena, (base_count + (size_t)count + 1) * sizeof(char *));
+    if (!envp) return NULL;
+
+    size_t n = 0;
+    for (size_t i = 0; i < base_count; i++) {
+        bool overridden = false;
+        for (int j = 0; j < count && !overridden; j++) {
+            size_t name_length = (size_t)(strchr(assignments[j], '=') - assignments[j]);
+            overridden = strncmp(base[i], assignments[j], name_length + 1) == 0;
+        }
+        if (!overridden) envp[n++] = base[i];
+    }
+    for (int j = 0; j < count; j++) envp[n++] = assignments[j];
+    envp[n] = NULL;
+    return envp;
+}
+
+// Copy tokens to out, replacing unquoted alias names in command position
+// with the alias's tokens. An alias is not expanded again inside its own
+// expansion, which stops cycles such as alias ls='ls -F'.
+static ShellError shell_splice_aliases(ExtendedShellContext *ctx, ShellArena *arena, ShellTokenList *out, const ShellToken *tokens, size_t count,
+                                       const ShellCommand **active, int depth, bool *command_position) {
+    bool redirect_target = false;
+
+    for (size_t i = 0; i < count; i++) {
+        const ShellToken *token = &tokens[i];
+        ShellCommand *alias = NULL;
+
+        if (token->type == SHELL_TOKEN_WORD) {
+            if (*command_position && !redirect_target && !(token->flags & SHELL_WORD_QUOTED) && depth < SHELL_ALIAS_DEPTH) {
+                alias = shell_lookup_command(ctx, token->text);
+                if (alias && !alias->value) alias = NULL;
+                for (int j = 0; alias && j < depth; j++) {
+                    if (active[j] == alias) alias = NULL;
+                }
+            }
+            if (!alias && !redirect_target && !shell_is_assignment(token)) *command_position = false;
+            redirect_target = false;
+        } else {
+            redirect_target = shell_is_redirection(token->type);
+            if (!redirect_target) *command_position = true;
+        }
+
+        if (!alias) {
+            ShellToken *copy = shell_push_token(arena, out, token->type);
+            if (!copy) return SHELL_ERROR_MEMORY_ALLOCATION;
+            *copy = *token;
+            continue;
+        }
+
+        // Splice a copy, so the line is unaffected if it redefines the alias
+        size_t n = alias->alias_token_count;
+        char *block = shell_arena_alloc(arena, alias->value_size);
+        ShellToken *expansion = shell_arena_alloc(arena, (n + 1) * sizeof(ShellToken));
+        if (!block || !expansion) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+        memcpy(block, alias->value, alias->value_size);
+        for (size_t j = 0; j < n; j++) {
+            const ShellToken *source = &alias->alias_tokens[j];
+            expansion[j] = *source;
+            expansion[j].flags |= SHELL_WORD_ALIASED;
+            expansion[j].raw = block + (source->raw - alias->value);
+            if (source->text) expansion[j].text = block + (source->text - alias->value);
+        }
+
+        active[depth] = alias;
+        *command_position = true;
+        ShellError result = shell_splice_aliases(ctx, arena, out, expansion, n, active, depth + 1, command_position);
+        if (result != SHELL_OK) return result;
+
+        // An alias ending in a blank makes the next word a candidate as well
+        if (alias->alias_blank) *command_position = true;
+    }
+
+    return SHELL_OK;
+}
+
+// Grow an argument array in the line arena
+static bool shell_reserve_words(ExtendedShellContext *ctx, char ***words, size_t *capacity, size_t used, size_t extra) {
+    if (used + extra + 1 <= *capacity) return true;
+
+    size_t grown_capacity = *capacity * 2 > used + extra + 1 ? *capacity * 2 : used + extra + 1;
+    char **grown = shell_arena_alloc(&ctx->arena, grown_capacity * sizeof(char *));
+    if (!grown) return false;
+
+    memcpy(grown, *words, used * sizeof(char *));
+    *words = grown;
+    *capacity = grown_capacity;
+    return true;
+}
+
+// Expand aliases in a lexed line, allocating from the line's arena
+static ShellError shell_expand_aliases(ExtendedShellContext *ctx, ShellArena *arena, ShellTokenList *list) {
+    const ShellCommand *active[SHELL_ALIAS_DEPTH];
+    ShellTokenList expanded = { NULL, 0, 0, false };
+    bool command_position = true;
+
+    ShellError result = shell_splice_aliases(ctx, arena, &expanded, list->tokens, list->count, active, 0, &command_position);
+    if (result == SHELL_OK) *list = expanded;
+    return result;
+}
+
+// Redirection of a simple command. op is the operator token, which holds
+// the descriptor number and the body of a here-document.
+typedef struct {
+    ShellTokenType type;
+    const ShellToken *op;
+    const ShellToken *target;
+} ShellRedirect;
+
+// Kinds of syntax tree nodes
+typedef enum {
+    SHELL_NODE_SIMPLE,
+    SHELL_NODE_PIPELINE,
+    SHELL_NODE_AND_OR,
+    SHELL_NODE_LIST,
+    SHELL_NODE_IF,
+    SHELL_NODE_WHILE,
+    SHELL_NODE_UNTIL,
+    SHELL_NODE_FOR,
+    SHELL_NODE_GROUP,
+    SHELL_NODE_FUNCTION
+} ShellNodeType;
+
+// Node of a parsed command line. Simple commands keep their words as
+// tokens and are expanded each time they run; pipelines, and-or lists and
+// lists hold their children in order, and each pipeline of an and-or list
+// after the first is marked on_failure when || precedes it rather than &&.
+// Compound commands use the children as follows:
+//   if:           condition, body pairs, then the else body if there is one
+//   while, until: condition, body
+//   for:          body; name is the variable and words the list to iterate
+//   group:        the list between the braces
+//   function:     body; name is the function name and parse owns the tree
+typedef struct ShellNode {
+    ShellNodeType type;
+    bool background;
+    bool on_failure;
+    const ShellToken *words;
+    size_t word_count;
+    size_t assignment_count;
+    const ShellRedirect *redirects;
+    size_t redirect_count;
+    struct ShellNode **children;
+    size_t child_count;
+    const char *text;
+    size_t text_length;
+    bool text_is_line;  // text is the whole line, standing in for alias tokens
+    const ShellToken *name;
+    struct ShellParse *parse;
+} ShellNode;
+
+// A parsed line. The tree, its tokens and a copy of the line share one
+// arena. refs counts the parse cache, every execution in progress and
+// every function defined by the line. used is set whenever the cache hands
+// the parse out again, and cleared as the eviction clock passes it.
+typedef struct ShellParse {
+    ShellArena arena;
+    ShellNode *root;
+    unsigned long generation;
+    unsigned refs;
+    bool used;
+} ShellParse;
+
+// Parser position in a token list. incomplete is set when the tokens run
+// out inside a construct, so more input could still complete it; message
+// explains a syntax error that is more than an unexpected token.
+typedef struct {
+    ShellArena *arena;
+    const ShellToken *tokens;
+    size_t count;
+    size_t position;
+    const char *line;
+    size_t line_length;
+    ShellParse *owner;
+    bool incomplete;
+    const char *message;
+} ShellParser;
+
+// Allocate an empty node
+static ShellNode *shell_new_node(ShellArena *arena, ShellNodeType type) {
+    ShellNode *node = shell_arena_alloc(arena, sizeof(ShellNode));
+    if (node) {
+        memset(node, 0, sizeof(ShellNode));
+        node->type = type;
+    }
+    return node;
+}
+
+// Append a child node, growing the array inside the arena
+static bool shell_add_child(ShellArena *arena, ShellNode *parent, ShellNode *child, size_t *capacity) {
+    if (parent->child_count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 4;
+        ShellNode **children = shell_arena_alloc(arena, grown * sizeof(ShellNode *));
+        if (!children) return false;
+        if (parent->child_count) memcpy(children, parent->children, parent->child_count * sizeof(ShellNode *));
+        parent->children = children;
+        *capacity = grown;
+    }
+
+    parent->children[parent->child_count++] = child;
+    return true;
+}
+
+// Record the source text of tokens[first..last]. Tokens spliced in from an
+// alias do not point into the line, so the whole line stands in for them.
+static void shell_node_text(const ShellParser *parser, ShellNode *node, size_t first, size_t last) {
+    const ShellToken *a = &parser->tokens[first];
+    const ShellToken *b = &parser->tokens[last];
+
+    if ((a->flags | b->flags) & SHELL_WORD_ALIASED) {
+        node->text = parser->line;
+        node->text_length = parser->line_length;
+        node->text_is_line = true;
+    } else {
+        node->text = a->raw;
+        node->text_length = (size_t)(b->raw + b->raw_length - a->raw);
+    }
+}
+
+// simple_command: (WORD | redirection)+
+static ShellError shell_parse_simple(ShellParser *parser, ShellNode **out) {
+    const ShellToken *tokens = parser->tokens;
+    size_t start = parser->position;
+    size_t end = start;
+    size_t word_count = 0;
+    size_t redirect_count = 0;
+
+    // Count first so words and redirections get one allocation each
+    while (end < parser->count) {
+        ShellTokenType type = tokens[end].type;
+        if (type == SHELL_TOKEN_WORD) {
+            word_count++;
+            end++;
+        } else if (shell_is_redirection(type)) {
+            if (end + 1 >= parser->count || tokens[end + 1].type != SHELL_TOKEN_WORD) return SHELL_ERROR_SYNTAX;
+            redirect_count++;
+            end += 2;
+        } else {
+            break;
+        }
+    }
+    if (end == start) return SHELL_ERROR_SYNTAX;
+
+    ShellNode *node = shell_new_node(parser->arena, SHELL_NODE_SIMPLE);
+    ShellToken *words = shell_arena_alloc(parser->arena, (word_count + 1) * sizeof(ShellToken));
+    ShellRedirect *redirects = shell_arena_alloc(parser->arena, (redirect_count + 1) * sizeof(ShellRedirect));
+    if (!node || !words || !redirects) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    for (size_t i = start; i < end; i++) {
+        if (tokens[i].type == SHELL_TOKEN_WORD) {
+            words[node->word_count++] = tokens[i];
+        } else {
+            redirects[node->redirect_count++] = (ShellRedirect){ tokens[i].type, &tokens[i], &tokens[i + 1] };
+            i++;
+        }
+    }
+
+    // NAME=value words before the command name are assignments
+    while (node->assignment_count < word_count && shell_is_assignment(&words[node->assignment_count])) {
+        node->assignment_count++;
+    }
+
+    node->words = words;
+    node->redirects = redirects;
+    shell_node_text(parser, node, start, end - 1);
+    parser->position = end;
+    *out = node;
+    return SHELL_OK;
+}
+
+// Whether the next token is the given reserved word. Reserved words are
+// only recognized unquoted, and only where the parser expects a command.
+static bool shell_at_reserved(const ShellParser *parser, const char *word) {
+    if (parser->position >= parser->count) return false;
+    const ShellToken *token = &parser->tokens[parser->position];
+    return token->type == SHELL_TOKEN_WORD && !(token->flags & SHELL_WORD_QUOTED) && strcmp(token->text, word) == 0;
+}
+
+// Whether the next token is a reserved word that closes a compound list
+static bool shell_at_list_end(const ShellParser *parser) {
+    static const char *const words[] = { "then", "elif", "else", "fi", "do", "done", "}" };
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        if (shell_at_reserved(parser, words[i])) return true;
+    }
+    return false;
+}
+
+// Consume a reserved word the grammar requires here
+static ShellError shell_expect_reserved(ShellParser *parser, const char *word) {
+    if (parser->position >= parser->count) {
+        parser->incomplete = true;
+        return SHELL_ERROR_SYNTAX;
+    }
+    if (!shell_at_reserved(parser, word)) return SHELL_ERROR_SYNTAX;
+    parser->position++;
+    return SHELL_OK;
+}
+
+// Skip newlines where the grammar allows them
+static void shell_skip_newlines(ShellParser *parser) {
+    while (parser->position < parser->count && parser->tokens[parser->position].type == SHELL_TOKEN_NEWLINE) {
+        parser->position++;
+    }
+}
+
+static ShellError shell_parse_list(ShellParser *parser, ShellNode **out, bool nested);
+
+// compound_list: a non-empty list closed by a reserved word
+static ShellError shell_parse_body(ShellParser *parser, ShellNode **out) {
+    ShellError result = shell_parse_list(parser, out, true);
+    if (result != SHELL_OK) return result;
+    if (parser->position >= parser->count) {
+        parser->incomplete = true;
+        return SHELL_ERROR_SYNTAX;
+    }
+    return (*out)->child_count > 0 ? SHELL_OK : SHELL_ERROR_SYNTAX;
+}
+
+// Parse a body and append it to a compound command
+static ShellError shell_parse_child(ShellParser *parser, ShellNode *parent, size_t *capacity) {
+    ShellNode *body;
+    ShellError result = shell_parse_body(parser, &body);
+    if (result != SHELL_OK) return result;
+    return shell_add_child(parser->arena, parent, body, capacity) ? SHELL_OK : SHELL_ERROR_MEMORY_ALLOCATION;
+}
+
+// if_clause: 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+static ShellError shell_parse_if(ShellParser *parser, ShellNode *node) {
+    size_t capacity = 0;
+    ShellError result;
+
+    parser->position++;
+    do {
+        if ((result = shell_parse_child(parser, node, &capacity)) != SHELL_OK) return result;
+        if ((result = shell_expect_reserved(parser, "then")) != SHELL_OK) return result;
+        if ((result = shell_parse_child(parser, node, &capacity)) != SHELL_OK) return result;
+    } while (shell_expect_reserved(parser, "elif") == SHELL_OK);
+
+    if (shell_at_reserved(parser, "else")) {
+        parser->position++;
+        if ((result = shell_parse_child(parser, node, &capacity)) != SHELL_OK) return result;
+    }
+    return shell_expect_reserved(parser, "fi");
+}
+
+// do_group: 'do' list 'done'
+static ShellError shell_parse_do_group(ShellParser *parser, ShellNode *node, size_t *capacity) {
+    ShellError result = shell_expect_reserved(parser, "do");
+    if (result == SHELL_OK) result = shell_parse_child(parser, node, capacity);
+    if (result == SHELL_OK) result = shell_expect_reserved(parser, "done");
+    return result;
+}
+
+// while_clause: ('while' | 'until') list do_group
+static ShellError shell_parse_while(ShellParser *parser, ShellNode *node) {
+    size_t capacity = 0;
+    parser->position++;
+    ShellError result = shell_parse_child(parser, node, &capacity);
+    return result == SHELL_OK ? shell_parse_do_group(parser, node, &capacity) : result;
+}
+
+// for_clause: 'for' NAME ['in' WORD*] (';' | newline) do_group
+// Without 'in' the loop runs over "$@".
+static ShellError shell_parse_for(ShellParser *parser, ShellNode *node) {
+    parser->position++;
+    if (parser->position >= parser->count) {
+        parser->incomplete = true;
+        return SHELL_ERROR_SYNTAX;
+    }
+
+    const ShellToken *name = &parser->tokens[parser->position++];
+    if (name->type != SHELL_TOKEN_WORD || name->flags != 0 || !shell_valid_name(name->text, strlen(name->text))) {
+        return SHELL_ERROR_SYNTAX;
+    }
+    node->name = name;
+    shell_skip_newlines(parser);
+
+    if (shell_at_reserved(parser, "in")) {
+        size_t first = ++parser->position;
+        while (parser->position < parser->count && parser->tokens[parser->position].type == SHELL_TOKEN_WORD) {
+            parser->position++;
+        }
+        node->words = &parser->tokens[first];
+        node->word_count = parser->position - first;
+
+        if (parser->position >= parser->count) {
+            parser->incomplete = true;
+            return SHELL_ERROR_SYNTAX;
+        }
+        ShellTokenType separator = parser->tokens[parser->position].type;
+        if (separator != SHELL_TOKEN_SEMI && separator != SHELL_TOKEN_NEWLINE) return SHELL_ERROR_SYNTAX;
+        parser->position++;
+    } else {
+        static const ShellToken all = { SHELL_TOKEN_WORD, SHELL_WORD_QUOTED | SHELL_WORD_EXPAND, "$@", "\"$@\"", 4, -1 };
+        node->words = &all;
+        node->word_count = 1;
+        if (parser->position < parser->count && parser->tokens[parser->position].type == SHELL_TOKEN_SEMI) parser->position++;
+    }
+
+    size_t capacity = 0;
+    shell_skip_newlines(parser);
+    return shell_parse_do_group(parser, node, &capacity);
+}
+
+// brace_group: '{' list '}'
+static ShellError shell_parse_group(ShellParser *parser, ShellNode *node) {
+    size_t capacity = 0;
+    parser->position++;
+    ShellError result = shell_parse_child(parser, node, &capacity);
+    return result == SHELL_OK ? shell_expect_reserved(parser, "}") : result;
+}
+
+static ShellError shell_parse_command(ShellParser *parser, ShellNode **out);
+
+// function_definition: NAME '(' ')' newline* compound_command
+static ShellError shell_parse_function(ShellParser *parser, ShellNode *node) {
+    node->name = &parser->tokens[parser->position];
+    node->parse = parser->owner;
+    parser->position += 3;
+    shell_skip_newlines(parser);
+
+    ShellNode *body;
+    size_t capacity = 0;
+    ShellError result = shell_parse_command(parser, &body);
+    if (result != SHELL_OK) return result;
+    if (body->type == SHELL_NODE_SIMPLE) return SHELL_ERROR_SYNTAX;
+    return shell_add_child(parser->arena, node, body, &capacity) ? SHELL_OK : SHELL_ERROR_MEMORY_ALLOCATION;
+}
+
+// command: simple_command | compound_command | function_definition
+static ShellError shell_parse_command(ShellParser *parser, ShellNode **out) {
+    if (parser->position >= parser->count) {
+        parser->incomplete = true;
+        return SHELL_ERROR_SYNTAX;
+    }
+
+    static const struct {
+        const char *word;
+        ShellNodeType type;
+        ShellError (*parse)(ShellParser *, ShellNode *);
+    } compounds[] = {
+        { "if", SHELL_NODE_IF, shell_parse_if },
+        { "while", SHELL_NODE_WHILE, shell_parse_while },
+        { "until", SHELL_NODE_UNTIL, shell_parse_while },
+        { "for", SHELL_NODE_FOR, shell_parse_for },
+        { "{", SHELL_NODE_GROUP, shell_parse_group },
+    };
+
+    size_t start = parser->position;
+    const ShellToken *tokens = parser->tokens;
+    ShellNodeType type = SHELL_NODE_SIMPLE;
+    ShellError (*parse)(ShellParser *, ShellNode *) = NULL;
+
+    for (size_t i = 0; i < sizeof(compounds) / sizeof(compounds[0]) && !parse; i++) {
+        if (shell_at_reserved(parser, compounds[i].word)) {
+            type = compounds[i].type;
+            parse = compounds[i].parse;
+        }
+    }
+    if (!parse && start + 1 < parser->count && tokens[start].type == SHELL_TOKEN_WORD && tokens[start + 1].type == SHELL_TOKEN_LPAREN) {
+        if (start + 2 >= parser->count) {
+            parser->incomplete = true;
+            return SHELL_ERROR_SYNTAX;
+        }
+        if (tokens[start].flags != 0 || tokens[start + 2].type != SHELL_TOKEN_RPAREN) return SHELL_ERROR_SYNTAX;
+        type = SHELL_NODE_FUNCTION;
+        parse = shell_parse_function;
+    }
+    if (!parse) return shell_parse_simple(parser, out);
+
+    ShellNode *node = shell_new_node(parser->arena, type);
+    if (!node) return SHELL_ERROR_MEMORY_ALLOCATION;
+    ShellError result = parse(parser, node);
+    if (result != SHELL_OK) return result;
+
+    shell_node_text(parser, node, start, parser->position - 1);
+    *out = node;
+    return SHELL_OK;
+}
+
+// pipeline: simple_command ('|' newline* simple_command)* | command
+// Compound commands run in the shell itself, so they cannot yet be a
+// stage of a pipeline.
+static ShellError shell_parse_pipeline(ShellParser *parser, ShellNode **out) {
+    size_t start = parser->position;
+    ShellNode *first;
+    ShellError result = shell_parse_command(parser, &first);
+    if (result != SHELL_OK) return result;
+
+    if (parser->position >= parser->count || parser->tokens[parser->position].type != SHELL_TOKEN_PIPE) {
+        *out = first;
+        return SHELL_OK;
+    }
+    if (first->type != SHELL_NODE_SIMPLE) {
+        parser->message = "compound commands cannot be a stage of a pipeline yet";
+        return SHELL_ERROR_SYNTAX;
+    }
+
+    ShellNode *pipeline = shell_new_node(parser->arena, SHELL_NODE_PIPELINE);
+    size_t capacity = 0;
+    if (!pipeline || !shell_add_child(parser->arena, pipeline, first, &capacity)) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    while (parser->position < parser->count && parser->tokens[parser->position].type == SHELL_TOKEN_PIPE) {
+        parser->position++;
+        shell_skip_newlines(parser);
+        if (parser->position >= parser->count) {
+            parser->incomplete = true;
+            return SHELL_ERROR_SYNTAX;
+        }
+
+        // A compound stage is parsed whole, so the error names it rather
+        // than a reserved word inside it
+        ShellNode *stage;
+        result = shell_parse_command(parser, &stage);
+        if (result != SHELL_OK) return result;
+        if (stage->type != SHELL_NODE_SIMPLE) {
+            parser->message = "compound commands cannot be a stage of a pipeline yet";
+            return SHELL_ERROR_SYNTAX;
+        }
+        if (!shell_add_child(parser->arena, pipeline, stage, &capacity)) return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    shell_node_text(parser, pipeline, start, parser->position - 1);
+    *out = pipeline;
+    return SHELL_OK;
+}
+
+// and_or: pipeline (('&&' | '||') newline* pipeline)*
+// The operators have equal precedence and group from the left, so the
+// pipelines are kept flat and run in order, each one skipped unless the
+// status so far matches its operator.
+static ShellError shell_parse_and_or(ShellParser *parser, ShellNode **out) {
+    size_t start = parser->position;
+    ShellNode *first;
+    ShellError result = shell_parse_pipeline(parser, &first);
+    if (result != SHELL_OK) return result;
+
+    if (parser->position >= parser->count ||
+        (parser->tokens[parser->position].type != SHELL_TOKEN_AND_IF && parser->tokens[parser->position].type != SHELL_TOKEN_OR_IF)) {
+        *out = first;
+        return SHELL_OK;
+    }
+
+    ShellNode *list = shell_new_node(parser->arena, SHELL_NODE_AND_OR);
+    size_t capacity = 0;
+    if (!list || !shell_add_child(parser->arena, list, first, &capacity)) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    while (parser->position < parser->count &&
+           (parser->tokens[parser->position].type == SHELL_TOKEN_AND_IF || parser->tokens[parser->position].type == SHELL_TOKEN_OR_IF)) {
+        bool on_failure = parser->tokens[parser->position++].type == SHELL_TOKEN_OR_IF;
+        shell_skip_newlines(parser);
+        if (parser->position >= parser->count) {
+            parser->incomplete = true;
+            return SHELL_ERROR_SYNTAX;
+        }
+
+        ShellNode *next;
+        result = shell_parse_pipeline(parser, &next);
+        if (result != SHELL_OK) return result;
+        next->on_failure = on_failure;
+        if (!shell_add_child(parser->arena, list, next, &capacity)) return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    shell_node_text(parser, list, start, parser->position - 1);
+    *out = list;
+    return SHELL_OK;
+}
+
+// list: and_or ((';' | '&' | newline) and_or)* [';' | '&']
+// A nested list, the body of a compound command, ends before the reserved
+// word that closes it; at the top level those words are syntax errors.
+static ShellError shell_parse_list(ShellParser *parser, ShellNode **out, bool nested) {
+    ShellNode *list = shell_new_node(parser->arena, SHELL_NODE_LIST);
+    size_t capacity = 0;
+    if (!list) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    while (true) {
+        shell_skip_newlines(parser);
+        if (parser->position >= parser->count) break;
+        if (shell_at_list_end(parser)) {
+            if (nested) break;
+            return SHELL_ERROR_SYNTAX;
+        }
+
+        ShellNode *item;
+        ShellError result = shell_parse_and_or(parser, &item);
+        if (result != SHELL_OK) return result;
+        if (!shell_add_child(parser->arena, list, item, &capacity)) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+        if (parser->position >= parser->count) break;
+        const ShellNode *last = item->type == SHELL_NODE_AND_OR ? item->children[item->child_count - 1] : item;
+        if (nested && last->type != SHELL_NODE_SIMPLE && last->type != SHELL_NODE_PIPELINE && shell_at_list_end(parser)) break;
+
+        ShellTokenType separator = parser->tokens[parser->position].type;
+        if (separator == SHELL_TOKEN_AMP) {
+            // Compound commands and and-or lists run in the shell itself, so
+            // not in the background
+            if (item->type != SHELL_NODE_SIMPLE && item->type != SHELL_NODE_PIPELINE) {
+                parser->message = item->type == SHELL_NODE_AND_OR ? "and-or lists cannot run in the background yet"
+                                                                   : "compound commands cannot run in the background yet";
+                return SHELL_ERROR_SYNTAX;
+            }
+            item->background = true;
+        } else if (separator != SHELL_TOKEN_SEMI && separator != SHELL_TOKEN_NEWLINE) {
+            if (shell_is_redirection(separator) && last->type != SHELL_NODE_SIMPLE && last->type != SHELL_NODE_PIPELINE) {
+                parser->message = "compound commands cannot take redirections yet";
+            }
+            return SHELL_ERROR_SYNTAX;
+        }
+        parser->position++;
+    }
+
+    *out = list;
+    return SHELL_OK;
+}
+
+// Drop a reference to a parse
+static void shell_parse_release(ShellParse *parse) {
+    if (--parse->refs > 0) return;
+    shell_arena_free(&parse->arena);
+    free(parse);
+}
+
+// Empty the parse cache; parses still executing are freed when they finish
+static void shell_parse_cache_clear(ExtendedShellContext *ctx) {
+    for (size_t i = 0; i < ctx->parse_cache.capacity; i++) {
+        ShellParse *parse = ctx->parse_cache.entries[i].value;
+        if (ctx->parse_cache.entries[i].key && parse) shell_parse_release(parse);
+    }
+    shell_map_free(&ctx->parse_cache);
+    ctx->parse_cache_hand = 0;
+}
+
+// Make room in a full parse cache by dropping one line. The clock hand
+// sweeps the slots, giving each line reused since it last passed a second
+// chance, so lines a script keeps running stay cached while one-off lines
+// are dropped. Two turns always find a line.
+static void shell_parse_cache_evict(ExtendedShellContext *ctx) {
+    ShellMap *cache = &ctx->parse_cache;
+    for (size_t step = 0; step < 2 * cache->capacity; step++) {
+        ShellMapEntry *entry = &cache->entries[ctx->parse_cache_hand];
+        ctx->parse_cache_hand = (ctx->parse_cache_hand + 1) % cache->capacity;
+        if (!entry->key) continue;
+
+        ShellParse *parse = entry->value;
+        if (parse->used) {
+            parse->used = false;
+            continue;
+        }
+        shell_parse_release(shell_map_remove(cache, entry->key, entry->hash));
+        return;
+    }
+}
+
+// Report a syntax error on the context's standard error and set the status
+// to 2. While a script runs, the message names the line the error is on:
+// the line its command starts on plus the newlines before offset in text.
+static void shell_report_syntax(ExtendedShellContext *ctx, const char *text, size_t offset, const char *message) {
+    ShellOutput out;
+    shell_output_open(&out, &ctx->base, STDERR_FILENO);
+    if (ctx->script_line > 0) {
+        size_t line = ctx->script_line;
+        for (size_t i = 0; i < offset; i++) line += text[i] == '\n';
+        shell_output_printf(&out, "line %zu: ", line);
+    }
+    shell_output_printf(&out, "%s\n", message);
+    shell_output_flush(&out);
+    ctx->base.exit_status = 2;
+}
+
+// Report the syntax error a parser stopped at: its explanation, or the
+// token it could not take
+static void shell_report_parse_error(ExtendedShellContext *ctx, const ShellParser *parser) {
+    const ShellToken *token = parser->position < parser->count ? &parser->tokens[parser->position] : NULL;
+
+    // Tokens spliced in from an alias are not part of the line
+    bool in_line = token && token->raw >= parser->line && token->raw <= parser->line + parser->line_length;
+    size_t offset = in_line ? (size_t)(token->raw - parser->line) : parser->line_length;
+
+    char message[128];
+    if (parser->message) {
+        snprintf(message, sizeof(message), "syntax error: %s", parser->message);
+    } else if (!token) {
+        snprintf(message, sizeof(message), "syntax error: unexpected end of input");
+    } else if (token->type == SHELL_TOKEN_NEWLINE) {
+        snprintf(message, sizeof(message), "syntax error near newline");
+    } else {
+        int length = token->raw_length > 32 ? 32 : (int)token->raw_length;
+        snprintf(message, sizeof(message), "syntax error near '%.*s'", length, token->raw);
+    }
+    shell_report_syntax(ctx, parser->line, offset, message);
+}
+
+// Parse a line into a syntax tree, or reuse the cached tree of an identical
+// line. Aliases are spliced in while parsing, so a cached tree is only
+// reused while no alias has changed. The caller owns one reference to the
+// result. incomplete is set when the line fails to parse only because it
+// ends inside a quote or an unfinished construct; other syntax errors are
+// reported on the context's standard error.
+static ShellError shell_parse_line(ExtendedShellContext *ctx, const char *line, ShellParse **out, bool *incomplete) {
+    uint64_t started = ctx->profiling ? shell_clock_ns() : 0;
+    size_t length = strlen(line);
+    uint32_t hash = shell_hash_string(line);
+    *incomplete = false;
+
+    ShellMapEntry *entry = shell_map_find(&ctx->parse_cache, line, hash);
+    if (entry) {
+        ShellParse *cached = entry->value;
+        if (cached->generation == ctx->alias_generation) {
+            ctx->stats.parse_cache_hits++;
+            cached->refs++;
+            cached->used = true;
+            if (ctx->profiling) shell_histogram_add(&ctx->stats.parse_time, shell_clock_ns() - started);
+            *out = cached;
+            return SHELL_OK;
+        }
+        shell_parse_release(shell_map_remove(&ctx->parse_cache, line, hash));
+    }
+    ctx->stats.parse_cache_misses++;
+
+    ShellParse *parse = calloc(1, sizeof(ShellParse));
+    if (!parse) return SHELL_ERROR_MEMORY_ALLOCATION;
+    parse->refs = 1;
+    parse->generation = ctx->alias_generation;
+
+    // Tokens point into the parse's own copy of the line
+    char *copy = shell_arena_strndup(&parse->arena, line, length);
+    ShellTokenList list;
+    ShellError result = copy ? shell_lex(&parse->arena, copy, &list) : SHELL_ERROR_MEMORY_ALLOCATION;
+    if (result == SHELL_ERROR_SYNTAX) *incomplete = list.incomplete;
+    if (result == SHELL_OK && ctx->alias_count > 0) result = shell_expand_aliases(ctx, &parse->arena, &list);
+    if (result == SHELL_OK) {
+        ShellParser parser = { &parse->arena, list.tokens, list.count, 0, copy, length, parse, false, NULL };
+        result = shell_parse_list(&parser, &parse->root, false);
+        if (result == SHELL_ERROR_SYNTAX) *incomplete = parser.incomplete;
+        if (result == SHELL_ERROR_SYNTAX && !parser.incomplete) shell_report_parse_error(ctx, &parser);
+    }
+    if (result != SHELL_OK) {
+        shell_parse_release(parse);
+        return result;
+    }
+
+    // Very long lines are parsed each time rather than pinned in memory
+    if (length <= SHELL_PARSE_CACHE_MAX_LINE) {
+        if (ctx->parse_cache.count >= SHELL_PARSE_CACHE_SIZE) shell_parse_cache_evict(ctx);
+        entry = shell_map_insert(&ctx->parse_cache, line, hash);
+        if (entry) {
+            entry->value = parse;
+            parse->refs++;
+        }
+    }
+
+    if (ctx->profiling) shell_histogram_add(&ctx->stats.parse_time, shell_clock_ns() - started);
+    *out = parse;
+    return SHELL_OK;
+}
+
+// Whether a word is exactly "$@" or $@, which expands to one word per
+// positional parameter
+static bool shell_is_all_positional(const ShellToken *token) {
+    return (token->raw_length == 2 && memcmp(token->raw, "$@", 2) == 0) ||
+           (token->raw_length == 4 && memcmp(token->raw, "\"$@\"", 4) == 0);
+}
+
+// Expand words into a NULL-terminated array in the line arena. Globs are
+// replaced by their matches; a glob that matches nothing is kept literally.
+static ShellError shell_expand_words(ExtendedShellContext *ctx, const ShellToken *words, size_t count, char ***out, size_t *out_count) {
+    size_t capacity = count + 1;
+    char **argv = shell_arena_alloc(&ctx->arena, capacity * sizeof(char *));
+    if (!argv) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    size_t argc = 0;
+    for (size_t i = 0; i < count; i++) {
+        const ShellToken *word = &words[i];
+        char **paths = NULL;
+        size_t path_count = 0;
+        bool splice = false;
+
+        if (shell_is_all_positional(word)) {
+            paths = ctx->positional;
+            path_count = (size_t)ctx->positional_count;
+            splice = true;
+        } else if (word->flags & SHELL_WORD_GLOB) {
+            ShellError result = shell_glob_word(ctx, word, &paths, &path_count);
+            if (result != SHELL_OK) return result;
+            splice = path_count > 0;
+        }
+
+        if (splice) {
+            if (!shell_reserve_words(ctx, &argv, &capacity, argc, path_count + count - i)) {
+                return SHELL_ERROR_MEMORY_ALLOCATION;
+            }
+            if (path_count) memcpy(&argv[argc], paths, path_count * sizeof(char *));
+            argc += path_count;
+            continue;
+        }
+
+        argv[argc] = shell_expand_word(ctx, word);
+        if (!argv[argc++]) return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    argv[argc] = NULL;
+
+    *out = argv;
+    *out_count = argc;
+    return SHELL_OK;
+}
+
+// Whether a descriptor number is a run of digits, as after <& and >&
+static bool shell_parse_descriptor(const char *text, int *fd) {
+    if (!*text || strspn(text, "0123456789") != strlen(text) || strlen(text) > 4) return false;
+    *fd = atoi(text);
+    return true;
+}
+
+// Turn one parsed redirection into entries of a stage's redirection list.
+// A here-document or here-string becomes a memfd kept as a temporary; &>
+// and >& with a file name open the file onto stdout and copy it to stderr.
+static ShellError shell_add_redirection(ExtendedShellContext *ctx, const ShellRedirect *redirect, ShellRedirection *list, size_t *count) {
+    ShellTokenType type = redirect->type;
+    bool input = type == SHELL_TOKEN_LESS || type == SHELL_TOKEN_DLESS || type == SHELL_TOKEN_DLESSDASH ||
+                 type == SHELL_TOKEN_TLESS || type == SHELL_TOKEN_LESSAND;
+    int fd = redirect->op->fd != -1 ? redirect->op->fd : input ? STDIN_FILENO : STDOUT_FILENO;
+
+    if (type == SHELL_TOKEN_DLESS || type == SHELL_TOKEN_DLESSDASH || type == SHELL_TOKEN_TLESS) {
+        const char *text;
+        size_t length;
+        if (type == SHELL_TOKEN_TLESS) {
+            // A here-string is the expanded word and a newline
+            char *word = shell_expand_word(ctx, redirect->target);
+            length = word ? strlen(word) : 0;
+            char *line = word ? shell_arena_alloc(&ctx->arena, length + 2) : NULL;
+            if (!line) return SHELL_ERROR_MEMORY_ALLOCATION;
+            memcpy(line, word, length);
+            line[length++] = '\n';
+            line[length] = '\0';
+            text = line;
+        } else if (redirect->op->flags & SHELL_WORD_EXPAND) {
+            text = shell_expand_heredoc(ctx, redirect->op->text, &length);
+            if (!text) return SHELL_ERROR_MEMORY_ALLOCATION;
+        } else {
+            text = redirect->op->text;
+            length = strlen(text);
+        }
+
+        int document = shell_open_document(text, length);
+        if (document == -1) {
+            shell_printf(&ctx->base, STDERR_FILENO, "here-document: %s\n", strerror(errno));
+            return SHELL_ERROR_REDIRECTION_FAILED;
+        }
+        if (!shell_add_temporary(ctx, document, -1)) return SHELL_ERROR_MEMORY_ALLOCATION;
+        list[(*count)++] = (ShellRedirection){ fd, NULL, 0, document };
+        return SHELL_OK;
+    }
+
+    char *target = shell_expand_word(ctx, redirect->target);
+    if (!target) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    int source;
+    switch (type) {
+        case SHELL_TOKEN_LESS:
+            list[(*count)++] = (ShellRedirection){ fd, target, O_RDONLY, -1 };
+            return SHELL_OK;
+        case SHELL_TOKEN_GREAT:
+            list[(*count)++] = (ShellRedirection){ fd, target, O_WRONLY | O_CREAT | O_TRUNC, -1 };
+            return SHELL_OK;
+        case SHELL_TOKEN_DGREAT:
+            list[(*count)++] = (ShellRedirection){ fd, target, O_WRONLY | O_CREAT | O_APPEND, -1 };
+            return SHELL_OK;
+        case SHELL_TOKEN_LESSAND:
+        case SHELL_TOKEN_GREATAND:
+            if (strcmp(target, "-") == 0) {
+                list[(*count)++] = (ShellRedirection){ fd, NULL, 0, -1 };
+                return SHELL_OK;
+            }
+            if (shell_parse_descriptor(target, &source)) {
+                list[(*count)++] = (ShellRedirection){ fd, NULL, 0, source };
+                return SHELL_OK;
+            }
+            // >& file without a descriptor number is the same as &> file
+            if (type == SHELL_TOKEN_LESSAND || redirect->op->fd != -1) {
+                shell_printf(&ctx->base, STDERR_FILENO, "%s: ambiguous redirect\n", target);
+                return SHELL_ERROR_REDIRECTION_FAILED;
+            }
+            /* fall through */
+        case SHELL_TOKEN_AND_GREAT:
+        case SHELL_TOKEN_AND_DGREAT:
+            list[(*count)++] = (ShellRedirection){ STDOUT_FILENO, target, O_WRONLY | O_CREAT | (type == SHELL_TOKEN_AND_DGREAT ? O_APPEND : O_TRUNC), -1 };
+            list[(*count)++] = (ShellRedirection){ STDERR_FILENO, NULL, 0, STDOUT_FILENO };
+            return SHELL_OK;
+        default:
+            return SHELL_ERROR_SYNTAX;
+    }
+}
+
+// Expand a simple command into a pipeline stage: words are expanded and
+// globbed, redirection targets expanded, and leading assignments either
+// returned through assignments or, for a command with words, turned into
+// the stage's environment. Plain <, > and >> of the standard streams fill
+// the input and output files; the other redirections go to the list.
+static ShellError shell_build_stage(ExtendedShellContext *ctx, const ShellNode *node, ShellPipelineStage *stage, char ***assignments) {
+    *stage = (ShellPipelineStage){ NULL, NULL, NULL, false, NULL, NULL, 0, NULL };
+    ctx->substituted = false;
+
+    char **values = shell_arena_alloc(&ctx->arena, (node->assignment_count + 1) * sizeof(char *));
+    if (!values) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    for (size_t i = 0; i < node->assignment_count; i++) {
+        values[i] = shell_expand_word(ctx, &node->words[i]);
+        if (!values[i]) return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    values[node->assignment_count] = NULL;
+
+    size_t argc;
+    ShellError result = shell_expand_words(ctx, node->words + node->assignment_count, node->word_count - node->assignment_count, &stage->argv, &argc);
+    if (result != SHELL_OK) return result;
+
+    // pin before a command gives the command's process its settings; when
+    // they do not parse, the built-in runs and reports why
+    ShellCommand *pin = argc > 1 && strcmp(stage->argv[0], "pin") == 0 ? shell_lookup_command(ctx, "pin") : NULL;
+    if (pin && pin->kind == SHELL_COMMAND_BUILTIN) {
+        ShellSpawnResources *resources = shell_arena_alloc(&ctx->arena, sizeof(ShellSpawnResources));
+        if (!resources) return SHELL_ERROR_MEMORY_ALLOCATION;
+        int first;
+        if (shell_parse_pin(ctx, (int)argc, stage->argv, resources, &first, false) && first < (int)argc) {
+            stage->argv += first;
+            stage->resources = resources;
+        }
+    }
+
+    // A word naming a process substitution's pipe as /dev/fd/N, here or in
+    // an enclosing command such as a for loop, needs the descriptor to stay
+    // open across exec
+    size_t passed = 0;
+    for (size_t i = 0; i < ctx->temporary_count; i++) passed += ctx->temporaries[i].pid > 0 && ctx->temporaries[i].fd != -1;
+
+    bool plain = passed == 0;
+    for (size_t i = 0; plain && i < node->redirect_count; i++) {
+        ShellTokenType type = node->redirects[i].type;
+        plain = node->redirects[i].op->fd == -1 && (type == SHELL_TOKEN_LESS || type == SHELL_TOKEN_GREAT || type == SHELL_TOKEN_DGREAT);
+    }
+
+    if (plain) {
+        for (size_t i = 0; i < node->redirect_count; i++) {
+            const ShellRedirect *redirect = &node->redirects[i];
+            char *target = shell_expand_word(ctx, redirect->target);
+            if (!target) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+            if (redirect->type == SHELL_TOKEN_LESS) {
+                stage->input_file = target;
+            } else {
+                stage->output_file = target;
+                stage->append_output = redirect->type == SHELL_TOKEN_DGREAT;
+            }
+        }
+    } else {
+        // Each redirection adds at most two entries
+        ShellRedirection *list = shell_arena_alloc(&ctx->arena, (passed + 2 * node->redirect_count) * sizeof(ShellRedirection));
+        if (!list) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+        size_t count = 0;
+        for (size_t i = 0; i < ctx->temporary_count; i++) {
+            int fd = ctx->temporaries[i].fd;
+            if (ctx->temporaries[i].pid > 0 && fd != -1) list[count++] = (ShellRedirection){ fd, NULL, 0, fd };
+        }
+        for (size_t i = 0; i < node->redirect_count; i++) {
+            result = shell_add_redirection(ctx, &node->redirects[i], list, &count);
+            if (result != SHELL_OK) {
+                ctx->base.exit_status = 1;
+                return result;
+            }
+        }
+        stage->redirections = list;
+        stage->redirection_count = count;
+    }
+
+    // Leading assignments only reach the environment of the command they prefix
+    if (argc > 0 && node->assignment_count > 0) {
+        stage->envp = shell_assignment_environment(ctx, values, (int)node->assignment_count);
+        if (!stage->envp) return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    *assignments = values;
+    return SHELL_OK;
+}
+
+// Run a command without words: assignments set shell variables, and
+// redirections are performed for their side effects, as with "> file"
+static int shell_run_empty_command(ExtendedShellContext *ctx, const ShellPipelineStage *stage, char **assignments) {
+    // Without a command, the status is that of the last command substitution
+    int status = ctx->substituted ? ctx->base.exit_status : 0;
+    for (size_t i = 0; assignments[i]; i++) {
+        if (shell_assign(ctx, assignments[i]) != SHELL_OK) status = 1;
+    }
+
+    const ShellRedirection *redirections;
+    size_t count;
+    if (!shell_stage_redirections(ctx, stage, &redirections, &count)) return 1;
+    for (size_t i = 0; i < count; i++) {
+        if (!redirections[i].path) continue;
+        int fd = openat(shell_dir_fd(ctx), redirections[i].path, redirections[i].flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            shell_printf(&ctx->base, STDERR_FILENO, "%s: %s\n", redirections[i].path, strerror(errno));
+            status = 1;
+        } else {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+static ShellError shell_execute_node(ExtendedShellContext *ctx, const ShellNode *node);
+
+// Context descriptor replaced while a command runs in the shell process:
+// what it was before, and the descriptor opened for it, or -1
+typedef struct {
+    int fd;
+    int saved;
+    int opened;
+} ShellSavedDescriptor;
+
+// Undo shell_redirect_in_process, last change first
+static void shell_restore_in_process(ExtendedShellContext *ctx, ShellSavedDescriptor *saved, size_t count) {
+    for (size_t i = count; i-- > 0;) {
+        ctx->base.fds[saved[i].fd] = saved[i].saved;
+        if (saved[i].opened != -1) close(saved[i].opened);
+    }
+}
+
+// Apply a command's redirections to the context's descriptors while it
+// runs in the shell process; the process's own descriptors stay as they
+// are. *saved receives the changes to undo, in the line arena; a command
+// without redirections needs none.
+static bool shell_redirect_in_process(ExtendedShellContext *ctx, const ShellPipelineStage *stage, ShellSavedDescriptor **saved, size_t *saved_count) {
+    const ShellRedirection *redirections;
+    size_t count;
+    *saved = NULL;
+    *saved_count = 0;
+    if (!shell_stage_redirections(ctx, stage, &redirections, &count)) return false;
+    if (count == 0) return true;
+
+    *saved = shell_arena_alloc(&ctx->arena, count * sizeof(ShellSavedDescriptor));
+    if (!*saved) return false;
+
+    for (size_t i = 0; i < count; i++) {
+        const ShellRedirection *redirection = &redirections[i];
+        int fd = redirection->fd;
+        // Keeping a descriptor open across exec means nothing in process
+        if (!redirection->path && redirection->source == fd) continue;
+        if (fd < 0 || fd >= SHELL_CONTEXT_FDS) {
+            shell_printf(&ctx->base, STDERR_FILENO, "%d: %s\n", fd, strerror(EBADF));
+            shell_restore_in_process(ctx, *saved, *saved_count);
+            return false;
+        }
+
+        // What the context's descriptor stands for next: a file opened or a
+        // copy of the source, both placed above 9 like every entry
+        int opened = -1;
+        bool applied = true;
+        if (redirection->path) {
+            opened = shell_fd_above_context(openat(shell_dir_fd(ctx), redirection->path, redirection->flags | O_CLOEXEC, 0644));
+            if (opened == -1) shell_printf(&ctx->base, STDERR_FILENO, "%s: %s\n", redirection->path, strerror(errno));
+            applied = opened != -1;
+        } else if (redirection->source != -1) {
+            int source = shell_context_fd(&ctx->base, redirection->source);
+            opened = source == -1 ? -1 : fcntl(source, F_DUPFD_CLOEXEC, SHELL_CONTEXT_FDS);
+            if (opened == -1) shell_printf(&ctx->base, STDERR_FILENO, "%d: %s\n", redirection->source, strerror(source == -1 ? EBADF : errno));
+            applied = opened != -1;
+        }
+        if (!applied) {
+            shell_restore_in_process(ctx, *saved, *saved_count);
+            return false;
+        }
+        (*saved)[(*saved_count)++] = (ShellSavedDescriptor){ fd, ctx->base.fds[fd], opened };
+        ctx->base.fds[fd] = opened;
+    }
+    return true;
+}
+
+// Call a shell function with its arguments as the positional parameters.
+// The body runs from the tree it was parsed into, and that parse stays
+// referenced while it runs, so a function may safely redefine itself.
+static int shell_call_function(ExtendedShellContext *ctx, ShellCommand *function, int argc, char **argv) {
+    if (ctx->function_depth >= SHELL_FUNCTION_DEPTH) {
+        shell_printf(&ctx->base, STDERR_FILENO, "%s: maximum function nesting level exceeded\n", argv[0]);
+        return 1;
+    }
+
+    ShellParse *parse = function->function;
+    char **positional = ctx->positional;
+    int positional_count = ctx->positional_count;
+    int loop_depth = ctx->loop_depth;
+
+    // break and continue inside the function cannot reach the caller's loops
+    parse->refs++;
+    ctx->positional = argv + 1;
+    ctx->positional_count = argc - 1;
+    ctx->loop_depth = 0;
+    ctx->function_depth++;
+
+    shell_execute_node(ctx, function->body);
+
+    ctx->function_depth--;
+    ctx->loop_depth = loop_depth;
+    ctx->returning = false;
+    ctx->positional = positional;
+    ctx->positional_count = positional_count;
+    shell_parse_release(parse);
+    return ctx->base.exit_status;
+}
+
+// Run a simple command or pipeline. Its expanded words live in the line
+// arena only while it runs.
+static ShellError shell_execute_pipeline_node(ExtendedShellContext *ctx, const ShellNode *node) {
+    size_t stage_count = node->type == SHELL_NODE_PIPELINE ? node->child_count : 1;
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    size_t temporaries = ctx->temporary_count;
+    ShellPipelineStage *stages = shell_arena_alloc(&ctx->arena, stage_count * sizeof(ShellPipelineStage));
+    char **assignments = NULL;
+    ShellError result = stages ? SHELL_OK : SHELL_ERROR_MEMORY_ALLOCATION;
+
+    for (size_t i = 0; result == SHELL_OK && i < stage_count; i++) {
+        const ShellNode *command = node->type == SHELL_NODE_PIPELINE ? node->children[i] : node;
+        result = shell_build_stage(ctx, command, &stages[i], &assignments);
+    }
+
+    // The job table keeps the command text of background and stopped jobs
+    const char *text = result == SHELL_OK ? shell_arena_strndup(&ctx->arena, node->text, node->text_length) : NULL;
+    if (result == SHELL_OK && !text) result = SHELL_ERROR_MEMORY_ALLOCATION;
+
+    if (result == SHELL_OK && stage_count == 1 && !node->background) {
+        ShellCommand *entry = stages[0].argv[0] ? shell_lookup_command(ctx, stages[0].argv[0]) : NULL;
+        int argc = 0;
+        while (stages[0].argv[argc]) argc++;
+
+        if (argc == 0) {
+            ctx->base.exit_status = shell_run_empty_command(ctx, &stages[0], assignments);
+        } else if (entry && !stages[0].resources && entry->kind != SHELL_COMMAND_ALIAS && entry->kind != SHELL_COMMAND_STREAM) {
+            // Like POSIX special built-ins, they keep any leading assignments
+            for (size_t i = 0; assignments[i]; i++) shell_assign(ctx, assignments[i]);
+
+            // Redirections apply to the context's descriptors while the command runs
+            ShellSavedDescriptor *saved;
+            size_t saved_count;
+            if (!shell_redirect_in_process(ctx, &stages[0], &saved, &saved_count)) {
+                ctx->base.exit_status = 1;
+            } else {
+                bool profiling = ctx->profiling;
+                uint64_t started = profiling ? shell_clock_ns() : 0;
+                struct rusage usage;
+                if (profiling) shell_thread_usage(&usage);
+
+                ShellDispatch dispatch;
+                if (entry->kind == SHELL_COMMAND_CUSTOM) {
+                    dispatch = SHELL_DISPATCH_CUSTOM;
+                    result = entry->callback(&ctx->base, argc, stages[0].argv);
+                    ctx->base.exit_status = result == SHELL_OK ? 0 : 1;
+                } else if (entry->kind == SHELL_COMMAND_FUNCTION) {
+                    dispatch = SHELL_DISPATCH_FUNCTION;
+                    ctx->base.exit_status = shell_call_function(ctx, entry, argc, stages[0].argv);
+                } else {
+                    dispatch = SHELL_DISPATCH_BUILTIN;
+                    ctx->base.exit_status = entry->builtin(ctx, argc, stages[0].argv);
+                }
+
+                if (profiling) {
+                    struct rusage before = usage;
+                    shell_usage_since(&before, &usage);
+                    shell_profile_command(ctx, stages[0].argv[0], dispatch, shell_clock_ns() - started, 0, &usage);
+                }
+                shell_restore_in_process(ctx, saved, saved_count);
+            }
+        } else if (!shell_check_launchable(ctx, stages, 1, false)) {
+            result = SHELL_ERROR_INVALID_INPUT;
+        } else {
+            // External and stream commands, which get their redirections as descriptors
+            result = shell_launch_pipeline(ctx, stages, 1, false, text, temporaries);
+        }
+    } else if (result == SHELL_OK) {
+        result = shell_check_launchable(ctx, stages, stage_count, node->background)
+                     ? shell_launch_pipeline(ctx, stages, (int)stage_count, node->background, text, temporaries)
+                     : SHELL_ERROR_INVALID_INPUT;
+    }
+
+    shell_release_temporaries(ctx, temporaries);
+    shell_arena_release(&ctx->arena, mark);
+    if (result != SHELL_OK) ctx->base.last_error = result;
+    return result;
+}
+
+// Whether break, continue or return is unwinding the commands being run
+static bool shell_unwinding(const ExtendedShellContext *ctx) {
+    return ctx->break_levels > 0 || ctx->continue_levels > 0 || ctx->returning || ctx->exit_requested;
+}
+
+// Account for break and continue at the end of a loop iteration; returns
+// true if the loop must stop. A command killed by SIGINT interrupts every
+// loop, as it would a shell that received the signal itself.
+static bool shell_loop_done(ExtendedShellContext *ctx) {
+    if (ctx->base.exit_status == 128 + SIGINT) ctx->break_levels = ctx->loop_depth;
+    if (ctx->break_levels > 0) {
+        ctx->break_levels--;
+        return true;
+    }
+    if (ctx->continue_levels > 0) return --ctx->continue_levels > 0;
+    return ctx->returning || ctx->exit_requested;
+}
+
+// Store a function definition in the dispatch table
+static ShellError shell_define_function(ExtendedShellContext *ctx, const ShellNode *node) {
+    ShellCommand *command = shell_define_command(ctx, node->name->text, SHELL_COMMAND_FUNCTION);
+    if (!command) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    command->function = node->parse;
+    command->body = node->children[0];
+    node->parse->refs++;
+    ctx->base.exit_status = 0;
+    return SHELL_OK;
+}
+
+// Run a while or until loop. Its status is that of the last body run, or
+// zero if the body never ran.
+static ShellError shell_execute_while(ExtendedShellContext *ctx, const ShellNode *node) {
+    ShellError result = SHELL_OK;
+    int status = 0;
+
+    ctx->loop_depth++;
+    while (true) {
+        result = shell_execute_node(ctx, node->children[0]);
+        if (!shell_unwinding(ctx)) {
+            if ((ctx->base.exit_status == 0) == (node->type == SHELL_NODE_UNTIL)) {
+                ctx->base.exit_status = status;
+                break;
+            }
+            result = shell_execute_node(ctx, node->children[1]);
+            status = ctx->base.exit_status;
+        }
+        if (shell_loop_done(ctx)) break;
+    }
+    ctx->loop_depth--;
+    return result;
+}
+
+// Run a for loop. The word list is expanded once, before the first
+// iteration, and stays in the line arena until the loop ends.
+static ShellError shell_execute_for(ExtendedShellContext *ctx, const ShellNode *node) {
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    size_t temporaries = ctx->temporary_count;
+    char **values;
+    size_t count;
+    ShellError result = shell_expand_words(ctx, node->words, node->word_count, &values, &count);
+
+    if (result == SHELL_OK) {
+        ctx->base.exit_status = 0;
+        ctx->loop_depth++;
+        for (size_t i = 0; i < count; i++) {
+            ShellError assigned = shell_set_var(ctx, node->name->text, values[i]);
+            if (assigned != SHELL_OK) {
+                result = assigned;
+                break;
+            }
+            result = shell_execute_node(ctx, node->children[0]);
+            if (shell_loop_done(ctx)) break;
+        }
+        ctx->loop_depth--;
+    }
+
+    shell_release_temporaries(ctx, temporaries);
+    shell_arena_release(&ctx->arena, mark);
+    return result;
+}
+
+// Execute a syntax tree node
+static ShellError shell_execute_node(ExtendedShellContext *ctx, const ShellNode *node) {
+    ShellError result = SHELL_OK;
+
+    switch (node->type) {
+        case SHELL_NODE_SIMPLE:
+        case SHELL_NODE_PIPELINE:
+            return shell_execute_pipeline_node(ctx, node);
+
+        case SHELL_NODE_LIST:
+            // Items run in order whatever their status; the last one decides the result
+            for (size_t i = 0; i < node->child_count && !shell_unwinding(ctx); i++) {
+                result = shell_execute_node(ctx, node->children[i]);
+            }
+            return result;
+
+        case SHELL_NODE_AND_OR:
+            // A pipeline after && runs if the status so far is zero, and one
+            // after || if it is not
+            result = shell_execute_node(ctx, node->children[0]);
+            for (size_t i = 1; i < node->child_count && !shell_unwinding(ctx); i++) {
+                if (node->children[i]->on_failure == (ctx->base.exit_status != 0)) result = shell_execute_node(ctx, node->children[i]);
+            }
+            return result;
+
+        case SHELL_NODE_IF: {
+            size_t i = 0;
+            for (; i + 1 < node->child_count; i += 2) {
+                shell_execute_node(ctx, node->children[i]);
+                if (shell_unwinding(ctx)) return SHELL_OK;
+                if (ctx->base.exit_status == 0) return shell_execute_node(ctx, node->children[i + 1]);
+            }
+            if (i < node->child_count) return shell_execute_node(ctx, node->children[i]);
+            ctx->base.exit_status = 0;
+            return SHELL_OK;
+        }
+
+        case SHELL_NODE_WHILE:
+        case SHELL_NODE_UNTIL:
+            return shell_execute_while(ctx, node);
+
+        case SHELL_NODE_FOR:
+            return shell_execute_for(ctx, node);
+
+        case SHELL_NODE_GROUP:
+            return shell_execute_node(ctx, node->children[0]);
+
+        case SHELL_NODE_FUNCTION:
+            result = shell_define_function(ctx, node);
+            if (result != SHELL_OK) ctx->base.last_error = result;
+            return result;
+    }
+    return result;
+}
+
+// Execute a parsed line and drop the caller's reference to it. A line run
+// from outside the shell clears any earlier exit request.
+static ShellError shell_execute_parse(ExtendedShellContext *ctx, ShellParse *parse) {
+    if (ctx->execute_depth++ == 0) ctx->exit_requested = false;
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    size_t temporaries = ctx->temporary_count;
+    ShellError result = shell_execute_node(ctx, parse->root);
+    shell_release_temporaries(ctx, temporaries);
+    shell_arena_release(&ctx->arena, mark);
+    ctx->execute_depth--;
+    shell_parse_release(parse);
+    return result;
+}
+
+// Parse and execute a command line, reporting through incomplete whether
+// it failed only for want of further lines
+static ShellError shell_execute_text(ExtendedShellContext *ctx, const char *command, bool *incomplete) {
+    ShellParse *parse;
+    ShellError result = shell_parse_line(ctx, command, &parse, incomplete);
+    if (result != SHELL_OK) {
+        ctx->base.last_error = result;
+        return result;
+    }
+    return shell_execute_parse(ctx, parse);
+}
+
+// Parse and execute a command line: simple commands, pipelines, lists
+// separated by ; or &, and the if, while, until and for compound commands,
+// brace groups and function definitions. Parsed lines are cached, so
+// running the same line again skips lexing and parsing, and loop bodies and
+// functions run from their tree without being parsed again. Expansion state
+// is allocated from the context's arena and released when the line
+// completes, so nested calls from custom commands only roll back their own
+// allocations.
+ShellError shell_execute_command(ExtendedShellContext *ctx, const char *command) {
+    if (!ctx || !command) return SHELL_ERROR_NULL_POINTER;
+
+    bool incomplete;
+    ShellError result = shell_execute_text(ctx, command, &incomplete);
+    if (incomplete) shell_report_syntax(ctx, command, 0, "syntax error: unexpected end of input");
+    return result;
+}
+
+// Name of the first stage that cannot run in a process of its own, or
+// NULL. Built-ins run from PATH; functions, custom and stream commands
+// and commands without words need the shell itself.
+static const char *shell_detached_unsupported(ExtendedShellContext *ctx, const ShellPipelineStage *stages, size_t stage_count) {
+    for (size_t i = 0; i < stage_count; i++) {
+        const char *name = stages[i].argv[0];
+        ShellCommand *entry = name ? shell_lookup_command(ctx, name) : NULL;
+        if (!name) return "assignment";
+        if (entry && entry->kind != SHELL_COMMAND_BUILTIN && entry->kind != SHELL_COMMAND_ALIAS) return name;
+    }
+    return NULL;
+}
+
+// Spawn the stages of a pipeline that the shell does not wait for itself,
+// reading from input and writing to output (-1 to inherit). The pids of
+// the stages started go to pids. Returns 0, or the errno of the stage that
+// could not be spawned.
+static int shell_spawn_detached(ExtendedShellContext *ctx, const ShellPipelineStage *stages, size_t stage_count,
+                                int input, int output, pid_t pgid, pid_t *pids, size_t *spawned) {
+    int prev_read = input;
+    int status = 0;
+    *spawned = 0;
+    for (size_t i = 0; i < stage_count; i++) {
+        int pipe_fds[2] = { -1, -1 };
+        bool last = i == stage_count - 1;
+        if (!last && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            status = errno;
+            break;
+        }
+
+        ShellSpawnRequest request = { stages[i].argv, stages[i].envp, prev_read, last ? output : pipe_fds[1],
+                                      stages[i].input_file, stages[i].output_file, stages[i].append_output,
+                                      stages[i].redirections, stages[i].redirection_count, pgid, stages[i].resources, NULL };
+        pid_t pid;
+        status = shell_spawn_process(ctx, &request, &pid);
+        if (prev_read != input) close(prev_read);
+        if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        prev_read = pipe_fds[0];
+
+        if (status != 0) {
+            shell_printf(&ctx->base, STDERR_FILENO, "%s: %s\n", stages[i].argv[0], strerror(status));
+            break;
+        }
+        if (pgid == 0) pgid = pid;
+        pids[(*spawned)++] = pid;
+    }
+    if (prev_read != input && prev_read != -1) close(prev_read);
+    return status;
+}
+
+// Whether any word or redirection target of a pipeline is <(...) or >(...)
+static bool shell_has_process_substitution(const ShellNode *node) {
+    size_t stage_count = node->type == SHELL_NODE_PIPELINE ? node->child_count : 1;
+    for (size_t i = 0; i < stage_count; i++) {
+        const ShellNode *stage = node->type == SHELL_NODE_PIPELINE ? node->children[i] : node;
+        for (size_t j = 0; j < stage->word_count; j++) {
+            if (stage->words[j].flags & SHELL_WORD_PROCESS) return true;
+        }
+        for (size_t j = 0; j < stage->redirect_count; j++) {
+            if (stage->redirects[j].target->flags & SHELL_WORD_PROCESS) return true;
+        }
+    }
+    return false;
+}
+
+// Expand <(command) or >(command): the pipeline starts in the background,
+// connected to a pipe whose other end the shell keeps as a temporary, and
+// the word becomes that end's /dev/fd name. A command that cannot run
+// separately is reported and replaced by /dev/null.
+static char *shell_expand_process(ExtendedShellContext *ctx, const ShellToken *token) {
+    bool reading = token->raw[0] == '<';
+    char *inner = shell_arena_strndup(&ctx->arena, token->raw + 2, token->raw_length - 3);
+    if (!inner) return NULL;
+
+    ShellParse *parse;
+    bool incomplete;
+    if (shell_parse_line(ctx, inner, &parse, &incomplete) != SHELL_OK) {
+        if (incomplete) shell_printf(&ctx->base, STDERR_FILENO, "%.*s: syntax error\n", (int)token->raw_length, token->raw);
+        return "/dev/null";
+    }
+
+    const ShellNode *node = parse->root->child_count == 1 ? parse->root->children[0] : NULL;
+    if (!node || node->background || (node->type != SHELL_NODE_SIMPLE && node->type != SHELL_NODE_PIPELINE)) {
+        shell_printf(&ctx->base, STDERR_FILENO, "%.*s: only a pipeline can be substituted\n", (int)token->raw_length, token->raw);
+        shell_parse_release(parse);
+        return "/dev/null";
+    }
+
+    // The stages are built like any other, keeping the flag that tells the
+    // enclosing command whether a substitution ran
+    bool substituted = ctx->substituted;
+    size_t stage_count = node->type == SHELL_NODE_PIPELINE ? node->child_count : 1;
+    size_t temporaries = ctx->temporary_count;
+    ShellPipelineStage *stages = shell_arena_alloc(&ctx->arena, stage_count * sizeof(ShellPipelineStage));
+    pid_t *pids = shell_arena_alloc(&ctx->arena, stage_count * sizeof(pid_t));
+    ShellError result = stages && pids ? SHELL_OK : SHELL_ERROR_MEMORY_ALLOCATION;
+    char **assignments;
+    for (size_t i = 0; result == SHELL_OK && i < stage_count; i++) {
+        result = shell_build_stage(ctx, node->type == SHELL_NODE_PIPELINE ? node->children[i] : node, &stages[i], &assignments);
+    }
+    ctx->substituted = substituted;
+
+    const char *unsupported = result == SHELL_OK ? shell_detached_unsupported(ctx, stages, stage_count) : NULL;
+    if (unsupported) shell_printf(&ctx->base, STDERR_FILENO, "%s: cannot run in a process substitution\n", unsupported);
+
+    int pipe_fds[2] = { -1, -1 };
+    size_t spawned = 0;
+    if (result == SHELL_OK && !unsupported && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        shell_spawn_detached(ctx, stages, stage_count, reading ? -1 : pipe_fds[0], reading ? pipe_fds[1] : -1, -1, pids, &spawned);
+        close(pipe_fds[reading ? 1 : 0]);
+    }
+    shell_parse_release(parse);
+
+    // Here-documents of the stages are no longer needed, but processes of
+    // nested substitutions are waited for along with this one's
+    for (size_t i = temporaries; i < ctx->temporary_count; i++) {
+        if (ctx->temporaries[i].fd != -1) close(ctx->temporaries[i].fd);
+        ctx->temporaries[i].fd = -1;
+    }
+
+    int fd = shell_fd_above_context(pipe_fds[reading ? 0 : 1]);
+    if (result == SHELL_ERROR_MEMORY_ALLOCATION) {
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+    if (spawned < stage_count) {
+        if (fd != -1) close(fd);
+        fd = -1;
+    }
+    for (size_t i = 0; i < spawned; i++) {
+        if (!shell_add_temporary(ctx, i == spawned - 1 ? fd : -1, pids[i])) return NULL;
+    }
+    if (fd == -1) return "/dev/null";
+
+    char *name = shell_arena_alloc(&ctx->arena, 32);
+    if (name) snprintf(name, 32, "/dev/fd/%d", fd);
+    return name;
+}
+
+// Pipe collecting one standard stream while commands run. The context's
+// descriptor for the stream is the pipe, and a thread of its own reads it into a
+// buffer that grows by doubling, so neither spawned nor in-process
+// commands can fill it up and block. Everything read is also passed on to
+// copy_fd when it is set: through tee when it is a pipe, and through tee
+// into a relay pipe and splice out of it when it is a file or socket, so
+// the copy never passes through the buffer.
+typedef struct {
+    int *stream;      // the context's descriptor the pipe stands in for
+    int saved;        // what it was before, put back at the end
+    int write_fd;
+    int read_fd;
+    int copy_fd;      // -1 unless the stream is also copied
+    int relay[2];     // pipe feeding copy_fd by splice, or -1
+    bool zero_copy;   // tee and splice still work for copy_fd
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;      // the buffer could not grow; the rest is discarded
+    pthread_t thread;
+} ShellCaptureStream;
+
+// Move what tee put into the relay pipe on to copy_fd. Data splice cannot
+// take, as for an O_APPEND file, is read back and written instead.
+static void shell_capture_relay(ShellCaptureStream *capture, size_t length) {
+    char buffer[SHELL_EVENT_READ_SIZE];
+
+    while (length > 0) {
+        ssize_t moved = capture->zero_copy ? splice(capture->relay[0], NULL, capture->copy_fd, NULL, length, SPLICE_F_MOVE) : -1;
+        if (moved == -1 && errno == EINTR) continue;
+        if (moved <= 0) {
+            capture->zero_copy = false;
+            moved = read(capture->relay[0], buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+            if (moved <= 0) return;
+            if (capture->copy_fd != -1 && !shell_write_all(capture->copy_fd, buffer, (size_t)moved)) capture->copy_fd = -1;
+        }
+        length -= (size_t)moved;
+    }
+}
+
+// Duplicate up to length pending bytes of the capture pipe for copy_fd
+// without consuming them. Returns the count, 0 at the end of the input,
+// or -1 when the data must be copied from the buffer instead.
+static ssize_t shell_capture_tee(ShellCaptureStream *capture, size_t length) {
+    ssize_t teed;
+    do {
+        teed = tee(capture->read_fd, capture->relay[1] != -1 ? capture->relay[1] : capture->copy_fd, length, 0);
+    } while (teed == -1 && errno == EINTR);
+
+    if (teed == -1) {
+        capture->zero_copy = false;
+        return -1;
+    }
+    if (capture->relay[0] != -1) shell_capture_relay(capture, (size_t)teed);
+    return teed;
+}
+
+// Read the capture pipe until every writer has closed it. SIGPIPE stays
+// blocked on this thread, so a copy_fd whose reader went away only ends
+// the copy.
+static void *shell_drain_capture(void *data) {
+    ShellCaptureStream *capture = data;
+    char discard[SHELL_EVENT_READ_SIZE];
+    sigset_t pipe_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, NULL);
+
+    while (true) {
+        if (!capture->failed && capture->capacity - capture->length < SHELL_CAPTURE_MIN_READ) {
+            size_t capacity = capture->capacity ? capture->capacity * 2 : SHELL_CAPTURE_INITIAL_SIZE;
+            char *grown = realloc(capture->data, capacity);
+            if (grown) {
+                capture->data = grown;
+                capture->capacity = capacity;
+            } else {
+                capture->failed = true;
+            }
+        }
+
+        // One byte always stays free for the terminator
+        char *target = capture->failed ? discard : capture->data + capture->length;
+        size_t room = capture->failed ? sizeof(discard) : capture->capacity - capture->length - 1;
+
+        ssize_t teed = capture->copy_fd != -1 && capture->zero_copy ? shell_capture_tee(capture, room) : -1;
+        if (teed == 0) break;
+
+        // After a tee exactly the duplicated bytes are taken
+        size_t wanted = teed > 0 ? (size_t)teed : room;
+        size_t got = 0;
+        while (got < wanted) {
+            ssize_t length = read(capture->read_fd, target + got, wanted - got);
+            if (length == -1 && errno == EINTR) continue;
+            if (length <= 0) break;
+            got += (size_t)length;
+            if (teed < 0) break;
+        }
+        if (got == 0) break;
+
+        if (teed < 0 && capture->copy_fd != -1 && !shell_write_all(capture->copy_fd, target, got)) capture->copy_fd = -1;
+        if (!capture->failed) capture->length += got;
+    }
+
+    if (capture->data) capture->data[capture->length] = '\0';
+    return NULL;
+}
+
+// Make a new capture pipe stand for one of the context's standard streams
+// and start draining it. The buffer starts out as data, which may be NULL.
+static bool shell_begin_capture(ShellCaptureStream *capture, ShellContext *ctx, int target, char *data, size_t capacity,
+                                int copy_fd) {
+    *capture = (ShellCaptureStream){ &ctx->fds[target], ctx->fds[target], -1, -1, copy_fd, { -1, -1 }, copy_fd != -1,
+                                     data, 0, capacity, false, 0 };
+    if (data && capacity) data[0] = '\0';
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) return false;
+    pipe_fds[1] = shell_fd_above_context(pipe_fds[1]);
+    if (pipe_fds[1] == -1) {
+        close(pipe_fds[0]);
+        return false;
+    }
+
+    // A large pipe lets a fast writer run ahead while the buffer grows;
+    // the kernel limit may refuse it, and the default size still works
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, SHELL_CAPTURE_PIPE_SIZE);
+    capture->read_fd = pipe_fds[0];
+
+    struct stat info;
+    if (copy_fd != -1 && fstat(copy_fd, &info) == 0 && !S_ISFIFO(info.st_mode)) {
+        if (pipe2(capture->relay, O_CLOEXEC) == -1) {
+            capture->relay[0] = capture->relay[1] = -1;
+            capture->zero_copy = false;
+        }
+    }
+
+    // Only the context's descriptor changes: the process's own standard
+    // streams stay as they are for every other context
+    if (pthread_create(&capture->thread, NULL, shell_drain_capture, capture) == 0) {
+        capture->write_fd = pipe_fds[1];
+        *capture->stream = pipe_fds[1];
+        return true;
+    }
+
+    close(pipe_fds[1]);
+    close(capture->read_fd);
+    for (int i = 0; i < 2; i++) {
+        if (capture->relay[i] != -1) close(capture->relay[i]);
+    }
+    return false;
+}
+
+// Put the context's descriptor back and wait until the pipe has been read
+// to the end, which is when every process writing to it has closed it
+static void shell_end_capture(ShellCaptureStream *capture) {
+    *capture->stream = capture->saved;
+    close(capture->write_fd);
+
+    pthread_join(capture->thread, NULL);
+    close(capture->read_fd);
+    for (int i = 0; i < 2; i++) {
+        if (capture->relay[i] != -1) close(capture->relay[i]);
+    }
+}
+
+// Run a command line and collect what it writes: SHELL_CAPTURE_OUTPUT
+// collects standard output into ctx->base.output and SHELL_CAPTURE_ERROR
+// standard error into ctx->base.error, NUL-terminated with their lengths
+// in output_length and error_length. Unless copy_fd is -1, standard output
+// is also passed on to it, or only passed on when it is not collected. The
+// buffers are reused by the next capture; a stream not captured keeps its
+// buffer as it was.
+ShellError shell_capture_command(ExtendedShellContext *ctx, const char *command, unsigned flags, int copy_fd) {
+    if (!ctx || !command) return SHELL_ERROR_NULL_POINTER;
+
+    // Standard output that is only passed on needs no pipe at all
+    int saved_output = ctx->base.fds[STDOUT_FILENO];
+    int copy_output = -1;
+    if (!(flags & SHELL_CAPTURE_OUTPUT) && copy_fd != -1) {
+        copy_output = fcntl(copy_fd, F_DUPFD_CLOEXEC, SHELL_CONTEXT_FDS);
+        if (copy_output == -1) {
+            ctx->base.last_error = SHELL_ERROR_EXECUTION_FAILED;
+            return SHELL_ERROR_EXECUTION_FAILED;
+        }
+        ctx->base.fds[STDOUT_FILENO] = copy_output;
+    }
+
+    // The buffers are taken over while the command runs, so a capture
+    // nested inside it starts afresh
+    ShellCaptureStream captures[2];
+    bool active[2] = { false, false };
+    char **buffers[2] = { &ctx->base.output, &ctx->base.error };
+    size_t *lengths[2] = { &ctx->base.output_length, &ctx->base.error_length };
+    ShellError result = SHELL_OK;
+
+    for (int i = 0; i < 2 && result == SHELL_OK; i++) {
+        if (!(flags & (i == 0 ? SHELL_CAPTURE_OUTPUT : SHELL_CAPTURE_ERROR))) continue;
+        active[i] = shell_begin_capture(&captures[i], &ctx->base, i == 0 ? STDOUT_FILENO : STDERR_FILENO, *buffers[i],
+                                        ctx->capture_capacity[i], i == 0 ? copy_fd : -1);
+        if (!active[i]) {
+            result = SHELL_ERROR_PIPELINE_FAILED;
+            break;
+        }
+        *buffers[i] = NULL;
+        ctx->capture_capacity[i] = 0;
+    }
+
+    if (result == SHELL_OK) result = shell_execute_command(ctx, command);
+
+    for (int i = 1; i >= 0; i--) {
+        if (!active[i]) continue;
+        shell_end_capture(&captures[i]);
+        free(*buffers[i]);
+        *buffers[i] = captures[i].data;
+        *lengths[i] = captures[i].length;
+        ctx->capture_capacity[i] = captures[i].capacity;
+        if (captures[i].failed && result == SHELL_OK) result = SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if (copy_output != -1) {
+        ctx->base.fds[STDOUT_FILENO] = saved_output;
+        close(copy_output);
+    }
+    if (result != SHELL_OK) ctx->base.last_error = result;
+    return result;
+}
+
+// Replace $(command) with what the command writes to standard output,
+// less trailing newlines. The command runs in the shell process rather
+// than in a subshell: assignments and cd stay in effect, while exit,
+// return, break and continue only end the command itself.
+static size_t shell_expand_substitution(ExtendedShellContext *ctx, const char *raw, size_t length, ShellWordBuffer *out) {
+    size_t end;
+    if (shell_scan_substitution(raw, length, 0, &end) != SHELL_OK) {
+        shell_word_append(out, "$", 1);
+        return 1;
+    }
+
+    char *command = shell_arena_strndup(out->arena, raw + 2, end - 3);
+    ShellCaptureStream capture;
+    if (!command || !shell_begin_capture(&capture, &ctx->base, STDOUT_FILENO, NULL, 0, -1)) {
+        ctx->base.exit_status = 1;
+        ctx->substituted = true;
+        return end;
+    }
+
+    int loop_depth = ctx->loop_depth;
+    ctx->loop_depth = 0;
+    shell_execute_command(ctx, command);
+    ctx->loop_depth = loop_depth;
+    ctx->break_levels = 0;
+    ctx->continue_levels = 0;
+    ctx->returning = false;
+    ctx->exit_requested = false;
+    ctx->substituted = true;
+    shell_end_capture(&capture);
+
+    size_t output_length = capture.length;
+    while (output_length > 0 && capture.data[output_length - 1] == '\n') output_length--;
+    if (output_length) shell_word_append_quoted(out, capture.data, output_length);
+    if (capture.failed) out->failed = true;
+    free(capture.data);
+    return end;
+}
+
+// Process of an asynchronous command, watched through its pidfd when the
+// kernel has them and through SIGCHLD otherwise
+typedef struct {
+    pid_t pid;
+    int pidfd;
+    ShellEventSource source;
+} ShellAsyncProcess;
+
+// Command line running in the background of the event loop. Its items run
+// one after another, each a pipeline whose processes are all spawned at
+// once, or an and-or list of them; the command completes when the last
+// item has exited and its output has been read to the end.
+typedef struct ShellAsyncCommand {
+    ShellParse *parse;
+    size_t next_item;
+    const ShellNode *and_or;  // and-or list being run, or NULL
+    size_t next_link;         // next pipeline of and_or
+    ShellAsyncProcess *processes;
+    int process_count;
+    int remaining;
+    int last_process;  // slot of the last stage, or -1 if it did not start
+    int status;
+    int output_fd;     // read end of the captured output, or -1
+    int output_write;  // write end handed to each item's last stage
+    ShellEventSource output_source;
+    ShellOutputCallback on_output;
+    ShellCompletionCallback on_complete;
+    void *user_data;
+    bool finished;
+} ShellAsyncCommand;
+
+// Register a descriptor with the event loop
+static bool shell_event_watch(ExtendedShellContext *ctx, int fd, ShellEventSource *source) {
+    struct epoll_event event = { EPOLLIN, { .ptr = source } };
+    return epoll_ctl(ctx->events.epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// Unregister and close a watched descriptor. Closing alone is not enough:
+// a child that has not finished its exec yet may still hold a copy, which
+// keeps the registration and its source pointer alive.
+static void shell_event_close(ExtendedShellContext *ctx, int fd) {
+    epoll_ctl(ctx->events.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+// Create the epoll instance on first use, watching the SIGCHLD signalfd
+static bool shell_event_loop_ready(ExtendedShellContext *ctx) {
+    if (ctx->events.epoll_fd != -1) return true;
+
+    ctx->events.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->events.epoll_fd == -1) return false;
+
+    ctx->events.sigchld_source = (ShellEventSource){ SHELL_SOURCE_SIGCHLD, NULL, 0 };
+    ctx->events.input_source = (ShellEventSource){ SHELL_SOURCE_INPUT, NULL, 0 };
+    if (ctx->sigchld_fd != -1) shell_event_watch(ctx, ctx->sigchld_fd, &ctx->events.sigchld_source);
+    return true;
+}
+
+// Spawn the stages of a pipeline for an asynchronous command. Returns
+// false when no process started, with the item's status in command->status.
+static bool shell_async_spawn(ExtendedShellContext *ctx, ShellAsyncCommand *command, const ShellNode *node) {
+    size_t stage_count = node->type == SHELL_NODE_PIPELINE ? node->child_count : 1;
+    ShellArenaMark mark = shell_arena_mark(&ctx->arena);
+    size_t temporaries = ctx->temporary_count;
+    ShellPipelineStage *stages = shell_arena_alloc(&ctx->arena, stage_count * sizeof(ShellPipelineStage));
+    pid_t *pids = shell_arena_alloc(&ctx->arena, stage_count * sizeof(pid_t));
+    ShellAsyncProcess *processes = realloc(command->processes, stage_count * sizeof(ShellAsyncProcess));
+    if (processes) command->processes = processes;
+    command->process_count = 0;
+    command->last_process = -1;
+    command->status = 1;
+
+    // Process substitutions would start processes the event loop does not track
+    if (shell_has_process_substitution(node)) {
+        shell_printf(&ctx->base, STDERR_FILENO, "process substitution cannot run asynchronously\n");
+        shell_arena_release(&ctx->arena, mark);
+        return false;
+    }
+
+    char **assignments;
+    ShellError result = stages && pids && processes ? SHELL_OK : SHELL_ERROR_MEMORY_ALLOCATION;
+    for (size_t i = 0; result == SHELL_OK && i < stage_count; i++) {
+        const ShellNode *stage = node->type == SHELL_NODE_PIPELINE ? node->children[i] : node;
+        result = shell_build_stage(ctx, stage, &stages[i], &assignments);
+    }
+
+    // Everything runs in separate processes; built-ins come from PATH
+    const char *unsupported = result == SHELL_OK ? shell_detached_unsupported(ctx, stages, stage_count) : NULL;
+    if (unsupported) {
+        shell_printf(&ctx->base, STDERR_FILENO, "%s: cannot run asynchronously\n", unsupported);
+        result = SHELL_ERROR_INVALID_INPUT;
+    }
+    if (result != SHELL_OK) {
+        shell_release_temporaries(ctx, temporaries);
+        shell_arena_release(&ctx->arena, mark);
+        return false;
+    }
+
+    // The stages share a process group of their own, like a background job
+    size_t spawned;
+    int status = shell_spawn_detached(ctx, stages, stage_count, -1, command->output_write, 0, pids, &spawned);
+    if (status != 0) command->status = status == ENOENT ? 127 : 126;
+
+    for (size_t i = 0; i < spawned; i++) {
+        ShellAsyncProcess *process = &command->processes[command->process_count];
+        *process = (ShellAsyncProcess){ pids[i], shell_open_pidfd(pids[i]), { SHELL_SOURCE_PROCESS, command, command->process_count } };
+        if (process->pidfd != -1 && !shell_event_watch(ctx, process->pidfd, &process->source)) {
+            close(process->pidfd);
+            process->pidfd = -1;
+        }
+        if (i == stage_count - 1) command->last_process = command->process_count;
+        command->process_count++;
+        command->remaining++;
+    }
+
+    shell_release_temporaries(ctx, temporaries);
+    shell_arena_release(&ctx->arena, mark);
+    return command->remaining > 0;
+}
+
+// Start the items of an asynchronous command until one is running. Once
+// none are left the command has finished, and the shell lets go of the
+// write end of its output so the reader sees the end.
+static void shell_async_advance(ExtendedShellContext *ctx, ShellAsyncCommand *command) {
+    const ShellNode *root = command->parse->root;
+
+    while (command->remaining == 0) {
+        // Pipelines of an and-or list whose operator does not match the
+        // status so far are skipped
+        const ShellNode *next = NULL;
+        while (!next && command->and_or && command->next_link < command->and_or->child_count) {
+            const ShellNode *link = command->and_or->children[command->next_link++];
+            if (link->on_failure == (command->status != 0)) next = link;
+        }
+        if (!next) {
+            command->and_or = NULL;
+            if (command->next_item >= root->child_count) break;
+            next = root->children[command->next_item++];
+            if (next->type == SHELL_NODE_AND_OR) {
+                command->and_or = next;
+                command->next_link = 1;
+                next = next->children[0];
+            }
+        }
+        shell_async_spawn(ctx, command, next);
+    }
+    if (command->remaining > 0) return;
+
+    command->finished = true;
+    if (command->output_write != -1) close(command->output_write);
+    command->output_write = -1;
+}
+
+// Account for an exited process of an asynchronous command
+static void shell_async_reaped(ExtendedShellContext *ctx, ShellAsyncCommand *command, int slot, int status) {
+    ShellAsyncProcess *process = &command->processes[slot];
+    if (process->pidfd != -1) shell_event_close(ctx, process->pidfd);
+    process->pid = 0;
+    process->pidfd = -1;
+
+    // The status of a pipeline is that of its last stage
+    if (slot == command->last_process) command->status = shell_exit_status(status);
+    if (--command->remaining == 0) shell_async_advance(ctx, command);
+}
+
+// Reap a process whose pidfd became readable
+static void shell_async_process_event(ExtendedShellContext *ctx, ShellEventSource *source) {
+    ShellAsyncProcess *process = &source->command->processes[source->index];
+    int status;
+    if (waitpid(process->pid, &status, WNOHANG) == process->pid) shell_async_reaped(ctx, source->command, source->index, status);
+}
+
+// After a SIGCHLD, update the job table and reap the asynchronous
+// processes that have no pidfd
+static void shell_async_sigchld_event(ExtendedShellContext *ctx) {
+    shell_update_jobs(ctx);
+
+    for (size_t i = 0; i < ctx->events.count; i++) {
+        ShellAsyncCommand *command = ctx->events.commands[i];
+        for (int j = 0; j < command->process_count; j++) {
+            int status;
+            pid_t pid = command->processes[j].pid;
+            if (pid == 0 || command->processes[j].pidfd != -1) continue;
+            if (waitpid(pid, &status, WNOHANG) == pid) shell_async_reaped(ctx, command, j, status);
+        }
+    }
+}
+
+// Pass output of an asynchronous command on, closing it at the end
+static void shell_async_output_event(ExtendedShellContext *ctx, ShellAsyncCommand *command) {
+    char buffer[SHELL_EVENT_READ_SIZE];
+    ssize_t length = read(command->output_fd, buffer, sizeof(buffer));
+    if (length > 0) {
+        command->on_output(ctx, buffer, (size_t)length, command->user_data);
+        return;
+    }
+    if (length == -1 && (errno == EINTR || errno == EAGAIN)) return;
+
+    shell_event_close(ctx, command->output_fd);
+    command->output_fd = -1;
+}
+
+// Stop watching the input descriptor
+static void shell_unwatch_input(ExtendedShellContext *ctx) {
+    if (ctx->events.input_fd != -1 && ctx->events.epoll_fd != -1) {
+        epoll_ctl(ctx->events.epoll_fd, EPOLL_CTL_DEL, ctx->events.input_fd, NULL);
+    }
+    ctx->events.input_fd = -1;
+    ctx->events.line_length = 0;
+}
+
+// Read what the watched input has ready and pass on every complete line.
+// A callback may stop the watch, which ends the scan.
+static void shell_input_event(ExtendedShellContext *ctx) {
+    ShellEventLoop *events = &ctx->events;
+    int fd = events->input_fd;
+
+    if (events->line_capacity - events->line_length < SHELL_INPUT_READ_SIZE) {
+        size_t capacity = events->line_capacity ? events->line_capacity * 2 : SHELL_READ_BLOCK_SIZE;
+        char *line = realloc(events->line, capacity);
+        if (!line) return;
+        events->line = line;
+        events->line_capacity = capacity;
+    }
+
+    ssize_t length = read(fd, events->line + events->line_length, events->line_capacity - events->line_length - 1);
+    if (length == -1 && (errno == EINTR || errno == EAGAIN)) return;
+
+    if (length <= 0) {
+        // Hand over an unterminated last line, then report the end
+        ShellLineCallback on_line = events->on_line;
+        void *data = events->line_data;
+        if (events->line_length > 0) {
+            events->line[events->line_length] = '\0';
+            on_line(ctx, events->line, data);
+        }
+        if (events->input_fd == fd) shell_unwatch_input(ctx);
+        on_line(ctx, NULL, data);
+        return;
+    }
+
+    size_t end = events->line_length + (size_t)length;
+    size_t start = 0;
+    char *newline;
+    while ((newline = memchr(events->line + start, '\n', end - start))) {
+        *newline = '\0';
+        events->on_line(ctx, events->line + start, events->line_data);
+        if (events->input_fd != fd) return;
+        start = (size_t)(newline - events->line) + 1;
+    }
+
+    memmove(events->line, events->line + start, end - start);
+    events->line_length = end - start;
+}
+
+// Complete the finished asynchronous commands whose output has been read.
+// Callbacks run after the command is removed, so they may start new ones.
+static void shell_async_complete(ExtendedShellContext *ctx) {
+    size_t i = 0;
+    while (i < ctx->events.count) {
+        ShellAsyncCommand *command = ctx->events.commands[i];
+        if (!command->finished || command->output_fd != -1) {
+            i++;
+            continue;
+        }
+
+        ctx->events.commands[i] = ctx->events.commands[--ctx->events.count];
+        if (command->on_complete) command->on_complete(ctx, command->status, command->user_data);
+        shell_parse_release(command->parse);
+        free(command->processes);
+        free(command);
+    }
+}
+
+// Whether an asynchronous command is waiting to be completed
+static bool shell_async_completion_due(const ExtendedShellContext *ctx) {
+    for (size_t i = 0; i < ctx->events.count; i++) {
+        if (ctx->events.commands[i]->finished && ctx->events.commands[i]->output_fd == -1) return true;
+    }
+    return false;
+}
+
+// Start a command line without waiting for it. Its items run one after
+// another as separate processes, each pipeline in a process group of its
+// own; progress is made and on_complete called from shell_poll_events.
+// Only simple commands and pipelines separated by ; or newlines qualify.
+ShellError shell_execute_async(ExtendedShellContext *ctx, const char *command, ShellCompletionCallback on_complete, void *user_data) {
+    if (!ctx || !command) return SHELL_ERROR_NULL_POINTER;
+
+    ShellParse *parse;
+    bool incomplete;
+    ShellError result = shell_parse_line(ctx, command, &parse, &incomplete);
+    if (result != SHELL_OK) {
+        ctx->base.last_error = result;
+        return result;
+    }
+
+    // Only pipelines of commands that can run as processes qualify, alone
+    // or in and-or lists
+    for (size_t i = 0; result == SHELL_OK && i < parse->root->child_count; i++) {
+        const ShellNode *item = parse->root->children[i];
+        bool and_or = item->type == SHELL_NODE_AND_OR;
+        for (size_t j = 0; j < (and_or ? item->child_count : 1); j++) {
+            const ShellNode *pipeline = and_or ? item->children[j] : item;
+            if ((pipeline->type != SHELL_NODE_SIMPLE && pipeline->type != SHELL_NODE_PIPELINE) || pipeline->background) {
+                result = SHELL_ERROR_INVALID_INPUT;
+            }
+        }
+    }
+
+    ShellAsyncCommand *async = NULL;
+    if (result == SHELL_OK && !shell_event_loop_ready(ctx)) result = SHELL_ERROR_EXECUTION_FAILED;
+    if (result == SHELL_OK && ctx->events.count == ctx->events.capacity) {
+        size_t capacity = ctx->events.capacity ? ctx->events.capacity * 2 : 16;
+        ShellAsyncCommand **commands = realloc(ctx->events.commands, capacity * sizeof(ShellAsyncCommand *));
+        if (commands) {
+            ctx->events.commands = commands;
+            ctx->events.capacity = capacity;
+        } else {
+            result = SHELL_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+    if (result == SHELL_OK) {
+        async = calloc(1, sizeof(ShellAsyncCommand));
+        if (!async) result = SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    if (result != SHELL_OK) {
+        shell_parse_release(parse);
+        ctx->base.last_error = result;
+        return result;
+    }
+
+    *async = (ShellAsyncCommand){ parse, 0, NULL, 0, NULL, 0, 0, -1, 0, -1, -1, { SHELL_SOURCE_OUTPUT, async, 0 },
+                                  ctx->events.on_output, on_complete, user_data, false };
+
+    // With an output callback, the last stage of every item writes into a
+    // pipe that the loop reads
+    int output[2];
+    if (ctx->events.on_output && pipe2(output, O_CLOEXEC) == 0) {
+        fcntl(output[0], F_SETFL, O_NONBLOCK);
+        async->output_fd = output[0];
+        async->output_write = output[1];
+        if (!shell_event_watch(ctx, async->output_fd, &async->output_source)) {
+            close(async->output_fd);
+            async->output_fd = -1;
+        }
+    }
+
+    // A command that cannot be spawned is reported through on_complete
+    // with status 127 or 126, like a background job in sh
+    ctx->events.commands[ctx->events.count++] = async;
+    shell_async_advance(ctx, async);
+    return SHELL_OK;
+}
+
+// Set the callback that receives the output of asynchronous commands
+// started from now on; without one they write to the shell's stdout
+ShellError shell_set_async_output(ExtendedShellContext *ctx, ShellOutputCallback on_output) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+    ctx->events.on_output = on_output;
+    return SHELL_OK;
+}
+
+// Pass the lines read from fd to on_line from the event loop, or stop
+// watching with fd -1
+ShellError shell_watch_input(ExtendedShellContext *ctx, int fd, ShellLineCallback on_line, void *user_data) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+    shell_unwatch_input(ctx);
+    if (fd == -1) return SHELL_OK;
+    if (!on_line) return SHELL_ERROR_NULL_POINTER;
+
+    if (!shell_event_loop_ready(ctx) || !shell_event_watch(ctx, fd, &ctx->events.input_source)) {
+        ctx->base.last_error = SHELL_ERROR_EXECUTION_FAILED;
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+    ctx->events.input_fd = fd;
+    ctx->events.on_line = on_line;
+    ctx->events.line_data = user_data;
+    return SHELL_OK;
+}
+
+// Wait up to timeout_ms milliseconds (-1 for no limit) for events and
+// handle them: output of asynchronous commands goes to the output
+// callback, exited processes are reaped and the next items started,
+// background jobs are updated, and lines of the watched input are handed
+// over. Finished commands are then reported to their completion callbacks.
+ShellError shell_poll_events(ExtendedShellContext *ctx, int timeout_ms) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+    if (!shell_event_loop_ready(ctx)) {
+        ctx->base.last_error = SHELL_ERROR_EXECUTION_FAILED;
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+
+    // Completions that are already due must not wait for another event
+    if (shell_async_completion_due(ctx)) timeout_ms = 0;
+
+    struct epoll_event events[SHELL_EVENT_BATCH];
+    int count = epoll_wait(ctx->events.epoll_fd, events, SHELL_EVENT_BATCH, timeout_ms);
+    if (count == -1 && errno != EINTR) {
+        ctx->base.last_error = SHELL_ERROR_EXECUTION_FAILED;
+        return SHELL_ERROR_EXECUTION_FAILED;
+    }
+
+    // Commands are only freed by shell_async_complete, so every source in
+    // the batch stays valid while it is handled
+    for (int i = 0; i < count; i++) {
+        ShellEventSource *source = events[i].data.ptr;
+        switch (source->type) {
+            case SHELL_SOURCE_SIGCHLD:
+                shell_async_sigchld_event(ctx);
+                break;
+            case SHELL_SOURCE_INPUT:
+                if (ctx->events.input_fd != -1) shell_input_event(ctx);
+                break;
+            case SHELL_SOURCE_OUTPUT:
+                if (source->command->output_fd != -1) shell_async_output_event(ctx, source->command);
+                break;
+            case SHELL_SOURCE_PROCESS:
+                if (source->command->processes[source->index].pid != 0) shell_async_process_event(ctx, source);
+                break;
+        }
+    }
+
+    shell_async_complete(ctx);
+    return SHELL_OK;
+}
+
+// Descriptor of the event loop, readable whenever shell_poll_events has
+// something to do, for embedding into another loop
+int shell_event_fd(ExtendedShellContext *ctx) {
+    return ctx && shell_event_loop_ready(ctx) ? ctx->events.epoll_fd : -1;
+}
+
+// Number of asynchronous commands that have not been completed yet
+size_t shell_async_pending(ExtendedShellContext *ctx) {
+    return ctx ? ctx->events.count : 0;
+}
+
+// Release the event loop. Processes still running are left alone.
+static void shell_event_loop_free(ExtendedShellContext *ctx) {
+    for (size_t i = 0; i < ctx->events.count; i++) {
+        ShellAsyncCommand *command = ctx->events.commands[i];
+        for (int j = 0; j < command->process_count; j++) {
+            if (command->processes[j].pidfd != -1) close(command->processes[j].pidfd);
+        }
+        if (command->output_fd != -1) close(command->output_fd);
+        if (command->output_write != -1) close(command->output_write);
+        shell_parse_release(command->parse);
+        free(command->processes);
+        free(command);
+    }
+    free(ctx->events.commands);
+    free(ctx->events.line);
+    if (ctx->events.epoll_fd != -1) close(ctx->events.epoll_fd);
+    ctx->events = (ShellEventLoop){ 0 };
+    ctx->events.epoll_fd = -1;
+    ctx->events.input_fd = -1;
+}
+
+// Limits of the scan for open constructs. Anything beyond them leaves the
+// scan unsure, and the text is parsed after every line as before.
+#define SHELL_SCAN_DEPTH 64
+#define SHELL_SCAN_HEREDOCS 8
+#define SHELL_SCAN_WORD 256
+
+// Scan of a command that spans lines. While a construct is open each new
+// line is scanned once, following the quotes, here-documents and compound
+// commands the lexer and parser would, so the whole text is parsed again
+// only once it may be complete. The scan never reports a construct open
+// when the parser would accept the text; when unsure it gives up.
+typedef struct {
+    ExtendedShellContext *ctx;
+    char nesting[SHELL_SCAN_DEPTH];  // 'i' for if, 'l' for loops, '{'
+    size_t depth;
+    char quotes[SHELL_SCAN_DEPTH];   // '\'', '"' and '(' for $( <( >(
+    size_t quote_depth;
+    char delimiters[SHELL_SCAN_HEREDOCS][SHELL_SCAN_WORD];
+    bool strip[SHELL_SCAN_HEREDOCS];
+    size_t heredoc_count;            // here-documents opened on the line
+    size_t heredoc_next;             // first body not yet ended
+    bool in_body;
+    bool want_delimiter;
+    bool command_position;
+    bool after_operator;             // | && || still needs a command
+    bool after_compound;             // fi, done or } just closed a command
+    int for_state;                   // 1 before the name, 2 before in or do
+    bool in_word;
+    bool word_quoted;
+    const char *word;
+    bool skip_newline;               // the next newline is already accounted for
+    bool unsure;
+} ShellOpenScan;
+
+static void shell_scan_init(ShellOpenScan *scan, ExtendedShellContext *ctx) {
+    memset(scan, 0, sizeof(*scan));
+    scan->ctx = ctx;
+    scan->command_position = true;
+}
+
+// Kind of reserved word: 'o' for the words opening a compound command,
+// 'c' for those continuing or closing one, 'n' for in, or 0 for none
+static char shell_scan_reserved(const char *word, size_t length) {
+    static const struct {
+        const char *word;
+        char kind;
+    } words[] = {
+        { "if", 'o' }, { "while", 'o' }, { "until", 'o' }, { "for", 'o' }, { "{", 'o' }, { "then", 'c' }, { "elif", 'c' },
+        { "else", 'c' }, { "fi", 'c' }, { "do", 'c' }, { "done", 'c' }, { "}", 'c' }, { "in", 'n' },
+    };
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        if (strlen(words[i].word) == length && memcmp(words[i].word, word, length) == 0) return words[i].kind;
+    }
+    return 0;
+}
+
+// Whether a word names an alias whose value could open or close a construct
+static bool shell_scan_alias(ShellOpenScan *scan, const char *word, size_t length) {
+    if (scan->ctx->alias_count == 0) return false;
+    char name[SHELL_SCAN_WORD];
+    if (length >= sizeof(name)) return true;
+    memcpy(name, word, length);
+    name[length] = '\0';
+
+    const ShellCommand *alias = shell_lookup_command(scan->ctx, name);
+    if (!alias || !alias->value) return false;
+    for (size_t i = 0; i < alias->alias_token_count; i++) {
+        const ShellToken *token = &alias->alias_tokens[i];
+        if (token->type != SHELL_TOKEN_WORD || shell_scan_reserved(token->text, strlen(token->text))) return true;
+    }
+    return false;
+}
+
+// Take the delimiter of a here-document, with its quotes removed
+static void shell_scan_delimiter(ShellOpenScan *scan, const char *word, size_t length) {
+    scan->want_delimiter = false;
+    if (!word || scan->heredoc_count == SHELL_SCAN_HEREDOCS || length >= SHELL_SCAN_WORD ||
+        memchr(word, '\\', length) || memchr(word, '$', length) || (memchr(word, '\'', length) && memchr(word, '"', length))) {
+        scan->unsure = true;
+        return;
+    }
+    char *out = scan->delimiters[scan->heredoc_count++];
+    for (size_t i = 0; i < length; i++) {
+        if (word[i] != '\'' && word[i] != '"') *out++ = word[i];
+    }
+    *out = '\0';
+}
+
+// Pop the compound command a reserved word closes
+static void shell_scan_close(ShellOpenScan *scan, char kind) {
+    if (scan->depth == 0 || scan->nesting[scan->depth - 1] != kind) {
+        scan->unsure = true;
+        return;
+    }
+    scan->depth--;
+    scan->command_position = false;
+    scan->after_compound = true;
+}
+
+// Account for a word that ended at end
+static void shell_scan_end_word(ShellOpenScan *scan, const char *end) {
+    const char *word = scan->word;
+    size_t length = word ? (size_t)(end - word) : 0;
+    bool plain = word && !scan->word_quoted;
+    bool after_compound = scan->after_compound;
+    scan->in_word = false;
+    scan->after_compound = false;
+    scan->after_operator = false;
+
+    if (scan->want_delimiter) {
+        shell_scan_delimiter(scan, word, length);
+        scan->command_position = false;
+        return;
+    }
+    if (scan->for_state == 1) {
+        if (!plain) scan->unsure = true;
+        scan->for_state = 2;
+        scan->command_position = false;
+        return;
+    }
+    if (plain && shell_scan_alias(scan, word, length)) scan->unsure = true;
+
+    char kind = plain ? shell_scan_reserved(word, length) : 0;
+    bool is_do = kind == 'c' && length == 2 && memcmp(word, "do", 2) == 0;
+    if (scan->for_state == 2) {
+        // for NAME is followed by in or do
+        scan->for_state = 0;
+        scan->command_position = is_do;
+        if (kind == 'n') return;
+        if (!is_do) {
+            scan->unsure = true;
+            return;
+        }
+    }
+
+    // After a compound command only a word closing a list may follow
+    if (after_compound && kind != 'c') scan->unsure = true;
+    if (kind == 'n' || !kind || !(scan->command_position || after_compound)) {
+        scan->command_position = false;
+        return;
+    }
+
+    if (kind == 'o') {
+        if (scan->depth == SHELL_SCAN_DEPTH) {
+            scan->unsure = true;
+            return;
+        }
+        scan->nesting[scan->depth++] = word[0] == 'i' ? 'i' : word[0] == '{' ? '{' : 'l';
+        if (word[0] == 'f') {
+            scan->for_state = 1;
+            scan->command_position = false;
+        }
+    } else if (word[0] == '}') {
+        shell_scan_close(scan, '{');
+    } else if (length == 2 && word[0] == 'f') {
+        shell_scan_close(scan, 'i');
+    } else if (length == 4 && word[0] == 'd') {
+        shell_scan_close(scan, 'l');
+    } else {
+        // then, elif, else and do continue the innermost command
+        char expected = is_do ? 'l' : 'i';
+        if (scan->depth == 0 || scan->nesting[scan->depth - 1] != expected) scan->unsure = true;
+        scan->command_position = true;
+    }
+}
+
+// Push an open quote or substitution
+static void shell_scan_push_quote(ShellOpenScan *scan, char kind) {
+    if (scan->quote_depth == SHELL_SCAN_DEPTH) {
+        scan->unsure = true;
+        return;
+    }
+    scan->quotes[scan->quote_depth++] = kind;
+}
+
+// Scan the next chunk of a command that spans lines, made of whole lines
+// and starting with the newline that joins it to the text before. Returns
+// whether a construct is surely still open, so the text cannot parse yet.
+static bool shell_scan_open(ShellOpenScan *scan, const char *text, size_t length) {
+    size_t i = 0;
+    if (scan->skip_newline && length > 0 && text[0] == '\n') i++;
+    scan->skip_newline = false;
+    if (scan->in_word) scan->word = NULL;
+
+    while (i < length && !scan->unsure) {
+        // A here-document body runs to the line holding its delimiter
+        if (scan->in_body) {
+            size_t start = i;
+            if (scan->strip[scan->heredoc_next]) start += strspn(text + i, "\t");
+            const char *newline = memchr(text + i, '\n', length - i);
+            size_t end = newline ? (size_t)(newline - text) : length;
+            const char *delimiter = scan->delimiters[scan->heredoc_next];
+            if (end - start == strlen(delimiter) && memcmp(text + start, delimiter, end - start) == 0 &&
+                ++scan->heredoc_next == scan->heredoc_count) {
+                scan->in_body = false;
+                scan->heredoc_count = 0;
+            }
+            // Body lines take their newline with them
+            if (!newline) scan->skip_newline = true;
+            i = end + 1;
+            continue;
+        }
+
+        char c = text[i];
+        char next = i + 1 < length ? text[i + 1] : '\0';
+        char quote = scan->quote_depth ? scan->quotes[scan->quote_depth - 1] : '\0';
+
+        // Inside quotes and substitutions, as in shell_scan_double_quoted
+        // and shell_scan_substitution
+        if (quote == '\'') {
+            if (c == '\'') scan->quote_depth--;
+            i++;
+            continue;
+        }
+        if (quote) {
+            if (c == '\\') {
+                if (i + 1 == length) scan->skip_newline = true;
+                i += 2;
+                continue;
+            }
+            if (c == '"') {
+                if (quote == '"') {
+                    scan->quote_depth--;
+                } else {
+                    shell_scan_push_quote(scan, '"');
+                }
+            } else if (c == '$' && next == '(') {
+                shell_scan_push_quote(scan, '(');
+                i++;
+            } else if (quote == '(') {
+                if (c == '\'' || c == '(') shell_scan_push_quote(scan, c);
+                if (c == ')') scan->quote_depth--;
+            }
+            i++;
+            continue;
+        }
+
+        if (c == '\\') {
+            // Backslash-newline outside a word is a blank
+            if (i + 1 == length) scan->skip_newline = true;
+            if (!scan->in_word && (next == '\n' || i + 1 == length)) {
+                i += 2;
+                continue;
+            }
+        }
+        if (c == '\0' || !strchr(" \t\n|&;<>()", c)) {
+            if (!scan->in_word) {
+                if (c == '#') {
+                    // Comments run to the end of the line
+                    const char *newline = memchr(text + i, '\n', length - i);
+                    i = newline ? (size_t)(newline - text) : length;
+                    continue;
+                }
+                scan->in_word = true;
+                scan->word_quoted = false;
+                scan->word = text + i;
+            }
+            if (c == '\\') {
+                scan->word_quoted = true;
+                i += 2;
+            } else if (c == '\'' || c == '"') {
+                scan->word_quoted = true;
+                shell_scan_push_quote(scan, c);
+                i++;
+            } else if (c == '$' && next == '(') {
+                scan->word_quoted = true;
+                shell_scan_push_quote(scan, '(');
+                i += 2;
+            } else {
+                i++;
+            }
+            continue;
+        }
+
+        // A single digit directly before < or > names a descriptor
+        bool descriptor = scan->in_word && scan->word && !scan->word_quoted && text + i - scan->word == 1 &&
+                          isdigit((unsigned char)scan->word[0]) && (c == '<' || c == '>');
+        if (scan->in_word) shell_scan_end_word(scan, text + i);
+        if (scan->unsure) break;
+
+        if (c == ' ' || c == '\t') {
+            i++;
+        } else if (c == '\n') {
+            if (scan->want_delimiter) scan->unsure = true;
+            if (scan->heredoc_count > 0) {
+                scan->in_body = true;
+                scan->heredoc_next = 0;
+            }
+            scan->command_position = true;
+            scan->after_compound = false;
+            i++;
+        } else if ((c == '<' || c == '>') && next == '(' && !descriptor) {
+            // <(command) and >(command) are words of their own
+            scan->in_word = true;
+            scan->word_quoted = true;
+            scan->word = text + i;
+            shell_scan_push_quote(scan, '(');
+            i += 2;
+        } else if (c == '<' || c == '>' || (c == '&' && next == '>')) {
+            size_t width = 1;
+            if (c == '<' && next == '<') {
+                char third = i + 2 < length ? text[i + 2] : '\0';
+                if (third != '<') {
+                    scan->want_delimiter = true;
+                    scan->strip[scan->heredoc_count < SHELL_SCAN_HEREDOCS ? scan->heredoc_count : 0] = third == '-';
+                }
+                width = third == '<' || third == '-' ? 3 : 2;
+            } else if (next == '>' || next == '&') {
+                width = c == '&' && i + 2 < length && text[i + 2] == '>' ? 3 : 2;
+            }
+            if (scan->after_compound) scan->unsure = true;
+            scan->command_position = false;
+            scan->after_operator = false;
+            i += width;
+        } else if (c == '(') {
+            // Only a function definition has parentheses
+            if (scan->command_position || scan->after_compound) scan->unsure = true;
+            i++;
+        } else if (c == ')') {
+            scan->command_position = true;
+            i++;
+        } else {
+            // ; & | && ||. A list or pipeline needs a command first, and a
+            // compound command cannot be a stage of a pipeline.
+            bool and_or = (c == '&' || c == '|') && next == c;
+            if (scan->command_position || (scan->after_compound && !and_or && c != ';')) scan->unsure = true;
+            scan->after_operator = and_or || c == '|';
+            scan->after_compound = false;
+            scan->command_position = true;
+            i += and_or ? 2 : 1;
+        }
+    }
+
+    // A word is never continued across lines unless it is quoted
+    if (scan->in_word && scan->quote_depth == 0 && !scan->skip_newline) shell_scan_end_word(scan, text + length);
+    if (scan->unsure) return false;
+    return scan->quote_depth > 0 || scan->depth > 0 || scan->after_operator || scan->in_body || scan->heredoc_count > 0 ||
+           scan->want_delimiter;
+}
+
+// Execute every line of a script buffer without prompts or history.
+// Lines are terminated in place; when script[length] is not writable the
+// final unterminated line is copied instead. A command that leaves a
+// construct open, such as a loop or a quote, takes in the following lines
+// until it is complete; one still open at the end is a syntax error.
+// Syntax errors name the line they are on and end the script. Returns the
+// result of the last command, or the error that ended the script.
+static ShellError shell_run_buffer(ExtendedShellContext *ctx, char *script, size_t length, bool terminated) {
+    char *line = script;
+    char *next = script;
+    char *end = script + length;
+    ShellOpenScan scan;
+    bool spanning = false;
+    size_t saved_line = ctx->script_line;
+    size_t first = 1;   // line number of line
+    size_t number = 1;  // line number of next
+    ShellError result = SHELL_OK;
+
+    while (next < end) {
+        char *newline = memchr(next, '\n', (size_t)(end - next));
+        char *copy = NULL;
+
+        if (newline) {
+            *newline = '\0';
+        } else if (terminated) {
+            *end = '\0';
+        } else {
+            copy = strndup(line, (size_t)(end - line));
+            if (!copy) {
+                ctx->script_line = saved_line;
+                ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+                return SHELL_ERROR_MEMORY_ALLOCATION;
+            }
+        }
+
+        // Skip blank lines and comments, including a leading #! line. Once
+        // a construct is open only the new line is scanned, until the text
+        // may be complete.
+        char *command = copy ? copy : line;
+        bool incomplete = false;
+        command += strspn(command, " \t");
+        if (spanning && newline && shell_scan_open(&scan, next - 1, (size_t)(newline - (next - 1)))) {
+            incomplete = true;
+        } else if (*command && *command != '#') {
+            // A syntax error ends the script, as in sh
+            ShellParse *parse;
+            ctx->script_line = first;
+            result = shell_parse_line(ctx, command, &parse, &incomplete);
+            if (result == SHELL_OK) {
+                result = shell_execute_parse(ctx, parse);
+            } else if (!incomplete) {
+                ctx->base.last_error = result;
+                spanning = false;
+                free(copy);
+                break;
+            }
+            if (incomplete && !spanning) {
+                shell_scan_init(&scan, ctx);
+                shell_scan_open(&scan, command, strlen(command));
+            }
+        }
+        spanning = incomplete;
+
+        free(copy);
+        if (!newline || ctx->exit_requested) break;
+        number++;
+        if (incomplete) {
+            *newline = '\n';
+        } else {
+            line = newline + 1;
+            first = number;
+        }
+        next = newline + 1;
+    }
+
+    if (spanning && !ctx->exit_requested) {
+        ctx->script_line = first;
+        shell_report_syntax(ctx, line, (size_t)(end - line), "syntax error: unexpected end of file");
+        result = SHELL_ERROR_SYNTAX;
+        ctx->base.last_error = result;
+    }
+    ctx->script_line = saved_line;
+    return result;
+}
+
+// Execute a script held in a string, as with sh -c
+ShellError shell_run_string(ExtendedShellContext *ctx, const char *script) {
+    if (!ctx || !script) return SHELL_ERROR_NULL_POINTER;
+
+    // Copy the script once; every line is then executed in place
+    size_t length = strlen(script);
+    char *buffer = malloc(length + 1);
+    if (!buffer) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    memcpy(buffer, script, length + 1);
+
+    ShellError result = shell_run_buffer(ctx, buffer, length, true);
+    free(buffer);
+    return result;
+}
+
+// Execute a script file. A regular file is mapped privately, so only the
+// pages that are actually read (and the line terminators written) are
+// materialized; anything else is read to its end first.
+ShellError shell_run_file(ExtendedShellContext *ctx, const char *path) {
+    if (!ctx || !path) return SHELL_ERROR_NULL_POINTER;
+
+    int fd = openat(shell_dir_fd(ctx), path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    // Pipes, FIFOs and files that report no size, such as those of procfs,
+    // are read into a buffer that grows as needed
+    size_t length = (size_t)st.st_size;
+    if (!S_ISREG(st.st_mode) || length == 0) {
+        char *buffer = NULL;
+        size_t capacity = 0;
+        ShellError result = SHELL_OK;
+        while (result == SHELL_OK) {
+            if (length + 1 >= capacity) {
+                size_t grown = capacity ? capacity * 2 : SHELL_READ_BLOCK_SIZE;
+                char *larger = realloc(buffer, grown);
+                if (!larger) {
+                    result = SHELL_ERROR_MEMORY_ALLOCATION;
+                    break;
+                }
+                buffer = larger;
+                capacity = grown;
+            }
+            ssize_t count = read(fd, buffer + length, capacity - length - 1);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0) result = SHELL_ERROR_INVALID_INPUT;
+            if (count <= 0) break;
+            length += (size_t)count;
+        }
+        close(fd);
+
+        if (result == SHELL_OK) {
+            result = shell_run_buffer(ctx, buffer, length, true);
+        } else {
+            ctx->base.last_error = result;
+        }
+        free(buffer);
+        return result;
+    }
+
+    char *script = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (script == MAP_FAILED) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    madvise(script, length, MADV_SEQUENTIAL);
+
+    // The zero-filled tail of the last page can hold the final terminator
+    long page_size = sysconf(_SC_PAGESIZE);
+    bool terminated = page_size > 0 && length % (size_t)page_size != 0;
+
+    ShellError result = shell_run_buffer(ctx, script, length, terminated);
+    munmap(script, length);
+    return result;
+}
+
+// Layout of a snapshot file: the header, then the path, command, token and
+// variable records, then the string area. Strings are offsets into the
+// string area, whose first byte is NUL so that offset 0 stands for none;
+// the last byte of the file is NUL, so every string is terminated.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;  // 0x01020304 in the byte order of the host that saved it
+    uint64_t size;        // of the whole file
+    uint32_t path_count;
+    uint32_t command_count;
+    uint32_t token_count;
+    uint32_t variable_count;
+    uint64_t strings;     // offset of the string area
+    uint32_t path_value;  // PATH the cached lookups were made under
+    uint32_t reserved;
+} ShellSnapshotHeader;
+
+// Cached PATH lookup
+typedef struct {
+    uint32_t name;
+    uint32_t path;
+    uint64_t hits;
+} ShellSnapshotPath;
+
+// Dispatch table entry. value is the block of an alias, whose tokens are
+// the token_count records from first_token on; function is the definition
+// of a function, parsed again when the snapshot is loaded.
+typedef struct {
+    uint32_t name;
+    uint32_t kind;
+    uint32_t value;
+    uint32_t value_size;
+    uint32_t first_token;
+    uint32_t token_count;
+    uint32_t alias_blank;
+    uint32_t function;
+} ShellSnapshotCommand;
+
+// Token of an alias. text and raw are offsets into the alias block, text
+// UINT32_MAX for a token without one.
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint32_t text;
+    uint32_t raw;
+    uint32_t raw_length;
+    int32_t fd;
+} ShellSnapshotToken;
+
+// Variable. The name is stored apart from the NAME=value entry, so loading
+// never has to write to the mapping to terminate it.
+typedef struct {
+    uint32_t name;
+    uint32_t entry;
+    uint32_t exported;
+} ShellSnapshotVariable;
+
+// String area of a snapshot being written
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;  // the area could not grow; the snapshot is not written
+} ShellSnapshotStrings;
+
+// Append bytes to the string area and return their offset
+static uint32_t shell_snapshot_put(ShellSnapshotStrings *strings, const void *data, size_t length) {
+    if (strings->failed || length > UINT32_MAX - strings->length) {
+        strings->failed = true;
+        return 0;
+    }
+
+    if (strings->length + length > strings->capacity) {
+        size_t capacity = strings->capacity ? strings->capacity : 4096;
+        while (capacity < strings->length + length) capacity *= 2;
+        char *grown = realloc(strings->data, capacity);
+        if (!grown) {
+            strings->failed = true;
+            return 0;
+        }
+        strings->data = grown;
+        strings->capacity = capacity;
+    }
+
+    uint32_t offset = (uint32_t)strings->length;
+    memcpy(strings->data + strings->length, data, length);
+    strings->length += length;
+    return offset;
+}
+
+// Append a string with its terminator
+static uint32_t shell_snapshot_string(ShellSnapshotStrings *strings, const char *text) {
+    return shell_snapshot_put(strings, text, strlen(text) + 1);
+}
+
+// Kind a dispatch table entry is saved as. Built-ins are registered by
+// shell_init anyway, and a function whose source text was lost to alias
+// expansion cannot be parsed again, so both only keep their alias.
+static ShellCommandKind shell_snapshot_kind(const ShellCommand *command) {
+    if (command->kind == SHELL_COMMAND_BUILTIN) return SHELL_COMMAND_ALIAS;
+    if (command->kind == SHELL_COMMAND_FUNCTION && command->body->text_is_line) return SHELL_COMMAND_ALIAS;
+    return command->kind;
+}
+
+// Save the dispatch table, alias expansions, variable store and PATH cache
+// of a context to a file that shell_load_snapshot maps back in. Custom and
+// stream commands are saved by name only, functions as their source text.
+// The file is written under a temporary name and renamed over path.
+ShellError shell_save_snapshot(ExtendedShellContext *ctx, const char *path) {
+    if (!ctx || !path) return SHELL_ERROR_NULL_POINTER;
+
+    // The variable store is saved whole, including the imported environment
+    shell_load_variables(ctx);
+
+    size_t command_count = 0;
+    size_t token_count = 0;
+    for (size_t i = 0; i < ctx->commands.capacity; i++) {
+        const ShellCommand *command = ctx->commands.entries[i].key ? ctx->commands.entries[i].value : NULL;
+        if (!command || (!command->value && shell_snapshot_kind(command) == SHELL_COMMAND_ALIAS)) continue;
+        command_count++;
+        if (command->value) token_count += command->alias_token_count;
+    }
+
+    size_t path_count = ctx->path_cache.count;
+    size_t variable_count = ctx->base.variables.count;
+    size_t records_size = path_count * sizeof(ShellSnapshotPath) + command_count * sizeof(ShellSnapshotCommand) +
+                          token_count * sizeof(ShellSnapshotToken) + variable_count * sizeof(ShellSnapshotVariable);
+    char *records = calloc(1, records_size + 1);
+    if (!records) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+
+    ShellSnapshotPath *paths = (ShellSnapshotPath *)records;
+    ShellSnapshotCommand *commands = (ShellSnapshotCommand *)(paths + path_count);
+    ShellSnapshotToken *tokens = (ShellSnapshotToken *)(commands + command_count);
+    ShellSnapshotVariable *variables = (ShellSnapshotVariable *)(tokens + token_count);
+    ShellSnapshotStrings strings = { NULL, 0, 0, false };
+    shell_snapshot_put(&strings, "", 1);
+
+    size_t n = 0;
+    for (size_t i = 0; i < ctx->path_cache.capacity; i++) {
+        const ShellMapEntry *entry = &ctx->path_cache.entries[i];
+        if (!entry->key) continue;
+        const ShellPathEntry *cached = entry->value;
+        paths[n].name = shell_snapshot_string(&strings, entry->key);
+        paths[n].path = shell_snapshot_string(&strings, cached->path);
+        paths[n].hits = cached->hits;
+        n++;
+    }
+
+    n = 0;
+    size_t token = 0;
+    for (size_t i = 0; i < ctx->commands.capacity; i++) {
+        const ShellCommand *command = ctx->commands.entries[i].key ? ctx->commands.entries[i].value : NULL;
+        ShellCommandKind kind = command ? shell_snapshot_kind(command) : SHELL_COMMAND_ALIAS;
+        if (!command || (!command->value && kind == SHELL_COMMAND_ALIAS)) continue;
+
+        ShellSnapshotCommand *record = &commands[n++];
+        record->name = shell_snapshot_string(&strings, command->name);
+        record->kind = kind;
+        if (command->value) {
+            record->value = shell_snapshot_put(&strings, command->value, command->value_size);
+            record->value_size = (uint32_t)command->value_size;
+            record->first_token = (uint32_t)token;
+            record->token_count = (uint32_t)command->alias_token_count;
+            record->alias_blank = command->alias_blank;
+            for (size_t j = 0; j < command->alias_token_count; j++) {
+                const ShellToken *source = &command->alias_tokens[j];
+                tokens[token++] = (ShellSnapshotToken){
+                    source->type, source->flags,
+                    source->text ? (uint32_t)(source->text - command->value) : UINT32_MAX,
+                    (uint32_t)(source->raw - command->value), (uint32_t)source->raw_length, source->fd
+                };
+            }
+        }
+        if (kind == SHELL_COMMAND_FUNCTION) {
+            record->function = shell_snapshot_put(&strings, command->name, strlen(command->name));
+            shell_snapshot_put(&strings, "() ", 3);
+            shell_snapshot_put(&strings, command->body->text, command->body->text_length);
+            shell_snapshot_put(&strings, "", 1);
+        }
+    }
+
+    n = 0;
+    for (size_t i = 0; i < ctx->base.variables.capacity; i++) {
+        const ShellVariable *variable = ctx->base.variables.entries[i].key ? ctx->base.variables.entries[i].value : NULL;
+        if (!variable) continue;
+        variables[n].name = shell_snapshot_put(&strings, variable->entry, variable->name_length);
+        shell_snapshot_put(&strings, "", 1);
+        variables[n].entry = shell_snapshot_string(&strings, variable->entry);
+        variables[n].exported = variable->exported;
+        n++;
+    }
+
+    const char *search_path = shell_get_env(ctx, "PATH");
+    uint32_t path_value = shell_snapshot_string(&strings, search_path ? search_path : SHELL_DEFAULT_PATH);
+
+    ShellSnapshotHeader header = {
+        SHELL_SNAPSHOT_MAGIC, SHELL_SNAPSHOT_VERSION, 0x01020304,
+        sizeof(ShellSnapshotHeader) + records_size + strings.length,
+        (uint32_t)path_count, (uint32_t)command_count, (uint32_t)token_count, (uint32_t)variable_count,
+        sizeof(ShellSnapshotHeader) + records_size, path_value, 0
+    };
+
+    ShellError result = strings.failed ? SHELL_ERROR_MEMORY_ALLOCATION : SHELL_OK;
+    size_t path_length = strlen(path);
+    char *temporary = result == SHELL_OK ? malloc(path_length + 8) : NULL;
+    if (result == SHELL_OK && !temporary) result = SHELL_ERROR_MEMORY_ALLOCATION;
+
+    int fd = -1;
+    if (result == SHELL_OK) {
+        memcpy(temporary, path, path_length);
+        memcpy(temporary + path_length, ".XXXXXX", 8);
+        fd = mkostemp(temporary, O_CLOEXEC);
+        if (fd == -1) result = SHELL_ERROR_INVALID_INPUT;
+    }
+    if (fd != -1) {
+        bool written = shell_write_all(fd, (const char *)&header, sizeof(header)) &&
+                       shell_write_all(fd, records, records_size) &&
+                       shell_write_all(fd, strings.data, strings.length);
+        if (close(fd) != 0 || !written) result = SHELL_ERROR_EXECUTION_FAILED;
+        if (result == SHELL_OK && rename(temporary, path) != 0) result = SHELL_ERROR_INVALID_INPUT;
+        if (result != SHELL_OK) unlink(temporary);
+    }
+
+    free(temporary);
+    free(records);
+    free(strings.data);
+    if (result != SHELL_OK) ctx->base.last_error = result;
+    return result;
+}
+
+// Check that a mapped snapshot is complete and that every offset in it
+// stays inside the file, so loading can follow them without further checks
+static bool shell_snapshot_check(const char *map, size_t size) {
+    const ShellSnapshotHeader *header = (const ShellSnapshotHeader *)map;
+    if (size < sizeof(ShellSnapshotHeader) || memcmp(header->magic, SHELL_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->version != SHELL_SNAPSHOT_VERSION || header->byte_order != 0x01020304 || header->size != size) return false;
+    if (map[size - 1] != '\0') return false;
+
+    uint64_t records = (uint64_t)header->path_count * sizeof(ShellSnapshotPath) +
+                       (uint64_t)header->command_count * sizeof(ShellSnapshotCommand) +
+                       (uint64_t)header->token_count * sizeof(ShellSnapshotToken) +
+                       (uint64_t)header->variable_count * sizeof(ShellSnapshotVariable);
+    if (header->strings != sizeof(ShellSnapshotHeader) + records || header->strings >= size) return false;
+
+    const char *strings = map + header->strings;
+    uint64_t string_size = size - header->strings;
+    if (header->path_value >= string_size) return false;
+
+    const ShellSnapshotPath *paths = (const ShellSnapshotPath *)(map + sizeof(ShellSnapshotHeader));
+    for (uint32_t i = 0; i < header->path_count; i++) {
+        if (!paths[i].name || paths[i].name >= string_size || !paths[i].path || paths[i].path >= string_size) return false;
+    }
+
+    const ShellSnapshotCommand *commands = (const ShellSnapshotCommand *)(paths + header->path_count);
+    const ShellSnapshotToken *tokens = (const ShellSnapshotToken *)(commands + header->command_count);
+    for (uint32_t i = 0; i < header->command_count; i++) {
+        const ShellSnapshotCommand *command = &commands[i];
+        if (!command->name || command->name >= string_size) return false;
+        if (command->kind != SHELL_COMMAND_CUSTOM && command->kind != SHELL_COMMAND_ALIAS &&
+            command->kind != SHELL_COMMAND_FUNCTION && command->kind != SHELL_COMMAND_STREAM) return false;
+        if (command->kind == SHELL_COMMAND_FUNCTION && (!command->function || command->function >= string_size)) return false;
+        if (command->kind == SHELL_COMMAND_ALIAS && !command->value) return false;
+        if (!command->value) continue;
+
+        // The alias block ends in a terminator, so its words do too
+        if (command->value >= string_size || command->value_size == 0 || command->value_size > string_size - command->value) return false;
+        if (strings[command->value + command->value_size - 1] != '\0') return false;
+        if (command->first_token > header->token_count || command->token_count > header->token_count - command->first_token) return false;
+        for (uint32_t j = 0; j < command->token_count; j++) {
+            const ShellSnapshotToken *token = &tokens[command->first_token + j];
+            if (token->type > SHELL_TOKEN_RPAREN) return false;
+            if (token->raw > command->value_size || token->raw_length > command->value_size - token->raw) return false;
+            if (token->text != UINT32_MAX && token->text >= command->value_size) return false;
+        }
+    }
+
+    const ShellSnapshotVariable *variables = (const ShellSnapshotVariable *)(tokens + header->token_count);
+    for (uint32_t i = 0; i < header->variable_count; i++) {
+        if (!variables[i].name || variables[i].name >= string_size || !variables[i].entry || variables[i].entry >= string_size) return false;
+
+        const char *name = strings + variables[i].name;
+        const char *entry = strings + variables[i].entry;
+        size_t length = strlen(name);
+        if (!shell_valid_name(name, length) || strncmp(entry, name, length) != 0 || entry[length] != '=') return false;
+    }
+    return true;
+}
+
+// Attach an alias from a snapshot to its dispatch table entry, or to spare
+// if the name has none yet. The alias block and words stay in the mapping.
+static ShellError shell_snapshot_alias(ExtendedShellContext *ctx, const ShellSnapshotCommand *record, char *strings,
+                                       const ShellSnapshotToken *records, ShellToken *tokens, ShellCommand *spare) {
+    const char *name = strings + record->name;
+    ShellMapEntry *entry = shell_map_insert(&ctx->commands, name, shell_hash_string(name));
+    if (!entry) return SHELL_ERROR_MEMORY_ALLOCATION;
+
+    ShellCommand *command = entry->value;
+    if (!command) {
+        command = spare;
+        command->name = entry->key;
+        command->kind = SHELL_COMMAND_ALIAS;
+        entry->value = command;
+    }
+
+    char *value = strings + record->value;
+    for (uint32_t j = 0; j < record->token_count; j++) {
+        const ShellSnapshotToken *source = &records[j];
+        tokens[j] = (ShellToken){
+            (ShellTokenType)source->type, source->flags,
+            source->text == UINT32_MAX ? NULL : value + source->text,
+            value + source->raw, source->raw_length, source->fd
+        };
+    }
+
+    if (!command->value) ctx->alias_count++;
+    shell_snapshot_free(ctx, command->value);
+    shell_snapshot_free(ctx, command->alias_tokens);
+    command->value = value;
+    command->value_size = record->value_size;
+    command->alias_tokens = record->token_count ? tokens : NULL;
+    command->alias_token_count = record->token_count;
+    command->alias_blank = record->alias_blank != 0;
+    return SHELL_OK;
+}
+
+// Define a function from its source text in a snapshot. The text must
+// parse as nothing but the definition, so loading never runs commands.
+static ShellError shell_snapshot_function(ExtendedShellContext *ctx, const char *name, const char *definition) {
+    ShellParse *parse;
+    bool incomplete;
+    ShellError result = shell_parse_line(ctx, definition, &parse, &incomplete);
+    if (result != SHELL_OK) return result;
+
+    const ShellNode *root = parse->root;
+    const ShellNode *node = root->child_count == 1 ? root->children[0] : NULL;
+    if (!node || node->type != SHELL_NODE_FUNCTION || strcmp(node->name->text, name) != 0) {
+        result = SHELL_ERROR_SYNTAX;
+    } else {
+        int status = ctx->base.exit_status;
+        result = shell_define_function(ctx, node);
+        ctx->base.exit_status = status;
+    }
+    shell_parse_release(parse);
+    return result;
+}
+
+// Load a snapshot written by shell_save_snapshot, typically into a context
+// fresh from shell_init. The file is mapped privately and its strings are
+// used in place: loading allocates one block for the entries' structs and
+// copies only the map keys. Variables of the snapshot stand in for the
+// process environment and replace variables of the same name; the PATH
+// cache is only taken over when PATH is the one it was saved under.
+// Custom and stream commands must be registered before loading, since
+// callbacks cannot be saved; if any is missing, everything else is loaded
+// and SHELL_ERROR_COMMAND_NOT_FOUND returned. A context holds at most one
+// snapshot.
+ShellError shell_load_snapshot(ExtendedShellContext *ctx, const char *path) {
+    if (!ctx || !path) return SHELL_ERROR_NULL_POINTER;
+    if (ctx->snapshot.map) {
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ShellSnapshotHeader)) {
+        if (fd != -1) close(fd);
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    if (!shell_snapshot_check(map, size)) {
+        munmap(map, size);
+        ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+        return SHELL_ERROR_INVALID_INPUT;
+    }
+
+    const ShellSnapshotHeader *header = (const ShellSnapshotHeader *)map;
+    const ShellSnapshotPath *paths = (const ShellSnapshotPath *)(map + sizeof(ShellSnapshotHeader));
+    const ShellSnapshotCommand *commands = (const ShellSnapshotCommand *)(paths + header->path_count);
+    const ShellSnapshotToken *tokens = (const ShellSnapshotToken *)(commands + header->command_count);
+    const ShellSnapshotVariable *variables = (const ShellSnapshotVariable *)(tokens + header->token_count);
+    char *strings = map + header->strings;
+
+    // One block holds the structs of every entry, and the maps are sized
+    // up front so that loading never rehashes them
+    size_t variable_offset = header->command_count * sizeof(ShellCommand);
+    size_t path_offset = variable_offset + header->variable_count * sizeof(ShellVariable);
+    size_t token_offset = path_offset + header->path_count * sizeof(ShellPathEntry);
+    size_t block_size = token_offset + header->token_count * sizeof(ShellToken);
+    char *block = calloc(1, block_size + 1);
+    if (!block || shell_map_reserve(&ctx->commands, header->command_count) != SHELL_OK ||
+        shell_map_reserve(&ctx->base.variables, header->variable_count) != SHELL_OK ||
+        shell_map_reserve(&ctx->path_cache, header->path_count) != SHELL_OK) {
+        free(block);
+        munmap(map, size);
+        ctx->base.last_error = SHELL_ERROR_MEMORY_ALLOCATION;
+        return SHELL_ERROR_MEMORY_ALLOCATION;
+    }
+    ctx->snapshot = (ShellSnapshot){ map, size, block, block_size };
+
+    ShellCommand *command_structs = (ShellCommand *)block;
+    ShellVariable *variable_structs = (ShellVariable *)(block + variable_offset);
+    ShellPathEntry *path_structs = (ShellPathEntry *)(block + path_offset);
+    ShellToken *token_structs = (ShellToken *)(block + token_offset);
+    ShellError result = SHELL_OK;
+
+    ctx->base.variables_loaded = true;
+    bool path_changed = false;
+    for (uint32_t i = 0; i < header->variable_count && result == SHELL_OK; i++) {
+        const char *name = strings + variables[i].name;
+        ShellMapEntry *slot = shell_map_insert(&ctx->base.variables, name, shell_hash_string(name));
+        if (!slot) {
+            result = SHELL_ERROR_MEMORY_ALLOCATION;
+            break;
+        }
+
+        ShellVariable *variable = slot->value;
+        if (variable) {
+            shell_snapshot_free(ctx, variable->entry);
+        } else {
+            variable = &variable_structs[i];
+            slot->value = variable;
+        }
+        variable->entry = strings + variables[i].entry;
+        variable->name_length = strlen(name);
+        variable->exported = variables[i].exported != 0;
+        if (strcmp(name, "PATH") == 0) path_changed = true;
+    }
+    ctx->base.envp_dirty = true;
+    if (path_changed) shell_clear_path_cache(ctx);
+
+    // Lookups made under another PATH would resolve the wrong executables
+    const char *search_path = shell_get_env(ctx, "PATH");
+    if (!search_path) search_path = SHELL_DEFAULT_PATH;
+    if (strcmp(search_path, strings + header->path_value) == 0) {
+        for (uint32_t i = 0; i < header->path_count && result == SHELL_OK; i++) {
+            const char *name = strings + paths[i].name;
+            ShellMapEntry *slot = shell_map_insert(&ctx->path_cache, name, shell_hash_string(name));
+            if (!slot) {
+                result = SHELL_ERROR_MEMORY_ALLOCATION;
+            } else if (!slot->value) {
+                path_structs[i].path = strings + paths[i].path;
+                path_structs[i].hits = (unsigned long)paths[i].hits;
+                slot->value = &path_structs[i];
+            }
+        }
+    }
+
+    // Functions are defined after the other aliases, so their bodies see
+    // them, but before their own, which would be expanded in their names.
+    // An entry that fails does not stop the others; the first error is kept.
+    bool missing = false;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < header->command_count; i++) {
+            const ShellSnapshotCommand *record = &commands[i];
+            if ((record->kind == SHELL_COMMAND_FUNCTION) != (pass == 1)) continue;
+
+            const char *name = strings + record->name;
+            ShellError error = SHELL_OK;
+            if (record->kind == SHELL_COMMAND_CUSTOM || record->kind == SHELL_COMMAND_STREAM) {
+                const ShellCommand *command = shell_lookup_command(ctx, name);
+                if (!command || command->kind != (ShellCommandKind)record->kind) missing = true;
+            } else if (record->kind == SHELL_COMMAND_FUNCTION) {
+                error = shell_snapshot_function(ctx, name, strings + record->function);
+            }
+            if (error == SHELL_OK && record->value) {
+                error = shell_snapshot_alias(ctx, record, strings, &tokens[record->first_token],
+                                             &token_structs[record->first_token], &command_structs[i]);
+            }
+            if (error != SHELL_OK && result == SHELL_OK) result = error;
+        }
+    }
+    ctx->commands_generation++;
+    ctx->alias_generation++;
+
+    if (result == SHELL_OK && missing) result = SHELL_ERROR_COMMAND_NOT_FOUND;
+    if (result != SHELL_OK) ctx->base.last_error = result;
+    return result;
+}
+
+// Output composed for one terminal update
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} ShellTermBuffer;
+
+// Append to a terminal update
+static void shell_term_append(ShellTermBuffer *buffer, const char *text, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        while (capacity < buffer->length + length) capacity *= 2;
+
+        char *data = realloc(buffer->data, capacity);
+        if (!data) return;
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+}
+
+// Emit a composed update, normally with a single write
+static void shell_term_flush(ShellTermBuffer *buffer) {
+    size_t done = 0;
+    while (done < buffer->length) {
+        ssize_t written = write(STDOUT_FILENO, buffer->data + done, buffer->length - done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+        done += (size_t)written;
+    }
+    buffer->length = 0;
+}
+
+// Keys the editor handles besides plain bytes
+enum {
+    SHELL_KEY_DELETE = 0x100,
+};
+
+// What the editor does after a key
+typedef enum {
+    SHELL_EDITOR_CONTINUE,
+    SHELL_EDITOR_ACCEPT,
+    SHELL_EDITOR_CANCEL,
+    SHELL_EDITOR_EOF
+} ShellEditorAction;
+
+// State of one shell_read_line call. The line is edited in place in the
+// caller's getline-style buffer.
+typedef struct {
+    ExtendedShellContext *ctx;
+    char *line;
+    size_t length;
+    size_t capacity;
+    size_t cursor;
+    size_t history_index;
+    char *saved_line;
+    bool searching;
+    bool search_failed;
+    char search[MAX_INPUT_SIZE];
+    size_t search_length;
+    size_t search_match;
+    char sequence[8];
+    size_t sequence_length;
+    bool in_escape;
+    ShellTermBuffer out;
+} ShellLineEditor;
+
+// Make room for extra bytes plus the terminator
+static bool shell_editor_reserve(ShellLineEditor *editor, size_t extra) {
+    if (editor->length + extra + 1 <= editor->capacity) return true;
+
+    size_t capacity = editor->capacity ? editor->capacity * 2 : 128;
+    while (capacity < editor->length + extra + 1) capacity *= 2;
+
+    char *line = realloc(editor->line, capacity);
+    if (!line) return false;
+    editor->line = line;
+    editor->capacity = capacity;
+    return true;
+}
+
+// Insert text at the cursor
+static void shell_editor_insert(ShellLineEditor *editor, const char *text, size_t length) {
+    if (!shell_editor_reserve(editor, length)) return;
+
+    memmove(editor->line + editor->cursor + length, editor->line + editor->cursor, editor->length - editor->cursor + 1);
+    memcpy(editor->line + editor->cursor, text, length);
+    editor->length += length;
+    editor->cursor += length;
+}
+
+// Remove the bytes in [from, to)
+static void shell_editor_delete(ShellLineEditor *editor, size_t from, size_t to) {
+    memmove(editor->line + from, editor->line + to, editor->length - to + 1);
+    editor->length -= to - from;
+    if (editor->cursor > to) editor->cursor -= to - from;
+    else if (editor->cursor > from) editor->cursor = from;
+}
+
+// Replace the whole line, leaving the cursor at the end
+static void shell_editor_set(ShellLineEditor *editor, const char *text, size_t length) {
+    editor->length = 0;
+    editor->cursor = 0;
+    editor->line[0] = '\0';
+    shell_editor_insert(editor, text, length);
+}
+
+// Offsets of the neighbouring UTF-8 characters
+static size_t shell_editor_prev(const ShellLineEditor *editor, size_t position) {
+    if (position == 0) return 0;
+    do position--; while (position > 0 && ((unsigned char)editor->line[position] & 0xC0) == 0x80);
+    return position;
+}
+
+static size_t shell_editor_next(const ShellLineEditor *editor, size_t position) {
+    if (position >= editor->length) return editor->length;
+    do position++; while (position < editor->length && ((unsigned char)editor->line[position] & 0xC0) == 0x80);
+    return position;
+}
+
+// Terminal columns taken by text, counting one per character
+static size_t shell_columns(const char *text, size_t length) {
+    size_t columns = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (((unsigned char)text[i] & 0xC0) != 0x80) columns++;
+    }
+    return columns;
+}
+
+// Redraw the prompt and line. The whole update is composed first and
+// written at once, so a slow link sees one packet rather than one per key.
+static void shell_editor_refresh(ShellLineEditor *editor) {
+    char search_prompt[MAX_INPUT_SIZE + 32];
+    const char *prompt = editor->ctx->base.prompt;
+    size_t prompt_length = strlen(prompt);
+
+    if (editor->searching) {
+        int n = snprintf(search_prompt, sizeof(search_prompt), "(%sreverse-i-search)`%.*s': ",
+                         editor->search_failed ? "failed " : "", (int)editor->search_length, editor->search);
+        prompt = search_prompt;
+        prompt_length = n < 0 ? 0 : (size_t)n < sizeof(search_prompt) ? (size_t)n : sizeof(search_prompt) - 1;
+    }
+
+    struct winsize size;
+    size_t columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    size_t prompt_columns = shell_columns(prompt, prompt_length);
+
+    // Scroll the line horizontally so the cursor stays on screen
+    size_t start = 0;
+    size_t cursor_columns = shell_columns(editor->line, editor->cursor);
+    while (start < editor->cursor && prompt_columns + cursor_columns >= columns) {
+        start = shell_editor_next(editor, start);
+        cursor_columns--;
+    }
+    size_t end = start;
+    size_t shown = 0;
+    while (end < editor->length && prompt_columns + shown + 1 < columns) {
+        end = shell_editor_next(editor, end);
+        shown++;
+    }
+
+    ShellTermBuffer *out = &editor->out;
+    char move[32];
+    shell_term_append(out, "\r", 1);
+    shell_term_append(out, prompt, prompt_length);
+    shell_term_append(out, editor->line + start, end - start);
+    shell_term_append(out, "\x1b[0K\r", 5);
+    if (prompt_columns + cursor_columns > 0) {
+        int n = snprintf(move, sizeof(move), "\x1b[%zuC", prompt_columns + cursor_columns);
+        shell_term_append(out, move, (size_t)n);
+    }
+}
+
+// Step through the history; direction is -1 for older and 1 for newer
+static void shell_editor_history(ShellLineEditor *editor, int direction) {
+    size_t count = shell_history_count(&editor->ctx->base);
+    if (direction < 0 && editor->history_index == 0) return;
+    if (direction > 0 && editor->history_index >= count) return;
+
+    // Keep the line being typed so coming back down restores it
+    if (editor->history_index == count) {
+        free(editor->saved_line);
+        editor->saved_line = strndup(editor->line, editor->length);
+    }
+
+    editor->history_index += direction;
+    if (editor->history_index == count) {
+        const char *saved = editor->saved_line ? editor->saved_line : "";
+        shell_editor_set(editor, saved, strlen(saved));
+    } else {
+        size_t length;
+        const char *entry = shell_get_history(&editor->ctx->base, editor->history_index, &length);
+        if (entry) shell_editor_set(editor, entry, length);
+    }
+}
+
+// Find the newest history line older than index containing the search text
+static void shell_editor_search(ShellLineEditor *editor, size_t index) {
+    while (index > 0) {
+        index--;
+        size_t length;
+        const char *entry = shell_get_history(&editor->ctx->base, index, &length);
+        const char *found = entry ? memmem(entry, length, editor->search, editor->search_length) : NULL;
+        if (found) {
+            shell_editor_set(editor, entry, length);
+            editor->cursor = (size_t)(found - entry);
+            editor->search_match = index;
+            editor->search_failed = false;
+            return;
+        }
+    }
+    editor->search_failed = true;
+}
+
+// Complete the word before the cursor. A unique match is inserted; otherwise
+// the shared prefix is inserted, or the matches are listed if there is none.
+static void shell_editor_complete(ShellLineEditor *editor) {
+    ShellCompletion completion;
+    editor->line[editor->length] = '\0';
+    if (shell_complete(editor->ctx, editor->line, editor->cursor, &completion) != SHELL_OK) {
+        shell_term_append(&editor->out, "\a", 1);
+        return;
+    }
+
+    size_t typed = editor->cursor - completion.start;
+    if (completion.count == 1 || completion.common_length > typed) {
+        const char *match = completion.matches[0];
+        size_t length = completion.count == 1 ? strlen(match) : completion.common_length;
+        shell_editor_delete(editor, completion.start, editor->cursor);
+        shell_editor_insert(editor, match, length);
+        if (completion.count == 1 && match[length - 1] != '/') shell_editor_insert(editor, " ", 1);
+        return;
+    }
+
+    shell_term_append(&editor->out, "\r\n", 2);
+    for (int i = 0; i < completion.count; i++) {
+        if (i > 0) shell_term_append(&editor->out, "  ", 2);
+        shell_term_append(&editor->out, completion.matches[i], strlen(completion.matches[i]));
+    }
+    shell_term_append(&editor->out, "\r\n", 2);
+}
+
+// Handle a key typed during a reverse search. Returns false if the key ends
+// the search and should be handled as an ordinary key.
+static bool shell_editor_search_key(ShellLineEditor *editor, int key) {
+    size_t count = shell_history_count(&editor->ctx->base);
+
+    if (key == 18) {
+        // Ctrl-R again moves to the next older match
+        shell_editor_search(editor, editor->search_failed ? 0 : editor->search_match);
+    } else if (key == 127 || key == 8) {
+        if (editor->search_length > 0) editor->search_length--;
+        shell_editor_search(editor, count);
+    } else if (key >= 32 && key < 256 && key != 127) {
+        if (editor->search_length < sizeof(editor->search)) editor->search[editor->search_length++] = (char)key;
+        shell_editor_search(editor, editor->search_failed ? 0 : editor->search_match < count ? editor->search_match + 1 : count);
+    } else if (key == 7) {
+        // Ctrl-G abandons the search and restores the original line
+        const char *saved = editor->saved_line ? editor->saved_line : "";
+        shell_editor_set(editor, saved, strlen(saved));
+        editor->searching = false;
+    } else {
+        editor->searching = false;
+        return false;
+    }
+    return true;
+}
+
+// Apply one key to the line
+static ShellEditorAction shell_editor_key(ShellLineEditor *editor, int key) {
+    if (editor->searching && shell_editor_search_key(editor, key)) return SHELL_EDITOR_CONTINUE;
+
+    switch (key) {
+        case '\r':
+        case '\n':
+            return SHELL_EDITOR_ACCEPT;
+        case 3:
+            return SHELL_EDITOR_CANCEL;
+        case 4:
+            // Ctrl-D ends input on an empty line and deletes forward otherwise
+            if (editor->length == 0) return SHELL_EDITOR_EOF;
+            /* fall through */
+        case SHELL_KEY_DELETE:
+            shell_editor_delete(editor, editor->cursor, shell_editor_next(editor, editor->cursor));
+            break;
+        case 127:
+        case 8:
+            shell_editor_delete(editor, shell_editor_prev(editor, editor->cursor), editor->cursor);
+            break;
+        case 1:
+            editor->cursor = 0;
+            break;
+        case 5:
+            editor->cursor = editor->length;
+            break;
+        case 2:
+            editor->cursor = shell_editor_prev(editor, editor->cursor);
+            break;
+        case 6:
+            editor->cursor = shell_editor_next(editor, editor->cursor);
+            break;
+        case 11:
+            shell_editor_delete(editor, editor->cursor, editor->length);
+            break;
+        case 21:
+            shell_editor_delete(editor, 0, editor->cursor);
+            break;
+        case 23: {
+            // Ctrl-W deletes the word before the cursor
+            size_t start = editor->cursor;
+            while (start > 0 && editor->line[start - 1] == ' ') start--;
+            while (start > 0 && editor->line[start - 1] != ' ') start--;
+            shell_editor_delete(editor, start, editor->cursor);
+            break;
+        }
+        case 12:
+            shell_term_append(&editor->out, "\x1b[H\x1b[2J", 7);
+            break;
+        case 16:
+            shell_editor_history(editor, -1);
+            break;
+        case 14:
+            shell_editor_history(editor, 1);
+            break;
+        case 18:
+            free(editor->saved_line);
+            editor->saved_line = strndup(editor->line, editor->length);
+            editor->searching = true;
+            editor->search_failed = false;
+            editor->search_length = 0;
+            editor->search_match = shell_history_count(&editor->ctx->base);
+            break;
+        case '\t':
+            shell_editor_complete(editor);
+            break;
+        default:
+            if (key >= 32 && key < 256) {
+                char c = (char)key;
+                shell_editor_insert(editor, &c, 1);
+            }
+            break;
+    }
+    return SHELL_EDITOR_CONTINUE;
+}
+
+// Feed one input byte to the editor, decoding the escape sequences sent by
+// arrow, Home, End and Delete keys into the equivalent control keys
+static ShellEditorAction shell_editor_byte(ShellLineEditor *editor, unsigned char c) {
+    if (!editor->in_escape) {
+        if (c != 27) return shell_editor_key(editor, c);
+        editor->in_escape = true;
+        editor->sequence_length = 0;
+        return SHELL_EDITOR_CONTINUE;
+    }
+
+    editor->sequence[editor->sequence_length++] = (char)c;
+    if (editor->sequence_length == 1) {
+        // Alt-modified keys are ignored
+        if (c != '[' && c != 'O') editor->in_escape = false;
+        return SHELL_EDITOR_CONTINUE;
+    }
+    if (editor->sequence[0] == '[' && ((c >= '0' && c <= '9') || c == ';') && editor->sequence_length < sizeof(editor->sequence)) {
+        return SHELL_EDITOR_CONTINUE;
+    }
+
+    editor->in_escape = false;
+    char parameter = editor->sequence_length > 2 ? editor->sequence[1] : '\0';
+    switch (c) {
+        case 'A': return shell_editor_key(editor, 16);
+        case 'B': return shell_editor_key(editor, 14);
+        case 'C': return shell_editor_key(editor, 6);
+        case 'D': return shell_editor_key(editor, 2);
+        case 'H': return shell_editor_key(editor, 1);
+        case 'F': return shell_editor_key(editor, 5);
+        case '~':
+            if (parameter == '1' || parameter == '7') return shell_editor_key(editor, 1);
+            if (parameter == '4' || parameter == '8') return shell_editor_key(editor, 5);
+            if (parameter == '3') return shell_editor_key(editor, SHELL_KEY_DELETE);
+            break;
+    }
+    return SHELL_EDITOR_CONTINUE;
+}
+
+// Read a line like getline, printing the prompt first when interactive.
+// On a terminal the line is edited in raw mode with history recall (arrows,
+// Ctrl-P/N), reverse search (Ctrl-R) and completion (TAB); the terminal is
+// back in its original mode when the call returns. The newline is not
+// included in the returned length. Returns -1 at end of input, and
+// SHELL_LINE_CANCELLED when Ctrl-C discards the line.
+ssize_t shell_read_line(ExtendedShellContext *ctx, char **line, size_t *size) {
+    if (!ctx || !line || !size) return -1;
+
+    const char *term = getenv("TERM");
+    struct termios cooked;
+    if (!ctx->base.interactive || !isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) ||
+        (term && strcmp(term, "dumb") == 0) || tcgetattr(STDIN_FILENO, &cooked) != 0) {
+        if (ctx->base.interactive) {
+            fputs(ctx->base.prompt, stdout);
+            fflush(stdout);
+        }
+        ssize_t length = getline(line, size, stdin);
+        if (length > 0 && (*line)[length - 1] == '\n') (*line)[--length] = '\0';
+        return length;
+    }
+
+    // Raw mode without signal keys; the editor handles Ctrl-C itself.
+    // TCSADRAIN keeps anything typed ahead while the last command ran.
+    struct termios raw = cooked;
+    raw.c_iflag &= ~(tcflag_t)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    fflush(stdout);
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) != 0) return -1;
+
+    ShellLineEditor editor;
+    memset(&editor, 0, sizeof(editor));
+    editor.ctx = ctx;
+    editor.line = *line;
+    editor.capacity = *size;
+    editor.history_index = shell_history_count(&ctx->base);
+
+    ShellEditorAction action = SHELL_EDITOR_CONTINUE;
+    if (shell_editor_reserve(&editor, 0)) {
+        editor.line[0] = '\0';
+        shell_editor_refresh(&editor);
+        shell_term_flush(&editor.out);
+    } else {
+        action = SHELL_EDITOR_EOF;
+    }
+
+    // Bytes are read one at a time so that reading stops at the end of the
+    // line: anything typed or pasted after it stays queued on the terminal
+    // for the command the line runs. The screen is updated only once no more
+    // input is waiting, so pasted text is not redrawn character by character.
+    while (action == SHELL_EDITOR_CONTINUE) {
+        unsigned char c;
+        ssize_t count = read(STDIN_FILENO, &c, 1);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) {
+            action = SHELL_EDITOR_EOF;
+            break;
+        }
+
+        action = shell_editor_byte(&editor, c);
+        int waiting = 0;
+        if (action == SHELL_EDITOR_CONTINUE && (ioctl(STDIN_FILENO, FIONREAD, &waiting) != 0 || waiting == 0)) {
+            shell_editor_refresh(&editor);
+            shell_term_flush(&editor.out);
+        }
+    }
+
+    // Leave the finished line on screen with the cursor below it
+    editor.searching = false;
+    editor.cursor = editor.length;
+    shell_editor_refresh(&editor);
+    if (action == SHELL_EDITOR_CANCEL) shell_term_append(&editor.out, "^C", 2);
+    shell_term_append(&editor.out, "\r\n", 2);
+    shell_term_flush(&editor.out);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+
+    *line = editor.line;
+    *size = editor.capacity;
+    free(editor.saved_line);
+    free(editor.out.data);
+
+    if (action == SHELL_EDITOR_EOF && editor.length == 0) return -1;
+    if (action == SHELL_EDITOR_CANCEL) {
+        editor.line[0] = '\0';
+        return SHELL_LINE_CANCELLED;
+    }
+    editor.line[editor.length] = '\0';
+    return (ssize_t)editor.length;
+}
+
+// Main shell loop
+ShellError shell_run(ExtendedShellContext *ctx) {
+    if (!ctx) return SHELL_ERROR_NULL_POINTER;
+
+    // Lines of any length are read into a buffer that grows as needed. A
+    // command that leaves a construct open is collected in pending, with a
+    // "> " prompt for each further line.
+    char *input = NULL;
+    size_t input_size = 0;
+    char *pending = NULL;
+    size_t pending_length = 0;
+    size_t pending_capacity = 0;
+    ShellOpenScan scan;
+    char *prompt = ctx->base.prompt;
+    char continuation[] = "> ";
+    size_t number = 0;  // lines read so far
+
+    while (true) {
+        // Report background jobs that finished since the last line
+        if (!pending) shell_update_jobs(ctx);
+
+        ctx->base.prompt = pending ? continuation : prompt;
+        ssize_t length = shell_read_line(ctx, &input, &input_size);
+        ctx->base.prompt = prompt;
+        number++;
+        if (!pending) ctx->script_line = number;
+
+        // Ctrl-C abandons the construct being continued too, and the end
+        // of input leaves it unfinished; either way the next line starts a
+        // new command
+        if (length == SHELL_LINE_CANCELLED || (length == -1 && pending)) {
+            if (length == -1) {
+                shell_report_syntax(ctx, pending, pending_length, "syntax error: unexpected end of file");
+                ctx->base.last_error = SHELL_ERROR_SYNTAX;
+            }
+            free(pending);
+            pending = NULL;
+            continue;
+        }
+        if (length == -1) {
+            free(input);
+            free(pending);
+            ctx->script_line = 0;
+            ctx->base.last_error = SHELL_ERROR_INVALID_INPUT;
+            return SHELL_ERROR_INVALID_INPUT;
+        }
+
+        // Further lines of an open construct are scanned on their own, and
+        // the whole text parsed only once it may be complete
+        const char *command = input;
+        if (pending) {
+            size_t needed = pending_length + (size_t)length + 2;
+            if (needed > pending_capacity) {
+                size_t capacity = pending_capacity * 2 > needed ? pending_capacity * 2 : needed;
+                char *joined = realloc(pending, capacity);
+                if (!joined) {
+                    free(pending);
+                    pending = NULL;
+                    continue;
+                }
+                pending = joined;
+                pending_capacity = capacity;
+            }
+            pending[pending_length] = '\n';
+            memcpy(pending + pending_length + 1, input, (size_t)length + 1);
+            bool still_open = shell_scan_open(&scan, pending + pending_length, (size_t)length + 1);
+            pending_length += (size_t)length + 1;
+            if (still_open) continue;
+            command = pending;
+        }
+
+        ShellParse *parse;
+        bool incomplete;
+        ShellError result = shell_parse_line(ctx, command, &parse, &incomplete);
+        if (incomplete) {
+            if (!pending) {
+                pending = strdup(input);
+                pending_length = (size_t)length;
+                pending_capacity = pending_length + 1;
+                shell_scan_init(&scan, ctx);
+                shell_scan_open(&scan, input, pending_length);
+            }
+            continue;
+        }
+
+        // Add to history
+        shell_add_history(&ctx->base, command);
+
+        // Execute the command
+        if (result == SHELL_OK) {
+            shell_execute_parse(ctx, parse);
+        } else {
+            ctx->base.last_error = result;
+        }
+        free(pending);
+        pending = NULL;
+
+        if (ctx->exit_requested) {
+            free(input);
+            ctx->script_line = 0;
+            return SHELL_OK;
+        }
+    }
 }
 
 #endif // SIMPLE_SHELL_H 